@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file webLoadGenerator.cpp
+ *
+ * A load generator for the web server and embedCONTROL websocket, it opens many connections at once against a server
+ * such as webLoadServer, and drives a mix of clients over them. It reports the throughput and latency percentiles for
+ * each type of client, along with errors, 503 responses and timeouts. All connections start at the same moment, in the
+ * same way as a room of tablets reconnecting after the device restarts, so the first few seconds show the overload.
+ *
+ * The types of client are:
+ *   get     - requests the static assets one after another on a keep-alive connection, reconnecting when closed.
+ *   upgrade - connects, upgrades to a websocket, then closes and does it again.
+ *   storm   - upgrades once, then sends tag value changes as fast as they are answered.
+ *   slow    - requests the largest asset but only reads a little at a time, holding on to the server's resources.
+ *
+ * It only needs a POSIX host, build it with: g++ -O2 -std=c++17 -o webLoadGenerator webLoadGenerator.cpp
+ *
+ * Usage: webLoadGenerator [-H host] [-p port] [-c connections] [-d seconds] [-m get=70,upgrade=10,storm=15,slow=5]
+ *                         [-a /index.html,/style.css,/app.js] [-t timeoutMillis] [-s slowBytesPerTick]
+ */
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SLOW_READ_INTERVAL_MICROS 100000
+#define STORM_MESSAGE "ID=1|VC=22|"
+
+enum ClientKind { CLIENT_GET, CLIENT_UPGRADE, CLIENT_STORM, CLIENT_SLOW, CLIENT_KINDS };
+const char* const clientKindNames[CLIENT_KINDS] = { "get", "upgrade", "storm", "slow" };
+
+enum ClientState { CS_DISCONNECTED, CS_CONNECTING, CS_AWAIT_HTTP, CS_AWAIT_FRAME };
+
+struct LoadSettings {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 100;
+    int durationSeconds = 10;
+    int mix[CLIENT_KINDS] = { 70, 10, 15, 5 };
+    std::vector<std::string> assets = { "/index.html", "/style.css", "/app.js" };
+    int timeoutMillis = 5000;
+    int slowBytesPerTick = 256;
+};
+
+struct KindStats {
+    std::vector<uint32_t> latencyMicros;
+    uint32_t connects = 0;
+    uint32_t connectFailures = 0;
+    uint32_t closedByServer = 0;
+    uint32_t unavailable = 0;
+    uint32_t otherStatus = 0;
+    uint32_t timeouts = 0;
+};
+
+struct Client {
+    int fd = -1;
+    ClientKind kind = CLIENT_GET;
+    ClientState state = CS_DISCONNECTED;
+    std::string rx;
+    std::string tx;
+    uint64_t startedAt = 0;
+    uint64_t nextReadAt = 0;
+    size_t nextAsset = 0;
+    bool upgraded = false;
+};
+
+LoadSettings settings;
+KindStats stats[CLIENT_KINDS];
+sockaddr_in serverAddr{};
+
+uint64_t nowMicros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void closeClient(Client& client) {
+    if(client.fd >= 0) close(client.fd);
+    client.fd = -1;
+    client.state = CS_DISCONNECTED;
+    client.rx.clear();
+    client.tx.clear();
+    client.upgraded = false;
+}
+
+void startConnect(Client& client) {
+    client.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(client.fd < 0) {
+        stats[client.kind].connectFailures++;
+        return;
+    }
+    fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL, 0) | O_NONBLOCK);
+    int optData = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &optData, sizeof(optData));
+    if(client.kind == CLIENT_SLOW) {
+        // a small receive window makes the server block on its writes sooner.
+        int bufferSize = 1024;
+        setsockopt(client.fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    }
+    client.startedAt = nowMicros();
+    if(connect(client.fd, (sockaddr*)&serverAddr, sizeof(serverAddr)) != 0 && errno != EINPROGRESS) {
+        stats[client.kind].connectFailures++;
+        closeClient(client);
+        return;
+    }
+    client.state = CS_CONNECTING;
+}
+
+void queueHttpRequest(Client& client) {
+    std::string path;
+    const char* extraHeaders = "Connection: keep-alive\r\n";
+    if(client.kind == CLIENT_UPGRADE || (client.kind == CLIENT_STORM && !client.upgraded)) {
+        path = "/ws";
+        extraHeaders = "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Version: 13\r\n";
+    } else if(client.kind == CLIENT_SLOW) {
+        path = settings.assets.back();
+    } else {
+        path = settings.assets[client.nextAsset++ % settings.assets.size()];
+    }
+    client.tx = "GET " + path + " HTTP/1.1\r\nHost: " + settings.host + "\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                "Accept: */*\r\n" + extraHeaders + "\r\n";
+    client.rx.clear();
+    client.startedAt = nowMicros();
+    client.state = CS_AWAIT_HTTP;
+}
+
+void queueStormMessage(Client& client) {
+    // a masked text frame holding a tag value message, as the embedCONTROL UI sends when a value is changed.
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    std::string payload = "\x01\x01" "VC" STORM_MESSAGE "\x02";
+    client.tx.clear();
+    client.tx.push_back((char)0x81);
+    client.tx.push_back((char)(0x80 | payload.size()));
+    client.tx.append((const char*)mask, sizeof mask);
+    for(size_t i = 0; i < payload.size(); i++) client.tx.push_back((char)(payload[i] ^ mask[i % 4]));
+    client.rx.clear();
+    client.startedAt = nowMicros();
+    client.state = CS_AWAIT_FRAME;
+}
+
+void recordLatency(Client& client) {
+    stats[client.kind].latencyMicros.push_back((uint32_t)(nowMicros() - client.startedAt));
+}
+
+/**
+ * Checks if a whole HTTP response has arrived, returning the status code once it has, or 0 while it is incomplete.
+ * Upgrade responses have no body, other responses must have a content length.
+ */
+int completeHttpResponse(Client& client, bool& serverWillClose) {
+    auto headerEnd = client.rx.find("\r\n\r\n");
+    if(headerEnd == std::string::npos) return 0;
+    int status = atoi(client.rx.c_str() + 9);
+    serverWillClose = client.rx.find("Connection: close") < headerEnd;
+    size_t contentLength = 0;
+    auto lengthPos = client.rx.find("Content-Length: ");
+    if(lengthPos < headerEnd) contentLength = strtoul(client.rx.c_str() + lengthPos + 16, nullptr, 10);
+    if(client.rx.size() < headerEnd + 4 + contentLength) return 0;
+    client.rx.erase(0, headerEnd + 4 + contentLength);
+    return status;
+}
+
+void httpResponseReceived(Client& client) {
+    bool serverWillClose = false;
+    int status = completeHttpResponse(client, serverWillClose);
+    if(status == 0) return;
+
+    auto& kindStats = stats[client.kind];
+    if(status == 503) {
+        kindStats.unavailable++;
+        closeClient(client);
+        return;
+    }
+    bool expected = (status == 101) == (client.kind == CLIENT_UPGRADE || (client.kind == CLIENT_STORM && !client.upgraded));
+    if(!expected || (status != 101 && status != 200)) {
+        kindStats.otherStatus++;
+        closeClient(client);
+        return;
+    }
+    recordLatency(client);
+
+    if(client.kind == CLIENT_UPGRADE) {
+        closeClient(client);
+    } else if(client.kind == CLIENT_STORM) {
+        client.upgraded = true;
+        queueStormMessage(client);
+    } else if(serverWillClose) {
+        kindStats.closedByServer++;
+        closeClient(client);
+    } else {
+        queueHttpRequest(client);
+    }
+}
+
+void frameReceived(Client& client) {
+    if(client.rx.size() < 2) return;
+    size_t len = (uint8_t)client.rx[1] & 0x7f;
+    size_t headerLen = 2;
+    if(len == 126) {
+        if(client.rx.size() < 4) return;
+        len = ((uint8_t)client.rx[2] << 8) | (uint8_t)client.rx[3];
+        headerLen = 4;
+    }
+    if(client.rx.size() < headerLen + len) return;
+    int opcode = (uint8_t)client.rx[0] & 0x0f;
+    client.rx.erase(0, headerLen + len);
+    if(opcode == 0x08) {
+        stats[client.kind].closedByServer++;
+        closeClient(client);
+        return;
+    }
+    recordLatency(client);
+    queueStormMessage(client);
+}
+
+void serviceClient(Client& client, short revents, uint64_t now) {
+    if(client.state == CS_CONNECTING) {
+        if((revents & (POLLOUT | POLLERR | POLLHUP)) == 0) return;
+        int err = 0;
+        socklen_t errLen = sizeof(err);
+        getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+        if(err != 0) {
+            stats[client.kind].connectFailures++;
+            closeClient(client);
+            return;
+        }
+        stats[client.kind].connects++;
+        queueHttpRequest(client);
+    }
+
+    if(!client.tx.empty() && (revents & POLLOUT)) {
+        auto sent = send(client.fd, client.tx.data(), client.tx.size(), MSG_NOSIGNAL);
+        if(sent > 0) client.tx.erase(0, sent);
+    }
+
+    if(revents & (POLLIN | POLLHUP | POLLERR)) {
+        if(client.kind == CLIENT_SLOW && client.state == CS_AWAIT_HTTP && now < client.nextReadAt) return;
+        char buffer[8192];
+        size_t toRead = client.kind == CLIENT_SLOW ? (size_t)settings.slowBytesPerTick : sizeof buffer;
+        auto actual = recv(client.fd, buffer, std::min(toRead, sizeof buffer), 0);
+        if(actual <= 0) {
+            if(actual == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                stats[client.kind].closedByServer++;
+                closeClient(client);
+            }
+            return;
+        }
+        client.nextReadAt = now + SLOW_READ_INTERVAL_MICROS;
+        client.rx.append(buffer, actual);
+        if(client.state == CS_AWAIT_HTTP) {
+            httpResponseReceived(client);
+        } else if(client.state == CS_AWAIT_FRAME) {
+            frameReceived(client);
+        }
+    }
+}
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double pct) {
+    if(sorted.empty()) return 0;
+    size_t index = (size_t)(pct * (sorted.size() - 1) / 100.0 + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void printReport(double elapsedSeconds) {
+    printf("\n%-8s %9s %9s %9s %9s %9s %9s %9s %7s %7s %7s %7s %7s\n", "client", "ops", "ops/sec", "p50 ms", "p90 ms",
+           "p99 ms", "p99.9 ms", "max ms", "conns", "fails", "503s", "closed", "t/outs");
+    for(int kind = 0; kind < CLIENT_KINDS; kind++) {
+        auto& kindStats = stats[kind];
+        auto& sorted = kindStats.latencyMicros;
+        std::sort(sorted.begin(), sorted.end());
+        printf("%-8s %9zu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f %7u %7u %7u %7u %7u\n", clientKindNames[kind],
+               sorted.size(), sorted.size() / elapsedSeconds, percentile(sorted, 50) / 1000.0,
+               percentile(sorted, 90) / 1000.0, percentile(sorted, 99) / 1000.0, percentile(sorted, 99.9) / 1000.0,
+               (sorted.empty() ? 0 : sorted.back()) / 1000.0, kindStats.connects, kindStats.connectFailures,
+               kindStats.unavailable, kindStats.closedByServer, kindStats.timeouts);
+    }
+}
+
+bool parseMix(const char* text) {
+    int mix[CLIENT_KINDS] = {};
+    std::string remaining = text;
+    while(!remaining.empty()) {
+        auto comma = remaining.find(',');
+        auto item = remaining.substr(0, comma);
+        remaining = comma == std::string::npos ? "" : remaining.substr(comma + 1);
+        auto equals = item.find('=');
+        if(equals == std::string::npos) return false;
+        auto name = item.substr(0, equals);
+        int kind = 0;
+        while(kind < CLIENT_KINDS && name != clientKindNames[kind]) kind++;
+        if(kind == CLIENT_KINDS) return false;
+        mix[kind] = atoi(item.c_str() + equals + 1);
+    }
+    memcpy(settings.mix, mix, sizeof mix);
+    return true;
+}
+
+void parseAssets(const char* text) {
+    settings.assets.clear();
+    std::string remaining = text;
+    while(!remaining.empty()) {
+        auto comma = remaining.find(',');
+        settings.assets.push_back(remaining.substr(0, comma));
+        remaining = comma == std::string::npos ? "" : remaining.substr(comma + 1);
+    }
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:c:d:m:a:t:s:")) != -1) {
+        switch(opt) {
+            case 'H': settings.host = optarg; break;
+            case 'p': settings.port = atoi(optarg); break;
+            case 'c': settings.connections = atoi(optarg); break;
+            case 'd': settings.durationSeconds = atoi(optarg); break;
+            case 'm':
+                if(!parseMix(optarg)) {
+                    fprintf(stderr, "Mix must be a list such as get=70,upgrade=10,storm=15,slow=5\n");
+                    return 1;
+                }
+                break;
+            case 'a': parseAssets(optarg); break;
+            case 't': settings.timeoutMillis = atoi(optarg); break;
+            case 's': settings.slowBytesPerTick = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-m mix] [-a assets] "
+                                "[-t timeoutMillis] [-s slowBytesPerTick]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(settings.assets.empty() || settings.connections <= 0) {
+        fprintf(stderr, "At least one asset and one connection are needed\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    rlimit fileLimit{};
+    if(getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < (rlim_t)settings.connections + 64) {
+        fileLimit.rlim_cur = std::min(fileLimit.rlim_max, (rlim_t)settings.connections + 64);
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    hostent* hostEntry = gethostbyname(settings.host.c_str());
+    if(hostEntry == nullptr) {
+        fprintf(stderr, "Unknown host %s\n", settings.host.c_str());
+        return 1;
+    }
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(settings.port);
+    memcpy(&serverAddr.sin_addr, hostEntry->h_addr_list[0], sizeof(serverAddr.sin_addr));
+
+    // share the connections out according to the mix, any left over from rounding go to the first client type.
+    int mixTotal = 0;
+    for(int mix : settings.mix) mixTotal += mix;
+    if(mixTotal <= 0) mixTotal = settings.mix[CLIENT_GET] = 1;
+    std::vector<Client> clients(settings.connections);
+    size_t next = 0;
+    for(int kind = CLIENT_KINDS - 1; kind >= 0; kind--) {
+        int count = (settings.connections * settings.mix[kind]) / mixTotal;
+        for(int i = 0; i < count && next < clients.size(); i++) clients[next++].kind = (ClientKind)kind;
+    }
+    printf("Load test of %s:%d with %d connections for %ds\n", settings.host.c_str(), settings.port, settings.connections,
+           settings.durationSeconds);
+
+    std::vector<pollfd> pollFds(clients.size());
+    uint64_t started = nowMicros();
+    uint64_t finishAt = started + (uint64_t)settings.durationSeconds * 1000000ULL;
+    uint64_t timeoutMicros = (uint64_t)settings.timeoutMillis * 1000ULL;
+    uint64_t now = started;
+    while(now < finishAt) {
+        for(size_t i = 0; i < clients.size(); i++) {
+            auto& client = clients[i];
+            // a client may have started after now was taken, so the difference is signed.
+            if(client.state != CS_DISCONNECTED && (int64_t)(now - client.startedAt) > (int64_t)timeoutMicros) {
+                stats[client.kind].timeouts++;
+                closeClient(client);
+            }
+            if(client.state == CS_DISCONNECTED) startConnect(client);
+            pollFds[i].fd = client.fd;
+            pollFds[i].events = (short)(client.state == CS_CONNECTING || !client.tx.empty() ? POLLOUT : 0);
+            if(client.state != CS_CONNECTING && !(client.kind == CLIENT_SLOW && now < client.nextReadAt)) pollFds[i].events |= POLLIN;
+            pollFds[i].revents = 0;
+        }
+        poll(pollFds.data(), pollFds.size(), 1);
+        now = nowMicros();
+        for(size_t i = 0; i < clients.size(); i++) {
+            if(clients[i].fd >= 0 && pollFds[i].revents != 0) serviceClient(clients[i], pollFds[i].revents, now);
+        }
+    }
+
+    for(auto& client : clients) closeClient(client);
+    printReport((nowMicros() - started) / 1000000.0);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file webLoadServer.cpp
+ *
+ * A web server instance that runs on a desktop using the POSIX socket driver, for use with webLoadGenerator. It serves
+ * a small set of static assets of typical sizes, and upgrades /ws to a websocket that answers every tag value message
+ * with another one, as the embedCONTROL remote does when a change is applied. Build it as a host (native) build of this
+ * library along with TaskManagerIO, IoAbstraction and tcMenu, with TC_NET_HOST_SOCKETS defined for the whole build.
+ * The settings being tested are given on the command line of the compiler, for example:
+ *
+ *     -DTC_NET_HOST_SOCKETS -DMAX_WEBSERVER_RESPONSES=16 -DWS_CONNECTION_BACKLOG=32
+ *
+ * Latency metrics for each route and the websocket are served in Prometheus text format from /metrics. When built
+ * with WS_TRACE_ENABLED, the most recent trace events can also be read from /trace during or after a run.
+ *
+ * When a number of pooled buffers is given, the connections lease their buffers from a shared pool of that size rather
+ * than each owning two, and the peak number leased is printed along with the other statistics.
+ *
+ * Usage: webLoadServer [port] [concurrentResponses] [pooledBuffers]
+ */
+
+#include <Arduino.h>
+#include <TaskManagerIO.h>
+#include <IoLogging.h>
+#include "remote/TcMenuWebServer.h"
+#include "posix/tcNetDriver_POSIX.h"
+#include "remote/TcWebTrace.h"
+
+using namespace tcremote;
+
+#define LOAD_SERVER_MSG_SIZE 100
+#define LOAD_SERVER_PUMP_MICROS 500
+
+char indexHtml[2048];
+char styleCss[1024];
+char appJs[4096];
+
+// the message being read from each websocket, indexed in the same way as the web server's responses.
+struct WebSocketMessage {
+    char data[LOAD_SERVER_MSG_SIZE];
+    uint8_t position;
+};
+WebSocketMessage wsMessages[MAX_WEBSERVER_RESPONSES];
+
+TcMenuLightweightWebServer* webServer;
+WebBufferPool* bufferPool = nullptr;
+uint32_t messagesAnswered = 0;
+
+void fillContent(char* content, size_t size, const char* pattern) {
+    size_t patternLen = strlen(pattern);
+    for(size_t i = 0; i < size; i++) content[i] = pattern[i % patternLen];
+}
+
+void sendContent(WebServerResponse& response, WebServerResponse::WSRContentType type, const char* content, size_t size) {
+    response.startHeader();
+    response.contentInfo(type, size);
+    response.send(content, size);
+}
+
+void answerMessage(TcMenuWebServerTransport* transport, WebSocketMessage& msg) {
+    // the fields start after the start of message, protocol and two message type bytes.
+    msg.data[msg.position] = 0;
+    uint16_t msgType = msg.position > 4 ? ((uint8_t)msg.data[2] << 8U) | (uint8_t)msg.data[3] : 0;
+    transport->startMsg(msgType);
+    transport->writeStr(msg.position > 4 ? &msg.data[4] : "");
+    transport->endMsg();
+    messagesAnswered++;
+}
+
+void pumpWebSockets() {
+    for(int i = 0; i < webServer->getResponseCount(); i++) {
+        auto response = webServer->getWebResponse(i);
+        if(response->getMode() != WebServerResponse::WEBSOCKET_BUSY) continue;
+        auto transport = response->getTransport();
+        auto& msg = wsMessages[i];
+
+        while(transport->connected() && transport->readAvailable()) {
+            auto data = (char)transport->readByte();
+            if(data == START_OF_MESSAGE && msg.position != 1) msg.position = 0;
+            if(msg.position < sizeof(msg.data) - 1) msg.data[msg.position++] = data;
+            if(data == 0x02) {
+                msg.position--;
+                answerMessage(transport, msg);
+                msg.position = 0;
+            }
+        }
+
+        // as with the remote connection, once the transport has closed the response is freed up for reuse.
+        if(!transport->connected()) {
+            msg.position = 0;
+            response->closeConnection();
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    int concurrent = argc > 2 ? atoi(argv[2]) : MAX_WEBSERVER_RESPONSES;
+    int pooledBuffers = argc > 3 ? atoi(argv[3]) : 0;
+
+    fillContent(indexHtml, sizeof indexHtml, "<div class=\"item\"><span>Volume</span><b>22dB</b></div>\n");
+    fillContent(styleCss, sizeof styleCss, ".item { margin: 2px; padding: 4px; color: #333; }\n");
+    fillContent(appJs, sizeof appJs, "function update(id, val) { document.getElementById(id).innerText = val; }\n");
+
+    if(pooledBuffers > 0) bufferPool = new WebBufferPool(pooledBuffers, 125);
+    webServer = new TcMenuLightweightWebServer(port, concurrent, true, bufferPool);
+    webServer->onUrlGet("/index.html", [](WebServerResponse& response) {
+        sendContent(response, WebServerResponse::HTML_TEXT, indexHtml, sizeof indexHtml);
+    });
+    webServer->onUrlGet("/style.css", [](WebServerResponse& response) {
+        sendContent(response, WebServerResponse::TEXT_CSS, styleCss, sizeof styleCss);
+    });
+    webServer->onUrlGet("/app.js", [](WebServerResponse& response) {
+        sendContent(response, WebServerResponse::JAVASCRIPT, appJs, sizeof appJs);
+    });
+    webServer->onUrlGet("/ws", [](WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    webServer->enableMetrics();
+#ifdef WS_TRACE_ENABLED
+    registerTraceEndpoint(*webServer);
+#endif
+
+    if(startNetLayerDhcp() != SOCK_ERR_OK) {
+        printf("Network did not start\n");
+        return 1;
+    }
+    webServer->init();
+    taskManager.scheduleFixedRate(LOAD_SERVER_PUMP_MICROS, pumpWebSockets, TIME_MICROS);
+    taskManager.scheduleFixedRate(5, [] {
+        printf("open sockets %d, websocket messages answered %u\n", posixOpenClientCount(), (unsigned)messagesAnswered);
+        if(bufferPool) {
+            printf("buffers leased %d, peak %d of %d, pool empty %u times\n", bufferPool->getLeasedCount(),
+                   bufferPool->getPeakLeased(), bufferPool->getBufferCount(), (unsigned)bufferPool->getExhaustedCount());
+        }
+    }, TIME_SECONDS);
+
+    printf("Load test server on port %d with %d responses (max %d), backlog %d\n", port, concurrent,
+           MAX_WEBSERVER_RESPONSES, WS_CONNECTION_BACKLOG);
+    while(true) {
+        taskManager.runLoop();
+    }
+}
@@ -7,8 +7,10 @@
 #include "TcMenuNetLayerConfig.h"
 #endif
 
-// attempt to work out what platform we are on
-#if defined(ESP32) && !defined(TC_DONT_USE_INTERNAL_LWIP)
+// attempt to work out what platform we are on, host sockets are only used when asked for, for load testing.
+#if defined(TC_NET_HOST_SOCKETS)
+#define TC_NET_USES_POSIX
+#elif defined(ESP32) && !defined(TC_DONT_USE_INTERNAL_LWIP)
 #define TC_NET_USES_ESP32
 #elif defined(ARDUINO_ARCH_STM32)
 #define TC_NET_USES_STM32
@@ -21,11 +23,6 @@
 #define NET_LOGGING_CHANNEL SER_USER_1
 #endif //NET_LOGGING_CHANNEL
 
-// Do you want to log write and read data operations, this is very heavy, usually only for debugging
-#ifndef LOGGING_IO_OP_DEBUG
-#define LOGGING_IO_OP_DEBUG true
-#endif //LOGGING_IO_OP_DEBUG
-
 // The maximum amount to send in a single transmission.
 #ifndef MAX_SEND_PER_PACKET
 #define MAX_SEND_PER_PACKET 500
@@ -59,7 +59,8 @@ namespace tcremote {
     enum MemoryLocationType {
         /** the buffer is stored in program memory, as must be read from there as needed */
         IN_PROGRAM_MEM,
-        /** the buffer is in constant memory and doesn't therefore need to be copied */
+        /** the buffer is in constant memory and doesn't therefore need to be copied, drivers may keep referring to it
+         * until it has been acknowledged, so it must never change */
         CONSTANT_NO_COPY,
         /** the buffer is in transient RAM memory and therefore must be copied */
         RAM_NEEDS_COPY
@@ -68,10 +69,19 @@ namespace tcremote {
     /**
      * This is the callback used to indicate a new connection has been established and requires processing.
      * The call provides the socket reference as the first parameter and the second parameter is the callbackData
-     * that you provided when registering the callback with accept.
+     * that you provided when registering the callback with accept. Drivers never call it from within the network
+     * stack's own callbacks, so it may write to or close the socket straight away.
      */
     typedef void (*ServerAcceptedCallback)(socket_t clientSocketFd, void* callbackData);
 
+    /**
+     * This is the callback used to indicate that a socket accepted by a server may now be ready, either because data
+     * has arrived or because data has been sent and there is now room to write. It may be called from the network
+     * stack's own context, so should do no more than record the socket and notify a task. The second parameter is
+     * the callbackData that you provided when registering the callback with accept.
+     */
+    typedef void (*SocketReadyCallback)(socket_t clientSocketFd, void* callbackData);
+
     /**
      * Start the networking layer using DHCP, this will also start a maintenance task with the primary task manager
      * if it is needed to manage connectivity. Note that this call will block the calling task if required but allow
@@ -106,10 +116,15 @@ namespace tcremote {
 
     /**
      * Initialise a server side accept on a given port, it will call back onServerAccepted when a connection is made.
+     * Drivers that are able to will also call onSocketReady whenever a socket accepted on this port becomes ready,
+     * drivers that cannot ignore it, so callers must still poll with rawReadAvailable from time to time.
      * @param port the port on which to accept
+     * @param onServerAccepted called for each new connection
+     * @param callbackData passed to both callbacks
+     * @param onSocketReady optionally called when an accepted socket becomes ready
      * @return an error code to indicate call status
      */
-    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void* callbackData);
+    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void* callbackData, SocketReadyCallback onSocketReady = nullptr);
 
     /**
      * Attempt to read data from the socket, returns 0 if nothing is available at present, -1 on connection closure.
@@ -145,6 +160,27 @@ namespace tcremote {
      */
     SocketErrCode rawWriteData(socket_t socketNum, const void* data, size_t dataLen, MemoryLocationType locationType, int timeoutMillis = 30000);
 
+    /**
+     * Reserve space in the socket's write buffer so that data can be built directly where the driver will send it
+     * from, rather than in a buffer of your own that rawWriteData then copies. Nothing is written until rawWriteCommit
+     * is called, and no other write or flush may be made on the socket in between. Drivers without a write buffer of
+     * their own return nullptr, and the data must then be written with rawWriteData as usual.
+     * @param socketNum the socket to write to
+     * @param minimumLen the least amount of space needed, the buffer is flushed first if there is less than this free
+     * @param actualLen set to the space that was reserved, which may be more than the minimum
+     * @return the reserved space, or nullptr if it cannot be reserved.
+     */
+    uint8_t* rawWriteReserve(socket_t socketNum, size_t minimumLen, size_t* actualLen);
+
+    /**
+     * Commits data that was built in space given by rawWriteReserve, it is then sent as if written by rawWriteData.
+     * Committing zero bytes gives the space back without sending anything.
+     * @param socketNum the socket that the space was reserved on
+     * @param len the number of bytes to commit, from the start of the reserved space, at most the amount reserved
+     * @return an error code to indicate call status
+     */
+    SocketErrCode rawWriteCommit(socket_t socketNum, size_t len);
+
     /**
      * Flush any data that has been cached for the socket provided.
      * @param socketNum the socket to flush
@@ -9,7 +9,6 @@
 #ifdef TC_NET_USES_ESP32
 
 #define NET_LOGGING_CHANNEL SER_USER_1
-#define LOGGING_IO_OP_DEBUG true
 #define MAX_SEND_PER_PACKET 500
 #define MAX_TCP_ACCEPTS 2
 
@@ -116,7 +115,8 @@ namespace tcremote {
         }
     }
 
-    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void *callbackData) {
+    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void *callbackData, SocketReadyCallback onSocketReady) {
+        // sockets are read in non-blocking mode, so there is no ready notification and onSocketReady is not used.
         for (int i = 0; i < MAX_TCP_ACCEPTS; i++) {
             if (acceptSlots[i] == nullptr) {
                 auto atp = new AcceptTaskHandler(port, onServerAccepted, callbackData);
@@ -147,6 +147,14 @@ namespace tcremote {
         return SOCK_ERR_FAILED;
     }
 
+    uint8_t* rawWriteReserve(socket_t socketNum, size_t minimumLen, size_t* actualLen) {
+        return nullptr;
+    }
+
+    SocketErrCode rawWriteCommit(socket_t socketNum, size_t len) {
+        return SOCK_ERR_FAILED;
+    }
+
     SocketErrCode rawFlushAll(socket_t socketNum) {
         return SOCK_ERR_FAILED;
     }
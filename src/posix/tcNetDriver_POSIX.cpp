@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "tcNetDriver_POSIX.h"
+
+#ifdef TC_NET_USES_POSIX
+
+#include <TaskManagerIO.h>
+#include <IoLogging.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#define MAX_TCP_ACCEPTS 2
+
+#ifdef MSG_NOSIGNAL
+#define POSIX_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define POSIX_SEND_FLAGS 0
+#endif
+
+namespace tcremote {
+
+    class PosixAcceptor {
+    public:
+        int listenFd = TC_BAD_SOCKET_ID;
+        ServerAcceptedCallback onAccepted = nullptr;
+        SocketReadyCallback onReady = nullptr;
+        void* callbackData = nullptr;
+    };
+
+    class PosixClient {
+    public:
+        int fd = TC_BAD_SOCKET_ID;
+        PosixAcceptor* acceptor = nullptr;
+    };
+
+    PosixAcceptor posixAcceptors[MAX_TCP_ACCEPTS];
+    PosixClient posixClients[POSIX_MAX_CLIENT_SOCKETS];
+    pollfd posixPollFds[POSIX_MAX_CLIENT_SOCKETS];
+    int posixClientCount = 0;
+    bool posixNetworkUp = false;
+    taskid_t posixPollTask = TASKMGR_INVALIDID;
+
+    bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    PosixClient* findClient(socket_t fd) {
+        for(int i = 0; i < posixClientCount; i++) {
+            if(posixClients[i].fd == fd) return &posixClients[i];
+        }
+        return nullptr;
+    }
+
+    bool pollOne(socket_t fd, short events) {
+        if(fd < 0) return false;
+        pollfd pfd = { fd, events, 0 };
+        return poll(&pfd, 1, 0) > 0 && (pfd.revents & (events | POLLHUP | POLLERR)) != 0;
+    }
+
+    void acceptWaitingClients(PosixAcceptor& acceptor) {
+        while(true) {
+            int fd = accept(acceptor.listenFd, nullptr, nullptr);
+            if(fd < 0) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    serlogF2(SER_NETWORK_INFO, "Accept failed ", errno);
+                }
+                return;
+            }
+            if(posixClientCount >= POSIX_MAX_CLIENT_SOCKETS || !setNonBlocking(fd)) {
+                serlogF2(SER_NETWORK_INFO, "No client socket free ", fd);
+                close(fd);
+                continue;
+            }
+            // writes are already coalesced by the web server, so nagle would only add latency.
+            int optData = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optData, sizeof(optData));
+#ifdef SO_NOSIGPIPE
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optData, sizeof(optData));
+#endif
+            posixClients[posixClientCount].fd = fd;
+            posixClients[posixClientCount].acceptor = &acceptor;
+            posixClientCount++;
+            acceptor.onAccepted(fd, acceptor.callbackData);
+        }
+    }
+
+    void posixPollSockets() {
+        for(auto& acceptor : posixAcceptors) {
+            if(acceptor.listenFd >= 0) acceptWaitingClients(acceptor);
+        }
+
+        auto count = (nfds_t)posixClientCount;
+        if(count == 0) return;
+        for(nfds_t i = 0; i < count; i++) {
+            posixPollFds[i].fd = posixClients[i].fd;
+            posixPollFds[i].events = POLLIN;
+            posixPollFds[i].revents = 0;
+        }
+        if(poll(posixPollFds, count, 0) <= 0) return;
+
+        // a ready callback may close a socket, so the client is looked up again rather than using the index.
+        for(nfds_t i = 0; i < count; i++) {
+            if(posixPollFds[i].revents == 0) continue;
+            auto client = findClient(posixPollFds[i].fd);
+            if(client && client->acceptor->onReady) client->acceptor->onReady(client->fd, client->acceptor->callbackData);
+        }
+    }
+
+    int posixOpenClientCount() {
+        return posixClientCount;
+    }
+
+    SocketErrCode startNetLayerDhcp() {
+        // a peer closing while we write must give an error rather than ending the process.
+        signal(SIGPIPE, SIG_IGN);
+        posixNetworkUp = true;
+        return SOCK_ERR_OK;
+    }
+
+    SocketErrCode startNetLayerManual(const uint8_t *ip, const uint8_t *mac, const uint8_t *mask) {
+        // the host's own network configuration is always used.
+        return startNetLayerDhcp();
+    }
+
+    void copyIpAddress(socket_t theSocket, char *buffer, size_t bufferSize) {
+        sockaddr_in addr{};
+        socklen_t addrLen = sizeof(addr);
+        buffer[0] = 0;
+        if(theSocket == TC_LOCALHOST_SOCKET_ID) {
+            strncpy(buffer, "127.0.0.1", bufferSize);
+        } else if(getpeername(theSocket, (sockaddr*)&addr, &addrLen) == 0) {
+            inet_ntop(AF_INET, &addr.sin_addr, buffer, bufferSize);
+        }
+    }
+
+    bool isNetworkUp() {
+        return posixNetworkUp;
+    }
+
+    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void *callbackData, SocketReadyCallback onSocketReady) {
+        for(auto& acceptor : posixAcceptors) {
+            if(acceptor.listenFd >= 0) continue;
+
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if(fd < 0) return SOCK_ERR_FAILED;
+            int optData = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optData, sizeof(optData));
+
+            sockaddr_in listenAddr{};
+            listenAddr.sin_family = AF_INET;
+            listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+            listenAddr.sin_port = htons(port);
+            if(bind(fd, (sockaddr*)&listenAddr, sizeof(listenAddr)) != 0 || listen(fd, POSIX_LISTEN_BACKLOG) != 0 || !setNonBlocking(fd)) {
+                serlogF3(SER_ERROR, "Binding failed ", port, errno);
+                close(fd);
+                return SOCK_ERR_FAILED;
+            }
+
+            acceptor.listenFd = fd;
+            acceptor.onAccepted = onServerAccepted;
+            acceptor.onReady = onSocketReady;
+            acceptor.callbackData = callbackData;
+            if(posixPollTask == TASKMGR_INVALIDID) {
+                posixPollTask = taskManager.scheduleFixedRate(POSIX_POLL_INTERVAL_MICROS, posixPollSockets, TIME_MICROS);
+            }
+            serlogF2(NET_LOGGING_CHANNEL, "Accept created ", port);
+            return SOCK_ERR_OK;
+        }
+        return SOCK_ERR_FAILED;
+    }
+
+    int rawReadData(socket_t socketNum, void *data, size_t dataLen) {
+        if(socketNum < 0) return -1;
+        auto actual = recv(socketNum, data, dataLen, 0);
+        if(actual > 0) return (int)actual;
+        if(actual < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        // zero means the other side has closed the connection
+        return -1;
+    }
+
+    bool rawReadAvailable(socket_t socketNum) {
+        return pollOne(socketNum, POLLIN);
+    }
+
+    bool rawWriteAvailable(socket_t socketNum) {
+        return pollOne(socketNum, POLLOUT);
+    }
+
+    SocketErrCode rawWriteData(socket_t socketNum, const void *data, size_t dataLen, MemoryLocationType memType, int timeoutMillis) {
+        if(socketNum < 0) return SOCK_ERR_FAILED;
+        // program memory is ordinary memory on a host, so every location type is written straight from the buffer.
+        auto buffer = reinterpret_cast<const uint8_t*>(data);
+        size_t sent = 0;
+        unsigned long then = millis();
+        while(sent < dataLen) {
+            auto actual = send(socketNum, &buffer[sent], dataLen - sent, POSIX_SEND_FLAGS);
+            if(actual > 0) {
+                sent += actual;
+                continue;
+            }
+            if(actual < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                if(int(millis() - then) > timeoutMillis) {
+                    serlogF3(NET_LOGGING_CHANNEL, "Write timeout ", socketNum, sent);
+                    return SOCK_ERR_TIMEOUT;
+                }
+                taskManager.yieldForMicros(POSIX_WRITE_WAIT_MICROS);
+                continue;
+            }
+            serlogF3(NET_LOGGING_CHANNEL, "Write failed ", socketNum, errno);
+            return SOCK_ERR_FAILED;
+        }
+        return SOCK_ERR_OK;
+    }
+
+    uint8_t* rawWriteReserve(socket_t socketNum, size_t minimumLen, size_t* actualLen) {
+        // every write goes straight to the kernel, there is no write buffer in this driver to reserve space in.
+        return nullptr;
+    }
+
+    SocketErrCode rawWriteCommit(socket_t socketNum, size_t len) {
+        return SOCK_ERR_FAILED;
+    }
+
+    SocketErrCode rawFlushAll(socket_t socketNum) {
+        // nagle is turned off for every client, so nothing is ever held back waiting for a flush.
+        return socketNum >= 0 ? SOCK_ERR_OK : SOCK_ERR_FAILED;
+    }
+
+    void closeSocket(socket_t sockFd) {
+        if(sockFd < 0) return;
+        auto client = findClient(sockFd);
+        if(client) {
+            // keep the table packed by moving the last client into the gap.
+            *client = posixClients[posixClientCount - 1];
+            posixClientCount--;
+        }
+        close(sockFd);
+    }
+}
+
+#endif // TC_NET_USES_POSIX
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file tcNetDriver_POSIX.h
+ *
+ * A network driver for hosts with BSD sockets, such as Linux and macOS. It is not for use on a device, it lets the web
+ * server and the embedCONTROL websocket run on a desktop so that they can be load tested and profiled without any
+ * hardware. To use it define TC_NET_HOST_SOCKETS for the whole build.
+ *
+ * All sockets are non-blocking and are polled from a task manager task, which accepts new connections and calls the
+ * ready callback for any connection with data waiting. Writes that would block yield to task manager until there is
+ * room, or the timeout passes, in the same way as the device drivers.
+ */
+
+#ifndef TCMENU_TCNETDRIVER_POSIX_H
+#define TCMENU_TCNETDRIVER_POSIX_H
+
+#include <Arduino.h>
+#include "../TcMenuNetLayer.h"
+
+// The maximum number of client connections the driver tracks at once, connections beyond this are closed on accept.
+#ifndef POSIX_MAX_CLIENT_SOCKETS
+#define POSIX_MAX_CLIENT_SOCKETS 1024
+#endif
+
+// The length of the listen queue passed to the OS, a burst of reconnecting clients waits here until accepted.
+#ifndef POSIX_LISTEN_BACKLOG
+#define POSIX_LISTEN_BACKLOG 128
+#endif
+
+// How often the sockets are polled for new connections and data, in microseconds.
+#ifndef POSIX_POLL_INTERVAL_MICROS
+#define POSIX_POLL_INTERVAL_MICROS 500
+#endif
+
+// How long a write that cannot proceed yields to task manager before trying again, in microseconds.
+#ifndef POSIX_WRITE_WAIT_MICROS
+#define POSIX_WRITE_WAIT_MICROS 250
+#endif
+
+namespace tcremote {
+    /**
+     * Polls the sockets straight away rather than waiting for the next poll task, accepting new connections and
+     * calling the ready callback for connections with data. This is normally only needed by tools that do not run
+     * the task manager loop.
+     */
+    void posixPollSockets();
+
+    /**
+     * @return the number of client connections that are presently open.
+     */
+    int posixOpenClientCount();
+}
+
+#endif //TCMENU_TCNETDRIVER_POSIX_H
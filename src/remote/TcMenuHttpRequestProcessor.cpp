@@ -1,6 +1,10 @@
 
 #include "PlatformDetermination.h"
 #include "TcMenuHttpRequestProcessor.h"
+#include "TcWebResponseCache.h"
+#include "TcWebSha1.h"
+#include "TcWebBase64.h"
+#include "TcWebTrace.h"
 #include "TcMenuWebServer.h"
 #include "TaskManagerIO.h"
 
@@ -8,15 +12,6 @@ using namespace tcremote;
 
 const char pgmWebSockUuid[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
-namespace tc_b64 {
-    int base64(const uint8_t *data, int dataSize, uint8_t *buffer, int bufferSize);
-}
-
-// See the associated C file in this directory
-extern "C" {
-int sha1digest(uint8_t *hexDigest, const uint8_t *data, size_t databytes);
-}
-
 
 inline WebSocketOpcode getOpcode(uint8_t header) {
     return (WebSocketOpcode)(header & WS_OPCODE_MASK);
@@ -25,171 +20,356 @@ inline WebSocketOpcode getOpcode(uint8_t header) {
 char HttpProcessor::readCharFromTransport() {
     while(transport->connected()) {
         uint8_t sz[1];
-        auto actual = rawReadData(transport->getClientFd(), sz, 1);
-        if(actual) {
+        auto actual = transport->readFromConnection(sz, 1);
+        if(actual > 0) {
             return (char)sz[0];
         } else {
 #ifndef TC_DEBUG_SOCKET_LAYER
-            if((millis() - millisStart) > 2000) {
+            if(hasTimedOut()) {
                 protocolError = true;
                 return -1;
             }
 #endif
-            taskManager.yieldForMicros(1000);
+            waitForData();
         }
     }
     return 0;
 }
 
+int HttpProcessor::readDataFromTransport(uint8_t* buffer, size_t bufferSize) {
+    while(transport->connected()) {
+        auto actual = transport->readFromConnection(buffer, bufferSize);
+        if(actual > 0) {
+            millisStart = millis();
+            return actual;
+        } else if(actual < 0 || hasTimedOut()) {
+            protocolError = true;
+            return -1;
+        }
+        waitForData();
+    }
+    return -1;
+}
+
+void HttpProcessor::waitForData() {
+    taskManager.yieldForMicros(1000);
+    // the reactor cannot run while we wait within it, so deadlines are advanced from here, including our own.
+    if(deadlines) deadlines->advance(millis());
+}
+
+HttpWordRead HttpProcessor::readWord(char* buffer, size_t bufferSize, bool skipSeparator) {
+    while(true) {
+        uint8_t ch;
+        auto actual = transport->connected() ? transport->readFromConnection(&ch, 1) : -1;
+        if(actual < 0) {
+            protocolError = true;
+            traceWeb(TRACE_READ_ERROR, transport->getClientFd(), protocolError, transport->connected());
+            buffer[0] = 0;
+            wordPosition = 0;
+            wordTrimming = true;
+            return WORD_ERROR;
+        }
+        // the word so far stays in the buffer, and the next call carries on from where this one stopped.
+        if(actual == 0) return WORD_WAITING;
+
+        if(wordTrimming && ch == ' ') continue;
+        bool endOfLine = ch == '\n';
+        if(endOfLine || (!skipSeparator && (ch == ':' || ch == ' '))) {
+            millisStart = millis();
+            buffer[min(wordPosition, bufferSize - 1)] = 0;
+            wordPosition = 0;
+            wordTrimming = true;
+            return endOfLine ? WORD_END_OF_LINE : WORD_READ;
+        }
+        // ignore the \r, we are supposed to read \r\n
+        if(ch != '\r' && wordPosition < bufferSize) {
+            wordTrimming = false;
+            buffer[wordPosition++] = (char)ch;
+        }
+    }
+}
+
 bool HttpProcessor::readWordUntilTrim(char* buffer, size_t bufferSize, bool skipSeparator) {
-    unsigned int pos = 0;
-    bool wordRead = false;
-    bool trimming = true;
-    bool endOfLine = false;
-    buffer[0] = 0;
-
-    while(!wordRead) {
-        auto ch = readCharFromTransport();
-        if(protocolError || !transport->connected()) {
+    while(true) {
+        auto wordRead = readWord(buffer, bufferSize, skipSeparator);
+        if(wordRead != WORD_WAITING) return wordRead == WORD_END_OF_LINE;
+        if(hasTimedOut()) {
             protocolError = true;
-            serlogF3(SER_NETWORK_DEBUG, "read loop error(err, con) ", protocolError, transport->connected());
             buffer[0] = 0;
+            wordPosition = 0;
+            wordTrimming = true;
             return false;
         }
-        if(trimming && ch == ' ') continue;
-        if(!skipSeparator && (ch == ':' || ch == ' ')) wordRead = true;
-        else if(ch == '\n') {
-            wordRead = true;
-            endOfLine = true;
-        } else if(ch == '\r') {
-            // ignore the \r, we are supposed to read \r\n
-        } else if(pos < bufferSize) {
-            trimming = false;
-            buffer[pos] = ch;
-            pos++;
-        }
+        waitForData();
     }
-    buffer[min(pos, bufferSize -1)] = 0;
-    return endOfLine;
 }
 
 WebServerMethod HttpProcessor::processRequest(char* buffer, size_t bufferSize) {
-    if(readWordUntilTrim(buffer, bufferSize) || !transport->connected()) {
-        return REQ_NONE;
-    }
-    if(protocolError) {
-        serlogF(SER_NETWORK_DEBUG, "Socket closed or timeout");
-        return REQ_NONE;
-    }
-    bool getRequest = strcmp(buffer, "GET") == 0;
-    bool postRequest = strcmp(buffer, "POST") == 0;
-    if(getRequest || postRequest) {
-        if(readWordUntilTrim(buffer, bufferSize)) return REQ_ERROR; // missing HTTP/1.1
-        char sz[10];
-        if(!readWordUntilTrim(sz, sizeof sz, true)) {
-            serlogF4(SER_NETWORK_INFO, "Request missing protocol (buffer, proto, isGet)", buffer, sz, getRequest);
-            return REQ_ERROR; // protocol eg HTTP*
+    if(parseStage == PARSE_METHOD) {
+        auto wordRead = readWord(buffer, bufferSize);
+        if(wordRead == WORD_WAITING) return REQ_INCOMPLETE;
+        if(wordRead != WORD_READ) {
+            serlogF(SER_NETWORK_DEBUG, "Socket closed or empty request");
+            return REQ_NONE;
         }
-        if(protocolError || strncmp(sz, "HTTP", 4) != 0) {
-            serlogF4(SER_NETWORK_INFO, "Request without HTTP (buffer, proto, isGet)", buffer, sz, getRequest);
+        if(strcmp(buffer, "GET") == 0) parsedMethod = GET;
+        else if(strcmp(buffer, "POST") == 0) parsedMethod = POST;
+        else {
+            serlogF(SER_NETWORK_INFO,"Not POST or GET");
             return REQ_ERROR;
         }
-        serlogF4(SER_NETWORK_INFO, "Request processed (buffer, proto, isGet)", buffer, sz, getRequest);
-        return getRequest ? GET : POST;
+        parseStage = PARSE_URL;
+    }
+
+    if(parseStage == PARSE_URL) {
+        auto wordRead = readWord(buffer, bufferSize);
+        if(wordRead == WORD_WAITING) return REQ_INCOMPLETE;
+        if(wordRead != WORD_READ) return REQ_ERROR; // missing HTTP/1.1
+        parseStage = PARSE_PROTOCOL;
     }
-    else {
-        serlogF(SER_NETWORK_INFO,"Not POST or GET");
+
+    // the URL is left in the buffer, so the protocol is read into one of our own.
+    auto wordRead = readWord(protocol, sizeof protocol, true);
+    if(wordRead == WORD_WAITING) return REQ_INCOMPLETE;
+    if(wordRead != WORD_END_OF_LINE || strncmp(protocol, "HTTP", 4) != 0) {
+        serlogF4(SER_NETWORK_INFO, "Request without HTTP (buffer, proto, method)", buffer, protocol, parsedMethod);
         return REQ_ERROR;
     }
+    parseStage = PARSE_HEADER_NAME;
+    traceWeb(TRACE_REQUEST_LINE, transport->getClientFd(), parsedMethod, strlen(buffer));
+    return parsedMethod;
 }
 
-WebServerHeader HttpProcessor::processHeader(char* buffer, size_t bufferSize) {
-    millisStart = millis();
-    protocolError = false;
+static WebServerHeader headerFromName(const char* name) {
+    if(strcmp(name, "Host") == 0) return WSH_HOST;
+    if(strcmp(name, "User-Agent") == 0) return WSH_USER_AGENT;
+    if(strcmp(name, "Upgrade") == 0) return WSH_UPGRADE_TO_WEBSOCKET;
+    if(strcmp(name, "Connection") == 0) return WSH_CONNECTION;
+    if(strcmp(name, "Sec-WebSocket-Key") == 0) return WSH_SEC_WS_KEY;
+    if(strcmp(name, "Range") == 0) return WSH_RANGE;
+    if(strcmp(name, "Content-Length") == 0) return WSH_CONTENT_LENGTH;
+    if(strcmp(name, "Content-Type") == 0) return WSH_CONTENT_TYPE;
+    if(strcmp(name, "If-None-Match") == 0) return WSH_IF_NONE_MATCH;
+    if(strcmp(name, "Last-Event-ID") == 0) return WSH_LAST_EVENT_ID;
+    if(strcmp(name, "Accept-Encoding") == 0) return WSH_ACCEPT_ENCODING;
+    return WSH_UNPROCESSED;
+}
 
-    if(readWordUntilTrim(buffer, bufferSize)) return WSH_FINISHED;
-    if(!transport->connected()) return WSH_ERROR;
-    if(strcmp(buffer, "Host") == 0) {
-        if(!readWordUntilTrim(buffer, bufferSize, true)) {
-            serlogF2(SER_NETWORK_INFO, "Host tag not terminated", buffer);
-            return WSH_ERROR;
-        }
-        if(protocolError) return WSH_ERROR;
-        serlogF2(SER_NETWORK_DEBUG, "Host ", buffer);
-        return WSH_HOST;
-    }
-    if(strcmp(buffer, "User-Agent") == 0) {
-        if(!readWordUntilTrim(buffer, bufferSize, true)) {
-            serlogF2(SER_NETWORK_INFO, "User-Agent not terminated", buffer);
-            return WSH_ERROR;
-        }
-        if(protocolError) return WSH_ERROR;
-        serlogF2(SER_NETWORK_DEBUG, "User-Agent ", buffer);
-        return WSH_USER_AGENT;
-    }
-    if(strcmp(buffer, "Upgrade")==0) {
-        if(!readWordUntilTrim(buffer, bufferSize, true)) {
-            serlogF2(SER_NETWORK_INFO, "Upgrade not terminated", buffer);
-            return WSH_ERROR;
-        }
-        if(protocolError) return WSH_ERROR;
-        if(strcmp(buffer, "websocket") == 0) {
-            serlogF(SER_NETWORK_DEBUG, "Upgrade to websocket OK");
-            return WSH_UPGRADE_TO_WEBSOCKET;
-        }
-    } else if(strcmp(buffer, "Connection") == 0) {
-        readWordUntilTrim(buffer, bufferSize, true);
-        if(protocolError) return WSH_ERROR;
-        if(strcmp(buffer, "Upgrade") == 0) {
-            serlogF2(SER_NETWORK_DEBUG, "Connection upgrade OK", buffer);
-            return WSH_UPGRADE_TO_WEBSOCKET;
-        }
-    } else if(strcmp(buffer, "Sec-WebSocket-Key") == 0) {
-        if (!readWordUntilTrim(buffer, bufferSize, true)) {
-            serlogF2(SER_NETWORK_INFO, "SecKey not terminated", buffer);
-            return WSH_ERROR;
-        }
-        if (protocolError) return WSH_ERROR;
-        serlogF2(SER_NETWORK_DEBUG, "SecKey OK", buffer);
-        return WSH_SEC_WS_KEY;
-    } else if(strcmp(buffer, "Accept-Encoding") == 0) {
-        if (!readWordUntilTrim(buffer, bufferSize, true)) {
-            serlogF2(SER_NETWORK_INFO, "AcceptEncoding not terminated", buffer);
-            return WSH_ERROR;
+WebServerHeader HttpProcessor::processHeader(char* buffer, size_t bufferSize) {
+    if(parseStage == PARSE_HEADER_NAME) {
+        auto wordRead = readWord(buffer, bufferSize);
+        if(wordRead == WORD_WAITING) return WSH_INCOMPLETE;
+        if(wordRead == WORD_ERROR) return WSH_ERROR;
+        if(wordRead == WORD_END_OF_LINE) {
+            parseStage = PARSE_DONE;
+            return WSH_FINISHED;
         }
-        if (protocolError) return WSH_ERROR;
-        serlogF2(SER_NETWORK_DEBUG,"Accept encoding ", buffer);
-        return WSH_ACCEPT_ENCODING;
-    } else {
-        serlogF2(SER_NETWORK_DEBUG, "Unprocessed ", buffer);
-        readWordUntilTrim(buffer, bufferSize, true);
-        // you can enable the below if you want to see every single header for debugging.
-        serlogF3(SER_NETWORK_DEBUG, "Content: ", buffer, protocolError);
-        if(protocolError) return WSH_ERROR;
+        pendingHeader = headerFromName(buffer);
+        parseStage = PARSE_HEADER_VALUE;
     }
-    return WSH_UNPROCESSED;
+
+    auto wordRead = readWord(buffer, bufferSize, true);
+    if(wordRead == WORD_WAITING) return WSH_INCOMPLETE;
+    parseStage = PARSE_HEADER_NAME;
+    if(wordRead == WORD_ERROR) {
+        serlogF2(SER_NETWORK_INFO, "Header not terminated ", pendingHeader);
+        return WSH_ERROR;
+    }
+
+    // these two are only of interest when they ask to upgrade to a websocket.
+    if(pendingHeader == WSH_UPGRADE_TO_WEBSOCKET) {
+        return strcmp(buffer, "websocket") == 0 ? WSH_UPGRADE_TO_WEBSOCKET : WSH_UNPROCESSED;
+    } else if(pendingHeader == WSH_CONNECTION) {
+        return strcmp(buffer, "Upgrade") == 0 ? WSH_UPGRADE_TO_WEBSOCKET : WSH_UNPROCESSED;
+    }
+    return pendingHeader;
+}
+
+static const char* const webDayNames = "SunMonTueWedThuFriSat";
+static const char* const webMonthNames = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+static void appendTwoDigits(char* buffer, int value, char separator) {
+    size_t len = strlen(buffer);
+    buffer[len] = (char)('0' + ((value / 10) % 10));
+    buffer[len + 1] = (char)('0' + (value % 10));
+    buffer[len + 2] = separator;
+    buffer[len + 3] = 0;
+}
+
+void tcremote::formatWebDate(char* buffer, int year, int month, int day, int hour, int minute, int second) {
+    // day of the week using Sakamoto's method, 0 is Sunday.
+    static const uint8_t monthOffsets[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+    int y = (month < 3) ? year - 1 : year;
+    int dayOfWeek = (y + y / 4 - y / 100 + y / 400 + monthOffsets[month - 1] + day) % 7;
+
+    strncpy(buffer, &webDayNames[dayOfWeek * 3], 3);
+    buffer[3] = 0;
+    strcat(buffer, ", ");
+    appendTwoDigits(buffer, day, ' ');
+    strncat(buffer, &webMonthNames[(month - 1) * 3], 3);
+    strcat(buffer, " ");
+    appendTwoDigits(buffer, year / 100, 0);
+    appendTwoDigits(buffer, year % 100, ' ');
+    appendTwoDigits(buffer, hour, ':');
+    appendTwoDigits(buffer, minute, ':');
+    appendTwoDigits(buffer, second, ' ');
+    strcat(buffer, "GMT");
+}
+
+const char* tcremote::buildDateInWebForm() {
+    static char buildDate[WS_WEB_DATE_SIZE] = {};
+    if(buildDate[0] == 0) {
+        // __DATE__ is in the form "Jul 22 2009" and __TIME__ is "19:15:56"
+        const char* date = __DATE__;
+        const char* time = __TIME__;
+        int month = 1;
+        while(month < 12 && strncmp(&webMonthNames[(month - 1) * 3], date, 3) != 0) month++;
+        int day = atoi(&date[4]);
+        int year = atoi(&date[7]);
+        formatWebDate(buildDate, year, month, day, atoi(time), atoi(&time[3]), atoi(&time[6]));
+    }
+    return buildDate;
+}
+
+const char* WebDateCache::get(WebDateSourceFn source, unsigned long maxAgeMillis) {
+    if(!read || (millis() - readAt) >= maxAgeMillis) {
+        source(date, sizeof date);
+        readAt = millis();
+        read = true;
+    }
+    return date;
+}
+
+#if defined(WS_RTC_INTEGRATED)
+static WebDateCache webDateCache;
+
+const char* tcremote::currentWebDate() {
+    // reading the RTC can be slow, it is often on a shared bus, so it's only read once the cached value is too old.
+    return webDateCache.get(rtcUTCDateInWebForm, WS_DATE_REFRESH_MILLIS);
+}
+#endif
+
+bool HttpProcessor::parseContentLength(const char* lengthText, uint32_t& length) {
+    if(!isdigit(*lengthText)) return false;
+    length = 0;
+    while(isdigit(*lengthText)) {
+        uint32_t digit = *lengthText++ - '0';
+        // a length too large to hold is far over WS_MAX_REQUEST_BODY_SIZE anyway, so it is held at the largest value.
+        length = (length > (UINT32_MAX - digit) / 10) ? UINT32_MAX : (length * 10) + digit;
+    }
+    return *lengthText == 0;
+}
+
+bool HttpProcessor::parseEntityTag(const char* tagText, uint32_t& version) {
+    // only tags written by setEntityTagHeader are understood, a weak tag is treated the same as a strong one.
+    if(strncmp(tagText, "W/", 2) == 0) tagText += 2;
+    if(*tagText++ != '"') return false;
+    version = 0;
+    int digits = 0;
+    while(isxdigit(*tagText) && digits < 8) {
+        char ch = *tagText++;
+        version = (version << 4) | (isdigit(ch) ? (ch - '0') : ((ch | 0x20) - 'a' + 10));
+        digits++;
+    }
+    return digits == 8 && *tagText == '"';
+}
+
+static bool readRangePosition(const char*& pos, int32_t& position) {
+    // all the digits are always consumed, but a position too large to hold is reported rather than wrapped around.
+    bool fits = true;
+    position = 0;
+    while(isdigit(*pos)) {
+        int digit = *pos++ - '0';
+        if(position > (INT32_MAX - digit) / 10) fits = false;
+        else position = (position * 10) + digit;
+    }
+    return fits;
+}
+
+bool HttpProcessor::parseRange(const char* rangeText, int32_t& rangeFirst, int32_t& rangeLast) {
+    rangeFirst = rangeLast = -1;
+    if(strncmp(rangeText, "bytes=", 6) != 0 || strchr(rangeText, ',') != nullptr) return false;
+    const char* pos = &rangeText[6];
+    bool tooLarge = false;
+    if(isdigit(*pos) && !readRangePosition(pos, rangeFirst)) tooLarge = true;
+    if(*pos++ != '-') return false;
+    if(isdigit(*pos) && !readRangePosition(pos, rangeLast)) tooLarge = true;
+    if(*pos != 0 || (rangeFirst < 0 && rangeLast < 0)) return false;
+    if(tooLarge) {
+        // no resource we serve is that large, so the range is made one that can never be satisfied, giving a 416.
+        rangeFirst = rangeLast = INT32_MAX;
+        return true;
+    }
+    return rangeLast < 0 || rangeFirst <= rangeLast;
 }
 
 void tcremote::HttpProcessor::tick() {
     millisStart = millis();
+    timedOut = false;
 }
 
 void HttpProcessor::reset() {
     millisStart = millis();
     protocolError = false;
+    timedOut = false;
+    parseStage = PARSE_METHOD;
+    parsedMethod = REQ_NONE;
+    wordPosition = 0;
+    wordTrimming = true;
 }
 
 WebServerResponse::WebServerResponse(TcMenuLightweightWebServer *webServer, TcMenuWebServerTransport *tx,
                                      WebServerResponse::WSRConnectionType conType)
-        : webServer(webServer), method(GET), transport(tx), processor(tx), mode(NOT_IN_USE), connectionType(conType), webSocketSha1KeyToRespond{} {
+        : webServer(webServer), method(GET), transport(tx), processor(tx, &webServer->getTimerWheel()), mode(NOT_IN_USE), connectionType(conType), webSocketSha1KeyToRespond{} {
     initialConnectionType = connectionType;
 }
 
-void WebServerResponse::init() {
-    scheduledTaskId = taskManager.scheduleFixedRate(20, this);
+void WebServerResponse::contentInfo(WSRContentType contentType, size_t len) {
+    if(rangeState == RANGE_NOT_SATISFIABLE) return; // the 416 response has no content.
+    setContentTypeHeader(contentType);
+
+    char sz[40];
+    if(rangeState == RANGE_ACTIVE) {
+        strcpy(sz, "bytes ");
+        ltoa(rangeFirst, &sz[strlen(sz)], 10);
+        appendChar(sz, '-', sizeof sz);
+        ltoa(rangeLast, &sz[strlen(sz)], 10);
+        appendChar(sz, '/', sizeof sz);
+        ltoa((long)rangeTotal, &sz[strlen(sz)], 10);
+        setHeader(WSH_CONTENT_RANGE, sz);
+        len = (rangeLast - rangeFirst) + 1;
+    }
+
+    ltoa((long)len, sz, 10);
+    setHeader(WSH_CONTENT_LENGTH, sz);
 }
 
-void WebServerResponse::contentInfo(WSRContentType contentType, size_t len) {
+void WebServerResponse::contentInfoChunked(WSRContentType contentType) {
+    setContentTypeHeader(contentType);
+    setHeader(WSH_TRANSFER_ENCODING, "chunked");
+    chunkedEncoding = true;
+    chunkFill = 0;
+}
+
+void WebServerResponse::setEntityTagHeader() {
+    if(!entityTagPresent) return;
+    char sz[12];
+    sz[0] = '"';
+    for(int i = 0; i < 8; i++) {
+        sz[i + 1] = "0123456789abcdef"[(entityTag >> (28 - (i * 4))) & 0x0f];
+    }
+    sz[9] = '"';
+    sz[10] = 0;
+    setHeader(WSH_ETAG, sz);
+}
+
+void WebServerResponse::sendNotModified() {
+    startHeader(WS_INT_RESPONSE_NOT_MODIFIED, WS_TEXT_RESPONSE_NOT_MODIFIED);
+    setEntityTagHeader();
+}
+
+void WebServerResponse::setContentTypeHeader(WSRContentType contentType) {
+    if(captureEntry) captureEntry->captureContentType(contentType);
     const char *headerText;
     switch(contentType) {
         case WebServerResponse::HTML_TEXT:
@@ -221,20 +401,77 @@ void WebServerResponse::contentInfo(WSRContentType contentType, size_t len) {
             break;
     }
     setHeader(WSH_CONTENT_TYPE, headerText);
+    setEntityTagHeader();
+}
 
-    char sz[10];
-    itoa((int)len, sz, 10);
-    setHeader(WSH_CONTENT_LENGTH, sz);
+bool WebServerResponse::startRangedHeader(size_t totalLength) {
+    if(captureEntry) captureEntry->failCapture(); // ranged resources are not cached.
+    rangeTotal = totalLength;
+    rangePosition = 0;
+    if(rangeState == RANGE_REQUESTED) {
+        auto total = (int32_t)totalLength;
+        if(rangeFirst < 0) {
+            // suffix range, the last N bytes of the resource
+            rangeFirst = (rangeLast >= total) ? 0 : total - rangeLast;
+            rangeLast = total - 1;
+        } else if(rangeLast < 0 || rangeLast >= total) {
+            rangeLast = total - 1;
+        }
+        rangeState = (total == 0 || rangeFirst >= total) ? RANGE_NOT_SATISFIABLE : RANGE_ACTIVE;
+    }
+
+    if(rangeState == RANGE_NOT_SATISFIABLE) {
+        startHeader(WS_INT_RESPONSE_RANGE_NOT_SATISFIABLE, WS_TEXT_RESPONSE_RANGE_NOT_SATISFIABLE);
+        char sz[20];
+        strcpy(sz, "bytes */");
+        ltoa((long)totalLength, &sz[strlen(sz)], 10);
+        setHeader(WSH_CONTENT_RANGE, sz);
+        setHeader(WSH_CONTENT_LENGTH, "0");
+        return false;
+    }
+
+    if(rangeState == RANGE_ACTIVE) {
+        startHeader(WS_INT_RESPONSE_PARTIAL, WS_TEXT_RESPONSE_PARTIAL);
+    } else {
+        startHeader();
+    }
+    setHeader(WSH_ACCEPT_RANGES, "bytes");
+    return true;
+}
+
+bool WebServerResponse::clipToRange(const uint8_t*& startingLocation, size_t& numBytes) {
+    if(rangeState == RANGE_NONE || rangeState == RANGE_REQUESTED) return true;
+
+    // work out where this block sits within the resource, and then how much of it overlaps the range.
+    uint32_t blockFirst = rangePosition;
+    uint32_t blockEnd = rangePosition + numBytes;
+    rangePosition = blockEnd;
+    if(rangeState == RANGE_NOT_SATISFIABLE) return false;
+
+    uint32_t wantedEnd = rangeLast + 1;
+    if(blockEnd <= (uint32_t)rangeFirst || blockFirst >= wantedEnd) return false;
+
+    uint32_t from = max(blockFirst, (uint32_t)rangeFirst);
+    uint32_t to = min(blockEnd, wantedEnd);
+    startingLocation = &startingLocation[from - blockFirst];
+    numBytes = to - from;
+    return true;
 }
 
 void WebServerResponse::startHeader(int code, const char* textualInfo) {
-    serlogF3(SER_NETWORK_INFO, "Start header response", code, textualInfo);
+    traceWeb(TRACE_RESPONSE_START, transport->getClientFd(), code, 0);
+    if(timeToFirstByte == 0) {
+        uint32_t elapsed = micros() - requestStartMicros;
+        timeToFirstByte = elapsed ? elapsed : 1;
+    }
+    // only complete successful responses are cached.
+    if(captureEntry && code != WS_INT_RESPONSE_OK) captureEntry->failCapture();
     mode = PREPARING_HEADER;
     if(code == WS_CODE_CHANGING_PROTOCOL) connectionType = WEB_SOCKET; // websockets don't get closed after the request.
     uint8_t* dataArea = transport->getReadBuffer();
     size_t buffSize = transport->getReadBufferSize();
     strcpy((char*)dataArea, "HTTP/1.1 ");
-    char sz[32];
+    char sz[8];
     itoa(code, sz, 10);
     strcat((char*)dataArea, sz);
     appendChar((char*)dataArea, ' ', buffSize);
@@ -246,8 +483,7 @@ void WebServerResponse::startHeader(int code, const char* textualInfo) {
 // if you have an RTC device, you can implement `rtcUTCDateInWebForm` which allows you to give the current date from
 // the RTC device for submission in the headers as the DATE header. It is assumed the format is correct.
 #if defined(WS_RTC_INTEGRATED)
-    rtcUTCDateInWebForm(sz, sizeof sz);
-    setHeader(WSH_DATE, sz)
+    setHeader(WSH_DATE, currentWebDate());
 #endif
 
     // for synchronous single clients (IE one at a time), it's best that we close the connection immediately
@@ -270,6 +506,10 @@ const char* getHeaderAsText(WebServerHeader header) {
         case WebServerHeader::WSH_CACHE_CONTROL: return "Cache-Control: ";
         case WebServerHeader::WSH_CONTENT_ENCODING: return "Content-Encoding: ";
         case WebServerHeader::WSH_SEC_WS_ACCEPT_KEY: return "Sec-WebSocket-Accept: ";
+        case WebServerHeader::WSH_CONTENT_RANGE: return "Content-Range: ";
+        case WebServerHeader::WSH_ACCEPT_RANGES: return "Accept-Ranges: ";
+        case WebServerHeader::WSH_TRANSFER_ENCODING: return "Transfer-Encoding: ";
+        case WebServerHeader::WSH_ETAG: return "ETag: ";
         default: return nullptr; // shouldn't be sent
     }
 }
@@ -283,9 +523,9 @@ void WebServerResponse::setHeader(WebServerHeader header, const char *headerValu
     strcat((char*)dataArea, headerValue);
     strcat((char*)dataArea, "\r\n");
 
-    serlogF3(SER_NETWORK_DEBUG, "Add header ", hdrField, headerValue);
-
-    rawWriteData(transport->getClientFd(), dataArea, strlen((char*)dataArea), RAM_NEEDS_COPY);
+    auto len = strlen((char*)dataArea);
+    traceWeb(TRACE_HEADER_WRITE, transport->getClientFd(), header, len);
+    rawWriteData(transport->getClientFd(), dataArea, len, RAM_NEEDS_COPY);
 }
 
 void WebServerResponse::turnRequestIntoWebSocket() {
@@ -303,131 +543,664 @@ void WebServerResponse::turnRequestIntoWebSocket() {
     connectionType = WEB_SOCKET;
     setMode(WEBSOCKET_BUSY);
     transport->setState(WSS_IDLE);
+    armDeadline(DEADLINE_WEBSOCKET_IDLE);
     end(); // terminate the header, won't close connection because we've switched to websocket mode.
 }
 
+void WebServerResponse::turnRequestIntoEventStream() {
+    serlogF(SER_NETWORK_INFO, "Convert request to event stream");
+    // the stream holds the connection open, even when the server is in single shot mode.
+    connectionType = KEEP_REQ_OPEN;
+    startHeader();
+    setHeader(WSH_CONTENT_TYPE, "text/event-stream");
+    setHeader(WSH_CACHE_CONTROL, "no-cache");
+    startData();
+    chunkedEncoding = false;
+    rangeState = RANGE_NONE;
+    setMode(EVENT_STREAM_BUSY);
+
+    char sz[20];
+    strcpy(sz, "retry: ");
+    ltoa(WS_EVENT_STREAM_RETRY_MILLIS, &sz[7], 10);
+    strcat(sz, "\n\n");
+    if(writeEventText(sz)) {
+        flushEvents();
+        armDeadline(DEADLINE_EVENT_STREAM_PING);
+    }
+}
+
+bool WebServerResponse::startEvent(uint32_t id, const char* eventName) {
+    if(mode != EVENT_STREAM_BUSY) return false;
+    char sz[20];
+    strcpy(sz, "id: ");
+    ltoa((long)id, &sz[4], 10);
+    strcat(sz, "\n");
+    if(!writeEventText(sz)) return false;
+    if(eventName && (!writeEventText("event: ") || !writeEventText(eventName) || !writeEventText("\n"))) return false;
+    return writeEventText("data: ");
+}
+
+bool WebServerResponse::endEvent() {
+    if(mode != EVENT_STREAM_BUSY || !writeEventText("\n\n")) return false;
+    // the event is now with the driver, so any buffer it was built in goes back to the pool, otherwise every open
+    // stream would hold one and the pool would soon run out.
+    transport->releaseBuffers();
+    // the ping is only needed when the stream has been quiet for a while.
+    armDeadline(DEADLINE_EVENT_STREAM_PING);
+    return true;
+}
+
+bool WebServerResponse::sendEvent(uint32_t id, const char* eventName, const char* data) {
+    if(!startEvent(id, eventName)) return false;
+    // each line of the data needs its own data field
+    const char* lineEnd;
+    while((lineEnd = strchr(data, '\n')) != nullptr) {
+        if(!writeContent((const uint8_t*)data, lineEnd - data, RAM_NEEDS_COPY) || !writeEventText("\ndata: ")) return false;
+        data = lineEnd + 1;
+    }
+    if(!writeEventText(data) || !endEvent()) return false;
+    flushEvents();
+    return true;
+}
+
+void WebServerResponse::flushEvents() {
+    if(mode != EVENT_STREAM_BUSY) return;
+    if(rawFlushAll(transport->getClientFd()) != SOCK_ERR_OK) {
+        closeConnection();
+    } else {
+        transport->releaseBuffers();
+    }
+}
+
 void WebServerResponse::startData() {
-    serlogF(SER_NETWORK_DEBUG, "Start data response");
     mode = PREPARING_CONTENT;
     rawWriteData(transport->getClientFd(), (uint8_t*)"\r\n", 2, RAM_NEEDS_COPY);
 }
 
 bool WebServerResponse::send(const uint8_t *startingLocation, size_t numBytes, bool memoryIsConst) {
-    if(mode != PREPARING_CONTENT) startData();
+    if(!completeProgramMemoryContent()) return false;
+    if(mode != PREPARING_CONTENT && mode != EVENT_STREAM_BUSY) startData();
+    if(!clipToRange(startingLocation, numBytes)) return true; // nothing in this block is within the range
     MemoryLocationType memType = memoryIsConst ? CONSTANT_NO_COPY : RAM_NEEDS_COPY;
-    auto didSend = rawWriteData(transport->getClientFd(), startingLocation, numBytes, memType);
-    if(!didSend) {
+    return writeContent(startingLocation, numBytes, memType);
+}
+
+bool WebServerResponse::send_P(const uint8_t *startingLocation, size_t numBytes) {
+    if(!completeProgramMemoryContent()) return false;
+    if(mode != PREPARING_CONTENT && mode != EVENT_STREAM_BUSY) startData();
+    if(!clipToRange(startingLocation, numBytes)) return true; // nothing in this block is within the range
+    return writeContent(startingLocation, numBytes, IN_PROGRAM_MEM);
+}
+
+bool WebServerResponse::writeContent(const uint8_t *data, size_t numBytes, MemoryLocationType memType) {
+    contentBytesSent += numBytes;
+    if(captureEntry) captureEntry->captureData(data, numBytes, memType);
+    if(!chunkedEncoding) {
+        if(writeToTransport(data, numBytes, memType)) return true;
         closeConnection();
         return false;
     }
+
+    if(writeChunked(data, numBytes, memType)) return true;
+    closeConnection();
+    return false;
+}
+
+bool WebServerResponse::writeChunked(const uint8_t *data, size_t numBytes, MemoryLocationType memType) {
+    // small sends are gathered in the write buffer, which is sent as one chunk when it fills or the response ends, so
+    // that a handler writing a little at a time does not pay for the framing of a chunk on every send.
+    uint8_t* buffer = transport->getWriteBuffer();
+    size_t bufferSize = transport->getWriteBufferSize();
+    size_t capacity = (buffer && bufferSize > WS_CHUNK_FRAMING) ? bufferSize - WS_CHUNK_FRAMING : 0;
+    if(numBytes < capacity) {
+        size_t copied = 0;
+        while(copied < numBytes) {
+            if(chunkFill == capacity && !flushChunk()) return false;
+            size_t toCopy = min(numBytes - copied, capacity - chunkFill);
+            if(memType == IN_PROGRAM_MEM) {
+                memcpy_P(&buffer[WS_CHUNK_PREFIX + chunkFill], &data[copied], toCopy);
+            } else {
+                memcpy(&buffer[WS_CHUNK_PREFIX + chunkFill], &data[copied], toCopy);
+            }
+            chunkFill += toCopy;
+            copied += toCopy;
+        }
+        return true;
+    }
+
+    // sends that would fill the buffer anyway gain nothing from being copied, so they are written as chunks of their
+    // own, after anything already gathered. Each is prefixed by its length in hex and followed by CRLF, a zero length
+    // chunk would end the stream so an empty send must not write anything.
+    if(!flushChunk()) return false;
+    size_t bytesSent = 0;
+    while(bytesSent < numBytes) {
+        size_t chunkSize = min(numBytes - bytesSent, (size_t)WS_MAX_CHUNK_SIZE);
+        char sz[12];
+        itoa((int)chunkSize, sz, 16);
+        strcat(sz, "\r\n");
+        if(rawWriteData(transport->getClientFd(), sz, strlen(sz), RAM_NEEDS_COPY) != SOCK_ERR_OK
+                || !writeToTransport(&data[bytesSent], chunkSize, memType)
+                || rawWriteData(transport->getClientFd(), "\r\n", 2, RAM_NEEDS_COPY) != SOCK_ERR_OK) {
+            return false;
+        }
+        bytesSent += chunkSize;
+    }
     return true;
 }
 
-bool WebServerResponse::send_P(const uint8_t *startingLocation, size_t numBytes) {
-    if(mode != PREPARING_CONTENT) startData();
+uint8_t* WebServerResponse::reserveChunkSpace(size_t& available) {
+    available = 0;
+    if(!chunkedEncoding || mode == NOT_IN_USE) return nullptr;
+    // a content source streams in chunks after the content has already been started.
+    if(mode != PREPARING_CONTENT && mode != EVENT_STREAM_BUSY && mode != STREAMING_CONTENT) startData();
+    uint8_t* buffer = transport->getWriteBuffer();
+    size_t bufferSize = transport->getWriteBufferSize();
+    if(buffer == nullptr || bufferSize <= WS_CHUNK_FRAMING) return nullptr;
+    size_t capacity = bufferSize - WS_CHUNK_FRAMING;
+    if(chunkFill == capacity && !flushChunk()) {
+        closeConnection();
+        return nullptr;
+    }
+    available = capacity - chunkFill;
+    return &buffer[WS_CHUNK_PREFIX + chunkFill];
+}
+
+void WebServerResponse::commitChunkSpace(size_t len) {
+    if(len == 0 || mode == NOT_IN_USE) return;
+    contentBytesSent += len;
+    if(captureEntry) captureEntry->captureData(&transport->getWriteBuffer()[WS_CHUNK_PREFIX + chunkFill], len, RAM_NEEDS_COPY);
+    chunkFill += len;
+}
+
+bool WebServerResponse::flushChunk() {
+    if(chunkFill == 0) return true;
+    // room was left in front of the data for the length and CRLF, the length is written up against the data, so it
+    // starts one position later when it needs only one hex digit. The closing CRLF goes straight after the data.
+    uint8_t* buffer = transport->getWriteBuffer();
+    char sz[4];
+    itoa((int)chunkFill, sz, 16);
+    size_t digits = strlen(sz);
+    size_t start = WS_CHUNK_PREFIX - (digits + 2);
+    memcpy(&buffer[start], sz, digits);
+    buffer[WS_CHUNK_PREFIX - 2] = '\r';
+    buffer[WS_CHUNK_PREFIX - 1] = '\n';
+    size_t dataEnd = WS_CHUNK_PREFIX + chunkFill;
+    buffer[dataEnd] = '\r';
+    buffer[dataEnd + 1] = '\n';
+    chunkFill = 0;
+    return rawWriteData(transport->getClientFd(), &buffer[start], (dataEnd + 2) - start, RAM_NEEDS_COPY) == SOCK_ERR_OK;
+}
 
-    auto err = rawWriteData(transport->getClientFd(), startingLocation, numBytes, IN_PROGRAM_MEM);
+bool WebServerResponse::writeToTransport(const uint8_t *data, size_t numBytes, MemoryLocationType memType) {
+    auto err = rawWriteData(transport->getClientFd(), data, numBytes, memType);
     if(err == SOCK_ERR_OK) {
         return true;
     } else if(err == SOCK_ERR_NO_PROGMEM_SUPPORT) {
-        size_t bytesSent = 0;
-        while (bytesSent < numBytes) {
-            size_t toSend = min(transport->getReadBufferSize(), numBytes);
-            memcpy_P(transport->getReadBuffer(), &startingLocation[bytesSent], toSend);
-            bool didSend = rawWriteData(transport->getClientFd(), transport->getReadBuffer(), toSend, RAM_NEEDS_COPY);
-            if (!didSend) {
-                closeConnection();
-                return false;
+        return writeFromProgramMemory(data, numBytes);
+    }
+
+    return false;
+}
+
+bool WebServerResponse::writeFromProgramMemory(const uint8_t* data, size_t numBytes) {
+    // the drivers that can reserve space in their write buffer can all send from program memory, so only those that
+    // cannot reach here. For a regular handler the content is taken over as a content source, it is then copied out
+    // a piece at a time as the socket drains after the handler returns, instead of holding up every other connection
+    // until it has all been written. Chunked, captured and coroutine responses still write it before returning.
+    programMemorySource = ProgramMemoryContentSource(data, numBytes);
+    if(mode == PREPARING_CONTENT && !chunkedEncoding && !captureEntry && !isCoroutineActive()) {
+        contentBytesSent -= numBytes; // it is counted as it is sent.
+        sourcePosition = 0;
+        sourceEnd = numBytes;
+        contentSource = &programMemorySource;
+        mode = STREAMING_CONTENT;
+        armDeadline(DEADLINE_WRITE_STALL);
+        return true;
+    }
+    return writeProgramMemoryNow(0, numBytes);
+}
+
+bool WebServerResponse::writeProgramMemoryNow(size_t position, size_t end) {
+    // copied out a buffer at a time into our read buffer and sent from there, the last piece is only what is left.
+    if(!transport->acquireReadBuffer()) return false;
+    uint8_t* buffer = transport->getReadBuffer();
+    size_t bufferSize = transport->getReadBufferSize();
+    while(position < end) {
+        size_t toSend = min(end - position, bufferSize);
+        programMemorySource.readAt(position, buffer, toSend);
+        if(rawWriteData(transport->getClientFd(), buffer, toSend, RAM_NEEDS_COPY) != SOCK_ERR_OK) return false;
+        position += toSend;
+    }
+    return true;
+}
+
+bool WebServerResponse::completeProgramMemoryContent() {
+    if(mode != STREAMING_CONTENT || contentSource != &programMemorySource) return true;
+    // the handler has more to write after content from program memory, which must go first, so the rest is sent now.
+    contentSource = nullptr;
+    webServer->getTimerWheel().cancel(deadline);
+    mode = PREPARING_CONTENT;
+    contentBytesSent += sourceEnd - sourcePosition;
+    if(writeProgramMemoryNow(sourcePosition, sourceEnd)) return true;
+    closeConnection();
+    return false;
+}
+
+bool WebServerResponse::streamContent(WebContentSource& source) {
+    // content from program memory still waiting to go is sent first, the connection is closed if that fails.
+    completeProgramMemoryContent();
+    if(mode == NOT_IN_USE) {
+        source.finished(false);
+        return false;
+    }
+    if(mode != PREPARING_CONTENT) startData();
+    // the body is written after the handler has returned, so it cannot be captured into the response cache.
+    if(captureEntry) captureEntry->failCapture();
+
+    sourcePosition = 0;
+    sourceEnd = source.getLength();
+    if(rangeState == RANGE_ACTIVE) {
+        sourcePosition = rangeFirst;
+        sourceEnd = min(sourceEnd, (uint32_t)rangeLast + 1);
+    } else if(rangeState == RANGE_NOT_SATISFIABLE) {
+        sourceEnd = 0;
+    }
+    contentSource = &source;
+    mode = STREAMING_CONTENT;
+    armDeadline(DEADLINE_WRITE_STALL);
+    return true;
+}
+
+void WebServerResponse::serviceContentSource() {
+    auto fd = transport->getClientFd();
+    size_t sentThisPass = 0;
+    while(sourcePosition < sourceEnd) {
+        if(sentThisPass >= WS_CONTENT_SOURCE_MAX_PER_PASS) return; // the reactor polls us again next pass.
+        if(!rawWriteAvailable(fd)) {
+            // the stall deadline only starts again when some data has been written since the last time.
+            if(sentThisPass) armDeadline(DEADLINE_WRITE_STALL);
+            // a chunk still being gathered is kept in the write buffer until the socket can take it.
+            if(chunkFill == 0) transport->releaseBuffers();
+            return;
+        }
+
+        // where the driver can, the source reads straight into its write buffer, otherwise through our read buffer.
+        // Chunked responses read straight into the chunk being gathered in our write buffer, which has room left for
+        // the chunk's length in front.
+        size_t space = 0;
+        size_t left = sourceEnd - sourcePosition;
+        uint8_t* target;
+        bool reserved = false;
+        if(chunkedEncoding) {
+            target = reserveChunkSpace(space);
+            if(!target) return; // closed when the last chunk could not be sent, otherwise wait for a buffer from the pool.
+        } else {
+            target = rawWriteReserve(fd, min(left, (size_t)WS_MIN_PROGMEM_CHUNK), &space);
+            reserved = target != nullptr;
+            if(!reserved) {
+                if(!transport->acquireReadBuffer()) return; // wait for a buffer from the pool.
+                target = transport->getReadBuffer();
+                space = transport->getReadBufferSize();
             }
-            bytesSent += toSend;
         }
-        return bytesSent == numBytes;
+        int actual = contentSource->readAt(sourcePosition, target, min(left, space));
+        if(actual <= 0 || (size_t)actual > left) {
+            serlogF2(SER_WARNING, "Content source read failed ", sourcePosition);
+            if(reserved) rawWriteCommit(fd, 0);
+            if(webServer->getMetrics()) webServer->getMetrics()->contentSourceFailed();
+            closeConnection();
+            return;
+        }
+        bool sent = true;
+        if(chunkedEncoding) {
+            commitChunkSpace(actual);
+        } else if(reserved) {
+            sent = rawWriteCommit(fd, actual) == SOCK_ERR_OK;
+            contentBytesSent += actual;
+            if(!sent) closeConnection();
+        } else {
+            sent = writeContent(target, actual, RAM_NEEDS_COPY);
+        }
+        if(!sent) return;
+        sourcePosition += actual;
+        sentThisPass += actual;
     }
 
-    return false;
+    // all sent, finish the response in the same way as a handler that had sent the content itself.
+    finishContentSource(true);
+    webServer->recordRequestMetrics(*this);
+    mode = PREPARING_CONTENT;
+    end();
+    if(mode != NOT_IN_USE && isInSingleShotMode()) closeConnection();
 }
 
+void WebServerResponse::finishContentSource(bool completed) {
+    auto source = contentSource;
+    contentSource = nullptr;
+    if(source) source->finished(completed);
+}
+
+WebServerHeader WebServerResponse::readRequestHead() {
+    char* buffer = (char*)transport->getReadBuffer();
+    if(method == REQ_INCOMPLETE) {
+        method = processor.processRequest(buffer, transport->getReadBufferSize());
+        if(method == REQ_INCOMPLETE) return WSH_INCOMPLETE;
+        if(method == REQ_ERROR) webServer->sendErrorCode(this, WS_INT_RESPONSE_INT_ERR);
+        if(method != GET && method != POST) return WSH_ERROR;
+        // the handler is found while the URL is still in the read buffer, the headers are then read over it.
+        if(!webServer->matchRequest(*this, buffer)) return WSH_ERROR;
+    }
+    auto headers = processHeaders();
+    if(headers == WSH_ERROR) webServer->sendErrorCode(this, WS_INT_RESPONSE_INT_ERR);
+    return headers;
+}
 
-bool WebServerResponse::processHeaders() {
+WebServerHeader WebServerResponse::processHeaders() {
     char* buffer = (char*)transport->getReadBuffer();
     size_t bufferSize = transport->getReadBufferSize();
-    bool foundEndOfRequest = false;
 
-    serlogF(SER_NETWORK_DEBUG, "Process header");
-    while(!foundEndOfRequest) {
+    while(true) {
         auto hdrType = processor.processHeader(buffer, bufferSize);
+        if(hdrType == WSH_INCOMPLETE) return WSH_INCOMPLETE;
+        traceWeb(TRACE_HEADER_READ, transport->getClientFd(), hdrType, strlen(buffer));
         switch (hdrType) {
             case WSH_SEC_WS_KEY: {
                 strncat_P(buffer, pgmWebSockUuid, bufferSize - strlen(buffer) - 1);
-                sha1digest(webSocketSha1KeyToRespond, (uint8_t *) buffer, strlen(buffer));
+                tc_sha1::sha1((uint8_t *) buffer, strlen(buffer), webSocketSha1KeyToRespond);
                 break;
             }
             case WSH_FINISHED:
-                serlogF(SER_NETWORK_INFO, "Request processed");
-                foundEndOfRequest = true;
-                return true;
+                // an oversized body will never be read, so the connection cannot be used for another request.
+                if(bodyLength > WS_MAX_REQUEST_BODY_SIZE) connectionType = CLOSE_AFTER_RESPONSE;
+                return WSH_FINISHED;
             case WSH_UPGRADE_TO_WEBSOCKET:
                 method = WS_UPGRADE;
                 break;
+            case WSH_CONTENT_LENGTH:
+                // without a valid length the end of the body cannot be found, so the request is rejected.
+                if(!HttpProcessor::parseContentLength(buffer, bodyLength)) {
+                    serlogF2(SER_NETWORK_INFO, "Bad Content-Length ", buffer);
+                    bodyLengthValid = false;
+                    bodyLength = 0;
+                    connectionType = CLOSE_AFTER_RESPONSE;
+                }
+                bodyRemaining = bodyLength;
+                break;
+            case WSH_CONTENT_TYPE:
+                bodyFormEncoded = strncmp(buffer, "application/x-www-form-urlencoded", 33) == 0;
+                break;
+            case WSH_IF_NONE_MATCH:
+                ifNoneMatchPresent = HttpProcessor::parseEntityTag(buffer, ifNoneMatch);
+                break;
+            case WSH_LAST_EVENT_ID:
+                lastEventId = strtoul(buffer, nullptr, 10);
+                lastEventIdPresent = true;
+                break;
+            case WSH_RANGE:
+                // a range we cannot parse is ignored, the full resource is then sent.
+                if(HttpProcessor::parseRange(buffer, rangeFirst, rangeLast)) {
+                    rangeState = RANGE_REQUESTED;
+                }
+                break;
             case WSH_ERROR:
                 serlogF(SER_NETWORK_INFO, "Request error");
-                foundEndOfRequest = false;
                 connectionType = CLOSE_AFTER_RESPONSE; // tell end to close the connection as the request is faulty.
-                return false;
+                return WSH_ERROR;
             default:
                 break;
         }
     }
-    return foundEndOfRequest;
+}
+
+int WebServerResponse::readBody(uint8_t* buffer, size_t bufferSize) {
+    if(bodyRemaining == 0 || bufferSize == 0) return 0;
+    armDeadline(DEADLINE_REQUEST_READ);
+    auto actual = processor.readDataFromTransport(buffer, min(bufferSize, (size_t)bodyRemaining));
+    if(actual > 0) {
+        bodyRemaining -= actual;
+    } else if(actual < 0) {
+        // the rest of the body can never be read, so the connection cannot be used again, and any loop reading the
+        // body must end rather than keep trying.
+        serlogF2(SER_NETWORK_INFO, "Body read failed, remaining ", bodyRemaining);
+        bodyRemaining = 0;
+        closeConnection();
+    }
+    return actual;
+}
+
+int WebServerResponse::readBodyChar() {
+    uint8_t sz[1];
+    return (readBody(sz, 1) == 1) ? sz[0] : -1;
+}
+
+static int hexCharToValue(int ch) {
+    if(ch >= '0' && ch <= '9') return ch - '0';
+    if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+int WebServerResponse::readFormPart(char* buffer, size_t bufferSize, char terminator, bool& malformed) {
+    size_t pos = 0;
+    int ch = readBodyChar();
+    while(ch >= 0 && ch != terminator && ch != '&') {
+        int next = -2;
+        if(ch == '+') {
+            ch = ' ';
+        } else if(ch == '%') {
+            // a % must be followed by two hex digits of a character other than NUL, when it is not, the character
+            // that was not a hex digit is looked at again, as it may end the field.
+            int high = readBodyChar();
+            int highValue = hexCharToValue(high);
+            int low = (highValue >= 0) ? readBodyChar() : high;
+            int lowValue = hexCharToValue(low);
+            ch = (highValue >= 0 && lowValue >= 0) ? (highValue << 4) | lowValue : 0;
+            if(ch == 0) {
+                malformed = true;
+                next = low;
+            }
+        }
+        if(ch != 0 && (pos + 1) < bufferSize) buffer[pos++] = (char)ch;
+        ch = (next != -2) ? next : readBodyChar();
+    }
+    buffer[pos] = 0;
+    return ch;
+}
+
+bool WebServerResponse::nextFormField(char* name, size_t nameSize, char* value, size_t valueSize) {
+    if(nameSize == 0 || valueSize == 0) return false;
+    while(true) {
+        name[0] = value[0] = 0;
+        if(bodyRemaining == 0) return false;
+        bool malformed = false;
+        // a field without an equals sign, such as "flag&", has an empty value
+        if(readFormPart(name, nameSize, '=', malformed) == '=') {
+            readFormPart(value, valueSize, '&', malformed);
+        }
+        if(mode == NOT_IN_USE) {
+            // the body could not be read, readBody has closed the connection.
+            name[0] = value[0] = 0;
+            return false;
+        }
+        if(!malformed) return true;
+        serlogF2(SER_NETWORK_INFO, "Skip badly encoded form field ", name);
+    }
 }
 
 void WebServerResponse::end() {
-    serlogF(SER_NETWORK_INFO, "Finished response");
+    traceWeb(TRACE_RESPONSE_END, transport->getClientFd(), mode, 0);
+    // the connection may already have been closed, such as when the body could not be read. Content still being
+    // sent from program memory ends the response itself once it has all gone.
+    if(mode == NOT_IN_USE || contentSource == &programMemorySource) return;
+    arena.reset();
     if(mode != PREPARING_CONTENT) {
         rawWriteData(transport->getClientFd(), (uint8_t*)"\r\n", 2, RAM_NEEDS_COPY);
     }
+    if(chunkedEncoding) {
+        // anything still gathered goes first, then the zero length chunk followed by an empty trailer terminates it.
+        flushChunk();
+        rawWriteData(transport->getClientFd(), (uint8_t*)"0\r\n\r\n", 5, RAM_NEEDS_COPY);
+        chunkedEncoding = false;
+    }
 
     if(connectionType == CLOSE_AFTER_RESPONSE) {
         transport->flush();
         transport->close();
+        webServer->getTimerWheel().cancel(deadline);
         mode = NOT_IN_USE;
     } else if(connectionType != WEB_SOCKET) {
+        // discard any of the body that the handler did not read, so it does not get treated as the next request.
+        // a content source may have finished after the read buffer went back to the pool, so take it again first.
+        if(bodyRemaining > 0 && transport->acquireReadBuffer()) {
+            uint8_t* discard = transport->getReadBuffer();
+            while(bodyRemaining > 0 && readBody(discard, transport->getReadBufferSize()) > 0);
+        }
+        if(bodyRemaining > 0) {
+            closeConnection();
+            return;
+        }
+
         mode = TRANSPORT_ASSIGNED;
-        processor.tick(); // wait 2 seconds from end of last message.
+        servedRequest = true;
+        armDeadline(DEADLINE_KEEP_ALIVE);
+        // when pipelined requests are waiting we leave the data with the driver, so that the responses are
+        // coalesced into as few writes as possible, the last response in the batch flushes everything.
+        if(!transport->isReadReady()) rawFlushAll(transport->getClientFd());
+        transport->releaseBuffers();
     }
 }
 
+void WebServerResponse::stop() {
+    stopped = true;
+    if(mode != NOT_IN_USE) closeConnection();
+}
+
 void WebServerResponse::serviceClient(socket_t sock) {
     transport->setClient(sock);
+    processor.reset();
+    servedRequest = false;
     setMode(TRANSPORT_ASSIGNED);
     connectionType = initialConnectionType;
+    armDeadline(DEADLINE_REQUEST_READ);
+}
+
+void WebServerResponse::armDeadline(WSRDeadline type) {
+    uint32_t millisFromNow;
+    switch(type) {
+        case DEADLINE_KEEP_ALIVE: millisFromNow = WS_KEEP_ALIVE_IDLE_MILLIS; break;
+        case DEADLINE_WEBSOCKET_IDLE: millisFromNow = WS_WEBSOCKET_IDLE_MILLIS; break;
+        case DEADLINE_WRITE_STALL: millisFromNow = WS_WRITE_STALL_MILLIS; break;
+        case DEADLINE_EVENT_STREAM_PING: millisFromNow = WS_EVENT_STREAM_PING_MILLIS; break;
+        default: millisFromNow = WS_REQUEST_TIMEOUT_MILLIS; break;
+    }
+    processor.tick();
+    webServer->getTimerWheel().schedule(deadline, type, millisFromNow);
+}
+
+void WebServerResponse::deadlineExpired(WSRDeadline type) {
+    if(mode == NOT_IN_USE) return;
+
+    if(type == DEADLINE_WEBSOCKET_IDLE) {
+        // websocket reads happen on every frame, so rather than move the deadline each time, we check for any reads
+        // since it was set and push it out by the remaining time.
+        unsigned long idleFor = millis() - transport->getLastReadMillis();
+        if(idleFor < WS_WEBSOCKET_IDLE_MILLIS) {
+            webServer->getTimerWheel().schedule(deadline, type, WS_WEBSOCKET_IDLE_MILLIS - idleFor);
+        } else if(mode == WEBSOCKET_BUSY) {
+            // the remote connection sees the transport disconnect, and frees up this response when it closes.
+            serlogF(SER_NETWORK_INFO, "Websocket idle timeout");
+            transport->close();
+        }
+    } else if(type == DEADLINE_EVENT_STREAM_PING) {
+        // a comment line keeps proxies from timing out a quiet stream, and a failed write finds clients that have gone.
+        if(mode == EVENT_STREAM_BUSY && writeEventText(":\n\n")) {
+            flushEvents();
+            if(mode == EVENT_STREAM_BUSY) armDeadline(DEADLINE_EVENT_STREAM_PING);
+        }
+    } else if(mode == STREAMING_CONTENT) {
+        // nothing is waiting on a content source, it is only serviced when the socket is writable.
+        serlogF(SER_NETWORK_INFO, "Content source write stalled");
+        closeConnection();
+    } else if(isWaitingForRequest() && !isCoroutineActive()) {
+        // nothing is waiting on the connection, not even a request that has only partly arrived, as it is parsed as
+        // it arrives, so it can be closed straight away.
+        serlogF2(SER_NETWORK_INFO, "Idle connection timeout ", type);
+        closeConnection();
+    } else {
+        // a request is in progress, the read or coroutine waiting on it sees this and unwinds.
+        serlogF2(SER_NETWORK_INFO, "Request deadline expired ", type);
+        processor.markTimedOut();
+    }
 }
 
 void WebServerResponse::exec() {
-    if(mode == TRANSPORT_ASSIGNED) {
+#if defined(WS_COROUTINE_HANDLERS)
+    if(activeCoroutine) {
+        serviceCoroutine();
+        return;
+    }
+#endif
+
+    if(mode == STREAMING_CONTENT) {
+        serviceContentSource();
+        return;
+    }
+
+    if(isWaitingForRequest()) {
+        // nothing waiting yet, idle connections and requests that stop arriving are closed by their deadline.
+        if(!transport->isReadReady()) return;
+
         transport->setState(WSS_HTTP_REQUEST); // regular http request.
-        processor.reset();
 
         bool needAnotherGo = true;
         while (needAnotherGo) {
-            method = processor.processRequest(reinterpret_cast<char *>(transport->getReadBuffer()),
-                                              transport->getReadBufferSize());
-            if (method == POST || method == GET) {
-                setMode(WebServerResponse::READING_HEADERS);
-                needAnotherGo = webServer->attemptToHandleRequest(*this, (const char *) transport->getReadBuffer());
+            if(mode == TRANSPORT_ASSIGNED) {
+                // with a buffer pool, the request waits in the socket until a buffer is free, rather than failing.
+                if(!transport->acquireReadBuffer()) return;
+                processor.reset();
+                arena.reset();
+                armDeadline(DEADLINE_REQUEST_READ);
+                setMode(READING_HEADERS);
+                requestStartMicros = micros();
+                timeToFirstByte = contentBytesSent = 0;
+                method = REQ_INCOMPLETE;
+                rangeState = RANGE_NONE;
+                chunkedEncoding = false;
+                bodyFormEncoded = false;
+                bodyLength = bodyRemaining = 0;
+                bodyLengthValid = true;
+                lastEventIdPresent = false;
+                lastEventId = 0;
+                entityTagPresent = false;
+                ifNoneMatchPresent = false;
+            }
+
+            // the head is parsed as it arrives, when it has not all arrived we carry on from here once there is more,
+            // rather than waiting for it and holding up every other connection.
+            auto headRead = readRequestHead();
+            if(headRead == WSH_INCOMPLETE) return;
+            if (headRead == WSH_FINISHED) {
+                needAnotherGo = webServer->attemptToHandleRequest(*this);
 
                 // if we upgraded to a websocket, we don't need another go, and we mark the response object busy.
-                // It is the responsibility of the websocket handler to close the connection once completed.
-                if(connectionType == WEB_SOCKET) {
+                // It is the responsibility of the websocket handler to close the connection once completed. The same
+                // applies while a coroutine handler is in progress, the response is then finished when it completes,
+                // and to event streams, which are held open until the connection closes. A content source is started
+                // straight away, and then continues whenever the socket is writable until it has all been sent.
+                if(mode == STREAMING_CONTENT && !isCoroutineActive()) {
+                    needAnotherGo = false;
+                    serviceContentSource();
+                } else if(connectionType == WEB_SOCKET || mode == EVENT_STREAM_BUSY || isCoroutineActive()) {
                     needAnotherGo = false;
+                    if(!isCoroutineActive()) transport->releaseBuffers();
                 } else if(!needAnotherGo) {
                     closeConnection();
+                } else {
+                    // serve any pipelined requests straight away, otherwise wait for the next request on a later tick.
+                    needAnotherGo = transport->isReadReady();
                 }
-            } else if (method == REQ_ERROR) {
-                needAnotherGo = false;
-                webServer->sendErrorCode(this, WS_INT_RESPONSE_INT_ERR);
-                closeConnection();
             } else {
+                // any error response has already been sent.
                 needAnotherGo = false;
                 closeConnection();
             }
@@ -435,20 +1208,129 @@ void WebServerResponse::exec() {
     }
 }
 
+#if defined(WS_COROUTINE_HANDLERS)
+
+void WebServerResponse::startCoroutine(WebCoroutine&& coroutine) {
+    activeCoroutine = coroutine.release();
+    asyncWait = ASYNC_NONE;
+    processor.tick();
+    serviceCoroutine();
+}
+
+void WebServerResponse::serviceCoroutine() {
+    if(asyncWait == ASYNC_SEND && !prepareAsyncSend(asyncData, asyncRemaining, asyncMemType)) {
+        if(processor.hasTimedOut()) {
+            serlogF(SER_NETWORK_INFO, "Coroutine write stalled");
+            closeConnection();
+            finishCoroutine();
+        }
+        return;
+    } else if(asyncWait == ASYNC_READ && bodyRemaining != 0 && !transport->isReadReady()) {
+        if(processor.hasTimedOut()) {
+            serlogF(SER_NETWORK_INFO, "Coroutine read timed out");
+            closeConnection();
+            finishCoroutine();
+        }
+        return;
+    }
+
+    asyncWait = ASYNC_NONE;
+    activeCoroutine.resume();
+    if(activeCoroutine.done()) finishCoroutine();
+}
+
+void WebServerResponse::finishCoroutine() {
+    activeCoroutine.destroy();
+    activeCoroutine = nullptr;
+    asyncWait = ASYNC_NONE;
+    if(mode == STREAMING_CONTENT) return; // the content source finishes the response once it has all been sent.
+    webServer->recordRequestMetrics(*this);
+
+    // as with regular handlers, end the response if the handler did not, then close or wait for the next request.
+    if (mode == READING_HEADERS || mode == PREPARING_HEADER || mode == PREPARING_CONTENT) {
+        end();
+    }
+    if(mode != NOT_IN_USE && mode != WEBSOCKET_BUSY && mode != EVENT_STREAM_BUSY && isInSingleShotMode()) {
+        closeConnection();
+    }
+    transport->releaseBuffers();
+}
+
+bool WebServerResponse::prepareAsyncSend(const uint8_t* data, size_t numBytes, MemoryLocationType memType) {
+    if(asyncWait != ASYNC_SEND) {
+        // first time for this send, start the data and work out what is within any range.
+        if(mode != PREPARING_CONTENT) startData();
+        if(!clipToRange(data, numBytes)) numBytes = 0;
+        asyncMemType = memType;
+    }
+    asyncData = data;
+    asyncRemaining = numBytes;
+
+    // write as much as the socket will take without blocking, suspending when it is not writable.
+    bool progressed = asyncWait != ASYNC_SEND;
+    while(asyncRemaining > 0 && mode != NOT_IN_USE) {
+        if(!rawWriteAvailable(transport->getClientFd())) {
+            // the stall deadline only starts again when some data has been written since the last suspend.
+            if(progressed) armDeadline(DEADLINE_WRITE_STALL);
+            asyncWait = ASYNC_SEND;
+            return false;
+        }
+        size_t toSend = min(asyncRemaining, (size_t)WS_MAX_CHUNK_SIZE);
+        if(!writeContent(asyncData, toSend, asyncMemType)) break;
+        asyncData += toSend;
+        asyncRemaining -= toSend;
+        progressed = true;
+    }
+    if(asyncWait == ASYNC_SEND) webServer->getTimerWheel().cancel(deadline);
+    asyncWait = ASYNC_NONE;
+    return true;
+}
+
+WebSendAwaiter WebServerResponse::asyncSend(const uint8_t* startingLocation, size_t numBytes, bool memIsConst) {
+    return { *this, startingLocation, numBytes, memIsConst ? CONSTANT_NO_COPY : RAM_NEEDS_COPY };
+}
+
+WebSendAwaiter WebServerResponse::asyncSend_P(const uint8_t* startingLocation, size_t numBytes) {
+    return { *this, startingLocation, numBytes, IN_PROGRAM_MEM };
+}
+
+WebBodyReadAwaiter WebServerResponse::asyncReadBody(uint8_t* buffer, size_t bufferSize) {
+    armDeadline(DEADLINE_REQUEST_READ);
+    return { *this, buffer, bufferSize };
+}
+
+bool WebBodyReadAwaiter::await_ready() {
+    return response.getBodyRemaining() == 0 || response.getTransport()->isReadReady();
+}
+
+#endif
+
 void WebServerResponse::closeConnection() {
-    serlogF(SER_NETWORK_INFO, "HTTP close");
+    if(transport) traceWeb(TRACE_CONNECTION_CLOSE, transport->getClientFd(), mode, 0);
+    if(captureEntry) captureEntry->failCapture();
+    finishContentSource(false);
+    chunkFill = 0;
     mode = NOT_IN_USE;
+    arena.reset();
+    webServer->getTimerWheel().cancel(deadline);
     if(transport) transport->close();
 }
 
-bool WebServerResponse::hasErrorOccurred() {
-    return processor.isProtocolError();
+bool WebServerResponse::isWaitingForRequest() {
+    return mode == TRANSPORT_ASSIGNED || (mode == READING_HEADERS && !processor.isHeadComplete());
 }
 
-void WebServerResponse::stop() {
-    if(scheduledTaskId != TASKMGR_INVALIDID) {
-        taskManager.cancelTask(scheduledTaskId);
-    }
+bool WebServerResponse::needsPolling() {
+    return (isWaitingForRequest() && transport->isReadReady()) || isCoroutineActive()
+            || (mode == STREAMING_CONTENT && rawWriteAvailable(transport->getClientFd()));
+}
+
+bool WebServerResponse::isIdleKeepAlive() {
+    return mode == TRANSPORT_ASSIGNED && servedRequest && !isCoroutineActive() && !transport->isReadReady();
+}
+
+bool WebServerResponse::hasErrorOccurred() {
+    return processor.isProtocolError();
 }
 
 void WebServerResponse::sendError(int code) {
@@ -4,15 +4,111 @@
 
 #include "TransportNetworkDriver.h"
 #include "TaskManagerIO.h"
+#include "TcWebTimerWheel.h"
+#include "TcWebRequestArena.h"
+#include "TcWebContentSource.h"
+
+// Coroutine based page handlers are optional, they need a compiler with C++20 coroutine support. To use them define
+// WS_COROUTINE_HANDLERS in your build flags or TcMenuNetLayerConfig.h. They are always on for host builds, such as the
+// unit tests under EpoxyDuino, when the compiler supports them.
+#if !defined(WS_COROUTINE_HANDLERS) && defined(EPOXY_DUINO) && defined(__cpp_impl_coroutine)
+#define WS_COROUTINE_HANDLERS
+#endif
+#if defined(WS_COROUTINE_HANDLERS)
+#include <coroutine>
+#endif
 
 #define WS_SERVER_NAME "tccWS"
 #define WS_TEXT_RESPONSE_NOT_FOUND "Not found"
 #define WS_INT_RESPONSE_NOT_FOUND 404
 #define WS_INT_RESPONSE_OK 200
 #define WS_TEXT_RESPONSE_OK "OK"
+#define WS_INT_RESPONSE_NOT_MODIFIED 304
+#define WS_TEXT_RESPONSE_NOT_MODIFIED "Not Modified"
+#define WS_INT_RESPONSE_PARTIAL 206
+#define WS_TEXT_RESPONSE_PARTIAL "Partial Content"
+#define WS_INT_RESPONSE_RANGE_NOT_SATISFIABLE 416
+#define WS_TEXT_RESPONSE_RANGE_NOT_SATISFIABLE "Range Not Satisfiable"
+#define WS_INT_RESPONSE_BAD_REQUEST 400
+#define WS_TEXT_RESPONSE_BAD_REQUEST "Bad Request"
+#define WS_INT_RESPONSE_FORBIDDEN 403
+#define WS_TEXT_RESPONSE_FORBIDDEN "Forbidden"
+#define WS_INT_RESPONSE_PAYLOAD_TOO_LARGE 413
+#define WS_TEXT_RESPONSE_PAYLOAD_TOO_LARGE "Payload Too Large"
 #define WS_INT_RESPONSE_INT_ERR 500
 #define WS_CODE_CHANGING_PROTOCOL 101
 
+// How long to wait for a request to be completed, and how long a keep alive connection can be idle before closing.
+#ifndef WS_REQUEST_TIMEOUT_MILLIS
+#define WS_REQUEST_TIMEOUT_MILLIS 2000
+#endif
+
+// How long a keep alive connection can be idle between requests before it is closed.
+#ifndef WS_KEEP_ALIVE_IDLE_MILLIS
+#define WS_KEEP_ALIVE_IDLE_MILLIS WS_REQUEST_TIMEOUT_MILLIS
+#endif
+
+// How long a websocket can go without receiving anything before it is closed, should be well above the heartbeat.
+#ifndef WS_WEBSOCKET_IDLE_MILLIS
+#define WS_WEBSOCKET_IDLE_MILLIS 30000
+#endif
+
+// How long an asynchronous send can wait for the socket to become writable before the connection is closed.
+#ifndef WS_WRITE_STALL_MILLIS
+#define WS_WRITE_STALL_MILLIS 5000
+#endif
+
+// How often a comment is sent on an idle event stream, this keeps proxies from closing it and detects dead clients.
+#ifndef WS_EVENT_STREAM_PING_MILLIS
+#define WS_EVENT_STREAM_PING_MILLIS 15000
+#endif
+
+// How long a browser should wait before reconnecting an event stream, sent to the client in the retry field.
+#ifndef WS_EVENT_STREAM_RETRY_MILLIS
+#define WS_EVENT_STREAM_RETRY_MILLIS 3000
+#endif
+
+// The size of a date in IMF-fixdate form, as used in the Date and Last-Modified headers, including the terminator.
+#define WS_WEB_DATE_SIZE 30
+
+// How long the date from the RTC is used for before reading it again, only used when WS_RTC_INTEGRATED is defined.
+#ifndef WS_DATE_REFRESH_MILLIS
+#define WS_DATE_REFRESH_MILLIS 1000
+#endif
+
+// The largest request body that will be accepted, requests with a larger content length get a 413 response.
+#ifndef WS_MAX_REQUEST_BODY_SIZE
+#define WS_MAX_REQUEST_BODY_SIZE 4096
+#endif
+
+// The longest part of a URL that can be matched by a wildcard handler, such as the id in /api/item/*, including the
+// terminator. Requests with a longer part get a 400 response.
+#ifndef WS_MAX_PATH_PARAMETER
+#define WS_MAX_PATH_PARAMETER 16
+#endif
+
+// When a content source is read straight into space reserved in the driver's write buffer, and less than this is
+// free, the driver sends what it has first.
+#ifndef WS_MIN_PROGMEM_CHUNK
+#define WS_MIN_PROGMEM_CHUNK 32
+#endif
+
+// The most that a content source writes in one go when the socket is writable, before giving other connections a turn.
+#ifndef WS_CONTENT_SOURCE_MAX_PER_PASS
+#define WS_CONTENT_SOURCE_MAX_PER_PASS 1024
+#endif
+
+// The largest chunk that will be written at once in chunked transfer encoding mode, best matched to the amount that
+// the driver can send in a single packet, see MAX_SEND_PER_PACKET. Sends smaller than the write buffer are gathered
+// together in it and sent as one chunk when it fills.
+#ifndef WS_MAX_CHUNK_SIZE
+#define WS_MAX_CHUNK_SIZE 500
+#endif
+
+// Space kept in front of a gathered chunk for its length in hex and CRLF, and in total for that and the closing CRLF.
+#define WS_CHUNK_PREFIX 4
+#define WS_CHUNK_FRAMING 6
+
 namespace tcremote {
 
     class AbstractWebSocketTcMenuTransport;
@@ -21,7 +117,7 @@ namespace tcremote {
      * Enumerates the various types of request that this server can handle, or none/error for the case that we cannot
      * process a given request.
      */
-    enum WebServerMethod { GET, POST, WS_UPGRADE, REQ_NONE, REQ_ERROR };
+    enum WebServerMethod { GET, POST, WS_UPGRADE, REQ_NONE, REQ_ERROR, REQ_INCOMPLETE };
 
     /**
      * Provides an enumeration of all supported web server headers that we process, any other header will come through as
@@ -44,9 +140,9 @@ namespace tcremote {
         WSH_SERVER,
         /** Last modified header, can be set to a GMT time in the right format */
         WSH_LAST_MODIFIED,
-        /** The content type header, usually used on write internally during startHeader */
+        /** The content type header, used on write internally during startHeader, and on read for the body type */
         WSH_CONTENT_TYPE,
-        /** The content length header, usually used on write internally during startHeader */
+        /** The content length header, used on write internally during startHeader, and on read for the body length */
         WSH_CONTENT_LENGTH,
         /** The content encoding header, for example, often set to gzip to send compressed files */
         WSH_CONTENT_ENCODING,
@@ -62,55 +158,275 @@ namespace tcremote {
         WSH_CONNECTION,
         /** The response to the sec key in a websocket upgrade */
         WSH_SEC_WS_ACCEPT_KEY,
+        /** Range header on read, the buffer will contain the byte range requested, EG bytes=0-499 */
+        WSH_RANGE,
+        /** Content range header, used on write for partial content responses */
+        WSH_CONTENT_RANGE,
+        /** Accept ranges header, used on write to tell the client that byte ranges are supported */
+        WSH_ACCEPT_RANGES,
+        /** Transfer encoding header, used on write for chunked responses */
+        WSH_TRANSFER_ENCODING,
+        /** Entity tag header, used on write to give the version of the content */
+        WSH_ETAG,
+        /** If none match header on read, the buffer contains the entity tag that the client already has */
+        WSH_IF_NONE_MATCH,
+        /** Last event ID header on read, sent by a reconnecting event stream client with the id of the last event it saw */
+        WSH_LAST_EVENT_ID,
         /** Indicates a serious error has occurred that cannot be corrected and the transport should close */
-        WSH_ERROR
+        WSH_ERROR,
+        /** The header has not all arrived yet, call again with the same buffer once more data is ready, only on read */
+        WSH_INCOMPLETE
     };
 
     class TcMenuWebServerTransport;
 
     /**
-     * The HTTP processor is responsible for actually parsing data from a HTTP request, it can read data from a socket
-     * asynchronously allowing other tasks to run while the read is completed. It allows other code to run while the
-     * reads are taking place by calling yield on task manager. It separates processing the request line from the
-     * headers so as to require as little memory storage as possible. With the current approach only one buffer is
-     * needed large enough to fit one single parameter (either path or header value) at once.
+     * Formats a UTC date and time in the IMF-fixdate form used by HTTP headers, EG Wed, 22 Jul 2009 19:15:56 GMT.
+     * @param buffer the buffer to write into, must be at least WS_WEB_DATE_SIZE
+     * @param year the full year, EG 2009
+     * @param month the month, 1 to 12
+     * @param day the day of the month, 1 to 31
+     * @param hour the hour, 0 to 23
+     * @param minute the minute, 0 to 59
+     * @param second the second, 0 to 59
+     */
+    void formatWebDate(char* buffer, int year, int month, int day, int hour, int minute, int second);
+
+    /**
+     * @return the time the library was built in IMF-fixdate form, formatted on first use. Used as the Last-Modified
+     * time of content that is built into the firmware. The compiler only knows the local time of the build machine,
+     * which is sent as if it were GMT, this is fine for validating caches as the time only ever moves forward.
+     */
+    const char* buildDateInWebForm();
+
+    /**
+     * A function that writes the current date in IMF-fixdate form into the buffer, such as rtcUTCDateInWebForm.
+     */
+    typedef void (*WebDateSourceFn)(char* buffer, size_t bufferLen);
+
+    /**
+     * Holds a formatted date for a while, so that a slow source such as an RTC is not read for every response.
+     */
+    class WebDateCache {
+    private:
+        char date[WS_WEB_DATE_SIZE] = {};
+        unsigned long readAt = 0;
+        bool read = false;
+    public:
+        /**
+         * @param source where to read the date from when the cached value is too old
+         * @param maxAgeMillis how long the cached value is used for before the source is read again
+         * @return the date, either from the cache or read fresh from the source
+         */
+        const char* get(WebDateSourceFn source, unsigned long maxAgeMillis);
+    };
+
+#if defined(WS_RTC_INTEGRATED)
+    /**
+     * @return the current date in IMF-fixdate form for the Date header, the RTC is only read when the cached value
+     * is older than WS_DATE_REFRESH_MILLIS, so most responses do not need to read it at all.
+     */
+    const char* currentWebDate();
+#endif
+
+    /**
+     * The result of reading a word of the request head with HttpProcessor::readWord.
+     */
+    enum HttpWordRead { WORD_WAITING, WORD_READ, WORD_END_OF_LINE, WORD_ERROR };
+
+    /**
+     * The HTTP processor is responsible for actually parsing data from a HTTP request. The request line and headers
+     * are parsed as they arrive, when the data runs out part way through, the parse stops and carries on from where it
+     * was once more data is ready, so that a slow client never holds up the other connections. It separates processing
+     * the request line from the headers so as to require as little memory storage as possible. With the current
+     * approach only one buffer is needed large enough to fit one single parameter (either path or header value) at
+     * once. Reading the body still waits for data, allowing other tasks to run by calling yield on task manager.
      */
     class HttpProcessor {
+    public:
+        enum HttpParseStage { PARSE_METHOD, PARSE_URL, PARSE_PROTOCOL, PARSE_HEADER_NAME, PARSE_HEADER_VALUE, PARSE_DONE };
     private:
         TcMenuWebServerTransport *transport;
+        TimerWheel* deadlines;
         unsigned long millisStart;
         bool protocolError = false;
+        bool timedOut = false;
+        HttpParseStage parseStage = PARSE_METHOD;
+        WebServerMethod parsedMethod = REQ_NONE;
+        WebServerHeader pendingHeader = WSH_UNPROCESSED;
+        size_t wordPosition = 0;
+        bool wordTrimming = true;
+        char protocol[10] = {};
+
+        void waitForData();
     public:
-        explicit HttpProcessor(TcMenuWebServerTransport* transport) : transport(transport), millisStart(0) {}
+        explicit HttpProcessor(TcMenuWebServerTransport* transport, TimerWheel* deadlines = nullptr)
+                : transport(transport), deadlines(deadlines), millisStart(0) {}
 
         void reset();
 
+        /**
+         * Reads the next word of the request head, skipping leading spaces, and without waiting for data. When the
+         * data runs out part way through, what has been read so far is kept in the buffer and WORD_WAITING returned,
+         * call again with the same buffer once more data is ready. Characters beyond the end of the buffer are dropped.
+         * @param buffer the buffer to read into, it is terminated once the word has been read
+         * @param bufferSize the size of the buffer
+         * @param skipSeparator when true, only the end of the line ends the word, otherwise a colon or space also does
+         * @return WORD_READ or WORD_END_OF_LINE when the word has been read, WORD_WAITING when more data is needed,
+         *         or WORD_ERROR if the connection failed.
+         */
+        HttpWordRead readWord(char *buffer, size_t bufferSize, bool skipSeparator = false);
+
+        /**
+         * Reads the next word of the request head, waiting with yield until it has all arrived. The server itself no
+         * longer uses this, as a slow client would hold up every other connection while it waits, see readWord.
+         * @return true if the word ended the line
+         */
         bool readWordUntilTrim(char *buffer, size_t bufferSize, bool skipSeparator = false);
 
         char readCharFromTransport();
 
+        /**
+         * Reads data from the transport into the buffer, waiting with yield until at least one byte is available.
+         * @param buffer the buffer to read into
+         * @param bufferSize the maximum number of bytes to read
+         * @return the number of bytes read, or -1 if the connection closed or timed out.
+         */
+        int readDataFromTransport(uint8_t* buffer, size_t bufferSize);
+
+        /**
+         * Parses the request line as it arrives, leaving the URL in the buffer once it has all been read.
+         * @param buffer the buffer to read into, the same buffer must be given each time until the line is complete
+         * @param bufferSize the size of the buffer
+         * @return the method, REQ_INCOMPLETE when more data is needed, REQ_ERROR for a bad request line, or REQ_NONE
+         *         when the connection closed.
+         */
         WebServerMethod processRequest(char *buffer, size_t bufferSize);
 
+        /**
+         * Parses the next header as it arrives, once the request line has been read by processRequest.
+         * @param buffer the buffer to read into, the same buffer must be given each time until the header is complete
+         * @param bufferSize the size of the buffer
+         * @return the header with its value in the buffer, WSH_FINISHED at the end of the headers, WSH_INCOMPLETE
+         *         when more data is needed, or WSH_ERROR when the connection failed.
+         */
         WebServerHeader processHeader(char *buffer, size_t bufferSize);
 
+        /**
+         * @return true once the blank line at the end of the headers has been read, until the next reset. Before then
+         * nothing is waiting on the connection other than the parse, which carries on when more data arrives.
+         */
+        bool isHeadComplete() const { return parseStage == PARSE_DONE; }
+
         void tick();
 
         bool isProtocolError() const {return protocolError;}
+
+        /**
+         * Called when a deadline for this connection expires while a read is in progress, the read then fails with a
+         * protocol error the next time it finds no data waiting. Cleared by reset or tick.
+         */
+        void markTimedOut() { timedOut = true; }
+
+        /**
+         * @return true if a deadline has expired since the last reset or tick, see markTimedOut
+         */
+        bool hasTimedOut() const { return timedOut; }
+
+        /**
+         * @return the value of millis() at the last reset or tick, IE the last activity on the connection.
+         */
+        unsigned long getLastActivity() const { return millisStart; }
+
+        /**
+         * Parses the value of a range header, only a single byte range is supported, in any of the forms bytes=0-499,
+         * bytes=500- or bytes=-500. Where either end is not provided it is returned as -1. A position that does not
+         * fit in 31 bits returns both ends as INT32_MAX, which no resource can satisfy, so a 416 is sent.
+         * @param rangeText the value of the range header
+         * @param rangeFirst the first byte position, or -1 for a suffix range
+         * @param rangeLast the last byte position inclusive, or -1 for an open ended range
+         * @return true if a single range was parsed successfully, otherwise false
+         */
+        static bool parseRange(const char* rangeText, int32_t& rangeFirst, int32_t& rangeLast);
+
+        /**
+         * Parses the value of a Content-Length header, which must be only decimal digits, so a negative or non
+         * numeric length is rejected. A length too large to hold is returned as UINT32_MAX.
+         * @param lengthText the value of the header
+         * @param length the length that was parsed
+         * @return true if the length is valid
+         */
+        static bool parseContentLength(const char* lengthText, uint32_t& length);
+
+        /**
+         * Parses an entity tag from an If-None-Match header, in the form written by the server, a quoted version
+         * of eight hex digits. A weak tag is accepted, lists of tags are not supported and only the first is used.
+         * @param tagText the value of the header
+         * @param version the version in the tag
+         * @return true if the tag could be parsed
+         */
+        static bool parseEntityTag(const char* tagText, uint32_t& version);
     };
 
     class TcMenuLightweightWebServer;
+    class WebCacheEntry;
+
+#if defined(WS_COROUTINE_HANDLERS)
+    /**
+     * The return type of a coroutine page handler, a handler returning this type can use co_await on the response's
+     * asyncSend, asyncSend_P and asyncReadBody functions. Instead of blocking while the socket is busy, the handler is
+     * suspended and then resumed by the response's own task once the socket is ready again, so long downloads
+     * interleave fairly with other tasks without any nested calls to yield. The coroutine frame is allocated on the
+     * heap when the handler is called, and freed when the handler completes.
+     */
+    class WebCoroutine {
+    public:
+        struct promise_type {
+            WebCoroutine get_return_object() { return WebCoroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() {}
+        };
+
+        explicit WebCoroutine(std::coroutine_handle<promise_type> h) : handle(h) {}
+        WebCoroutine(const WebCoroutine&) = delete;
+        WebCoroutine& operator=(const WebCoroutine&) = delete;
+        WebCoroutine(WebCoroutine&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+        WebCoroutine& operator=(WebCoroutine&& other) noexcept {
+            if(this != &other) {
+                if(handle) handle.destroy();
+                handle = other.handle;
+                other.handle = nullptr;
+            }
+            return *this;
+        }
+        // a coroutine that was never handed to a response still owns its frame, so free it here.
+        ~WebCoroutine() { if(handle) handle.destroy(); }
+
+        std::coroutine_handle<> release() { auto h = handle; handle = nullptr; return h; }
+    private:
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    class WebSendAwaiter;
+    class WebBodyReadAwaiter;
+#endif
 
     /**
      * A Webserver Response object is responsible for parsing the request line and header data out of an incoming request
      * (potentially iteratively if there's more than one request) and then providing the means to respond to the request
      * in the usual manner (eg sending headers, then data, then calling end, once end() is called, you can check if there
-     * is another request within the same transport.
+     * is another request within the same transport. Responses are not tasks themselves, the web server's reactor calls
+     * exec on each one when it is ready.
      */
-    class WebServerResponse : public Executable {
+    class WebServerResponse {
     public:
-        enum WSRMode { NOT_IN_USE, TRANSPORT_ASSIGNED, READING_HEADERS, PREPARING_HEADER, PREPARING_CONTENT, WEBSOCKET_BUSY };
+        enum WSRMode { NOT_IN_USE, TRANSPORT_ASSIGNED, READING_HEADERS, PREPARING_HEADER, PREPARING_CONTENT, WEBSOCKET_BUSY, EVENT_STREAM_BUSY, STREAMING_CONTENT };
         enum WSRContentType { PLAIN_TEXT, HTML_TEXT, PNG_IMAGE, JPG_IMAGE, WEBP_IMAGE, JSON_TEXT, TEXT_CSS, JAVASCRIPT, IMG_ICON };
         enum WSRConnectionType { KEEP_REQ_OPEN, CLOSE_AFTER_RESPONSE, WEB_SOCKET };
+        enum WSRRangeState { RANGE_NONE, RANGE_REQUESTED, RANGE_ACTIVE, RANGE_NOT_SATISFIABLE };
+        enum WSRDeadline { DEADLINE_REQUEST_READ, DEADLINE_KEEP_ALIVE, DEADLINE_WEBSOCKET_IDLE, DEADLINE_WRITE_STALL, DEADLINE_EVENT_STREAM_PING };
     private:
         TcMenuLightweightWebServer* webServer;
         WebServerMethod method;
@@ -120,13 +436,96 @@ namespace tcremote {
         WSRConnectionType initialConnectionType;
         WSRConnectionType connectionType;
         uint8_t webSocketSha1KeyToRespond[20];
-        taskid_t scheduledTaskId = TASKMGR_INVALIDID;
+        volatile bool readyForService = false;
+        WSRRangeState rangeState = RANGE_NONE;
+        int32_t rangeFirst = -1;
+        int32_t rangeLast = -1;
+        uint32_t rangeTotal = 0;
+        uint32_t rangePosition = 0;
+        bool chunkedEncoding = false;
+        uint8_t chunkFill = 0;
+        bool servedRequest = false;
+        bool stopped = false;
+        bool bodyFormEncoded = false;
+        bool bodyLengthValid = true;
+        uint32_t bodyLength = 0;
+        uint32_t bodyRemaining = 0;
+        uint32_t lastEventId = 0;
+        bool lastEventIdPresent = false;
+        uint32_t entityTag = 0;
+        uint32_t ifNoneMatch = 0;
+        bool entityTagPresent = false;
+        bool ifNoneMatchPresent = false;
+        WebCacheEntry* captureEntry = nullptr;
+        char pathParameter[WS_MAX_PATH_PARAMETER] = {};
+        const char* handlerRoute = nullptr;
+        uint16_t handlerKey = 0;
+        unsigned long requestStartMicros = 0;
+        unsigned long handlerStartMicros = 0;
+        uint32_t timeToFirstByte = 0;
+        uint32_t contentBytesSent = 0;
+        TimerWheelEntry deadline {this};
+        WebRequestArena arena;
+        WebContentSource* contentSource = nullptr;
+        uint32_t sourcePosition = 0;
+        uint32_t sourceEnd = 0;
+        ProgramMemoryContentSource programMemorySource {nullptr, 0};
+
+        void armDeadline(WSRDeadline type);
+        bool clipToRange(const uint8_t*& startingLocation, size_t& numBytes);
+        WebServerHeader readRequestHead();
+        bool isWaitingForRequest();
+        void setContentTypeHeader(WSRContentType contentType);
+        void setEntityTagHeader();
+        int readBodyChar();
+#if defined(WS_COROUTINE_HANDLERS)
+        enum WSRAsyncWait { ASYNC_NONE, ASYNC_SEND, ASYNC_READ };
+        std::coroutine_handle<> activeCoroutine = nullptr;
+        WSRAsyncWait asyncWait = ASYNC_NONE;
+        const uint8_t* asyncData = nullptr;
+        size_t asyncRemaining = 0;
+        MemoryLocationType asyncMemType = RAM_NEEDS_COPY;
+
+        void serviceCoroutine();
+        void finishCoroutine();
+#endif
+        int readFormPart(char* buffer, size_t bufferSize, char terminator, bool& malformed);
+        bool writeContent(const uint8_t* data, size_t numBytes, MemoryLocationType memType);
+        bool writeToTransport(const uint8_t* data, size_t numBytes, MemoryLocationType memType);
+        bool writeChunked(const uint8_t* data, size_t numBytes, MemoryLocationType memType);
+        bool flushChunk();
+        bool writeFromProgramMemory(const uint8_t* data, size_t numBytes);
+        bool writeProgramMemoryNow(size_t position, size_t end);
+        bool completeProgramMemoryContent();
+        void serviceContentSource();
+        void finishContentSource(bool completed);
+        bool writeEventText(const char* text) { return writeContent((const uint8_t*)text, strlen(text), RAM_NEEDS_COPY); }
     public:
         WebServerResponse(TcMenuLightweightWebServer* webServer, TcMenuWebServerTransport* tx, WSRConnectionType conType);
-        void init();
+
+        /**
+         * Responses no longer need a task of their own as the web server's reactor services them all, this is kept
+         * for compatibility, and only lets the reactor give this response connections again after stop.
+         */
+        void init() { stopped = false; }
+
+        /**
+         * Closes any connection this response is serving and stops the reactor giving it any more until init is
+         * called. Kept for compatibility from when each response was a task of its own.
+         */
         void stop();
+
+        /** @return true if stop has been called without a later init, the response is then not given connections */
+        bool isStopped() const { return stopped; }
+
         void serviceClient(socket_t sock);
-        bool processHeaders();
+
+        /**
+         * Reads the request headers as they arrive, once the request line has been read. It returns as soon as the
+         * data runs out, and carries on from where it was when called again.
+         * @return WSH_FINISHED once all the headers are read, WSH_INCOMPLETE when more data is needed, or WSH_ERROR
+         */
+        WebServerHeader processHeaders();
 
         WSRMode getMode() { return mode; }
         void setMode(WSRMode newMode) { mode = newMode; }
@@ -143,6 +542,18 @@ namespace tcremote {
          */
         void startHeader(int code, const char* textualInfo);
 
+        /**
+         * Starts a response for a resource that supports byte ranges, the total length of the resource must be known
+         * up front. If the request had a satisfiable Range header a 206 Partial Content response is started and
+         * contentInfo, send and send_P will only write the requested window of the resource, so you should still
+         * send the entire resource as usual. Without a range header this is the same as startHeader() but also tells
+         * the client that ranges are accepted. When the range cannot be satisfied a 416 response is written and false
+         * is returned, in that case the handler should just return.
+         * @param totalLength the total length of the resource that will be sent
+         * @return true if the content should be sent, false if the range was not satisfiable.
+         */
+        bool startRangedHeader(size_t totalLength);
+
         /**
          * Set a header onto the response
          * @param header the header type
@@ -150,6 +561,12 @@ namespace tcremote {
          */
         void setHeader(WebServerHeader header, const char* headerValue);
 
+        /**
+         * Adds a Last-Modified header with the time the firmware was built, for static content that is compiled
+         * into the firmware and so can only change when it is rebuilt. Call after starting the header.
+         */
+        void setLastModifiedToBuildTime() { setHeader(WSH_LAST_MODIFIED, buildDateInWebForm()); }
+
         /**
          * Tells this request handler that the request we are processing is a websocket, usually called during
          * header processing, this automatically starts the header and adds most web socket headers. Including the
@@ -157,14 +574,106 @@ namespace tcremote {
          */
         void turnRequestIntoWebSocket();
 
+        /**
+         * Turns the request into a server sent event stream (text/event-stream), call from a GET handler instead of
+         * starting a header. The connection is then held open in the EVENT_STREAM_BUSY mode, in the same way as a
+         * websocket, and events are pushed to the client with sendEvent until the connection is closed. Browsers
+         * reconnect automatically when an event stream is lost, sending the id of the last event they saw, see
+         * getLastEventId. Idle streams are sent a comment every WS_EVENT_STREAM_PING_MILLIS.
+         */
+        void turnRequestIntoEventStream();
+
+        /**
+         * Sends an event on an event stream, and flushes it to the client. Data containing newlines is sent as
+         * several data lines, which the client joins back together.
+         * @param id the id of the event, sent back by the client in Last-Event-ID when it reconnects
+         * @param eventName the event type, or nullptr for the default message type
+         * @param data the data for the event
+         * @return true if the event was written, false if the connection has closed.
+         */
+        bool sendEvent(uint32_t id, const char* eventName, const char* data);
+
+        /**
+         * Starts an event on an event stream for data that is written using send, the data must not contain any
+         * newlines, call endEvent once the data is written. Use this to stream larger events such as JSON directly.
+         * @param id the id of the event, sent back by the client in Last-Event-ID when it reconnects
+         * @param eventName the event type, or nullptr for the default message type
+         * @return true if the event was started, false if the connection has closed.
+         */
+        bool startEvent(uint32_t id, const char* eventName);
+
+        /**
+         * Ends an event that was started with startEvent, the event is not flushed so that several events can be
+         * sent together, call flushEvents once they are all written.
+         * @return true if the event was written, false if the connection has closed.
+         */
+        bool endEvent();
+
+        /**
+         * Flushes any events that are waiting in the driver out to the client.
+         */
+        void flushEvents();
+
+        /**
+         * Sets the version of the content for this response, it is sent as the ETag header along with the content
+         * info. Usually set by the response cache, see onUrlGetCached.
+         * @param version the version of the content
+         */
+        void setEntityTag(uint32_t version) {
+            entityTag = version;
+            entityTagPresent = true;
+        }
+
+        /**
+         * @return true if the request had an If-None-Match header with an entity tag that could be parsed.
+         */
+        bool hasIfNoneMatch() const { return ifNoneMatchPresent; }
+
+        /**
+         * @return the version from the If-None-Match header if the request had one, otherwise 0.
+         */
+        uint32_t getIfNoneMatch() const { return ifNoneMatchPresent ? ifNoneMatch : 0; }
+
+        /**
+         * Sends a 304 Not Modified response with the entity tag, for when the client already has the current version
+         * of the content. There is no content, so nothing more should be sent.
+         */
+        void sendNotModified();
+
+        /**
+         * Sets the cache entry that captures the content of this response as it is sent, used by the response cache.
+         * @param entry the entry to capture into, or nullptr to stop capturing
+         */
+        void setCaptureEntry(WebCacheEntry* entry) { captureEntry = entry; }
+
+        /**
+         * @return true if the request had a Last-Event-ID header, IE it is an event stream client reconnecting.
+         */
+        bool hasLastEventId() const { return lastEventIdPresent; }
+
+        /**
+         * @return the value of the Last-Event-ID header if the request had one, otherwise 0.
+         */
+        uint32_t getLastEventId() const { return lastEventId; }
+
         /**
          * Called during header processing to send the content type and length of the data, this should always be
-         * called before starting data transmission
+         * called before starting data transmission. For ranged responses, the length is adjusted to the range.
          * @param contentType one of the standard content types
          * @param len the length of the data to send
          */
         void contentInfo(WSRContentType contentType, size_t len);
 
+        /**
+         * Called during header processing instead of contentInfo when the length of the data is not known up front,
+         * the response is sent using chunked transfer encoding. Small sends are gathered in the write buffer and sent
+         * as one chunk when it fills, larger ones are written as chunks of at most WS_MAX_CHUNK_SIZE bytes, and end()
+         * terminates the stream. This allows a handler to generate large responses in constant memory without
+         * working out the length first.
+         * @param contentType one of the standard content types
+         */
+        void contentInfoChunked(WSRContentType contentType);
+
         /**
          * Tells the HTTP layer that the header is complete and we will start the data response, can be omitted and
          * the first call to send.. will call this.
@@ -181,11 +690,12 @@ namespace tcremote {
         bool send_P(const char* startingLocation, size_t numBytes) { return send_P((uint8_t*) startingLocation, numBytes);}
 
         /**
-         * Sends data to the HTTP client using the buffer provided, where the data is in program memory. This will block
-         * until the bytes are sent, but it will yield to taskmanager frequently so other tasks still run.
+         * Sends data to the HTTP client using the buffer provided, where the data is in program memory. When the
+         * driver cannot send from program memory, a regular handler's call returns straight away and the data is
+         * sent as the socket drains after the handler returns, so it must stay in program memory, as it always does.
          * @param startingLocation the starting location
          * @param numBytes the number of bytes to send
-         * @return true if the bytes were sent.
+         * @return true if the bytes were sent, or are queued to be sent.
          */
         bool send_P(const uint8_t* startingLocation, size_t numBytes);
 
@@ -211,6 +721,35 @@ namespace tcremote {
          */
         bool send(const uint8_t* startingLocation, size_t numBytes, bool memIsConst = false);
 
+        /**
+         * For writers that build chunked content in place, such as JsonStreamWriter, gives the free space at the end
+         * of the chunk being gathered in the write buffer, so the content is not copied again. When the chunk is full
+         * it is sent first. Nothing else may be sent until the space is committed.
+         * @param available set to the space that can be written
+         * @return where to build the content, or nullptr if the response is not chunked or has no write buffer.
+         */
+        uint8_t* reserveChunkSpace(size_t& available);
+
+        /**
+         * Adds content that was built in the space given by reserveChunkSpace to the chunk being gathered.
+         * @param len the number of bytes built, at most the space that was available
+         */
+        void commitChunkSpace(size_t len);
+
+        /** @return true if the content is being sent with chunked transfer encoding */
+        bool isChunked() const { return chunkedEncoding; }
+
+        /**
+         * Attaches a content source that provides the body of the response, the handler should return straight away
+         * afterwards. Instead of blocking in the handler, the server reads from the source whenever the socket can
+         * take more, directly into the driver's write buffer where it can, and ends the response once it has all
+         * been sent. Call after contentInfo, or startRangedHeader and contentInfo, with the length of the source, a
+         * range only reads the requested window. See TcWebContentSource.h
+         * @param source the source of the body, it must remain valid until its finished method is called.
+         * @return true if streaming has started, otherwise false and finished has already been called.
+         */
+        bool streamContent(WebContentSource& source);
+
         /**
          * Use this to end the request after the data and headers has been sent. Can be omitted in most cases and the
          * transport will do this automatically
@@ -241,10 +780,205 @@ namespace tcremote {
          */
         WebServerMethod getMethod() { return method; }
 
+        /**
+         * When the handler was registered with a URL ending in a wildcard, this is the part of the request URL that
+         * matched the wildcard, for example with a wildcard after /api/item/ and a request of /api/item/12 it is "12".
+         * @return the part of the URL matched by a wildcard, or an empty string.
+         */
+        const char* getPathParameter() const { return pathParameter; }
+
+        /**
+         * Gets the scratch memory for this request, handlers can use it instead of the heap or large stack buffers
+         * for anything needed until the response ends, when it is all given back. See TcWebRequestArena.h
+         * @return the arena for this request
+         */
+        WebRequestArena& getArena() { return arena; }
+
+        /**
+         * Called by the web server to store the part of the URL that matched a wildcard, see getPathParameter.
+         * @param param the part of the URL matched by the wildcard
+         * @return false if it is too long to store, it is then left empty and the request should get a 400 response.
+         */
+        bool setPathParameter(const char* param) {
+            size_t len = strlen(param);
+            if(len >= sizeof(pathParameter)) {
+                pathParameter[0] = 0;
+                return false;
+            }
+            memcpy(pathParameter, param, len + 1);
+            return true;
+        }
+
+        /**
+         * Called by the web server once the request line is read to record which handler matched, the handler is
+         * then called when the headers have all arrived.
+         * @param key the key of the matching handler
+         */
+        void setHandlerKey(uint16_t key) { handlerKey = key; }
+        /** @return the key of the handler that matched the current request, see setHandlerKey */
+        uint16_t getHandlerKey() const { return handlerKey; }
+
+        /**
+         * Called by the web server just before a handler is called, so that the handler time can be recorded.
+         * @param route the URL the handler was registered with, or nullptr when no handler matched the request
+         */
+        void startHandlerTiming(const char* route) {
+            handlerRoute = route;
+            handlerStartMicros = micros();
+        }
+
+        /** @return the URL of the handler for the current request, or nullptr when no handler matched */
+        const char* getHandlerRoute() const { return handlerRoute; }
+        /** @return the microseconds since the handler for the current request was called */
+        uint32_t getHandlerMicros() const { return micros() - handlerStartMicros; }
+        /** @return the microseconds from starting to read the request to writing the first byte of the response */
+        uint32_t getTimeToFirstByte() const { return timeToFirstByte; }
+        /** @return the number of content bytes sent for the current request, not including headers */
+        uint32_t getContentBytesSent() const { return contentBytesSent; }
+
+        /**
+         * @return the content length of the request body, or 0 if the request has no body.
+         */
+        uint32_t getBodyLength() const { return bodyLength; }
+
+        /**
+         * @return false if the request had a Content-Length header that was not a valid length, it then gets a 400.
+         */
+        bool isBodyLengthValid() const { return bodyLengthValid; }
+
+        /**
+         * @return the number of bytes in the request body that are yet to be read.
+         */
+        uint32_t getBodyRemaining() const { return bodyRemaining; }
+
+        /**
+         * @return true if the request body has the content type application/x-www-form-urlencoded
+         */
+        bool isBodyFormEncoded() const { return bodyFormEncoded; }
+
+        /**
+         * Reads the next part of the request body into the buffer you provide, it never reads past the end of the
+         * body so the next request on a keep alive connection is not affected. Call repeatedly to stream a body that
+         * is larger than your buffer. This will wait for data, but it will yield to taskmanager so other tasks still run.
+         * Any part of the body not read by the handler is discarded when the response ends.
+         * @param buffer the buffer to read into
+         * @param bufferSize the size of the buffer
+         * @return the number of bytes read, 0 at the end of the body, or -1 if the connection closed or timed out, in
+         *         which case the connection is closed and there is no more body to read.
+         */
+        int readBody(uint8_t* buffer, size_t bufferSize);
+
+        /**
+         * Reads the next field from an application/x-www-form-urlencoded request body, decoding it directly into the
+         * buffers provided without any allocation. Fields or values that are too long for the buffers are truncated.
+         * Fields that are not correctly encoded, such as a % without two hex digits after it, are skipped. When the
+         * body cannot be read the connection is closed and false is returned, so a loop over the fields always ends.
+         * @param name the buffer to hold the field name
+         * @param nameSize the size of the name buffer
+         * @param value the buffer to hold the decoded value
+         * @param valueSize the size of the value buffer
+         * @return true if a field was read, false when there are no more fields.
+         */
+        bool nextFormField(char* name, size_t nameSize, char* value, size_t valueSize);
+
+#if defined(WS_COROUTINE_HANDLERS)
+        /**
+         * Starts a coroutine page handler for this response, called by the web server when a request matches a
+         * coroutine handler. The coroutine is run until it first suspends.
+         * @param coroutine the coroutine returned by calling the handler
+         */
+        void startCoroutine(WebCoroutine&& coroutine);
+
+        /**
+         * For use in coroutine handlers only, sends data to the client using co_await, the handler is suspended
+         * while the socket cannot accept more data, instead of blocking.
+         * @param startingLocation the starting location
+         * @param numBytes the number of bytes to send
+         * @param memIsConst indicates if the memory is constant and doesn't need copying.
+         * @return an awaitable that resumes with true if the bytes were sent.
+         */
+        WebSendAwaiter asyncSend(const uint8_t* startingLocation, size_t numBytes, bool memIsConst = false);
+
+        /**
+         * For use in coroutine handlers only, sends data that is in program memory to the client using co_await,
+         * the handler is suspended while the socket cannot accept more data, instead of blocking.
+         * @param startingLocation the starting location
+         * @param numBytes the number of bytes to send
+         * @return an awaitable that resumes with true if the bytes were sent.
+         */
+        WebSendAwaiter asyncSend_P(const uint8_t* startingLocation, size_t numBytes);
+
+        /**
+         * For use in coroutine handlers only, reads the next part of the request body using co_await, the handler
+         * is suspended until body data is available. See readBody for details.
+         * @param buffer the buffer to read into
+         * @param bufferSize the size of the buffer
+         * @return an awaitable that resumes with the number of bytes read, 0 at the end of the body, or -1 on error
+         */
+        WebBodyReadAwaiter asyncReadBody(uint8_t* buffer, size_t bufferSize);
+
+        /**
+         * Called by the awaiters to prepare an asynchronous send, and write as much as possible straight away.
+         * @return true if all the data was written and the handler need not suspend.
+         */
+        bool prepareAsyncSend(const uint8_t* data, size_t numBytes, MemoryLocationType memType);
+
+        /**
+         * Called by the awaiters to indicate the handler is suspended waiting for body data.
+         */
+        void awaitReadable() { asyncWait = ASYNC_READ; }
+
+        /**
+         * @return true if the last asynchronous send wrote all the data successfully
+         */
+        bool didAsyncSendComplete() const { return asyncRemaining == 0 && mode != NOT_IN_USE; }
+#endif
+
+        /**
+         * @return true if this is a keep alive connection that has served at least one request and is now idle
+         * waiting for another, such connections can be closed to make room when the server is overloaded.
+         */
+        bool isIdleKeepAlive();
+
+        /**
+         * @return the value of millis() when there was last activity on this connection
+         */
+        unsigned long getLastActivity() const { return processor.getLastActivity(); }
+
+        /**
+         * Called by the web server's timer wheel when the current deadline for this connection has passed. Idle
+         * connections are closed straight away, if a request is in progress it is marked as timed out instead so
+         * that the code waiting on the connection can unwind before it is closed.
+         * @param type the type of deadline that expired
+         */
+        void deadlineExpired(WSRDeadline type);
+
+        /**
+         * @return the deadline entry for this connection in the web server's timer wheel
+         */
+        TimerWheelEntry& getDeadline() { return deadline; }
+
+        /**
+         * @return true if a coroutine handler is in progress on this response, always false without coroutine support.
+         */
+        bool isCoroutineActive() const {
+#if defined(WS_COROUTINE_HANDLERS)
+            return activeCoroutine != nullptr;
+#else
+            return false;
+#endif
+        }
+
+        /**
+         * @return the state of any byte range requested by the client, see startRangedHeader.
+         */
+        WSRRangeState getRangeState() const { return rangeState; }
+
         /**
          * @return the underlying transport for this request.
          */
         TcMenuWebServerTransport* getTransport() { return transport; }
+        TcMenuLightweightWebServer* getWebServer() { return webServer; }
 
         /**
          * @return true if there has been an error during processing, otherwise false.
@@ -252,10 +986,66 @@ namespace tcremote {
         bool hasErrorOccurred();
 
         /**
-         * This is the executable implementation, it is used to service the request when active.
+         * Marks this response as needing service, the reactor will call exec on its next pass. This may be called
+         * from the network driver's context.
+         */
+        void markReady() { readyForService = true; }
+
+        /**
+         * Clears the ready flag returning its previous value, used by the reactor to take the response off the ready list.
+         * @return true if the response was ready
+         */
+        bool takeReady() {
+            bool wasReady = readyForService;
+            readyForService = false;
+            return wasReady;
+        }
+
+        /**
+         * @return true if polling shows this response has something to do, used when the driver cannot notify us.
          */
-        void exec() override;
+        bool needsPolling();
+
+        /**
+         * Called by the web server's reactor to service the request when it is ready.
+         */
+        void exec();
+    };
+
+#if defined(WS_COROUTINE_HANDLERS)
+    /**
+     * The awaitable returned by asyncSend, it writes as much as it can immediately and only suspends the handler
+     * when the socket is not able to take any more data. Resumes with true if all the data was sent.
+     */
+    class WebSendAwaiter {
+    private:
+        WebServerResponse& response;
+        const uint8_t* data;
+        size_t numBytes;
+        MemoryLocationType memType;
+    public:
+        WebSendAwaiter(WebServerResponse& resp, const uint8_t* d, size_t len, MemoryLocationType ty) : response(resp), data(d), numBytes(len), memType(ty) {}
+        bool await_ready() { return response.prepareAsyncSend(data, numBytes, memType); }
+        void await_suspend(std::coroutine_handle<>) {}
+        bool await_resume() { return response.didAsyncSendComplete(); }
+    };
+
+    /**
+     * The awaitable returned by asyncReadBody, it only suspends the handler when there is more body to read and
+     * no data is available yet. Resumes with the result of readBody.
+     */
+    class WebBodyReadAwaiter {
+    private:
+        WebServerResponse& response;
+        uint8_t* buffer;
+        size_t bufferSize;
+    public:
+        WebBodyReadAwaiter(WebServerResponse& resp, uint8_t* buf, size_t sz) : response(resp), buffer(buf), bufferSize(sz) {}
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<>) { response.awaitReadable(); }
+        int await_resume() { return response.readBody(buffer, bufferSize); }
     };
+#endif
 }
 
 #endif //TCMENU_TCMENUHTTPREQUESTPROCESSOR_H
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "PlatformDetermination.h"
+#include <tcMenu.h>
+#include <RuntimeMenuItem.h>
+#include <MenuIterator.h>
+#include <MenuItemFormatter.h>
+#include "TcMenuRestApi.h"
+#include "TcWebJson.h"
+
+using namespace tcremote;
+
+namespace tc_rest {
+
+    const char* menuTypeName(MenuType type) {
+        switch(type) {
+            case MENUTYPE_INT_VALUE: return "analog";
+            case MENUTYPE_ENUM_VALUE: return "enum";
+            case MENUTYPE_BOOLEAN_VALUE: return "boolean";
+            case MENUTYPE_SUB_VALUE: return "sub";
+            case MENUTYPE_TEXT_VALUE: return "text";
+            case MENUTYPE_FLOAT_VALUE: return "float";
+            case MENUTYPE_ACTION_VALUE: return "action";
+            case MENUTYPE_LARGENUM_VALUE: return "largeNum";
+            case MENUTYPE_RUNTIME_LIST: return "list";
+            case MENUTYPE_IPADDRESS: return "ipAddress";
+            case MENUTYPE_TIME: return "time";
+            case MENUTYPE_DATE: return "date";
+            case MENUTYPE_COLOR_VALUE: return "color";
+            case MENUTYPE_SCROLLCHOICE_VALUE: return "scrollChoice";
+            default: return "other";
+        }
+    }
+
+    void writeMenuLevel(JsonStreamWriter& writer, MenuItem* item);
+
+    void writeMenuItem(JsonStreamWriter& writer, MenuItem* item) {
+        char sz[WS_REST_VALUE_SIZE];
+        writer.startObject();
+        writer.field("id", (long)item->getId());
+        item->copyNameToBuffer(sz, sizeof sz);
+        writer.field("name", sz);
+        writer.field("type", menuTypeName(item->getMenuType()));
+        writer.boolField("readOnly", item->isReadOnly());
+        writer.boolField("visible", item->isVisible());
+
+        if(item->getMenuType() == MENUTYPE_SUB_VALUE) {
+            writer.key("items");
+            writeMenuLevel(writer, reinterpret_cast<SubMenuItem*>(item)->getChild());
+        } else if(item->getMenuType() != MENUTYPE_ACTION_VALUE) {
+            copyMenuItemValue(item, sz, sizeof sz);
+            writer.field("value", sz);
+            if(isMenuBasedOnValueItem(item)) {
+                writer.field("current", (long)reinterpret_cast<ValueMenuItem*>(item)->getCurrentValue());
+            }
+        }
+        writer.endObject();
+    }
+
+    void writeMenuLevel(JsonStreamWriter& writer, MenuItem* item) {
+        writer.startArray();
+        while(item) {
+            // back items only exist for navigation on the device itself.
+            if(item->getMenuType() != MENUTYPE_BACK_VALUE) writeMenuItem(writer, item);
+            item = item->getNext();
+        }
+        writer.endArray();
+    }
+
+    void startJsonResponse(WebServerResponse& response) {
+        response.startHeader();
+        response.setHeader(WSH_CACHE_CONTROL, "no-cache");
+        response.contentInfoChunked(WebServerResponse::JSON_TEXT);
+    }
+
+    MenuItem* itemFromPath(WebServerResponse& response) {
+        char* end;
+        const char* idText = response.getPathParameter();
+        long id = strtol(idText, &end, 10);
+        MenuItem* item = nullptr;
+        if(*idText != 0 && *end == 0 && id >= 0) item = getMenuItemById((menuid_t)id);
+        if(item == nullptr) response.sendError(WS_INT_RESPONSE_NOT_FOUND);
+        return item;
+    }
+
+    bool applyValueToItem(MenuItem* item, JsonToken token, const char* value) {
+        switch(item->getMenuType()) {
+            case MENUTYPE_INT_VALUE:
+            case MENUTYPE_ENUM_VALUE: {
+                if(token != JSON_NUMBER) return false;
+                long current = atol(value);
+                if(current < 0 || current > item->getMaximumValue()) return false;
+                reinterpret_cast<ValueMenuItem*>(item)->setCurrentValue((uint16_t)current);
+                return true;
+            }
+            case MENUTYPE_BOOLEAN_VALUE:
+                if(token == JSON_TRUE || token == JSON_FALSE) {
+                    reinterpret_cast<ValueMenuItem*>(item)->setCurrentValue(token == JSON_TRUE);
+                    return true;
+                } else if(token == JSON_NUMBER) {
+                    reinterpret_cast<ValueMenuItem*>(item)->setCurrentValue(atol(value) != 0);
+                    return true;
+                }
+                return false;
+            case MENUTYPE_TEXT_VALUE:
+                if(token != JSON_STRING) return false;
+                reinterpret_cast<TextMenuItem*>(item)->setTextValue(value);
+                return true;
+            case MENUTYPE_FLOAT_VALUE:
+                if(token != JSON_NUMBER) return false;
+                reinterpret_cast<FloatMenuItem*>(item)->setFloatValue((float)atof(value));
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool applyValueFromBody(WebServerResponse& response, MenuItem* item) {
+        // read the members of the object, applying the value member and skipping anything else.
+        char sz[WS_REST_VALUE_SIZE];
+        JsonPullParser parser(response);
+        bool applied = false;
+        bool valid = parser.next(sz, sizeof sz) == JSON_OBJECT_START;
+        while(valid) {
+            auto token = parser.next(sz, sizeof sz);
+            if(token == JSON_OBJECT_END) break;
+            if(token != JSON_KEY) {
+                valid = false;
+            } else if(strcmp(sz, "value") == 0) {
+                token = parser.next(sz, sizeof sz);
+                applied = applyValueToItem(item, token, sz);
+                valid = applied;
+            } else {
+                valid = parser.skipValue(sz, sizeof sz);
+            }
+        }
+        return valid && applied;
+    }
+
+    void handleGetMenu(WebServerResponse& response) {
+        startJsonResponse(response);
+        JsonStreamWriter writer(response);
+        writer.startObject();
+        writer.key("items");
+        writeMenuLevel(writer, menuMgr.getRoot());
+        writer.endObject();
+        writer.flush();
+    }
+
+    void handleGetItem(WebServerResponse& response) {
+        MenuItem* item = itemFromPath(response);
+        if(item == nullptr) return;
+
+        startJsonResponse(response);
+        JsonStreamWriter writer(response);
+        writeMenuItem(writer, item);
+        writer.flush();
+    }
+
+    void handlePostItem(WebServerResponse& response) {
+        MenuItem* item = itemFromPath(response);
+        if(item == nullptr) return;
+        if(item->isReadOnly() || item->getMenuType() == MENUTYPE_SUB_VALUE) {
+            response.sendError(WS_INT_RESPONSE_FORBIDDEN);
+            return;
+        }
+
+        if(item->getMenuType() == MENUTYPE_ACTION_VALUE) {
+            // actions have no value, any post triggers them.
+            item->triggerCallback();
+        } else if(!applyValueFromBody(response, item)) {
+            serlogF2(SER_NETWORK_INFO, "REST value not applied ", item->getId());
+            response.sendError(WS_INT_RESPONSE_BAD_REQUEST);
+            return;
+        }
+
+        notifyMenuEventStream();
+        startJsonResponse(response);
+        JsonStreamWriter writer(response);
+        writeMenuItem(writer, item);
+        writer.flush();
+    }
+
+    TcMenuLightweightWebServer* eventServer = nullptr;
+    uint8_t eventRemoteNo = 0;
+    uint32_t eventCounter = 0;
+
+    void publishMenuChanges();
+
+    bool anyEventStreamClients() {
+        for(int i = 0; i < eventServer->getResponseCount(); i++) {
+            if(eventServer->getWebResponse(i)->getMode() == WebServerResponse::EVENT_STREAM_BUSY) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Publishes menu changes to the event streams from a task of its own, it is triggered by the REST API, by edits
+     * made on the device, and by notifyMenuEventStream. Changes that nobody notified are picked up every
+     * WS_EVENT_STREAM_CHECK_MILLIS, but only while a client is connected.
+     */
+    class MenuEventPublisher : public BaseEvent, public MenuManagerObserver {
+    private:
+        bool changesNotified = false;
+        unsigned long lastCheckMillis = 0;
+    public:
+        void notifyChanges() {
+            changesNotified = true;
+            markTriggeredAndNotify();
+        }
+
+        uint32_t timeOfNextCheck() override {
+            if(eventServer && (changesNotified || (anyEventStreamClients() && (millis() - lastCheckMillis) >= WS_EVENT_STREAM_CHECK_MILLIS))) {
+                markTriggeredAndNotify();
+            }
+            return millisToMicros(WS_EVENT_STREAM_CHECK_MILLIS);
+        }
+
+        void exec() override {
+            // this task can run while the web server yields part way through writing to a response, so it waits
+            // until the server has finished rather than writing events into the middle of that response.
+            if(eventServer == nullptr || eventServer->isServicing()) return;
+            changesNotified = false;
+            lastCheckMillis = millis();
+            publishMenuChanges();
+        }
+
+        void structureHasChanged() override { notifyChanges(); }
+        bool menuEditStarting(MenuItem*) override { return true; }
+        void menuEditEnded(MenuItem*) override { notifyChanges(); }
+    };
+
+    MenuEventPublisher eventPublisher;
+    bool eventPublisherObserving = false;
+
+    /**
+     * Event ids count up from a starting point picked when they are first needed, rather than from zero, because the
+     * count restarts when the device does. A client that saw events before a restart would otherwise hold an id that
+     * may match one after it, and so miss every change in between. Any id that does not match is sent everything.
+     */
+    uint32_t currentEventId() {
+        if(eventCounter == 0) {
+            eventCounter = micros() ^ (millis() << 20);
+            if(eventCounter == 0) eventCounter = 1;
+        }
+        return eventCounter;
+    }
+
+    bool sendItemEvent(WebServerResponse& response, MenuItem* item, uint32_t id) {
+        if(!response.startEvent(id, "item")) return false;
+        JsonStreamWriter writer(response);
+        writeMenuItem(writer, item);
+        return writer.flush() && response.endEvent();
+    }
+
+    void sendAllItemEvents(WebServerResponse& response, MenuItem* item) {
+        while(item && response.getMode() == WebServerResponse::EVENT_STREAM_BUSY) {
+            if(item->getMenuType() == MENUTYPE_SUB_VALUE) {
+                sendAllItemEvents(response, reinterpret_cast<SubMenuItem*>(item)->getChild());
+            } else if(item->getMenuType() != MENUTYPE_BACK_VALUE) {
+                sendItemEvent(response, item, currentEventId());
+            }
+            item = item->getNext();
+        }
+    }
+
+    void publishChangesAtLevel(MenuItem* item, bool& anySent) {
+        while(item) {
+            bool changed = item->isSendRemoteNeeded(eventRemoteNo);
+            if(changed) item->setSendRemoteNeeded(eventRemoteNo, false);
+
+            if(item->getMenuType() == MENUTYPE_SUB_VALUE) {
+                publishChangesAtLevel(reinterpret_cast<SubMenuItem*>(item)->getChild(), anySent);
+            } else if(changed && item->getMenuType() != MENUTYPE_BACK_VALUE) {
+                uint32_t id = currentEventId() + 1;
+                eventCounter = id ? id : 1;
+                for(int i = 0; i < eventServer->getResponseCount(); i++) {
+                    auto response = eventServer->getWebResponse(i);
+                    if(response->getMode() != WebServerResponse::EVENT_STREAM_BUSY) continue;
+                    sendItemEvent(*response, item, eventCounter);
+                    anySent = true;
+                }
+            }
+            item = item->getNext();
+        }
+    }
+
+    void publishMenuChanges() {
+        // the flags are cleared even without any clients, a client that connects later is sent everything anyway.
+        bool anySent = false;
+        publishChangesAtLevel(menuMgr.getRoot(), anySent);
+        if(!anySent) return;
+        for(int i = 0; i < eventServer->getResponseCount(); i++) {
+            eventServer->getWebResponse(i)->flushEvents();
+        }
+    }
+
+    void handleEventStream(WebServerResponse& response) {
+        response.turnRequestIntoEventStream();
+        // when the client saw the latest event there is nothing to resend, otherwise it may have missed changes.
+        if(!response.hasLastEventId() || response.getLastEventId() != currentEventId()) {
+            sendAllItemEvents(response, menuMgr.getRoot());
+            response.flushEvents();
+        }
+    }
+
+} // namespace tc_rest
+
+using namespace tc_rest;
+
+void tcremote::registerMenuRestApi(TcMenuLightweightWebServer& webServer) {
+    webServer.onUrlGet("/api/menu", handleGetMenu);
+    webServer.onUrlGet("/api/item/*", handleGetItem);
+    webServer.onUrlPost("/api/item/*", handlePostItem);
+}
+
+void tcremote::registerMenuEventStream(TcMenuLightweightWebServer& webServer, uint8_t remoteNo, const char* url) {
+    eventServer = &webServer;
+    eventRemoteNo = remoteNo;
+    webServer.onUrlGet(url, handleEventStream);
+    taskManager.registerEvent(&eventPublisher);
+    if(!eventPublisherObserving) {
+        menuMgr.addChangeNotification(&eventPublisher);
+        eventPublisherObserving = true;
+    }
+}
+
+void tcremote::notifyMenuEventStream() {
+    eventPublisher.notifyChanges();
+}
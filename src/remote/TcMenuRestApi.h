@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcMenuRestApi.h
+ *
+ * An optional REST API for the menu tree, built on the lightweight web server. It is much cheaper than the websocket
+ * protocol for integrations that just poll or set a few values over HTTP, as no bootstrap is needed. To use it, call
+ * registerMenuRestApi on your web server before calling init. The following endpoints are provided:
+ *
+ * * GET /api/menu - the whole menu tree, streamed as JSON, submenus have an items array of their own.
+ * * GET /api/item/{id} - a single item as JSON.
+ * * POST /api/item/{id} - change a value, the body is a JSON object such as {"value": 10}, the updated item is returned.
+ *
+ * Each item is written as {"id":1,"name":"Volume","type":"analog","readOnly":false,"visible":true,"value":"10dB"},
+ * where value is the formatted value. Items based on a value (analog, enum and boolean) also have a "current" field
+ * with the raw integer value, and it is this raw value that should be posted for those types. Text items take a
+ * string, float items a number, and posting anything to an action item triggers its callback.
+ *
+ * Changes to the menu can also be pushed to the browser as server sent events, see registerMenuEventStream. Each
+ * changed item is sent as an "item" event with the same JSON as above. As events describe the latest state of an item
+ * rather than a history, a client that reconnects having missed events is sent every item again.
+ */
+
+#ifndef TCMENU_TCMENURESTAPI_H
+#define TCMENU_TCMENURESTAPI_H
+
+#include "TcMenuWebServer.h"
+
+// How often the menu tree is checked for changes to push to event streams while a client is connected, this only
+// picks up changes that were not notified, see notifyMenuEventStream.
+#ifndef WS_EVENT_STREAM_CHECK_MILLIS
+#define WS_EVENT_STREAM_CHECK_MILLIS 250
+#endif
+
+// The largest value that can be read from or written to an item through the REST API, including the terminator.
+#ifndef WS_REST_VALUE_SIZE
+#define WS_REST_VALUE_SIZE 32
+#endif
+
+namespace tcremote {
+    /**
+     * Registers the REST API handlers with the web server, see the file documentation for the endpoints.
+     * @param webServer the web server to add the handlers to
+     */
+    void registerMenuRestApi(TcMenuLightweightWebServer& webServer);
+
+    /**
+     * Registers a server sent event stream on the web server that pushes menu changes to the browser, in javascript
+     * use `new EventSource("/api/events")` and listen for "item" events. Changes are found using the item's remote
+     * send flags, in the same way as other remote connections, so the remote number must not be used by any other
+     * connection. There is only one event stream per application, but each response slot can be a client of it.
+     * @param webServer the web server to add the handler to
+     * @param remoteNo the remote number used to track which items have changed
+     * @param url the URL of the event stream
+     */
+    void registerMenuEventStream(TcMenuLightweightWebServer& webServer, uint8_t remoteNo, const char* url = "/api/events");
+
+    /**
+     * Tells the event stream that menu items have changed, they are then pushed to clients straight away, rather than
+     * when the menu tree is next checked. Changes made through the REST API, and edits made on the device, are
+     * notified automatically, call this after changing items from your own code.
+     */
+    void notifyMenuEventStream();
+}
+
+#endif //TCMENU_TCMENURESTAPI_H
@@ -6,10 +6,17 @@
 #include "PlatformDetermination.h"
 #include "TcMenuWebServer.h"
 #include "TcMenuHttpRequestProcessor.h"
+#include "TcWebTrace.h"
 
 using namespace tcremote;
 
 void TcMenuWebServerTransport::close() {
+    // closing twice must not close a socket number that the driver has since given to another connection.
+    if(!consideredOpen && currentState == WSS_NOT_CONNECTED) return;
+    // a frame part built in space reserved from the driver is dropped first, otherwise the driver is still waiting on
+    // it when the close frame is written.
+    if(txFrame) rawWriteCommit(clientFd, 0);
+    txFrame = nullptr;
     consideredOpen = false;
     if(currentState != WSS_HTTP_REQUEST && currentState != WSS_NOT_CONNECTED) {
         // don't send a ws close event unless we are in web socket mode.
@@ -19,14 +26,33 @@ void TcMenuWebServerTransport::close() {
     closeSocket(clientFd);
     bytesLeftInCurrentMsg = 0;
     frameMaskingPosition = 0;
-    writePosition = 0;
+    writePosition = frameCapacity = 0;
     readAvail = 0;
     readPosition = 0;
+    readAheadAvail = readAheadPosition = 0;
     currentState = WSS_NOT_CONNECTED;
+    releaseBuffers();
+}
+
+void TcMenuWebServerTransport::releaseBuffers() {
+    if(!bufferPool) return;
+    // in websocket mode the read buffer holds a frame that is part read, and the write buffer one that is part built.
+    bool frameBeingRead = currentState > WSS_IDLE || (currentState == WSS_IDLE && readPosition != 0);
+    if(readBuffer && !frameBeingRead) {
+        bufferPool->release(readBuffer);
+        readBuffer = nullptr;
+    }
+    if(writeBuffer && writePosition == 0) {
+        bufferPool->release(writeBuffer);
+        writeBuffer = nullptr;
+    }
 }
 
 bool TcMenuWebServerTransport::available() {
     if(!consideredOpen) return false;
+    // frames built in space the driver reserves need no write buffer, otherwise when none can be leased the remote
+    // holds back its updates until one is free.
+    if(!txFrame && !driverReserves && !writeBuffer && !bufferPool->hasFree()) return false;
     return rawWriteAvailable(clientFd);
 }
 
@@ -34,13 +60,15 @@ bool TcMenuWebServerTransport::readAvailable() {
     if(!consideredOpen) return false;
     // short circuit when there's room in the buffer already.
     if(readPosition < readAvail && currentState == WSS_PROCESSING_MSG) return true;
+    // between frames a buffer is only leased once the next frame starts to arrive, and it waits while none are free.
+    if(!readBuffer && (!isReadReady() || !acquireReadBuffer())) return false;
 
     bool processing = true;
     while(processing) {
         switch (currentState) {
             case WSS_PROCESSING_MSG:
                 if(bytesLeftInCurrentMsg > 0) {
-                    readAvail = rawReadData(clientFd, readBuffer, min(bytesLeftInCurrentMsg, (size_t)bufferSize));
+                    readAvail = readFromConnection(readBuffer, min(bytesLeftInCurrentMsg, (size_t)bufferSize));
                     bytesLeftInCurrentMsg = bytesLeftInCurrentMsg - readAvail;
                     readPosition = 0;
                     return readAvail > 0;
@@ -48,11 +76,14 @@ bool TcMenuWebServerTransport::readAvailable() {
                 setState(WSS_IDLE); // we are now idle and trying to read the two byte frame
                 readPosition = 0;
                 processing = false;
+                releaseBuffers();
                 break;
             case WSS_IDLE:
             case WSS_LEN_READ: {
-                auto actual = rawReadData(clientFd, &readBuffer[readPosition], readPosition == 0 ? 2 : 1);
+                auto actual = readFromConnection(&readBuffer[readPosition], readPosition == 0 ? 2 : 1);
                 if(actual < 0) {
+                    // the client has gone, close now rather than holding the connection until the idle deadline.
+                    close();
                     return false;
                 }
                 readPosition += actual;
@@ -61,7 +92,7 @@ bool TcMenuWebServerTransport::readAvailable() {
                 int len = readBuffer[1] & 0x7f;
                 if (len == WS_FAIL_PAYLOAD_LEN) {
                     close();
-                    processing = false;
+                    return false;
                 } else if (len == WS_EXTENDED_PAYLOAD) {
                     setState(WSS_EXT_LEN_READ);
                     processing = true;
@@ -69,11 +100,16 @@ bool TcMenuWebServerTransport::readAvailable() {
                     bytesLeftInCurrentMsg = len;
                     setState(WSS_MASK_READ);
                 }
+                if(metrics) {
+                    metrics->webSocketFrameReceived();
+                    frameArrivedMicros = micros();
+                    replyPending = true;
+                }
                 if ((readBuffer[1] & 0x80) == 0) return false;
                 break;
             }
             case WSS_EXT_LEN_READ: {
-                auto actual = rawReadData(clientFd, &readBuffer[readPosition], readPosition == 2 ? 2 : 1);
+                auto actual = readFromConnection(&readBuffer[readPosition], readPosition == 2 ? 2 : 1);
                 readPosition += actual;
                 if (readPosition < 4) return false;
                 bytesLeftInCurrentMsg = readBuffer[2] << 8;
@@ -84,7 +120,7 @@ bool TcMenuWebServerTransport::readAvailable() {
             }
             case WSS_MASK_READ: {
                 int start = (bytesLeftInCurrentMsg > 125) ? 4 : 2;
-                auto actual = rawReadData(clientFd, &readBuffer[readPosition], (start + 4) - (readPosition));
+                auto actual = readFromConnection(&readBuffer[readPosition], (start + 4) - (readPosition));
                 readPosition += actual;
                 frameMask[0] = readBuffer[start];
                 frameMask[1] = readBuffer[start + 1];
@@ -106,7 +142,7 @@ bool TcMenuWebServerTransport::readAvailable() {
 uint8_t TcMenuWebServerTransport::readByte() {
     if(currentState == WSS_HTTP_REQUEST) {
         uint8_t sz[1];
-        rawReadData(clientFd, sz, 1);
+        readFromConnection(sz, 1);
         return sz[0];
     }
     else if(readPosition < readAvail && currentState == WSS_PROCESSING_MSG) {
@@ -119,15 +155,38 @@ uint8_t TcMenuWebServerTransport::readByte() {
 }
 
 int TcMenuWebServerTransport::writeChar(char data) {
-    if(writePosition >= (bufferSize - 2)) {
-        // we've exceeded the buffer size so we must flush, and then ensure
+    auto frame = frameForNextChar();
+    if(!frame) return 0;
+    frame[writePosition + 2] = data;
+    writePosition++;
+    return 1;
+}
+
+uint8_t* TcMenuWebServerTransport::frameForNextChar() {
+    if(writePosition < frameCapacity) return txFrame ? txFrame : writeBuffer;
+
+    if(writePosition != 0) {
+        // we've exceeded the frame size so we must flush, and then ensure
         // that flush actually did something and there is now capacity.
         flush();
-        if(writePosition != 0) return 0;// we did not write so return an error condition.
+        if(writePosition != 0) return nullptr;
     }
-    writeBuffer[writePosition + 2] = data;
-    writePosition++;
-    return 1;
+
+    // where the driver can, the frame is built straight into its write buffer, leaving room for the header, which
+    // is filled in by flush once the length is known. Keeping to short frames means the header is always two bytes.
+    size_t reserved = 0;
+    txFrame = rawWriteReserve(clientFd, WS_MIN_DIRECT_FRAME + 2, &reserved);
+    driverReserves = txFrame != nullptr;
+    if(txFrame) {
+        frameCapacity = (uint8_t)min(reserved - 2, (size_t)WS_MAX_SMALL_PAYLOAD);
+        return txFrame;
+    }
+
+    // otherwise it is built in our own write buffer, which the driver then copies. No buffer being free in the pool
+    // is reported as an error, in the same way as a write that did not complete.
+    if(!acquireWriteBuffer()) return nullptr;
+    frameCapacity = bufferSize - 2;
+    return writeBuffer;
 }
 
 int TcMenuWebServerTransport::writeStr(const char *data) {
@@ -153,17 +212,39 @@ void TcMenuWebServerTransport::flush() {
     if(currentState == WSS_HTTP_REQUEST) {
         rawFlushAll(clientFd);
     } else if(writePosition != 0) {
-        sendMessageOnWire(OPC_TEXT, writeBuffer, writePosition);
-        serlogF2(SER_NETWORK_INFO, "Buffer written ", writePosition);
-        writePosition = 0;
+        unsigned long started = metrics ? micros() : 0;
+        if(txFrame) {
+            txFrame[0] = (uint8_t)(WS_FIN | OPC_TEXT);
+            txFrame[1] = writePosition;
+            rawWriteCommit(clientFd, writePosition + 2);
+            txFrame = nullptr;
+        } else {
+            sendMessageOnWire(OPC_TEXT, writeBuffer, writePosition);
+        }
+        frameCapacity = 0;
+        traceWeb(TRACE_WS_FLUSH, clientFd, writePosition, 0);
         rawFlushAll(clientFd);
+        if(metrics) {
+            metrics->webSocketFrameSent(micros() - started, writePosition);
+            if(replyPending) metrics->webSocketReply(started - frameArrivedMicros);
+            replyPending = false;
+        }
+        writePosition = 0;
+        releaseBuffers();
     }
 }
 
 void TcMenuWebServerTransport::sendMessageOnWire(WebSocketOpcode opcode, uint8_t* buffer, size_t size) {
-    buffer[0] = (uint8_t)(WS_FIN | opcode);
-    buffer[1] = (uint8_t)size;
-    rawWriteData(clientFd, buffer, size + 2, RAM_NEEDS_COPY);
+    if(size <= WS_MAX_SMALL_PAYLOAD) {
+        buffer[0] = (uint8_t)(WS_FIN | opcode);
+        buffer[1] = (uint8_t)size;
+        rawWriteData(clientFd, buffer, size + 2, RAM_NEEDS_COPY);
+    } else {
+        // only two bytes are left in front of the payload, so the longer header is written separately.
+        uint8_t header[4] = { (uint8_t)(WS_FIN | opcode), WS_EXTENDED_PAYLOAD, (uint8_t)(size >> 8), (uint8_t)size };
+        rawWriteData(clientFd, header, sizeof header, RAM_NEEDS_COPY);
+        rawWriteData(clientFd, &buffer[2], size, RAM_NEEDS_COPY);
+    }
 }
 
 void TcMenuWebServerTransport::endMsg() {
@@ -174,18 +255,53 @@ void TcMenuWebServerTransport::endMsg() {
 void TcMenuWebServerTransport::setClient(socket_t client) {
     clientFd = client;
     consideredOpen = true;
-    readPosition = readAvail = writePosition = frameMaskingPosition = 0;
+    readPosition = readAvail = writePosition = frameMaskingPosition = frameCapacity = 0;
+    txFrame = nullptr;
+    replyPending = false;
+    driverReserves = false;
+    readAheadPosition = readAheadAvail = 0;
     setState(tcremote::WSS_HTTP_REQUEST);
 }
 
+int TcMenuWebServerTransport::readFromConnection(uint8_t* data, size_t dataLen) {
+    if(readAheadPosition >= readAheadAvail) {
+        // nothing buffered, large reads go straight into the callers buffer as they cannot over read.
+        if(dataLen >= sizeof(readAhead)) {
+            auto actual = rawReadData(clientFd, data, dataLen);
+            if(actual > 0) lastReadMillis = millis();
+            return actual;
+        }
+
+        readAheadPosition = readAheadAvail = 0;
+        auto actual = rawReadData(clientFd, readAhead, sizeof(readAhead));
+        if(actual <= 0) return actual;
+        readAheadAvail = actual;
+        lastReadMillis = millis();
+    }
+
+    size_t toCopy = min(dataLen, size_t(readAheadAvail - readAheadPosition));
+    memcpy(data, &readAhead[readAheadPosition], toCopy);
+    readAheadPosition += toCopy;
+    return (int)toCopy;
+}
+
 // ------------ Web server
 
-TcMenuLightweightWebServer::TcMenuLightweightWebServer(int port, int numConcurrent, bool keepConOpen): numConcurrent(numConcurrent),
-            responses {}, socketInitialised(false), connectionsWaiting(5), port(port) {
-    if(numConcurrent > MAX_WEBSERVER_RESPONSES) numConcurrent = MAX_WEBSERVER_RESPONSES;
+TcMenuLightweightWebServer::TcMenuLightweightWebServer(int port, int numConcurrent): numConcurrent(numConcurrent),
+            responses {}, socketInitialised(false), connectionsWaiting{},
+            timerWheel([](TimerWheelEntry& entry) {
+                auto response = reinterpret_cast<WebServerResponse*>(entry.getOwner());
+                response->deadlineExpired((WebServerResponse::WSRDeadline)entry.getDeadlineType());
+            }), port(port) {
+    if(numConcurrent > MAX_WEBSERVER_RESPONSES) this->numConcurrent = MAX_WEBSERVER_RESPONSES;
+}
 
-    for(int i=0; i<numConcurrent; i++){
-        responses[i] = new WebServerResponse(this, new TcMenuWebServerTransport(),
+TcMenuLightweightWebServer::TcMenuLightweightWebServer(int port, int numConcurrent, bool keepConOpen, WebBufferPool* bufferPool)
+        : TcMenuLightweightWebServer(port, numConcurrent) {
+    responsesOwned = true;
+    for(int i=0; i<this->numConcurrent; i++){
+        auto transport = bufferPool ? new TcMenuWebServerTransport(bufferPool) : new TcMenuWebServerTransport();
+        responses[i] = new WebServerResponse(this, transport,
                                              keepConOpen ? WebServerResponse::KEEP_REQ_OPEN : WebServerResponse::CLOSE_AFTER_RESPONSE);
     }
 }
@@ -195,86 +311,239 @@ TcMenuLightweightWebServer::~TcMenuLightweightWebServer() {
         taskManager.cancelTask(wsTaskId);
     }
 
-    for(int i=0; i<numConcurrent; i++) {
-        responses[i]->stop();
-        delete responses[i];
+    if(responsesOwned) {
+        for(int i=0; i<numConcurrent; i++) {
+            delete responses[i];
+        }
+    }
+    delete responseCache;
+    delete metrics;
+}
+
+void TcMenuLightweightWebServer::enableMetrics(const char* url) {
+    if(metrics != nullptr) return;
+    metrics = new WebServerMetrics();
+    for(int i = 0; i < numConcurrent; i++) {
+        responses[i]->getTransport()->setMetrics(metrics);
     }
+    onUrlGet(url, [](WebServerResponse& response) {
+        response.startHeader();
+        response.setHeader(WSH_CACHE_CONTROL, "no-cache");
+        response.contentInfoChunked(WebServerResponse::PLAIN_TEXT);
+        response.getWebServer()->getMetrics()->writePrometheus(response);
+    });
+}
+
+void TcMenuLightweightWebServer::onUrlGetCached(const char* url, WebPageHandler pageHandler, WebContentVersionFn versionFn, uint16_t ttlMillis) {
+    if(responseCache == nullptr) responseCache = new WebResponseCache();
+    urlHandlers.add(UrlWithHandler(urlHandlers.count(), url, pageHandler, versionFn, ttlMillis));
 }
 
 void TcMenuLightweightWebServer::init() {
     wsTaskId = taskManager.registerEvent(this);
-    initialiseAccept(port, [](socket_t fd, void* d) { reinterpret_cast<TcMenuLightweightWebServer*>(d)->pushClientSocket(fd); }, this);
+    initialiseAccept(port, [](socket_t fd, void* d) { reinterpret_cast<TcMenuLightweightWebServer*>(d)->pushClientSocket(fd); }, this,
+                     [](socket_t fd, void* d) { reinterpret_cast<TcMenuLightweightWebServer*>(d)->socketReady(fd); });
     for(int i=0; i<numConcurrent; i++) {
         responses[i]->init();
     }
 }
 
 void TcMenuLightweightWebServer::exec() {
+    servicing = true;
+    timerWheel.advance(millis());
+
     if(!socketInitialised) {
         socketInitialised = isNetworkUp();
-    } else {
-        while(connectionsWaiting.available()) {
-            socket_t sockFd = connectionsWaiting.get();
-            WebServerResponse* response = nextAvailableResponse();
-            if(response) {
-                response->serviceClient(sockFd);
-            } else {
-                serlogF(SER_ERROR, "Too many connections");
-                return;
-            }
+        servicing = false;
+        return;
+    }
+
+    admitWaitingConnections();
+
+    if((millis() - lastPollMillis) >= WS_REACTOR_POLL_MILLIS) {
+        lastPollMillis = millis();
+        for(int i=0; i<numConcurrent; i++) {
+            if(responses[i]->needsPolling()) responses[i]->markReady();
         }
     }
+
+    // service the ready responses, starting one further along each time round so that all get a fair share.
+    for(int i=0; i<numConcurrent; i++) {
+        auto response = responses[(roundRobinNext + i) % numConcurrent];
+        if(response->takeReady()) response->exec();
+    }
+    roundRobinNext = (roundRobinNext + 1) % numConcurrent;
+    servicing = false;
+}
+
+void TcMenuLightweightWebServer::admitWaitingConnections() {
+    while(waitingCount > 0) {
+        auto& waiting = connectionsWaiting[waitingFirst];
+        WebServerResponse* response = nextAvailableResponse();
+        if(!response) response = evictIdleConnection();
+
+        if(response) {
+            response->serviceClient(waiting.clientFd);
+            // service it on this pass, any data that arrived with the connection is handled straight away.
+            response->markReady();
+        } else if((millis() - waiting.queuedAt) > WS_MAX_QUEUE_WAIT_MILLIS) {
+            serlogF2(SER_NETWORK_INFO, "Queue wait exceeded ", waiting.clientFd);
+            rejectConnection(waiting.clientFd);
+        } else {
+            // the oldest connection is at the front, so nothing else can have waited too long either.
+            serlogF(SER_NETWORK_DEBUG, "All connections busy");
+            return;
+        }
+        waitingFirst = (waitingFirst + 1) % WS_CONNECTION_BACKLOG;
+        waitingCount--;
+    }
 }
 
 void TcMenuLightweightWebServer::pushClientSocket(socket_t socketIncoming) {
-    connectionsWaiting.put(socketIncoming);
+    if(waitingCount >= WS_CONNECTION_BACKLOG) {
+        serlogF2(SER_NETWORK_INFO, "Backlog full ", socketIncoming);
+        rejectConnection(socketIncoming);
+        return;
+    }
+    auto& waiting = connectionsWaiting[(waitingFirst + waitingCount) % WS_CONNECTION_BACKLOG];
+    waiting.clientFd = socketIncoming;
+    waiting.queuedAt = millis();
+    waitingCount++;
     markTriggeredAndNotify();
 }
 
 uint32_t TcMenuLightweightWebServer::timeOfNextCheck() {
-    if(connectionsWaiting.available() || !socketInitialised) {
+    // every open connection has a deadline, so the wheel having entries means there are connections to poll.
+    if(waitingCount > 0 || !socketInitialised || timerWheel.hasEntries()) {
         markTriggeredAndNotify();
     }
-    return millisToMicros(100);
+    return millisToMicros(timerWheel.hasEntries() ? WS_REACTOR_POLL_MILLIS : WS_TIMER_WHEEL_TICK_MILLIS);
 }
 
-bool TcMenuLightweightWebServer::attemptToHandleRequest(WebServerResponse& response, const char* url) {
+void TcMenuLightweightWebServer::socketReady(socket_t clientFd) {
+    for(int i=0; i<numConcurrent; i++) {
+        if(responses[i]->getMode() != WebServerResponse::NOT_IN_USE && responses[i]->getTransport()->getClientFd() == clientFd) {
+            responses[i]->markReady();
+            markTriggeredAndNotify();
+            return;
+        }
+    }
+}
+
+bool TcMenuLightweightWebServer::matchRequest(WebServerResponse& response, const char* url) {
     for(auto urlWithHandler : urlHandlers) {
         if(urlWithHandler.isRequestCompatible(url, response.getMethod())) {
-            if(response.processHeaders()) {
-                urlWithHandler.handleUrl(response);
-                if (response.getMode() != WebServerResponse::NOT_IN_USE && response.getMode() != WebServerResponse::WEBSOCKET_BUSY) {
-                    response.end();
-                }
-                // we return if it is likley that more request will be on the same connection, if in single shot mode
-                // then this should be false. Otherwise true, to keep the connection open.
-                return !response.isInSingleShotMode();
-            } else {
-                sendErrorCode(&response, WS_INT_RESPONSE_INT_ERR);
+            // the URL is in the read buffer, which is overwritten as the headers are read.
+            if(!response.setPathParameter(urlWithHandler.wildcardPart(url))) {
+                sendErrorCode(&response, WS_INT_RESPONSE_BAD_REQUEST);
                 return false;
             }
+            response.setHandlerKey(urlWithHandler.getKey());
+            return true;
         }
     }
+    response.startHandlerTiming(nullptr);
     sendErrorCode(&response, WS_INT_RESPONSE_NOT_FOUND);
+    recordRequestMetrics(response);
     return false;
 }
 
+bool TcMenuLightweightWebServer::attemptToHandleRequest(WebServerResponse& response) {
+    auto urlWithHandler = urlHandlers.getByKey(response.getHandlerKey());
+    if(!urlWithHandler) return false;
+    if(!response.isBodyLengthValid()) {
+        sendErrorCode(&response, WS_INT_RESPONSE_BAD_REQUEST);
+        return false;
+    }
+    if(response.getBodyLength() > WS_MAX_REQUEST_BODY_SIZE) {
+        sendErrorCode(&response, WS_INT_RESPONSE_PAYLOAD_TOO_LARGE);
+        return false;
+    }
+    response.startHandlerTiming(urlWithHandler->getUrl());
+    if(urlWithHandler->isCached()) {
+        responseCache->handleRequest(*urlWithHandler, response);
+    } else {
+        urlWithHandler->handleUrl(response);
+    }
+    // a coroutine handler that has suspended, or a content source still being sent, is finished by the
+    // response when it completes.
+    if(response.isCoroutineActive() || response.getMode() == WebServerResponse::STREAMING_CONTENT) return true;
+    recordRequestMetrics(response);
+    // only end the response when the handler has not already done so, otherwise a keep alive connection
+    // would get an extra line written into the next pipelined response.
+    auto mode = response.getMode();
+    if (mode == WebServerResponse::READING_HEADERS || mode == WebServerResponse::PREPARING_HEADER || mode == WebServerResponse::PREPARING_CONTENT) {
+        response.end();
+    }
+    // we return if it is likley that more request will be on the same connection, if in single shot mode
+    // then this should be false. Otherwise true, to keep the connection open.
+    return !response.isInSingleShotMode();
+}
+
 void TcMenuLightweightWebServer::sendErrorCode(WebServerResponse* response, int errorCode) {
-    if(errorCode == WS_INT_RESPONSE_NOT_FOUND) {
-        response->startHeader(WS_INT_RESPONSE_NOT_FOUND, WS_TEXT_RESPONSE_NOT_FOUND);
-        response->contentInfo(WebServerResponse::PLAIN_TEXT, 0);
-        response->end();
+    const char* errorText;
+    switch(errorCode) {
+        case WS_INT_RESPONSE_NOT_FOUND: errorText = WS_TEXT_RESPONSE_NOT_FOUND; break;
+        case WS_INT_RESPONSE_PAYLOAD_TOO_LARGE: errorText = WS_TEXT_RESPONSE_PAYLOAD_TOO_LARGE; break;
+        case WS_INT_RESPONSE_BAD_REQUEST: errorText = WS_TEXT_RESPONSE_BAD_REQUEST; break;
+        case WS_INT_RESPONSE_FORBIDDEN: errorText = WS_TEXT_RESPONSE_FORBIDDEN; break;
+        default:
+            errorCode = WS_INT_RESPONSE_INT_ERR;
+            errorText = "Internal error";
+            break;
+    }
+    response->startHeader(errorCode, errorText);
+    response->contentInfo(WebServerResponse::PLAIN_TEXT, 0);
+    response->end();
+}
+
+const char serviceUnavailableResponse[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                          "Server: " WS_SERVER_NAME "\r\n"
+                                          "Retry-After: " WS_RETRY_AFTER_SECONDS "\r\n"
+                                          "Connection: close\r\n"
+                                          "Content-Length: 0\r\n\r\n";
+
+void TcMenuLightweightWebServer::rejectConnection(socket_t clientFd) {
+    // never wait on a client that is being turned away, if the 503 cannot be written straight away just drop it.
+    if(rawWriteAvailable(clientFd) && rawWriteData(clientFd, serviceUnavailableResponse, sizeof(serviceUnavailableResponse) - 1,
+                                                   CONSTANT_NO_COPY, WS_REJECT_WRITE_MILLIS) == SOCK_ERR_OK) {
+        rawFlushAll(clientFd);
     } else {
-        response->startHeader(WS_INT_RESPONSE_INT_ERR, "Internal error");
-        response->contentInfo(WebServerResponse::PLAIN_TEXT, 0);
-        response->end();
+        serlogF2(SER_NETWORK_INFO, "Reject without 503 ", clientFd);
+    }
+    closeSocket(clientFd);
+}
+
+WebServerResponse *TcMenuLightweightWebServer::evictIdleConnection() {
+    WebServerResponse* oldest = nullptr;
+    unsigned long oldestIdleTime = 0;
+    bool oldestIsStream = false;
+    for(int i=0;i<numConcurrent;i++) {
+        if(responses[i] == nullptr) continue;
+        // event streams are also held open while idle, the client reconnects and resumes from its last event, but
+        // they are only closed when there are no idle keep alive connections.
+        bool isStream = responses[i]->getMode() == WebServerResponse::EVENT_STREAM_BUSY;
+        if(!isStream && !responses[i]->isIdleKeepAlive()) continue;
+        unsigned long idleTime = millis() - responses[i]->getLastActivity();
+        if(oldest == nullptr || (oldestIsStream && !isStream) || (isStream == oldestIsStream && idleTime > oldestIdleTime)) {
+            oldest = responses[i];
+            oldestIdleTime = idleTime;
+            oldestIsStream = isStream;
+        }
+    }
 
+    if(oldest) {
+        serlogF2(SER_NETWORK_INFO, "Evict idle connection ", oldest->getTransport()->getClientFd());
+        oldest->closeConnection();
     }
+    return oldest;
 }
 
 WebServerResponse *TcMenuLightweightWebServer::nextAvailableResponse() {
     for(int i=0;i<numConcurrent;i++) {
-        if(responses[i] != nullptr && responses[i]->getMode() == WebServerResponse::NOT_IN_USE) return responses[i];
+        // a coroutine may still be unwinding on a response whose connection has been closed.
+        if(responses[i] != nullptr && responses[i]->getMode() == WebServerResponse::NOT_IN_USE && !responses[i]->isCoroutineActive()
+                && !responses[i]->isStopped()) return responses[i];
     }
     return nullptr;
 }
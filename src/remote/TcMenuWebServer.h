@@ -11,18 +11,67 @@
 #include "remote/BaseRemoteComponents.h"
 #include "remote/BaseBufferedRemoteTransport.h"
 #include "TcMenuHttpRequestProcessor.h"
+#include "TcWebResponseCache.h"
+#include "TcWebMetrics.h"
+#include "TcWebBufferPool.h"
 #include "SCCircularBuffer.h"
 #include "SimpleCollections.h"
 #include "TransportNetworkDriver.h"
+#include <new>
 
 #if defined(WS_RTC_INTEGRATED)
-void rtcUTCDateInWebForm(const char* buffer, size_t bufferLen);
+/**
+ * Implement this when WS_RTC_INTEGRATED is defined to provide the current UTC date for the Date header, it is called
+ * at most once a second and the result shared by every response, see tcremote::formatWebDate.
+ * @param buffer the buffer to write the date into in IMF-fixdate form, EG Wed, 22 Jul 2009 19:15:56 GMT
+ * @param bufferLen the size of the buffer
+ */
+void rtcUTCDateInWebForm(char* buffer, size_t bufferLen);
 #endif
 
 #ifndef MAX_WEBSERVER_RESPONSES
 #define MAX_WEBSERVER_RESPONSES 4
 #endif
 
+// The number of accepted connections that can wait for a free response slot, beyond this they get a 503 response.
+#ifndef WS_CONNECTION_BACKLOG
+#define WS_CONNECTION_BACKLOG 5
+#endif
+
+// How long an accepted connection can wait for a free response slot before it gets a 503 response.
+#ifndef WS_MAX_QUEUE_WAIT_MILLIS
+#define WS_MAX_QUEUE_WAIT_MILLIS 1000
+#endif
+
+// The number of seconds a client is asked to wait in the Retry-After header of a 503 response.
+#ifndef WS_RETRY_AFTER_SECONDS
+#define WS_RETRY_AFTER_SECONDS "2"
+#endif
+
+// The longest a 503 response may take to write before the connection is dropped without it, this is in the accept
+// path so it must be short.
+#ifndef WS_REJECT_WRITE_MILLIS
+#define WS_REJECT_WRITE_MILLIS 5
+#endif
+
+// How often the reactor polls connections while any are open, this picks up data for drivers that cannot notify the
+// server when a socket is ready, and coroutines waiting on a socket. Drivers that do notify are serviced straight away.
+#ifndef WS_REACTOR_POLL_MILLIS
+#define WS_REACTOR_POLL_MILLIS 20
+#endif
+
+// Each connection reads ahead from the socket into a buffer of this size, anything past the end of the current
+// request is kept there for the next pipelined request on the same connection. At most 255.
+#ifndef WS_READ_AHEAD_SIZE
+#define WS_READ_AHEAD_SIZE 64
+#endif
+
+// When a websocket frame is built straight into the driver's write buffer, this is the least payload space it is
+// given, if the driver has less free than this it sends what it has buffered first.
+#ifndef WS_MIN_DIRECT_FRAME
+#define WS_MIN_DIRECT_FRAME 32
+#endif
+
 // byte 1
 #define WS_FIN              0x80
 #define WS_RSV1             6
@@ -34,6 +83,8 @@ void rtcUTCDateInWebForm(const char* buffer, size_t bufferLen);
 #define WS_MASKED_PAYLOAD   7
 #define WS_EXTENDED_PAYLOAD 126
 #define WS_FAIL_PAYLOAD_LEN 127
+// the largest payload that fits in a two byte frame header, larger ones need the extended length.
+#define WS_MAX_SMALL_PAYLOAD 125
 
 /**
  * A very cut down and basic web server with webSocket implementation that can act as a web socket endpoint on a given
@@ -54,25 +105,57 @@ namespace tcremote {
 
 
     class TcMenuWebServerTransport : public TagValueTransport {
+        static_assert(WS_READ_AHEAD_SIZE > 0 && WS_READ_AHEAD_SIZE <= 255, "the read ahead buffer is indexed by 8 bit positions");
     protected:
         socket_t clientFd;
         size_t bytesLeftInCurrentMsg;
         uint8_t frameMask[4];
         uint8_t* writeBuffer;
         uint8_t* readBuffer;
+        uint8_t* txFrame;
         WebSocketTransportState currentState;
         const uint8_t bufferSize;
         uint8_t frameMaskingPosition;
         uint8_t readPosition;
         uint8_t readAvail;
         uint8_t writePosition;
+        uint8_t frameCapacity;
+        uint8_t readAheadPosition;
+        uint8_t readAheadAvail;
+        uint8_t readAhead[WS_READ_AHEAD_SIZE];
+        unsigned long lastReadMillis;
+        unsigned long frameArrivedMicros;
+        WebServerMetrics* metrics;
+        WebBufferPool* bufferPool;
         bool consideredOpen;
+        bool replyPending;
+        bool driverReserves; // the driver gave space for the last frame, so the next is not expected to need the pool
     public:
-        explicit TcMenuWebServerTransport(uint8_t buffSz = 125) : TagValueTransport(TVAL_UNBUFFERED), clientFd(TC_BAD_SOCKET_ID),
-                                             bytesLeftInCurrentMsg(0), frameMask{}, writeBuffer(new uint8_t[buffSz]),
-                                             readBuffer(new uint8_t[buffSz]), currentState(WSS_NOT_CONNECTED),
+        explicit TcMenuWebServerTransport(uint8_t buffSz = 125) : TcMenuWebServerTransport(new uint8_t[buffSz], new uint8_t[buffSz], buffSz) {}
+
+        /**
+         * Creates a transport without buffers of its own, it leases them from the pool only while it needs them, see
+         * TcWebBufferPool.h. The buffer size is that of the pool.
+         * @param pool the pool to lease buffers from
+         */
+        explicit TcMenuWebServerTransport(WebBufferPool* pool) : TcMenuWebServerTransport(nullptr, nullptr, pool->getBufferSize()) {
+            bufferPool = pool;
+        }
+
+        /**
+         * Creates a transport that uses buffers provided by the caller rather than allocating them, both buffers must
+         * be at least buffSz long and last as long as the transport.
+         * @param writeBuf the buffer that websocket frames are built in
+         * @param readBuf the buffer that requests and websocket frames are read into
+         * @param buffSz the size of each buffer
+         */
+        TcMenuWebServerTransport(uint8_t* writeBuf, uint8_t* readBuf, uint8_t buffSz) : TagValueTransport(TVAL_UNBUFFERED), clientFd(TC_BAD_SOCKET_ID),
+                                             bytesLeftInCurrentMsg(0), frameMask{}, writeBuffer(writeBuf),
+                                             readBuffer(readBuf), txFrame(nullptr), currentState(WSS_NOT_CONNECTED),
                                              bufferSize(buffSz), frameMaskingPosition(0), readPosition(0), readAvail(0),
-                                             writePosition(0), consideredOpen(false) {}
+                                             writePosition(0), frameCapacity(0), readAheadPosition(0), readAheadAvail(0), readAhead{},
+                                             lastReadMillis(0), frameArrivedMicros(0), metrics(nullptr), bufferPool(nullptr),
+                                             consideredOpen(false), replyPending(false), driverReserves(false) {}
         void flush() override;
         void close() override;
         uint8_t readByte() override;
@@ -80,6 +163,32 @@ namespace tcremote {
 
         void setClient(socket_t client);
 
+        /**
+         * Sets the metrics that websocket frames on this transport are recorded in, see TcWebMetrics.h
+         * @param webMetrics the metrics, or nullptr to stop recording
+         */
+        void setMetrics(WebServerMetrics* webMetrics) { metrics = webMetrics; }
+
+        /**
+         * Reads data from the connection, first taking anything left over in the read ahead buffer, then from the
+         * socket. All reads for both HTTP and websocket must go through here so that bytes belonging to a pipelined
+         * request are not lost.
+         * @param data the buffer to read into
+         * @param dataLen the maximum number of bytes to read
+         * @return the number of bytes read (could be 0), or -1 for an error.
+         */
+        int readFromConnection(uint8_t* data, size_t dataLen);
+
+        /**
+         * @return true if there is data in the read ahead buffer or on the socket waiting to be read.
+         */
+        bool isReadReady() { return readAheadPosition < readAheadAvail || rawReadAvailable(clientFd); }
+
+        /**
+         * @return the value of millis() when data was last read from the socket
+         */
+        unsigned long getLastReadMillis() const { return lastReadMillis; }
+
         int writeChar(char data) override;
         int writeStr(const char *data) override;
 
@@ -88,17 +197,45 @@ namespace tcremote {
 
         bool connected() override;
 
+        /**
+         * Makes sure this transport holds a read buffer, leasing one from the pool when it does not. Transports that
+         * own their buffers always have one.
+         * @return true if there is a read buffer, false if the pool is empty and the work should wait.
+         */
+        bool acquireReadBuffer() { return readBuffer || (readBuffer = bufferPool->lease()) != nullptr; }
+
+        /**
+         * Makes sure this transport holds a write buffer, leasing one from the pool when it does not.
+         * @return true if there is a write buffer, false if the pool is empty and the work should wait.
+         */
+        bool acquireWriteBuffer() { return writeBuffer || (writeBuffer = bufferPool->lease()) != nullptr; }
+
+        /**
+         * Gives any leased buffers back to the pool, called whenever the connection becomes idle. Does nothing when
+         * the transport owns its buffers, or when a websocket frame is part way through being read or built.
+         */
+        void releaseBuffers();
+
+        /** @return true if the buffers are leased from a pool rather than owned */
+        bool isPooled() const { return bufferPool != nullptr; }
+
         void setState(WebSocketTransportState state) { currentState = state;}
         size_t getReadBufferSize() const { return bufferSize; }
+        /** @return the read buffer, only valid while processing a request, or after acquireReadBuffer returns true */
         uint8_t* getReadBuffer() { return readBuffer; }
         size_t getWriteBufferSize() const { return bufferSize; }
-        uint8_t* getWriteBuffer() { return writeBuffer; }
+        /** @return the write buffer, leasing it from the pool if needed, this is nullptr if the pool is empty */
+        uint8_t* getWriteBuffer() { return acquireWriteBuffer() ? writeBuffer : nullptr; }
         socket_t getClientFd() { return clientFd; }
     private:
+        uint8_t* frameForNextChar();
         void sendMessageOnWire(WebSocketOpcode opcode, uint8_t* buffer, size_t size);
     };
 
     typedef void (*WebPageHandler)(WebServerResponse&);
+#if defined(WS_COROUTINE_HANDLERS)
+    typedef WebCoroutine (*WebCoroutineHandler)(WebServerResponse&);
+#endif
 
     class UrlWithHandler {
     private:
@@ -106,44 +243,273 @@ namespace tcremote {
         WebServerMethod handlerMethod;
         const char* handlerUrl;
         WebPageHandler handlerFn;
+        WebContentVersionFn versionFn = nullptr;
+        uint16_t cacheTtl = 0;
+        bool cached = false;
+#if defined(WS_COROUTINE_HANDLERS)
+        WebCoroutineHandler coroutineFn = nullptr;
+#endif
     public:
         UrlWithHandler() : index(-1), handlerMethod(GET), handlerUrl(nullptr), handlerFn(nullptr) {}
         UrlWithHandler(uint16_t idx, WebServerMethod method, const char* url, WebPageHandler handler) : index(idx), handlerMethod(method), handlerUrl(url), handlerFn(handler) {}
+#if defined(WS_COROUTINE_HANDLERS)
+        UrlWithHandler(uint16_t idx, WebServerMethod method, const char* url, WebCoroutineHandler handler) : index(idx), handlerMethod(method), handlerUrl(url), handlerFn(nullptr), coroutineFn(handler) {}
+#endif
+        UrlWithHandler(uint16_t idx, const char* url, WebPageHandler handler, WebContentVersionFn version, uint16_t ttl)
+                : index(idx), handlerMethod(GET), handlerUrl(url), handlerFn(handler), versionFn(version), cacheTtl(ttl), cached(true) {}
         UrlWithHandler(const UrlWithHandler& other) = default;
         UrlWithHandler& operator= (const UrlWithHandler& other) = default;
         uint16_t getKey() const { return index; }
+        const char* getUrl() const { return handlerUrl; }
+        bool isCached() const { return cached; }
+        WebContentVersionFn getVersionFn() const { return versionFn; }
+        uint16_t getCacheTtl() const { return cacheTtl; }
 
-        bool isRequestCompatible(const char* url, WebServerMethod method) { return handlerUrl && strcmp(url, handlerUrl) == 0 && method == handlerMethod; }
-        void handleUrl(WebServerResponse& response) { handlerFn(response); }
+        /**
+         * Checks if this handler is for the URL and method provided, a handler URL ending with * matches any URL that
+         * starts with the text before the *, see WebServerResponse::getPathParameter.
+         */
+        bool isRequestCompatible(const char* url, WebServerMethod method) {
+            if(!handlerUrl || method != handlerMethod) return false;
+            size_t len = strlen(handlerUrl);
+            if(len > 0 && handlerUrl[len - 1] == '*') return strncmp(url, handlerUrl, len - 1) == 0;
+            return strcmp(url, handlerUrl) == 0;
+        }
+
+        /**
+         * @return the part of the URL that matched the wildcard, only valid when isRequestCompatible returned true
+         */
+        const char* wildcardPart(const char* url) {
+            size_t len = strlen(handlerUrl);
+            return (len > 0 && handlerUrl[len - 1] == '*') ? &url[len - 1] : "";
+        }
+        void handleUrl(WebServerResponse& response) {
+#if defined(WS_COROUTINE_HANDLERS)
+            if(coroutineFn) {
+                response.startCoroutine(coroutineFn(response));
+                return;
+            }
+#endif
+            handlerFn(response);
+        }
     };
 
+    /**
+     * An accepted connection that is waiting for a response slot, along with when it was queued.
+     */
+    struct WaitingConnection {
+        socket_t clientFd;
+        unsigned long queuedAt;
+    };
+
+    /**
+     * The web server itself, it accepts connections and passes them to a free response object for processing. When
+     * all responses are busy, connections wait in a backlog of WS_CONNECTION_BACKLOG for up to
+     * WS_MAX_QUEUE_WAIT_MILLIS, the least recently used idle keep alive connection is closed to make room for them.
+     * Connections that cannot be queued or wait too long are immediately sent a 503 response and closed. All the
+     * connection deadlines are kept in a single timer wheel that is advanced by this event.
+     *
+     * This event is the reactor for all connections, the driver tells us when a socket is ready and the matching
+     * response is marked ready, then ready responses are serviced in round-robin order so that no connection is
+     * always served first. Only this one task is registered with task manager regardless of the number of responses.
+     */
     class TcMenuLightweightWebServer : public BaseEvent {
     protected:
         int numConcurrent;
         WebServerResponse* responses[MAX_WEBSERVER_RESPONSES];
         BtreeList<uint16_t, UrlWithHandler> urlHandlers;
         bool socketInitialised;
-        GenericCircularBuffer<socket_t> connectionsWaiting;
+        WaitingConnection connectionsWaiting[WS_CONNECTION_BACKLOG];
+        uint8_t waitingFirst = 0;
+        uint8_t waitingCount = 0;
+        TimerWheel timerWheel;
+        WebResponseCache* responseCache = nullptr;
+        WebServerMetrics* metrics = nullptr;
+        unsigned long lastPollMillis = 0;
+        uint8_t roundRobinNext = 0;
         int port;
         taskid_t wsTaskId = TASKMGR_INVALIDID;
+        bool responsesOwned = false;
+        bool servicing = false;
+
+        /**
+         * For subclasses that provide their own responses, they must fill in the responses array before init.
+         * @param port the port to listen on
+         * @param numConcurrent the number of responses that the subclass provides
+         */
+        TcMenuLightweightWebServer(int port, int numConcurrent);
     public:
-        explicit TcMenuLightweightWebServer(int port, int numConcurrent, bool keepConOpen);
+        /**
+         * Creates a web server with a number of concurrent responses, each with its own transport.
+         * @param port the port to listen on
+         * @param numConcurrent the number of connections that can be served at once
+         * @param keepConOpen true to keep connections open between requests
+         * @param bufferPool optionally a pool that the transports lease their buffers from, see TcWebBufferPool.h,
+         *                   otherwise each transport allocates its own.
+         */
+        explicit TcMenuLightweightWebServer(int port, int numConcurrent, bool keepConOpen, WebBufferPool* bufferPool = nullptr);
         ~TcMenuLightweightWebServer() override;
 
         void init();
         void exec() override;
+
+        /**
+         * @return true while the reactor is servicing connections, a task that runs when the server yields must not
+         * write to any response until this is false again.
+         */
+        bool isServicing() const { return servicing; }
+
         uint32_t timeOfNextCheck() override;
         void pushClientSocket(socket_t socketIncoming);
 
+        /**
+         * Called by the driver when a socket may be ready, marks the response serving that socket as ready and wakes
+         * the reactor. Safe to call from the driver's context.
+         * @param clientFd the socket that is ready
+         */
+        void socketReady(socket_t clientFd);
+
         void onUrlGet(const char* url, WebPageHandler pageHandler) { urlHandlers.add(UrlWithHandler(urlHandlers.count(), GET, url, pageHandler));}
         void onUrlPost(const char* url, WebPageHandler pageHandler) { urlHandlers.add(UrlWithHandler(urlHandlers.count(), POST, url, pageHandler)); }
 
+        /**
+         * Register a GET handler whose output is held in the response cache, see TcWebResponseCache.h. Repeat requests
+         * within the ttl are served from the cache, after that the version function is called and the cached content
+         * is still used when the version has not changed. Clients that send the current version in If-None-Match get
+         * a 304 response. The cache is allocated when the first cached handler is registered.
+         * @param url the URL to handle
+         * @param pageHandler the handler that renders the content
+         * @param versionFn returns the current version of the content, or nullptr to only cache for the ttl without an ETag
+         * @param ttlMillis how long the cached content is used before checking the version again
+         */
+        void onUrlGetCached(const char* url, WebPageHandler pageHandler, WebContentVersionFn versionFn, uint16_t ttlMillis = WS_RESPONSE_CACHE_TTL_MILLIS);
+
+        /**
+         * @return the response cache, or nullptr when no cached handlers have been registered.
+         */
+        WebResponseCache* getResponseCache() { return responseCache; }
+
+        /**
+         * Turns on the latency metrics described in TcWebMetrics.h and serves them in Prometheus text format from
+         * the URL provided. The metrics are allocated when this is called, call it before init.
+         * @param url the URL to serve the metrics from
+         */
+        void enableMetrics(const char* url = "/metrics");
+
+        /**
+         * @return the metrics, or nullptr when they have not been enabled.
+         */
+        WebServerMetrics* getMetrics() { return metrics; }
+
+        /**
+         * Records the metrics for a request once its handler has returned, or its coroutine has completed.
+         * @param response the response that handled the request
+         */
+        void recordRequestMetrics(WebServerResponse& response) {
+            if(metrics) metrics->recordRequest(response.getHandlerRoute(), response.getTimeToFirstByte(),
+                                               response.getHandlerMicros(), response.getContentBytesSent());
+        }
+
+#if defined(WS_COROUTINE_HANDLERS)
+        /**
+         * Register a coroutine handler for GET requests on a URL, see WebCoroutine.
+         * @param url the URL to handle
+         * @param pageHandler the coroutine handler
+         */
+        void onUrlGetAsync(const char* url, WebCoroutineHandler pageHandler) { urlHandlers.add(UrlWithHandler(urlHandlers.count(), GET, url, pageHandler));}
+        /**
+         * Register a coroutine handler for POST requests on a URL, see WebCoroutine.
+         * @param url the URL to handle
+         * @param pageHandler the coroutine handler
+         */
+        void onUrlPostAsync(const char* url, WebCoroutineHandler pageHandler) { urlHandlers.add(UrlWithHandler(urlHandlers.count(), POST, url, pageHandler)); }
+#endif
+
         bool isInitialised() const { return socketInitialised; }
-        bool attemptToHandleRequest(WebServerResponse& method, const char* url);
+        /**
+         * Finds the handler for a request once its request line has been read, when there is none a 404 is sent.
+         * @param response the response for the request
+         * @param url the URL that was requested
+         * @return true if a handler matched, it is then called by attemptToHandleRequest once the headers are read
+         */
+        bool matchRequest(WebServerResponse& response, const char* url);
+
+        /**
+         * Calls the handler found by matchRequest once all the request headers have been read.
+         * @param response the response for the request
+         * @return true if the connection should be kept open for another request
+         */
+        bool attemptToHandleRequest(WebServerResponse& response);
         virtual void sendErrorCode(WebServerResponse* response, int errorCode);
 
         WebServerResponse *nextAvailableResponse();
+
+        /**
+         * Closes the least recently used keep alive connection that is idle, to make room for a new connection. When
+         * there are no idle keep alive connections, the least recently used event stream is closed instead.
+         * @return the response that is now free, or nullptr if no connection was idle.
+         */
+        WebServerResponse *evictIdleConnection();
+
+        /**
+         * Sends a canned 503 response to a connection that cannot be served because of overload, and closes it.
+         * @param clientFd the socket to reject
+         */
+        virtual void rejectConnection(socket_t clientFd);
+    private:
+        void admitWaitingConnections();
+    public:
         WebServerResponse* getWebResponse(int num) { return responses[num]; }
+        int getResponseCount() const { return numConcurrent; }
+        TimerWheel& getTimerWheel() { return timerWheel; }
+    };
+
+    /**
+     * A web server whose responses, transports and buffers are all held in one contiguous block within the server
+     * object itself, instead of being allocated one at a time on the heap when it is constructed. Declare it as a
+     * global, and the memory it needs is then known at link time and the heap is not fragmented at startup.
+     * Otherwise it works exactly as TcMenuLightweightWebServer.
+     *
+     *     TcMenuStaticWebServer<4, 125> webServer(80, true);
+     *
+     * @tparam Slots the number of concurrent responses, at most MAX_WEBSERVER_RESPONSES
+     * @tparam BufferSize the size of the read and write buffers for each connection, at most 255
+     */
+    template<int Slots, int BufferSize = 125>
+    class TcMenuStaticWebServer : public TcMenuLightweightWebServer {
+        static_assert(Slots > 0 && Slots <= MAX_WEBSERVER_RESPONSES, "Slots must be between 1 and MAX_WEBSERVER_RESPONSES");
+        static_assert(BufferSize > 0 && BufferSize <= 255, "BufferSize must be between 1 and 255");
+    private:
+        struct WebServerSlot {
+            TcMenuWebServerTransport transport;
+            WebServerResponse response;
+            uint8_t readBuffer[BufferSize];
+            uint8_t writeBuffer[BufferSize];
+
+            WebServerSlot(TcMenuLightweightWebServer* server, WebServerResponse::WSRConnectionType conType)
+                    : transport(writeBuffer, readBuffer, BufferSize), response(server, &transport, conType) {}
+        };
+
+        // the slots cannot be default constructed, so they are constructed in place by the constructor.
+        union SlotArena {
+            WebServerSlot slots[Slots];
+            SlotArena() {}
+            ~SlotArena() {}
+        } arena;
+    public:
+        TcMenuStaticWebServer(int port, bool keepConOpen) : TcMenuLightweightWebServer(port, Slots) {
+            auto conType = keepConOpen ? WebServerResponse::KEEP_REQ_OPEN : WebServerResponse::CLOSE_AFTER_RESPONSE;
+            for(int i = 0; i < Slots; i++) {
+                new (&arena.slots[i]) WebServerSlot(this, conType);
+                responses[i] = &arena.slots[i].response;
+            }
+        }
+
+        ~TcMenuStaticWebServer() override {
+            for(int i = 0; i < Slots; i++) {
+                arena.slots[i].~WebServerSlot();
+            }
+        }
     };
 }
 
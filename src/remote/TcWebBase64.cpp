@@ -1,65 +1,111 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
 /**
  * When a websocket is upgraded from HTTP to WS protocol, it must answer with a security key, this is made up of the
- * key provided, this UUID, turned into a sha1 and base64 encoded.
+ * key provided, this UUID, turned into a sha1 and base64 encoded. The decoder is used for basic authentication and
+ * binary data sent in request bodies.
  */
 
 #include "PlatformDetermination.h"
+#include "TcWebBase64.h"
 
 namespace tc_b64 {
-    /**
-     * A lightweight base 64 facility that takes in some data and writes out base 64 into the buffer
-     * @param data input data
-     * @param dataSize input data size
-     * @param buffer the buffer to write to
-     * @param bufferSize buffer size
-     * @return the number of bytes written.
-     */
-    int base64(const uint8_t *data, int dataSize, uint8_t *buffer, int bufferSize);
-}
+    const char b64Dictionary[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-namespace tc_b64 {
-    const char *b64Dictionary = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    // maps the first 128 characters back to their 6 bit value, 0xff marks a character that is not in the alphabet.
+    const uint8_t b64DecodeTable[128] PROGMEM = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+        0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff
+    };
 
-    void innerBase64(const uint8_t *data, int size, uint8_t *buffer) {
-        if (size == 3) {
-            buffer[0] = b64Dictionary[data[0] >> 2];
-            buffer[1] = b64Dictionary[(data[0] & 0x3) << 4 | (data[1] >> 4)];
-            buffer[2] = b64Dictionary[(data[1] & 0x0F) << 2 | (data[2] >> 6)];
-            buffer[3] = b64Dictionary[data[2] & 0x3F];
-        } else if (size == 2) {
-            buffer[0] = b64Dictionary[data[0] >> 2];
-            buffer[1] = b64Dictionary[(data[0] & 0x3) << 4 | (data[1] >> 4)];
-            buffer[2] = b64Dictionary[(data[1] & 0x0F) << 2];
-            buffer[3] = '=';
-        } else if (size == 1) {
-            buffer[0] = b64Dictionary[data[0] >> 2];
-            buffer[1] = b64Dictionary[(data[0] & 0x3) << 4];
-            buffer[2] = '=';
-            buffer[3] = '=';
-        }
+    inline uint8_t encodeChar(uint32_t value) {
+        return pgm_read_byte(&b64Dictionary[value & 0x3f]);
+    }
+
+    inline uint8_t decodeChar(uint8_t ch) {
+        return (ch & 0x80) ? 0xff : pgm_read_byte(&b64DecodeTable[ch]);
     }
 
     int base64(const uint8_t *data, int dataSize, uint8_t *buffer, int bufferSize) {
-        // If we get here we've got enough space to do the encoding
+        if(dataSize < 0 || BASE64_ENCODED_SIZE(dataSize) >= bufferSize) return -1;
+
+        // each whole group of three bytes is packed into a 24 bit word and written as four characters.
+        uint8_t* out = buffer;
+        int wholeGroups = dataSize / 3;
+        for(int i = 0; i < wholeGroups; i++) {
+            uint32_t group = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+            out[0] = encodeChar(group >> 18);
+            out[1] = encodeChar(group >> 12);
+            out[2] = encodeChar(group >> 6);
+            out[3] = encodeChar(group);
+            data += 3;
+            out += 4;
+        }
 
-        int writtenBytes = 0;
-        // Break the input into 3-byte chunks and process each of them
-        int i;
-        for (i = 0; i < dataSize / 3; i++) {
-            writtenBytes += 4;
-            if(writtenBytes >= bufferSize) return -1;
-            innerBase64(&data[i * 3], 3, &buffer[i * 4]);
+        // then any partial group at the end is padded out.
+        int remaining = dataSize - (wholeGroups * 3);
+        if(remaining != 0) {
+            uint32_t group = (uint32_t)data[0] << 16;
+            if(remaining == 2) group |= (uint32_t)data[1] << 8;
+            out[0] = encodeChar(group >> 18);
+            out[1] = encodeChar(group >> 12);
+            out[2] = (remaining == 2) ? encodeChar(group >> 6) : '=';
+            out[3] = '=';
+            out += 4;
         }
-        if (dataSize % 3 > 0) {
-            writtenBytes += 4;
-            // It doesn't fit neatly into a 3-byte chunk, so process what's left
-            innerBase64(&data[i * 3], dataSize % 3, &buffer[i * 4]);
+
+        *out = 0;
+        return (int)(out - buffer);
+    }
+
+    int base64Decode(const char *encoded, size_t encodedSize, uint8_t *buffer, size_t bufferSize) {
+        if((encodedSize % 4) != 0) return -1;
+        if(encodedSize == 0) return 0;
+
+        size_t padding = 0;
+        if(encoded[encodedSize - 1] == '=') padding = (encoded[encodedSize - 2] == '=') ? 2 : 1;
+        size_t decodedSize = ((encodedSize / 4) * 3) - padding;
+        if(decodedSize > bufferSize) return -1;
+
+        // any character outside the alphabet has the top bit set, so a whole group is checked with a single test.
+        auto in = (const uint8_t*)encoded;
+        uint8_t* out = buffer;
+        size_t wholeGroups = (encodedSize / 4) - (padding ? 1 : 0);
+        for(size_t i = 0; i < wholeGroups; i++) {
+            uint8_t a = decodeChar(in[0]);
+            uint8_t b = decodeChar(in[1]);
+            uint8_t c = decodeChar(in[2]);
+            uint8_t d = decodeChar(in[3]);
+            if((a | b | c | d) & 0x80) return -1;
+            uint32_t group = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+            out[0] = (uint8_t)(group >> 16);
+            out[1] = (uint8_t)(group >> 8);
+            out[2] = (uint8_t)group;
+            in += 4;
+            out += 3;
         }
 
-        if(writtenBytes < bufferSize) {
-            buffer[writtenBytes] = 0;
+        if(padding != 0) {
+            uint8_t a = decodeChar(in[0]);
+            uint8_t b = decodeChar(in[1]);
+            uint8_t c = (padding == 1) ? decodeChar(in[2]) : 0;
+            if((a | b | c) & 0x80) return -1;
+            uint32_t group = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6);
+            // the unused bits in the last character must be zero, otherwise the text is not valid base 64.
+            if((group & (padding == 1 ? 0xffU : 0xffffU)) != 0) return -1;
+            out[0] = (uint8_t)(group >> 16);
+            if(padding == 1) out[1] = (uint8_t)(group >> 8);
         }
-        return writtenBytes;
+
+        return (int)decodedSize;
     }
 }
-
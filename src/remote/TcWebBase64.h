@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebBase64.h
+ *
+ * Base 64 encoding and decoding using the standard alphabet with padding, as used by the websocket handshake, basic
+ * authentication headers and binary payloads embedded in request bodies. Both directions are table driven, handling
+ * a whole group of three bytes and four characters at a time, with any partial group dealt with once at the end.
+ */
+
+#ifndef TCMENU_TCWEBBASE64_H
+#define TCMENU_TCWEBBASE64_H
+
+#include <Arduino.h>
+
+/**
+ * @return the number of characters needed to base 64 encode a number of bytes, not including the terminator.
+ */
+#define BASE64_ENCODED_SIZE(bytes) ((((bytes) + 2) / 3) * 4)
+
+namespace tc_b64 {
+    /**
+     * A lightweight base 64 facility that takes in some data and writes out base 64 into the buffer, the output is
+     * always zero terminated, so the buffer must have room for BASE64_ENCODED_SIZE(dataSize) + 1 characters.
+     * @param data input data
+     * @param dataSize input data size
+     * @param buffer the buffer to write to
+     * @param bufferSize buffer size
+     * @return the number of bytes written not including the terminator, or -1 if the buffer is too small.
+     */
+    int base64(const uint8_t *data, int dataSize, uint8_t *buffer, int bufferSize);
+
+    /**
+     * Decodes base 64 text into the buffer provided, validating it as it goes. The text must be a multiple of four
+     * characters, only use the standard alphabet, and only have padding at the end. It does not need to be zero
+     * terminated, and can be decoded in place as the output is always shorter than the input.
+     * @param encoded the base 64 text
+     * @param encodedSize the number of characters of text
+     * @param buffer the buffer to write the decoded bytes to
+     * @param bufferSize the size of the buffer
+     * @return the number of bytes decoded, or -1 if the text is not valid or the buffer is too small.
+     */
+    int base64Decode(const char *encoded, size_t encodedSize, uint8_t *buffer, size_t bufferSize);
+}
+
+#endif //TCMENU_TCWEBBASE64_H
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "TcWebBufferPool.h"
+
+using namespace tcremote;
+
+WebBufferPool::WebBufferPool(uint8_t count, uint8_t size) : bufferCount(count), bufferSize(size) {
+    if(bufferCount > WS_BUFFER_POOL_MAX_BUFFERS) bufferCount = WS_BUFFER_POOL_MAX_BUFFERS;
+    storage = new uint8_t[bufferCount * bufferSize];
+    freeMask = (bufferCount == 32) ? 0xffffffffUL : ((1UL << bufferCount) - 1);
+}
+
+WebBufferPool::~WebBufferPool() {
+    delete[] storage;
+}
+
+uint8_t* WebBufferPool::lease() {
+    if(freeMask == 0) {
+        exhaustedCount++;
+        return nullptr;
+    }
+    int idx = __builtin_ctz(freeMask);
+    freeMask &= ~(1UL << idx);
+    leaseCount++;
+    leased++;
+    if(leased > peakLeased) peakLeased = leased;
+    return &storage[idx * bufferSize];
+}
+
+void WebBufferPool::release(uint8_t* buffer) {
+    if(buffer < storage || buffer >= &storage[bufferCount * bufferSize]) return;
+    auto bit = 1UL << ((buffer - storage) / bufferSize);
+    if(freeMask & bit) return; // already back in the pool
+    freeMask |= bit;
+    leased--;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebBufferPool.h
+ *
+ * A pool of read and write buffers shared between all the connections of a web server. Without a pool every
+ * connection owns its two buffers for its whole life, even while it is an idle keep alive or not in use at all. With a
+ * pool, a connection only leases a buffer while it has a request to parse or a websocket frame to read or build, and
+ * gives it back as soon as it is idle again, so many more connections can be held open in the same RAM.
+ *
+ * When the pool is empty, work waits rather than fails. A request is left in the socket until a buffer is free, a
+ * websocket reports no data available to read, and a websocket transport reports that it is not available for
+ * writing, so the remote connection holds back its updates. The pool records how many buffers have ever been leased
+ * at once, and how often it was empty, so that it can be sized from a real workload.
+ */
+
+#ifndef TCMENU_TCWEBBUFFERPOOL_H
+#define TCMENU_TCWEBBUFFERPOOL_H
+
+#include <Arduino.h>
+
+// The largest number of buffers a pool can hold, free buffers are tracked in a 32 bit mask.
+#define WS_BUFFER_POOL_MAX_BUFFERS 32
+
+namespace tcremote {
+
+    /**
+     * A fixed number of equally sized buffers, allocated together in one block when the pool is created. Pass the
+     * pool to the web server's constructor, it then creates its transports without buffers of their own. The pool
+     * must only be used from task manager context.
+     */
+    class WebBufferPool {
+    private:
+        uint8_t* storage;
+        uint32_t freeMask;
+        uint32_t leaseCount = 0;
+        uint32_t exhaustedCount = 0;
+        uint8_t bufferCount;
+        uint8_t bufferSize;
+        uint8_t leased = 0;
+        uint8_t peakLeased = 0;
+    public:
+        /**
+         * Creates the pool and allocates all of its buffers in one go.
+         * @param count the number of buffers, at most WS_BUFFER_POOL_MAX_BUFFERS, usually about twice the number of
+         *              connections that are expected to be busy at the same time
+         * @param size the size of each buffer, this becomes the read and write buffer size of every transport
+         */
+        WebBufferPool(uint8_t count, uint8_t size);
+        ~WebBufferPool();
+
+        WebBufferPool(const WebBufferPool&) = delete;
+        WebBufferPool& operator=(const WebBufferPool&) = delete;
+
+        /**
+         * Takes a buffer from the pool
+         * @return the buffer, or nullptr if every buffer is leased.
+         */
+        uint8_t* lease();
+
+        /**
+         * Gives a buffer back to the pool, it must have come from lease on this pool.
+         * @param buffer the buffer to return
+         */
+        void release(uint8_t* buffer);
+
+        /** @return true if there is at least one buffer that can be leased */
+        bool hasFree() const { return freeMask != 0; }
+        /** @return the size of each buffer */
+        uint8_t getBufferSize() const { return bufferSize; }
+        /** @return the number of buffers in the pool */
+        uint8_t getBufferCount() const { return bufferCount; }
+        /** @return the number of buffers leased right now */
+        uint8_t getLeasedCount() const { return leased; }
+        /** @return the most buffers that have been leased at the same time */
+        uint8_t getPeakLeased() const { return peakLeased; }
+        /** @return the number of successful leases */
+        uint32_t getLeaseCount() const { return leaseCount; }
+        /** @return the number of times a lease was asked for when the pool was empty */
+        uint32_t getExhaustedCount() const { return exhaustedCount; }
+    };
+}
+
+#endif //TCMENU_TCWEBBUFFERPOOL_H
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "TcWebContentSource.h"
+
+using namespace tcremote;
+
+int MemoryContentSource::readAt(size_t offset, uint8_t* buffer, size_t len) {
+    if(offset >= length) return 0;
+    if(len > length - offset) len = length - offset;
+    memcpy(buffer, &data[offset], len);
+    return (int)len;
+}
+
+int ProgramMemoryContentSource::readAt(size_t offset, uint8_t* buffer, size_t len) {
+    if(offset >= length) return 0;
+    if(len > length - offset) len = length - offset;
+    memcpy_P(buffer, &data[offset], len);
+    return (int)len;
+}
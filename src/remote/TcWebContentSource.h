@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebContentSource.h
+ *
+ * Content sources let a handler hand the body of a response to the web server instead of sending it itself. The
+ * handler writes the headers, attaches a source with WebServerResponse::streamContent and returns straight away. From
+ * then on, each time the socket can take more data, the server asks the source to read the next part of the body
+ * directly into the driver's write buffer, much like sendfile. Large assets on flash or an SD card are then served a
+ * piece at a time as the client takes them, without holding up task manager while the whole file is written.
+ */
+
+#ifndef TCMENU_TCWEBCONTENTSOURCE_H
+#define TCMENU_TCWEBCONTENTSOURCE_H
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+#if !defined(__AVR__)
+#include <stdio.h>
+#endif
+
+namespace tcremote {
+
+    /**
+     * A body that the web server reads from as the socket drains, see the file documentation. The source must stay
+     * valid until finished is called on it, which happens once the body has been sent or the connection closed.
+     */
+    class WebContentSource {
+    public:
+        virtual ~WebContentSource() = default;
+
+        /**
+         * @return the total length of the content in bytes, this is called once when streaming starts.
+         */
+        virtual size_t getLength() = 0;
+
+        /**
+         * Reads part of the content into the buffer provided, the server reads forwards through the content so
+         * sources that must seek can skip it when the offset follows on from the last read.
+         * @param offset the position in the content to read from
+         * @param buffer where to put the data
+         * @param len the most that can be read
+         * @return the number of bytes read, zero or less indicates an error and the connection is closed.
+         */
+        virtual int readAt(size_t offset, uint8_t* buffer, size_t len) = 0;
+
+        /**
+         * Called once when the server no longer needs the source, for example to close a file.
+         * @param completed true if all of the content was sent, false if the connection closed first.
+         */
+        virtual void finished(bool /*completed*/) {}
+    };
+
+    /**
+     * Streams content that is in RAM, or any memory that can be read directly, the memory must not change until
+     * streaming has finished.
+     */
+    class MemoryContentSource : public WebContentSource {
+    private:
+        const uint8_t* data;
+        size_t length;
+    public:
+        MemoryContentSource(const uint8_t* data, size_t length) : data(data), length(length) {}
+        size_t getLength() override { return length; }
+        int readAt(size_t offset, uint8_t* buffer, size_t len) override;
+    };
+
+    /**
+     * Streams content that is stored in program memory, such as a page declared with PROGMEM, it is copied out with
+     * memcpy_P so it works on boards where flash cannot be read directly.
+     */
+    class ProgramMemoryContentSource : public WebContentSource {
+    private:
+        const uint8_t* data;
+        size_t length;
+    public:
+        ProgramMemoryContentSource(const uint8_t* data, size_t length) : data(data), length(length) {}
+        size_t getLength() override { return length; }
+        int readAt(size_t offset, uint8_t* buffer, size_t len) override;
+    };
+
+    /**
+     * Streams an open file, the file type needs size(), seek(position), read(buffer, len) and close() as provided
+     * by the File classes of the Arduino SD and ESP32 file system libraries. The file is closed when streaming
+     * finishes. For example, an SD card asset could be served with:
+     *
+     * ```
+     * FileContentSource<File> source(SD.open("/index.htm"));
+     * ```
+     *
+     * @tparam F the file type, it is held by value as Arduino file classes are handles.
+     */
+    template<class F> class FileContentSource : public WebContentSource {
+    private:
+        F file;
+        size_t filePosition = SIZE_MAX; // not known until the first read, which therefore always seeks.
+    public:
+        explicit FileContentSource(F file) : file(file) {}
+
+        size_t getLength() override { return file.size(); }
+
+        int readAt(size_t offset, uint8_t* buffer, size_t len) override {
+            if(offset != filePosition) {
+                if(!file.seek(offset)) return -1;
+                filePosition = offset;
+            }
+            int actual = (int)file.read(buffer, len);
+            if(actual > 0) filePosition += actual;
+            return actual;
+        }
+
+        void finished(bool) override { file.close(); }
+
+        /** @return the file being streamed */
+        F& getFile() { return file; }
+    };
+
+#if !defined(__AVR__)
+    /**
+     * Gives a stdio FILE the same shape as an Arduino file, so that FileContentSource can stream it. This is mainly
+     * for boards with a POSIX style file system, and for testing on a desktop.
+     */
+    class StdioFile {
+    private:
+        FILE* fp;
+    public:
+        explicit StdioFile(FILE* fp) : fp(fp) {}
+
+        size_t size() {
+            if(!fp) return 0;
+            // a file that cannot be measured, such as a pipe, is given as empty rather than a huge length.
+            long position = ftell(fp);
+            if(position < 0 || fseek(fp, 0, SEEK_END) != 0) return 0;
+            long len = ftell(fp);
+            if(fseek(fp, position, SEEK_SET) != 0) return 0;
+            return len > 0 ? (size_t)len : 0;
+        }
+
+        bool seek(size_t position) { return fp && fseek(fp, (long)position, SEEK_SET) == 0; }
+        int read(uint8_t* buffer, size_t len) { return fp ? (int)fread(buffer, 1, len, fp) : -1; }
+
+        void close() {
+            if(fp) fclose(fp);
+            fp = nullptr;
+        }
+
+        bool isOpen() const { return fp != nullptr; }
+    };
+#endif
+}
+
+#endif //TCMENU_TCWEBCONTENTSOURCE_H
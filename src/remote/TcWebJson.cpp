@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "PlatformDetermination.h"
+#include "TcWebJson.h"
+#include "TcMenuWebServer.h"
+
+using namespace tcremote;
+
+JsonStreamWriter::JsonStreamWriter(WebServerResponse& response)
+        : response(&response), buffer(nullptr), bufferSize(0), position(0), needComma(false), failed(false),
+          inChunk(response.isChunked()) {
+    // chunked content is gathered in the write buffer by the response, so it is built straight into the chunk there,
+    // otherwise the write buffer is free to build it in. Either way, the buffer is only taken on the first write.
+}
+
+JsonStreamWriter::JsonStreamWriter(uint8_t* buffer, size_t bufferSize, WebServerResponse* response)
+        : response(response), buffer(buffer), bufferSize(bufferSize), position(0), needComma(false), failed(false),
+          inChunk(false) {}
+
+void JsonStreamWriter::writeChar(char ch) {
+    if(position >= bufferSize && !(flush() && takeBuffer())) return;
+    buffer[position++] = ch;
+}
+
+void JsonStreamWriter::writeRaw(const char* data) {
+    while(*data) writeChar(*data++);
+}
+
+void JsonStreamWriter::writeEscaped(const char* data) {
+    writeChar('"');
+    while(*data) {
+        char ch = *data++;
+        if(ch == '"' || ch == '\\') {
+            writeChar('\\');
+            writeChar(ch);
+        } else if(ch == '\n') {
+            writeRaw("\\n");
+        } else if(ch == '\r') {
+            writeRaw("\\r");
+        } else if(ch == '\t') {
+            writeRaw("\\t");
+        } else if((uint8_t)ch < 0x20) {
+            // other control characters are written as unicode escapes
+            char sz[8];
+            strcpy(sz, "\\u00");
+            sz[4] = "0123456789abcdef"[(uint8_t)ch >> 4];
+            sz[5] = "0123456789abcdef"[ch & 0x0f];
+            sz[6] = 0;
+            writeRaw(sz);
+        } else {
+            writeChar(ch);
+        }
+    }
+    writeChar('"');
+}
+
+void JsonStreamWriter::separate() {
+    if(needComma) writeChar(',');
+    needComma = true;
+}
+
+void JsonStreamWriter::startObject() {
+    separate();
+    writeChar('{');
+    needComma = false;
+}
+
+void JsonStreamWriter::endObject() {
+    writeChar('}');
+    needComma = true;
+}
+
+void JsonStreamWriter::startArray() {
+    separate();
+    writeChar('[');
+    needComma = false;
+}
+
+void JsonStreamWriter::endArray() {
+    writeChar(']');
+    needComma = true;
+}
+
+void JsonStreamWriter::key(const char* name) {
+    separate();
+    writeEscaped(name);
+    writeChar(':');
+    needComma = false;
+}
+
+void JsonStreamWriter::stringValue(const char* value) {
+    separate();
+    writeEscaped(value);
+}
+
+void JsonStreamWriter::numberValue(long value) {
+    separate();
+    char sz[21]; // enough for a 64 bit long with its sign
+    ltoa(value, sz, 10);
+    writeRaw(sz);
+}
+
+void JsonStreamWriter::boolValue(bool value) {
+    separate();
+    writeRaw(value ? "true" : "false");
+}
+
+void JsonStreamWriter::nullValue() {
+    separate();
+    writeRaw("null");
+}
+
+bool JsonStreamWriter::flush() {
+    if(failed) return false;
+    if(response == nullptr) {
+        // with nothing to send to, the buffer can only be flushed when it is not full.
+        if(position >= bufferSize) failed = true;
+        return !failed;
+    }
+    if(inChunk) {
+        response->commitChunkSpace(position);
+        buffer = nullptr;
+        bufferSize = 0;
+    } else if(position > 0 && !response->send(buffer, position)) {
+        failed = true;
+    }
+    position = 0;
+    if(response->getMode() == WebServerResponse::NOT_IN_USE) failed = true;
+    return !failed;
+}
+
+bool JsonStreamWriter::takeBuffer() {
+    if(response == nullptr || bufferSize != 0) return true;
+    if(inChunk) {
+        buffer = response->reserveChunkSpace(bufferSize);
+    } else {
+        buffer = response->getTransport()->getWriteBuffer();
+        bufferSize = buffer ? response->getTransport()->getWriteBufferSize() : 0;
+    }
+    if(response->getMode() == WebServerResponse::NOT_IN_USE) {
+        failed = true;
+    } else if(bufferSize == 0) {
+        // no write buffer could be leased from the pool. Waiting for one would hold up the server task that frees
+        // them, so the response fails instead.
+        serlogF(SER_WARNING, "No buffer for JSON, closing");
+        response->closeConnection();
+        failed = true;
+    }
+    return !failed;
+}
+
+int JsonPullParser::readChar() {
+    if(pushedBack >= 0) {
+        int ch = pushedBack;
+        pushedBack = -1;
+        return ch;
+    }
+    if(text) {
+        if(*text == 0) return -1;
+        return (uint8_t)*text++;
+    }
+    uint8_t sz[1];
+    return response->readBody(sz, 1) == 1 ? sz[0] : -1;
+}
+
+int JsonPullParser::readNonSpace() {
+    int ch;
+    do {
+        ch = readChar();
+    } while(ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n');
+    return ch;
+}
+
+inline int jsonHexValue(int ch) {
+    if(ch >= '0' && ch <= '9') return ch - '0';
+    if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+bool JsonPullParser::readString(char* buffer, size_t bufferSize) {
+    size_t pos = 0;
+    while(true) {
+        int ch = readChar();
+        if(ch < 0) return false;
+        if(ch == '"') break;
+        if(ch == '\\') {
+            ch = readChar();
+            switch(ch) {
+                case 'n': ch = '\n'; break;
+                case 'r': ch = '\r'; break;
+                case 't': ch = '\t'; break;
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+                case 'u': {
+                    // only characters in the ascii range can be represented, others become a question mark.
+                    int value = 0;
+                    for(int i = 0; i < 4; i++) {
+                        int hex = jsonHexValue(readChar());
+                        if(hex < 0) return false;
+                        value = (value << 4) | hex;
+                    }
+                    ch = value < 0x80 ? value : '?';
+                    break;
+                }
+                case '"': case '\\': case '/': break;
+                default: return false;
+            }
+        }
+        if(pos < (bufferSize - 1)) buffer[pos++] = (char)ch;
+    }
+    buffer[pos] = 0;
+    return true;
+}
+
+bool JsonPullParser::readLiteral(const char* rest) {
+    while(*rest) {
+        if(readChar() != *rest++) return false;
+    }
+    return true;
+}
+
+JsonToken JsonPullParser::next(char* buffer, size_t bufferSize) {
+    buffer[0] = 0;
+    int ch = readNonSpace();
+    while(ch == ',') ch = readNonSpace();
+
+    switch(ch) {
+        case -1: return JSON_END;
+        case '{': return JSON_OBJECT_START;
+        case '}': return JSON_OBJECT_END;
+        case '[': return JSON_ARRAY_START;
+        case ']': return JSON_ARRAY_END;
+        case 't': return readLiteral("rue") ? JSON_TRUE : JSON_ERROR;
+        case 'f': return readLiteral("alse") ? JSON_FALSE : JSON_ERROR;
+        case 'n': return readLiteral("ull") ? JSON_NULL : JSON_ERROR;
+        case '"': {
+            if(!readString(buffer, bufferSize)) return JSON_ERROR;
+            // a string followed by a colon is the key of an object member.
+            int after = readNonSpace();
+            if(after == ':') return JSON_KEY;
+            if(after >= 0) pushedBack = after;
+            return JSON_STRING;
+        }
+        default:
+            if(ch == '-' || isdigit(ch)) {
+                size_t pos = 0;
+                while(ch == '-' || ch == '+' || ch == '.' || ch == 'e' || ch == 'E' || isdigit(ch)) {
+                    if(pos < (bufferSize - 1)) buffer[pos++] = (char)ch;
+                    ch = readChar();
+                }
+                buffer[pos] = 0;
+                if(ch >= 0) pushedBack = ch;
+                return JSON_NUMBER;
+            }
+            return JSON_ERROR;
+    }
+}
+
+bool JsonPullParser::skipValue(char* buffer, size_t bufferSize) {
+    int depth = 0;
+    do {
+        auto token = next(buffer, bufferSize);
+        if(token == JSON_END || token == JSON_ERROR) return false;
+        if(token == JSON_OBJECT_START || token == JSON_ARRAY_START) depth++;
+        else if(token == JSON_OBJECT_END || token == JSON_ARRAY_END) depth--;
+    } while(depth > 0);
+    return true;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebJson.h
+ *
+ * A very small streaming JSON writer and pull parser for use with the web server. Neither allocates any memory, the
+ * writer works within a buffer that is sent to the response each time it fills, and the parser reads one token at a
+ * time straight from the request body into a buffer provided by the caller.
+ */
+
+#ifndef TCMENU_TCWEBJSON_H
+#define TCMENU_TCWEBJSON_H
+
+#include "TcMenuHttpRequestProcessor.h"
+
+namespace tcremote {
+
+    /**
+     * Writes JSON into a buffer, sending the buffer to the response whenever it fills. Commas are added automatically
+     * between values, so you just call the start, end, key and value functions in document order. Usually the buffer is
+     * the transport's own write buffer, for chunked responses the JSON is built straight into the chunk being gathered
+     * there, so it is not copied again before it is sent.
+     */
+    class JsonStreamWriter {
+    private:
+        WebServerResponse* response;
+        uint8_t* buffer;
+        size_t bufferSize;
+        size_t position;
+        bool needComma;
+        bool failed;
+        bool inChunk;
+
+        void writeChar(char ch);
+        bool takeBuffer();
+        void writeRaw(const char* text);
+        void writeEscaped(const char* text);
+        void separate();
+    public:
+        /**
+         * Create a writer that streams into the response, using the transport's write buffer. When the transport
+         * leases from a buffer pool that is empty, the connection is closed and the writer reports failure.
+         * @param response the response to write to, the content must already be started with contentInfoChunked
+         */
+        explicit JsonStreamWriter(WebServerResponse& response);
+
+        /**
+         * Create a writer with a buffer of your own, if the response is null the output must fit in the buffer.
+         * @param buffer the buffer to write into
+         * @param bufferSize the size of the buffer
+         * @param response optionally the response to send to when the buffer fills
+         */
+        JsonStreamWriter(uint8_t* buffer, size_t bufferSize, WebServerResponse* response = nullptr);
+
+        void startObject();
+        void endObject();
+        void startArray();
+        void endArray();
+
+        /**
+         * Writes the key of an object member, it should be followed by a value, object or array.
+         * @param name the name of the key
+         */
+        void key(const char* name);
+
+        void stringValue(const char* value);
+        void numberValue(long value);
+        void boolValue(bool value);
+        void nullValue();
+
+        void field(const char* name, const char* value) { key(name); stringValue(value); }
+        void field(const char* name, long value) { key(name); numberValue(value); }
+        void boolField(const char* name, bool value) { key(name); boolValue(value); }
+
+        /**
+         * Sends anything in the buffer to the response, call before ending the response.
+         * @return true if all the output has been written successfully
+         */
+        bool flush();
+
+        /**
+         * @return the number of bytes in the buffer that have not yet been sent
+         */
+        size_t getBufferedLength() const { return position; }
+
+        /**
+         * @return true if a write to the response failed, or the buffer overflowed without a response
+         */
+        bool hasFailed() const { return failed; }
+    };
+
+    enum JsonToken {
+        JSON_OBJECT_START, JSON_OBJECT_END, JSON_ARRAY_START, JSON_ARRAY_END, JSON_KEY, JSON_STRING, JSON_NUMBER,
+        JSON_TRUE, JSON_FALSE, JSON_NULL, JSON_END, JSON_ERROR
+    };
+
+    /**
+     * A pull parser that reads JSON one token at a time, either from the body of a request or from text in memory.
+     * Separators are consumed silently, and a string that is followed by a colon is returned as a key. Text longer
+     * than the buffer provided is truncated.
+     */
+    class JsonPullParser {
+    private:
+        WebServerResponse* response;
+        const char* text;
+        int pushedBack;
+
+        int readChar();
+        int readNonSpace();
+        bool readString(char* buffer, size_t bufferSize);
+        bool readLiteral(const char* rest);
+    public:
+        /**
+         * Create a parser that reads the body of the request.
+         * @param response the response whose request body is read
+         */
+        explicit JsonPullParser(WebServerResponse& response) : response(&response), text(nullptr), pushedBack(-1) {}
+
+        /**
+         * Create a parser that reads JSON from text in memory.
+         * @param text the zero terminated JSON text
+         */
+        explicit JsonPullParser(const char* text) : response(nullptr), text(text), pushedBack(-1) {}
+
+        /**
+         * Reads the next token, for keys, strings and numbers the text is copied into the buffer.
+         * @param buffer the buffer to receive any text, always zero terminated
+         * @param bufferSize the size of the buffer
+         * @return the token that was read, JSON_END at the end of the input, or JSON_ERROR
+         */
+        JsonToken next(char* buffer, size_t bufferSize);
+
+        /**
+         * Skips over the value that follows a key, including whole objects and arrays.
+         * @param buffer scratch space for reading tokens
+         * @param bufferSize the size of the scratch space
+         * @return false if the input ended or was not valid
+         */
+        bool skipValue(char* buffer, size_t bufferSize);
+    };
+}
+
+#endif //TCMENU_TCWEBJSON_H
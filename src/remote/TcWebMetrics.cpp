@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "TcWebMetrics.h"
+#include "TcMenuHttpRequestProcessor.h"
+
+using namespace tcremote;
+
+static_assert(WS_METRICS_MAX_ROUTES >= 2, "WS_METRICS_MAX_ROUTES must leave room for the other route");
+
+const char metricsUnmatchedRoute[] = "unmatched";
+const char metricsOtherRoute[] = "other";
+
+WebRouteMetrics& WebServerMetrics::routeFor(const char* route) {
+    if(!route) route = metricsUnmatchedRoute;
+    for(int i = 0; i < WS_METRICS_MAX_ROUTES - 1; i++) {
+        auto& r = routes[i];
+        if(r.route == route) return r;
+        if(r.route == nullptr) {
+            r.route = route;
+            return r;
+        }
+    }
+    // the last entry is kept for the routes that did not fit, so they are not mixed up with one that did.
+    auto& other = routes[WS_METRICS_MAX_ROUTES - 1];
+    other.route = metricsOtherRoute;
+    return other;
+}
+
+void WebServerMetrics::recordRequest(const char* route, uint32_t timeToFirstByte, uint32_t handlerMicros, uint32_t bytesSent) {
+    auto& r = routeFor(route);
+    r.timeToFirstByte.record(timeToFirstByte);
+    r.handlerTime.record(handlerMicros);
+    r.bytesSent += bytesSent;
+}
+
+namespace {
+    /**
+     * Builds a single line of the Prometheus output straight into the chunk being gathered in the response's write
+     * buffer, so the output is sent a buffer at a time rather than a line at a time. When the chunk fills up it is
+     * sent, and the line carries on in the next one.
+     */
+    class MetricLine {
+    private:
+        WebServerResponse& response;
+        uint8_t* space = nullptr;
+        size_t available = 0;
+        size_t used = 0;
+
+        void addChar(char ch) {
+            if(used == available) {
+                response.commitChunkSpace(used);
+                used = 0;
+                space = response.reserveChunkSpace(available);
+                if(!space) return; // the connection has closed, so the rest is dropped.
+            }
+            space[used++] = ch;
+        }
+    public:
+        explicit MetricLine(WebServerResponse& response) : response(response) {}
+
+        MetricLine& add(const char* str) {
+            while(*str) addChar(*str++);
+            return *this;
+        }
+
+        MetricLine& add(uint64_t value) {
+            char sz[21];
+            int pos = sizeof(sz) - 1;
+            sz[pos] = 0;
+            do {
+                sz[--pos] = char('0' + (value % 10));
+                value /= 10;
+            } while(value);
+            return add(&sz[pos]);
+        }
+
+        void end() {
+            addChar('\n');
+            response.commitChunkSpace(used);
+            used = available = 0;
+        }
+    };
+}
+
+static void writeMetricType(WebServerResponse& response, const char* name, const char* type) {
+    MetricLine(response).add("# TYPE tcweb_").add(name).add(" ").add(type).end();
+}
+
+static void writeMetricValue(WebServerResponse& response, const char* name, const char* route, uint64_t value) {
+    MetricLine line(response);
+    line.add("tcweb_").add(name);
+    if(route) line.add("{route=\"").add(route).add("\"}");
+    line.add(" ").add(value).end();
+}
+
+static void writeHistogram(WebServerResponse& response, const char* name, const char* route, const WebLatencyHistogram& histogram) {
+    uint64_t cumulative = 0;
+    for(int i = 0; i <= WS_METRICS_BUCKETS; i++) {
+        MetricLine line(response);
+        line.add("tcweb_").add(name).add("_bucket{");
+        if(route) line.add("route=\"").add(route).add("\",");
+        line.add("le=\"");
+        if(i < WS_METRICS_BUCKETS) {
+            cumulative += histogram.getBucketCount(i);
+            line.add((uint64_t)WebLatencyHistogram::bucketLimit(i)).add("\"} ").add(cumulative);
+        } else {
+            line.add("+Inf\"} ").add((uint64_t)histogram.getCount());
+        }
+        line.end();
+    }
+    MetricLine sumLine(response);
+    sumLine.add("tcweb_").add(name).add("_sum");
+    if(route) sumLine.add("{route=\"").add(route).add("\"}");
+    sumLine.add(" ").add(histogram.getSum()).end();
+    MetricLine countLine(response);
+    countLine.add("tcweb_").add(name).add("_count");
+    if(route) countLine.add("{route=\"").add(route).add("\"}");
+    countLine.add(" ").add((uint64_t)histogram.getCount()).end();
+}
+
+void WebServerMetrics::writePrometheus(WebServerResponse& response) const {
+    writeMetricType(response, "time_to_first_byte_microseconds", "histogram");
+    for(auto& r : routes) {
+        if(r.route) writeHistogram(response, "time_to_first_byte_microseconds", r.route, r.timeToFirstByte);
+    }
+    writeMetricType(response, "handler_microseconds", "histogram");
+    for(auto& r : routes) {
+        if(r.route) writeHistogram(response, "handler_microseconds", r.route, r.handlerTime);
+    }
+    writeMetricType(response, "sent_bytes_total", "counter");
+    for(auto& r : routes) {
+        if(r.route) writeMetricValue(response, "sent_bytes_total", r.route, r.bytesSent);
+    }
+    writeMetricType(response, "content_source_failures_total", "counter");
+    writeMetricValue(response, "content_source_failures_total", nullptr, contentSourceFailures);
+
+    writeMetricType(response, "ws_reply_microseconds", "histogram");
+    writeHistogram(response, "ws_reply_microseconds", nullptr, wsReplyTime);
+    writeMetricType(response, "ws_write_microseconds", "histogram");
+    writeHistogram(response, "ws_write_microseconds", nullptr, wsWriteTime);
+    writeMetricType(response, "ws_frames_received_total", "counter");
+    writeMetricValue(response, "ws_frames_received_total", nullptr, wsFramesReceived);
+    writeMetricType(response, "ws_frames_sent_total", "counter");
+    writeMetricValue(response, "ws_frames_sent_total", nullptr, wsFramesSent);
+    writeMetricType(response, "ws_sent_bytes_total", "counter");
+    writeMetricValue(response, "ws_sent_bytes_total", nullptr, wsBytesSent);
+}
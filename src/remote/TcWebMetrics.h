@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebMetrics.h
+ *
+ * Optional latency metrics for the web server, so that a slow UI can be put down to the network, a page handler or
+ * the menu loop. For each route the time to first byte, the handler time and the content bytes sent are recorded,
+ * requests that match no route are recorded against the route "unmatched", and routes beyond WS_METRICS_MAX_ROUTES
+ * against "other". For websockets the time taken to write each frame to the driver is recorded, along with the reply
+ * time, which is how long it is from a frame arriving to the next frame being sent back, this is mostly time spent
+ * waiting for the menu loop. Content sources that fail part way through a response are also counted.
+ *
+ * Times are kept in fixed histograms with power of two buckets, the first bucket being up to 64 microseconds, so
+ * recording is a few instructions and no memory is allocated after startup. Turn metrics on by calling enableMetrics
+ * on the web server, they are then served in Prometheus text format from /metrics.
+ */
+
+#ifndef TCMENU_TCWEBMETRICS_H
+#define TCMENU_TCWEBMETRICS_H
+
+#include <Arduino.h>
+
+// The number of buckets in each latency histogram, the last bucket is up to 64 << (WS_METRICS_BUCKETS - 1) microseconds.
+#ifndef WS_METRICS_BUCKETS
+#define WS_METRICS_BUCKETS 16
+#endif
+
+// The number of routes that metrics are kept for, the last is kept back for all routes that do not fit, as "other".
+#ifndef WS_METRICS_MAX_ROUTES
+#define WS_METRICS_MAX_ROUTES 8
+#endif
+
+// The upper bound of the first histogram bucket is 2 to the power of this, in microseconds.
+#define WS_METRICS_FIRST_BUCKET_SHIFT 6
+
+namespace tcremote {
+
+    class WebServerResponse;
+
+    /**
+     * A latency histogram with power of two buckets, along with the count and sum of all values recorded. Values
+     * beyond the last bucket are only included in the count and sum, as Prometheus expects of the +Inf bucket.
+     */
+    class WebLatencyHistogram {
+    private:
+        uint32_t buckets[WS_METRICS_BUCKETS] = {};
+        uint32_t count = 0;
+        uint64_t sum = 0;
+
+        /**
+         * @return the number of leading zero bits in a 32 bit value that is not zero, the compiler builtin is used
+         * where there is one, as it is a single instruction on most boards. Long is used as int may be 16 bits.
+         */
+        static int leadingZeros(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_clzl((unsigned long)value) - (int)(sizeof(unsigned long) - sizeof(uint32_t)) * 8;
+#else
+            int zeros = 0;
+            while(!(value & 0x80000000UL)) {
+                value <<= 1;
+                zeros++;
+            }
+            return zeros;
+#endif
+        }
+    public:
+        /**
+         * @return the bucket that a value falls into, which may be past the last bucket for large values.
+         */
+        static int bucketFor(uint32_t micros) {
+            if(micros <= (1UL << WS_METRICS_FIRST_BUCKET_SHIFT)) return 0;
+            return (32 - leadingZeros(micros - 1)) - WS_METRICS_FIRST_BUCKET_SHIFT;
+        }
+
+        /**
+         * @return the inclusive upper bound of a bucket in microseconds
+         */
+        static uint32_t bucketLimit(int bucket) { return 1UL << (bucket + WS_METRICS_FIRST_BUCKET_SHIFT); }
+
+        void record(uint32_t micros) {
+            int bucket = bucketFor(micros);
+            if(bucket < WS_METRICS_BUCKETS) buckets[bucket]++;
+            count++;
+            sum += micros;
+        }
+
+        uint32_t getBucketCount(int bucket) const { return buckets[bucket]; }
+        uint32_t getCount() const { return count; }
+        uint64_t getSum() const { return sum; }
+    };
+
+    /**
+     * The metrics for a single route, the route is the URL the handler was registered with.
+     */
+    struct WebRouteMetrics {
+        const char* route;
+        WebLatencyHistogram timeToFirstByte;
+        WebLatencyHistogram handlerTime;
+        uint32_t bytesSent;
+    };
+
+    /**
+     * Holds the metrics for all routes and websockets, created by the web server when metrics are enabled. See the
+     * file documentation for what is recorded.
+     */
+    class WebServerMetrics {
+    private:
+        WebRouteMetrics routes[WS_METRICS_MAX_ROUTES] = {};
+        WebLatencyHistogram wsReplyTime;
+        WebLatencyHistogram wsWriteTime;
+        uint32_t wsFramesReceived = 0;
+        uint32_t wsFramesSent = 0;
+        uint32_t wsBytesSent = 0;
+        uint32_t contentSourceFailures = 0;
+    public:
+        /**
+         * Finds the metrics for a route, claiming a free entry the first time a route is seen. Routes are matched by
+         * the address of the URL they were registered with, so this does not compare strings.
+         * @param route the URL the handler was registered with, or nullptr for requests that matched no route
+         * @return the metrics for the route, once all the other entries are in use this is the last one, "other".
+         */
+        WebRouteMetrics& routeFor(const char* route);
+
+        /**
+         * Records a completed request against its route.
+         * @param route the URL the handler was registered with, or nullptr if no route matched
+         * @param timeToFirstByte microseconds from starting to read the request to writing the first byte back
+         * @param handlerMicros microseconds spent in the handler
+         * @param bytesSent the number of content bytes sent
+         */
+        void recordRequest(const char* route, uint32_t timeToFirstByte, uint32_t handlerMicros, uint32_t bytesSent);
+
+        /** records that a websocket frame has arrived from the client */
+        void webSocketFrameReceived() { wsFramesReceived++; }
+
+        /**
+         * Records a websocket frame being written to the driver
+         * @param writeMicros how long the write and flush took
+         * @param bytes the size of the frame payload
+         */
+        void webSocketFrameSent(uint32_t writeMicros, size_t bytes) {
+            wsWriteTime.record(writeMicros);
+            wsFramesSent++;
+            wsBytesSent += bytes;
+        }
+
+        /** records the time from a websocket frame arriving to the next frame being sent back */
+        void webSocketReply(uint32_t replyMicros) { wsReplyTime.record(replyMicros); }
+
+        /** records a content source failing to read part way through a response, which closes the connection */
+        void contentSourceFailed() { contentSourceFailures++; }
+
+        const WebRouteMetrics& getRoute(int idx) const { return routes[idx]; }
+        const WebLatencyHistogram& getWebSocketReplyTime() const { return wsReplyTime; }
+        const WebLatencyHistogram& getWebSocketWriteTime() const { return wsWriteTime; }
+        uint32_t getWebSocketFramesReceived() const { return wsFramesReceived; }
+        uint32_t getWebSocketFramesSent() const { return wsFramesSent; }
+        uint32_t getContentSourceFailures() const { return contentSourceFailures; }
+
+        /**
+         * Writes all the metrics to the response in Prometheus text format, the response must already have been
+         * started with a chunked content type.
+         * @param response the response to write to
+         */
+        void writePrometheus(WebServerResponse& response) const;
+    };
+}
+
+#endif //TCMENU_TCWEBMETRICS_H
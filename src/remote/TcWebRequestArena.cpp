@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "TcWebRequestArena.h"
+
+using namespace tcremote;
+
+void* WebRequestArena::allocate(size_t size, size_t alignment) {
+    size_t start = (used + (alignment - 1)) & ~(alignment - 1);
+    if(start > WS_REQUEST_ARENA_SIZE || size > (WS_REQUEST_ARENA_SIZE - start)) {
+        failedCount++;
+        return nullptr;
+    }
+    used = uint16_t(start + size);
+    if(used > peakUsed) peakUsed = used;
+    return &storage[start];
+}
+
+char* WebRequestArena::allocateString(size_t len) {
+    auto str = static_cast<char*>(allocate(len + 1, 1));
+    if(str) str[0] = 0;
+    return str;
+}
+
+char* WebRequestArena::copyString(const char* str) {
+    size_t len = strlen(str);
+    auto copy = static_cast<char*>(allocate(len + 1, 1));
+    if(copy) memcpy(copy, str, len + 1);
+    return copy;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebRequestArena.h
+ *
+ * A small scratch area that every web server response carries, for handlers that need memory for the length of a
+ * single request, such as to format a JSON fragment, hold a query parameter or keep decoded form fields. Memory is
+ * taken from the front of the area by moving a position along, and is all given back at once when the response ends,
+ * so there is no heap use, no fragmentation and nothing to free.
+ */
+
+#ifndef TCMENU_TCWEBREQUESTARENA_H
+#define TCMENU_TCWEBREQUESTARENA_H
+
+#include <Arduino.h>
+#include <stddef.h>
+
+// The size of the scratch area given to each request, every response has one, so this is multiplied by the number
+// of concurrent responses.
+#ifndef WS_REQUEST_ARENA_SIZE
+#define WS_REQUEST_ARENA_SIZE 256
+#endif
+
+namespace tcremote {
+
+    /**
+     * A bump allocator over a fixed area, see the file documentation. Allocations are only valid until the response
+     * ends, and it must only hold plain data, as nothing allocated in it is ever destroyed.
+     */
+    class WebRequestArena {
+        static_assert(WS_REQUEST_ARENA_SIZE <= 0xffff, "the arena is indexed by 16 bit positions");
+    private:
+        alignas(max_align_t) uint8_t storage[WS_REQUEST_ARENA_SIZE];
+        uint16_t used = 0;
+        uint16_t peakUsed = 0;
+        uint16_t failedCount = 0;
+    public:
+        /**
+         * Takes memory from the arena
+         * @param size the number of bytes needed
+         * @param alignment the alignment needed, which must be a power of two
+         * @return the memory, or nullptr if there is not enough left.
+         */
+        void* allocate(size_t size, size_t alignment = alignof(max_align_t));
+
+        /**
+         * Takes memory for an array of plain data from the arena, correctly aligned for the type.
+         * @param count the number of entries
+         * @return the array, or nullptr if there is not enough left.
+         */
+        template<typename T> T* allocateArray(size_t count) {
+            return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        }
+
+        /**
+         * Takes space for a string of up to len characters along with its terminator, the string starts empty.
+         * @param len the longest string that will be stored
+         * @return the string, or nullptr if there is not enough left.
+         */
+        char* allocateString(size_t len);
+
+        /**
+         * Copies a string into the arena, for example a form field or header value that must outlive the buffer it
+         * was read into.
+         * @param str the string to copy
+         * @return the copy, or nullptr if there is not enough left.
+         */
+        char* copyString(const char* str);
+
+        /** gives back everything that has been allocated, called by the response when it ends */
+        void reset() { used = 0; }
+
+        /** @return the number of bytes allocated since the last reset, including alignment padding */
+        size_t getUsed() const { return used; }
+        /** @return the number of bytes left */
+        size_t getRemaining() const { return WS_REQUEST_ARENA_SIZE - used; }
+        /** @return the most that has been allocated in any one request, for sizing WS_REQUEST_ARENA_SIZE */
+        size_t getPeakUsed() const { return peakUsed; }
+        /** @return the number of allocations that failed because the arena was full */
+        uint16_t getFailedCount() const { return failedCount; }
+    };
+}
+
+#endif //TCMENU_TCWEBREQUESTARENA_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "PlatformDetermination.h"
+#include "TcWebResponseCache.h"
+#include "TcMenuWebServer.h"
+
+using namespace tcremote;
+
+bool WebCacheEntry::isFor(uint16_t key, const char* path) const {
+    return handlerKey == key && strncmp(pathParameter, path, sizeof(pathParameter) - 1) == 0;
+}
+
+void WebCacheEntry::captureContentType(WebServerResponse::WSRContentType type) {
+    if(state != ENTRY_CAPTURING_HEADER) return;
+    contentType = type;
+    state = ENTRY_CAPTURING_BODY;
+}
+
+void WebCacheEntry::captureData(const uint8_t* data, size_t len, MemoryLocationType memType) {
+    if(state == ENTRY_VALID || state == ENTRY_RETIRED) return;
+    // data sent before the content info, or too much data, means this response cannot be cached.
+    if(state != ENTRY_CAPTURING_BODY || (length + len) > sizeof(body)) {
+        state = ENTRY_FREE;
+        return;
+    }
+    if(memType == IN_PROGRAM_MEM) {
+        memcpy_P(&body[length], data, len);
+    } else {
+        memcpy(&body[length], data, len);
+    }
+    length += len;
+}
+
+WebCacheEntry* WebResponseCache::findValidEntry(uint16_t key, const char* path) {
+    for(auto& entry : entries) {
+        if(entry.state == WebCacheEntry::ENTRY_VALID && entry.isFor(key, path)) return &entry;
+    }
+    return nullptr;
+}
+
+WebCacheEntry* WebResponseCache::leastRecentlyUsed() {
+    WebCacheEntry* oldest = nullptr;
+    unsigned long now = millis();
+    for(auto& entry : entries) {
+        // entries that are being captured or sent cannot be reused until they are finished with.
+        if(entry.readers != 0 || entry.state == WebCacheEntry::ENTRY_CAPTURING_HEADER || entry.state == WebCacheEntry::ENTRY_CAPTURING_BODY
+                || entry.state == WebCacheEntry::ENTRY_RETIRED) continue;
+        if(entry.state == WebCacheEntry::ENTRY_FREE) return &entry;
+        if(oldest == nullptr || (now - entry.lastUsed) > (now - oldest->lastUsed)) oldest = &entry;
+    }
+    return oldest;
+}
+
+void WebResponseCache::serveEntry(WebCacheEntry& entry, WebServerResponse& response) {
+    // the send may yield, so the entry is pinned until it is written, to stop it being replaced underneath us.
+    entry.pin();
+    entry.lastUsed = millis();
+    response.startHeader();
+    response.contentInfo(entry.contentType, entry.length);
+    response.send(entry.body, entry.length);
+    entry.unpin();
+}
+
+void WebResponseCache::handleRequest(UrlWithHandler& handler, WebServerResponse& response) {
+    unsigned long now = millis();
+    auto versionFn = handler.getVersionFn();
+    auto entry = findValidEntry(handler.getKey(), response.getPathParameter());
+    bool current = entry != nullptr && (now - entry->storedAt) < handler.getCacheTtl();
+
+    // within the ttl the version is not checked, after that, an entry whose version has not changed is still current.
+    uint32_t version = current ? entry->version : 0;
+    if(!current && versionFn) {
+        version = versionFn(response);
+        if(entry && entry->version == version) {
+            entry->storedAt = now;
+            current = true;
+        }
+    }
+    if(entry && !current) entry->retire();
+
+    if(versionFn) {
+        response.setEntityTag(version);
+        if(response.hasIfNoneMatch() && response.getIfNoneMatch() == version) {
+            serlogF2(SER_NETWORK_DEBUG, "Cache not modified ", handler.getKey());
+            response.sendNotModified();
+            return;
+        }
+    }
+
+    if(current) {
+        serlogF2(SER_NETWORK_DEBUG, "Cache hit ", handler.getKey());
+        serveEntry(*entry, response);
+        return;
+    }
+
+    // render the response, capturing it into the least recently used entry as it is sent.
+    auto target = leastRecentlyUsed();
+    if(target) {
+        target->state = WebCacheEntry::ENTRY_CAPTURING_HEADER;
+        target->handlerKey = handler.getKey();
+        strncpy(target->pathParameter, response.getPathParameter(), sizeof(target->pathParameter) - 1);
+        target->pathParameter[sizeof(target->pathParameter) - 1] = 0;
+        target->version = version;
+        target->length = 0;
+        response.setCaptureEntry(target);
+    }
+
+    handler.handleUrl(response);
+
+    if(target) {
+        response.setCaptureEntry(nullptr);
+        if(target->state == WebCacheEntry::ENTRY_CAPTURING_BODY) {
+            // another request for the same content may have been captured while this handler was running.
+            auto older = findValidEntry(target->handlerKey, target->pathParameter);
+            if(older) older->retire();
+            target->state = WebCacheEntry::ENTRY_VALID;
+            target->storedAt = target->lastUsed = millis();
+        } else {
+            target->state = WebCacheEntry::ENTRY_FREE;
+        }
+    }
+}
+
+void WebResponseCache::clear() {
+    for(auto& entry : entries) {
+        if(entry.state == WebCacheEntry::ENTRY_VALID) entry.retire();
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebResponseCache.h
+ *
+ * An optional micro-cache for the output of dynamic page handlers, it sits in front of the handler so that pages that
+ * are polled frequently, such as dashboards, do not need to be rendered again for every request. Handlers opt in by
+ * registering with onUrlGetCached on the web server, along with a version function that cheaply returns a number that
+ * changes whenever the content would change. The version is sent to the client as the ETag, and a client that already
+ * has the current version gets a 304 Not Modified response without any content.
+ *
+ * The cache is a fixed number of entries of a fixed size, allocated once when the first cached handler is registered.
+ * Only the content type and the body are stored, so cached handlers should not add other headers. Responses larger
+ * than an entry, ranged responses, and anything other than a 200 response are sent as usual but not stored.
+ */
+
+#ifndef TCMENU_TCWEBRESPONSECACHE_H
+#define TCMENU_TCWEBRESPONSECACHE_H
+
+#include "TcMenuHttpRequestProcessor.h"
+
+// The number of responses that can be held in the cache at once, the least recently used one is replaced when full.
+#ifndef WS_RESPONSE_CACHE_ENTRIES
+#define WS_RESPONSE_CACHE_ENTRIES 4
+#endif
+
+// The largest response body that can be cached, the cache takes roughly this multiplied by the number of entries.
+#ifndef WS_RESPONSE_CACHE_ENTRY_SIZE
+#define WS_RESPONSE_CACHE_ENTRY_SIZE 512
+#endif
+
+// How long a cached response is served without checking its version, the default for onUrlGetCached.
+#ifndef WS_RESPONSE_CACHE_TTL_MILLIS
+#define WS_RESPONSE_CACHE_TTL_MILLIS 1000
+#endif
+
+namespace tcremote {
+
+    class UrlWithHandler;
+
+    /**
+     * Returns the version of the content that a cached handler would render for a request, this must be cheap to call
+     * and change whenever the content changes, for example a counter that is incremented when a menu item changes.
+     */
+    typedef uint32_t (*WebContentVersionFn)(WebServerResponse& response);
+
+    /**
+     * A single entry in the response cache, while a handler is rendering a response the entry captures the content
+     * type and body as they are sent. The entry only becomes valid once the whole response has been captured. An entry
+     * that is replaced while it is still being sent is retired, and only becomes free once the last reader is done.
+     */
+    class WebCacheEntry {
+    public:
+        enum CacheEntryState : uint8_t { ENTRY_FREE, ENTRY_CAPTURING_HEADER, ENTRY_CAPTURING_BODY, ENTRY_VALID, ENTRY_RETIRED };
+    private:
+        uint8_t body[WS_RESPONSE_CACHE_ENTRY_SIZE];
+        char pathParameter[WS_MAX_PATH_PARAMETER];
+        uint32_t version = 0;
+        unsigned long storedAt = 0;
+        unsigned long lastUsed = 0;
+        uint16_t length = 0;
+        uint16_t handlerKey = 0;
+        WebServerResponse::WSRContentType contentType = WebServerResponse::PLAIN_TEXT;
+        CacheEntryState state = ENTRY_FREE;
+        uint8_t readers = 0;
+        friend class WebResponseCache;
+    public:
+        bool isFor(uint16_t key, const char* path) const;
+
+        /**
+         * Records the content type of the response being captured, called as the content info is sent.
+         */
+        void captureContentType(WebServerResponse::WSRContentType type);
+
+        /**
+         * Appends data from the response body being captured, if it does not fit the capture is abandoned.
+         */
+        void captureData(const uint8_t* data, size_t len, MemoryLocationType memType);
+
+        /**
+         * Abandons a capture, called when the response is not suitable for caching or fails part way through.
+         */
+        void failCapture() { if(state != ENTRY_VALID && state != ENTRY_RETIRED) state = ENTRY_FREE; }
+
+        /**
+         * Pins the entry while it is being sent, so that it is not reused underneath the reader, call unpin after.
+         */
+        void pin() { readers++; }
+
+        /**
+         * Releases a pin taken with pin, a retired entry becomes free once the last reader has released it.
+         */
+        void unpin() {
+            if(readers > 0) readers--;
+            if(readers == 0 && state == ENTRY_RETIRED) state = ENTRY_FREE;
+        }
+
+        /**
+         * Stops the entry being served, it is freed straight away unless it is being sent, in which case it is freed
+         * when the last reader unpins it.
+         */
+        void retire() { state = readers ? ENTRY_RETIRED : ENTRY_FREE; }
+
+        CacheEntryState getState() const { return state; }
+        uint32_t getVersion() const { return version; }
+        uint16_t getLength() const { return length; }
+    };
+
+    /**
+     * The response cache, owned by the web server and used for every handler registered with onUrlGetCached. Entries
+     * are keyed on the handler and the path parameter, so a wildcard handler has an entry per distinct URL.
+     */
+    class WebResponseCache {
+    private:
+        WebCacheEntry entries[WS_RESPONSE_CACHE_ENTRIES];
+
+        WebCacheEntry* findValidEntry(uint16_t key, const char* path);
+        WebCacheEntry* leastRecentlyUsed();
+        void serveEntry(WebCacheEntry& entry, WebServerResponse& response);
+    public:
+        /**
+         * Handles a request for a cached handler, either sending a 304 when the client has the current version,
+         * sending the response from the cache when it is current, or calling the handler and capturing its output.
+         * @param handler the handler that matched the request
+         * @param response the response for the request
+         */
+        void handleRequest(UrlWithHandler& handler, WebServerResponse& response);
+
+        /**
+         * Removes every entry from the cache, entries that are in the middle of being sent are only reused afterwards.
+         */
+        void clear();
+    };
+}
+
+#endif //TCMENU_TCWEBRESPONSECACHE_H
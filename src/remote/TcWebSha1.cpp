@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "PlatformDetermination.h"
+#include "TcWebSha1.h"
+
+#if defined(WS_HARDWARE_SHA1) && defined(ESP32)
+#include <mbedtls/sha1.h>
+#define WS_SHA1_USE_MBEDTLS
+#elif defined(WS_HARDWARE_SHA1) && defined(HAL_HASH_MODULE_ENABLED)
+extern HASH_HandleTypeDef hhash;
+#define WS_SHA1_USE_STM32_HASH
+#endif
+
+using namespace tc_sha1;
+
+namespace {
+    inline uint32_t loadBigEndian(const uint8_t* p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        // a single possibly unaligned word load and a byte reverse, rather than four byte loads and shifts.
+        uint32_t word;
+        memcpy(&word, p, sizeof word);
+        return __builtin_bswap32(word);
+#else
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+#endif
+    }
+
+    inline void storeBigEndian(uint8_t* p, uint32_t value) {
+        p[0] = (uint8_t)(value >> 24);
+        p[1] = (uint8_t)(value >> 16);
+        p[2] = (uint8_t)(value >> 8);
+        p[3] = (uint8_t)value;
+    }
+}
+
+#define SHA1_ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+// the message schedule is kept as a rolling window of sixteen words, each new word replaces the one 16 rounds back.
+#define SHA1_W(i) (w[(i) & 15] = SHA1_ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+
+// each round is written against rotating variable names so that no values need to be shuffled between rounds.
+#define SHA1_R0(a, b, c, d, e, i) e += ((b & (c ^ d)) ^ d) + w[i] + 0x5A827999 + SHA1_ROL(a, 5); b = SHA1_ROL(b, 30);
+#define SHA1_R1(a, b, c, d, e, i) e += ((b & (c ^ d)) ^ d) + SHA1_W(i) + 0x5A827999 + SHA1_ROL(a, 5); b = SHA1_ROL(b, 30);
+#define SHA1_R2(a, b, c, d, e, i) e += (b ^ c ^ d) + SHA1_W(i) + 0x6ED9EBA1 + SHA1_ROL(a, 5); b = SHA1_ROL(b, 30);
+#define SHA1_R3(a, b, c, d, e, i) e += (((b | c) & d) | (b & c)) + SHA1_W(i) + 0x8F1BBCDC + SHA1_ROL(a, 5); b = SHA1_ROL(b, 30);
+#define SHA1_R4(a, b, c, d, e, i) e += (b ^ c ^ d) + SHA1_W(i) + 0xCA62C1D6 + SHA1_ROL(a, 5); b = SHA1_ROL(b, 30);
+
+void Sha1::processBlock(const uint8_t* data) {
+    uint32_t w[16];
+    for(int i = 0; i < 16; i++) w[i] = loadBigEndian(&data[i * 4]);
+
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+
+    SHA1_R0(a,b,c,d,e, 0); SHA1_R0(e,a,b,c,d, 1); SHA1_R0(d,e,a,b,c, 2); SHA1_R0(c,d,e,a,b, 3);
+    SHA1_R0(b,c,d,e,a, 4); SHA1_R0(a,b,c,d,e, 5); SHA1_R0(e,a,b,c,d, 6); SHA1_R0(d,e,a,b,c, 7);
+    SHA1_R0(c,d,e,a,b, 8); SHA1_R0(b,c,d,e,a, 9); SHA1_R0(a,b,c,d,e,10); SHA1_R0(e,a,b,c,d,11);
+    SHA1_R0(d,e,a,b,c,12); SHA1_R0(c,d,e,a,b,13); SHA1_R0(b,c,d,e,a,14); SHA1_R0(a,b,c,d,e,15);
+    SHA1_R1(e,a,b,c,d,16); SHA1_R1(d,e,a,b,c,17); SHA1_R1(c,d,e,a,b,18); SHA1_R1(b,c,d,e,a,19);
+
+    SHA1_R2(a,b,c,d,e,20); SHA1_R2(e,a,b,c,d,21); SHA1_R2(d,e,a,b,c,22); SHA1_R2(c,d,e,a,b,23);
+    SHA1_R2(b,c,d,e,a,24); SHA1_R2(a,b,c,d,e,25); SHA1_R2(e,a,b,c,d,26); SHA1_R2(d,e,a,b,c,27);
+    SHA1_R2(c,d,e,a,b,28); SHA1_R2(b,c,d,e,a,29); SHA1_R2(a,b,c,d,e,30); SHA1_R2(e,a,b,c,d,31);
+    SHA1_R2(d,e,a,b,c,32); SHA1_R2(c,d,e,a,b,33); SHA1_R2(b,c,d,e,a,34); SHA1_R2(a,b,c,d,e,35);
+    SHA1_R2(e,a,b,c,d,36); SHA1_R2(d,e,a,b,c,37); SHA1_R2(c,d,e,a,b,38); SHA1_R2(b,c,d,e,a,39);
+
+    SHA1_R3(a,b,c,d,e,40); SHA1_R3(e,a,b,c,d,41); SHA1_R3(d,e,a,b,c,42); SHA1_R3(c,d,e,a,b,43);
+    SHA1_R3(b,c,d,e,a,44); SHA1_R3(a,b,c,d,e,45); SHA1_R3(e,a,b,c,d,46); SHA1_R3(d,e,a,b,c,47);
+    SHA1_R3(c,d,e,a,b,48); SHA1_R3(b,c,d,e,a,49); SHA1_R3(a,b,c,d,e,50); SHA1_R3(e,a,b,c,d,51);
+    SHA1_R3(d,e,a,b,c,52); SHA1_R3(c,d,e,a,b,53); SHA1_R3(b,c,d,e,a,54); SHA1_R3(a,b,c,d,e,55);
+    SHA1_R3(e,a,b,c,d,56); SHA1_R3(d,e,a,b,c,57); SHA1_R3(c,d,e,a,b,58); SHA1_R3(b,c,d,e,a,59);
+
+    SHA1_R4(a,b,c,d,e,60); SHA1_R4(e,a,b,c,d,61); SHA1_R4(d,e,a,b,c,62); SHA1_R4(c,d,e,a,b,63);
+    SHA1_R4(b,c,d,e,a,64); SHA1_R4(a,b,c,d,e,65); SHA1_R4(e,a,b,c,d,66); SHA1_R4(d,e,a,b,c,67);
+    SHA1_R4(c,d,e,a,b,68); SHA1_R4(b,c,d,e,a,69); SHA1_R4(a,b,c,d,e,70); SHA1_R4(e,a,b,c,d,71);
+    SHA1_R4(d,e,a,b,c,72); SHA1_R4(c,d,e,a,b,73); SHA1_R4(b,c,d,e,a,74); SHA1_R4(a,b,c,d,e,75);
+    SHA1_R4(e,a,b,c,d,76); SHA1_R4(d,e,a,b,c,77); SHA1_R4(c,d,e,a,b,78); SHA1_R4(b,c,d,e,a,79);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void Sha1::reset() {
+    state[0] = 0x67452301;
+    state[1] = 0xEFCDAB89;
+    state[2] = 0x98BADCFE;
+    state[3] = 0x10325476;
+    state[4] = 0xC3D2E1F0;
+    totalBytes = 0;
+    blockUsed = 0;
+}
+
+void Sha1::update(const uint8_t* data, size_t len) {
+    totalBytes += len;
+
+    // top up any partial block first, then hash whole blocks straight from the caller's data without copying.
+    if(blockUsed != 0) {
+        size_t toCopy = min(len, (size_t)(SHA1_BLOCK_SIZE - blockUsed));
+        memcpy(&block[blockUsed], data, toCopy);
+        blockUsed += toCopy;
+        data += toCopy;
+        len -= toCopy;
+        if(blockUsed < SHA1_BLOCK_SIZE) return;
+        processBlock(block);
+        blockUsed = 0;
+    }
+
+    while(len >= SHA1_BLOCK_SIZE) {
+        processBlock(data);
+        data += SHA1_BLOCK_SIZE;
+        len -= SHA1_BLOCK_SIZE;
+    }
+
+    if(len) {
+        memcpy(block, data, len);
+        blockUsed = len;
+    }
+}
+
+void Sha1::finish(uint8_t* digest) {
+    // pad with a single one bit, then zeros up to the last eight bytes of a block, which hold the length in bits.
+    uint32_t totalBits = totalBytes << 3;
+    uint32_t totalBitsHigh = totalBytes >> 29;
+    block[blockUsed++] = 0x80;
+    if(blockUsed > (SHA1_BLOCK_SIZE - 8)) {
+        memset(&block[blockUsed], 0, SHA1_BLOCK_SIZE - blockUsed);
+        processBlock(block);
+        blockUsed = 0;
+    }
+    memset(&block[blockUsed], 0, (SHA1_BLOCK_SIZE - 8) - blockUsed);
+    storeBigEndian(&block[SHA1_BLOCK_SIZE - 8], totalBitsHigh);
+    storeBigEndian(&block[SHA1_BLOCK_SIZE - 4], totalBits);
+    processBlock(block);
+
+    for(int i = 0; i < 5; i++) storeBigEndian(&digest[i * 4], state[i]);
+}
+
+void tc_sha1::sha1(const uint8_t* data, size_t len, uint8_t* digest) {
+#if defined(WS_SHA1_USE_MBEDTLS)
+    mbedtls_sha1(data, len, digest);
+#elif defined(WS_SHA1_USE_STM32_HASH)
+    if(HAL_HASH_SHA1_Start(&hhash, const_cast<uint8_t*>(data), len, digest, HAL_MAX_DELAY) == HAL_OK) return;
+    // if the hash unit is busy or not set up, fall back to doing it in software.
+    Sha1 hash;
+    hash.update(data, len);
+    hash.finish(digest);
+#else
+    Sha1 hash;
+    hash.update(data, len);
+    hash.finish(digest);
+#endif
+}
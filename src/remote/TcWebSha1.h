@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebSha1.h
+ *
+ * The SHA-1 used for the websocket handshake, every upgrade hashes the client's key along with the websocket GUID.
+ * This implementation works a 32-bit word at a time with the rounds unrolled and a rolling sixteen word message
+ * schedule, so it needs far less stack and time than the compact byte oriented version in c_trabant_teeny_sha1.c.
+ *
+ * On boards with a hardware hash unit, define WS_HARDWARE_SHA1 to use it for one shot hashes. On ESP32 this uses the
+ * mbedtls SHA-1 that the IDF accelerates in hardware. On STM32 parts with a HASH peripheral, HAL_HASH_MODULE_ENABLED
+ * must be defined, and you must provide and initialise `HASH_HandleTypeDef hhash`. Otherwise the software version is
+ * always used.
+ */
+
+#ifndef TCMENU_TCWEBSHA1_H
+#define TCMENU_TCWEBSHA1_H
+
+#include <Arduino.h>
+
+#define SHA1_DIGEST_SIZE 20
+#define SHA1_BLOCK_SIZE 64
+
+namespace tc_sha1 {
+
+    /**
+     * An incremental SHA-1 hash, call update as many times as needed with the data, then finish to get the digest.
+     * The hash can be reused by calling reset.
+     */
+    class Sha1 {
+    private:
+        uint32_t state[5];
+        uint8_t block[SHA1_BLOCK_SIZE];
+        uint32_t totalBytes;
+        uint8_t blockUsed;
+
+        void processBlock(const uint8_t* data);
+    public:
+        Sha1() { reset(); }
+
+        /**
+         * Starts a new hash, discarding anything added so far.
+         */
+        void reset();
+
+        /**
+         * Adds data to the hash
+         * @param data the data to add
+         * @param len the number of bytes to add
+         */
+        void update(const uint8_t* data, size_t len);
+
+        /**
+         * Completes the hash, writing the digest in its usual big endian byte order.
+         * @param digest the buffer for the digest, at least SHA1_DIGEST_SIZE bytes
+         */
+        void finish(uint8_t* digest);
+    };
+
+    /**
+     * Hashes a block of data in one go, using the hardware hash unit when WS_HARDWARE_SHA1 is defined and supported.
+     * @param data the data to hash
+     * @param len the number of bytes of data
+     * @param digest the buffer for the digest, at least SHA1_DIGEST_SIZE bytes
+     */
+    void sha1(const uint8_t* data, size_t len, uint8_t* digest);
+}
+
+#endif //TCMENU_TCWEBSHA1_H
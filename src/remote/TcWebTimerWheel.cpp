@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "PlatformDetermination.h"
+#include "TcWebTimerWheel.h"
+
+using namespace tcremote;
+
+void TimerWheel::schedule(TimerWheelEntry& entry, uint8_t deadlineType, uint32_t millisFromNow) {
+    cancel(entry);
+    // the wheel was idle, so start counting ticks from now, unless an expiry is rescheduling during an advance.
+    if(entryCount == 0 && !advancing) lastTickMillis = millis();
+
+    // always at least one tick away, so that an entry is never expired in the same advance that scheduled it.
+    uint32_t ticks = (millisFromNow + WS_TIMER_WHEEL_TICK_MILLIS - 1) / WS_TIMER_WHEEL_TICK_MILLIS;
+    if(ticks == 0) ticks = 1;
+    entry.rounds = (ticks - 1) / WS_TIMER_WHEEL_SLOTS;
+    entry.deadlineType = deadlineType;
+    entry.slot = (currentSlot + ticks) % WS_TIMER_WHEEL_SLOTS;
+
+    entry.prev = nullptr;
+    entry.next = slots[entry.slot];
+    if(entry.next) entry.next->prev = &entry;
+    slots[entry.slot] = &entry;
+    entry.scheduled = true;
+    entryCount++;
+}
+
+void TimerWheel::cancel(TimerWheelEntry& entry) {
+    if(!entry.scheduled) return;
+
+    if(entry.prev) {
+        entry.prev->next = entry.next;
+    } else {
+        slots[entry.slot] = entry.next;
+    }
+    if(entry.next) entry.next->prev = entry.prev;
+    entry.next = entry.prev = nullptr;
+    entry.scheduled = false;
+    entryCount--;
+}
+
+void TimerWheel::advance(unsigned long now) {
+    advancing = true;
+    while(entryCount != 0 && (now - lastTickMillis) >= WS_TIMER_WHEEL_TICK_MILLIS) {
+        lastTickMillis += WS_TIMER_WHEEL_TICK_MILLIS;
+        currentSlot = (currentSlot + 1) % WS_TIMER_WHEEL_SLOTS;
+
+        TimerWheelEntry* entry = slots[currentSlot];
+        while(entry) {
+            TimerWheelEntry* nextEntry = entry->next;
+            if(entry->rounds == 0) {
+                cancel(*entry);
+                expiryCallback(*entry);
+            } else {
+                entry->rounds--;
+            }
+            entry = nextEntry;
+        }
+    }
+    advancing = false;
+    if(entryCount == 0) lastTickMillis = now;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebTimerWheel.h
+ *
+ * A hashed timer wheel used by the web server to track connection deadlines, such as reading a request, idle keep
+ * alive connections, idle websockets and stalled writes. Every connection owns one entry that is linked into the wheel
+ * when a deadline is set, so scheduling, cancelling and expiry are all constant time with no allocation.
+ */
+
+#ifndef TCMENU_TCWEBTIMERWHEEL_H
+#define TCMENU_TCWEBTIMERWHEEL_H
+
+#include <Arduino.h>
+
+// The resolution of the timer wheel, deadlines are accurate to within one tick.
+#ifndef WS_TIMER_WHEEL_TICK_MILLIS
+#define WS_TIMER_WHEEL_TICK_MILLIS 100
+#endif
+
+// The number of slots in the timer wheel, deadlines further out than one revolution just go around more than once.
+#ifndef WS_TIMER_WHEEL_SLOTS
+#define WS_TIMER_WHEEL_SLOTS 32
+#endif
+
+namespace tcremote {
+
+    class TimerWheel;
+
+    /**
+     * An entry in the timer wheel, usually embedded in the object that owns the deadline. An entry is either not
+     * scheduled, or linked into exactly one slot of the wheel.
+     */
+    class TimerWheelEntry {
+    private:
+        TimerWheelEntry* next = nullptr;
+        TimerWheelEntry* prev = nullptr;
+        void* owner;
+        uint16_t rounds = 0;
+        uint8_t deadlineType = 0;
+        uint8_t slot = 0;
+        bool scheduled = false;
+        friend class TimerWheel;
+    public:
+        explicit TimerWheelEntry(void* owner = nullptr) : owner(owner) {}
+        void setOwner(void* newOwner) { owner = newOwner; }
+        void* getOwner() const { return owner; }
+        uint8_t getDeadlineType() const { return deadlineType; }
+        bool isScheduled() const { return scheduled; }
+    };
+
+    /**
+     * Called when an entry's deadline has expired, the entry is no longer scheduled at this point, and may be
+     * scheduled again from within the callback.
+     */
+    typedef void (*TimerWheelExpiry)(TimerWheelEntry& entry);
+
+    /**
+     * The hashed timer wheel, it should be advanced regularly by a single task, it will then call the expiry callback
+     * for any deadlines that have passed. Both scheduling and cancelling are constant time.
+     */
+    class TimerWheel {
+    private:
+        TimerWheelEntry* slots[WS_TIMER_WHEEL_SLOTS];
+        TimerWheelExpiry expiryCallback;
+        unsigned long lastTickMillis;
+        uint16_t entryCount;
+        uint8_t currentSlot;
+        bool advancing;
+    public:
+        explicit TimerWheel(TimerWheelExpiry callback) : slots{}, expiryCallback(callback), lastTickMillis(0), entryCount(0), currentSlot(0), advancing(false) {}
+
+        /**
+         * Schedules the entry to expire after the given number of milliseconds, if it was already scheduled then
+         * that deadline is replaced.
+         * @param entry the entry to schedule
+         * @param deadlineType a value that is given back in the entry on expiry
+         * @param millisFromNow the number of milliseconds until expiry
+         */
+        void schedule(TimerWheelEntry& entry, uint8_t deadlineType, uint32_t millisFromNow);
+
+        /**
+         * Removes the entry from the wheel if it was scheduled.
+         * @param entry the entry to cancel
+         */
+        void cancel(TimerWheelEntry& entry);
+
+        /**
+         * Advances the wheel up to the time provided, calling the expiry callback for any deadlines that have passed.
+         * @param now the current value of millis()
+         */
+        void advance(unsigned long now);
+
+        /**
+         * @return true if any entries are presently scheduled
+         */
+        bool hasEntries() const { return entryCount != 0; }
+    };
+}
+
+#endif //TCMENU_TCWEBTIMERWHEEL_H
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+#include "TcWebTrace.h"
+#include "TcMenuWebServer.h"
+
+using namespace tcremote;
+
+static_assert((WS_TRACE_BUFFER_SIZE & (WS_TRACE_BUFFER_SIZE - 1)) == 0, "WS_TRACE_BUFFER_SIZE must be a power of two");
+
+const char* tcremote::traceEventName(uint8_t eventId) {
+    switch(eventId) {
+        case TRACE_REQUEST_LINE: return "request";
+        case TRACE_HEADER_READ: return "hdrRead";
+        case TRACE_READ_ERROR: return "readErr";
+        case TRACE_RESPONSE_START: return "respStart";
+        case TRACE_HEADER_WRITE: return "hdrWrite";
+        case TRACE_RESPONSE_END: return "respEnd";
+        case TRACE_WS_FLUSH: return "wsFlush";
+        case TRACE_RAW_WRITE: return "rawWrite";
+        case TRACE_RAW_WRITE_FULL: return "rawFull";
+        case TRACE_CONNECTION_CLOSE: return "close";
+        default: return "?";
+    }
+}
+
+bool WebTraceBuffer::getEvent(uint32_t sequence, WebTraceEvent& event) const {
+    if(sequence < getOldestSequence() || sequence >= recorded) return false;
+    event = events[sequence & (WS_TRACE_BUFFER_SIZE - 1)];
+    return true;
+}
+
+static size_t appendTraceUnsigned(char* buffer, size_t pos, size_t bufferSize, uint32_t value, bool negative = false) {
+    // the digits are written from the end, so the whole 32 bit range prints the same whatever the size of long is.
+    char sz[12]; // ten digits, the sign and the terminator
+    size_t start = sizeof(sz) - 1;
+    sz[start] = 0;
+    do {
+        sz[--start] = (char)('0' + (value % 10));
+        value /= 10;
+    } while(value != 0);
+    if(negative) sz[--start] = '-';
+    size_t len = sizeof(sz) - 1 - start;
+    if(pos + len + 1 >= bufferSize) return pos;
+    memcpy(&buffer[pos], &sz[start], len);
+    buffer[pos + len] = ' ';
+    return pos + len + 1;
+}
+
+static size_t appendTraceField(char* buffer, size_t pos, size_t bufferSize, int32_t value) {
+    // the most negative value only has a magnitude that fits once it is unsigned.
+    uint32_t magnitude = value < 0 ? 0U - (uint32_t)value : (uint32_t)value;
+    return appendTraceUnsigned(buffer, pos, bufferSize, magnitude, value < 0);
+}
+
+size_t WebTraceBuffer::formatEvent(const WebTraceEvent& event, char* buffer, size_t bufferSize) {
+    if(bufferSize < 2) return 0;
+    size_t pos = appendTraceUnsigned(buffer, 0, bufferSize, event.micros);
+    auto name = traceEventName(event.eventId);
+    size_t nameLen = strlen(name);
+    if(pos + nameLen + 1 < bufferSize) {
+        memcpy(&buffer[pos], name, nameLen);
+        pos += nameLen;
+        buffer[pos++] = ' ';
+    }
+    pos = appendTraceField(buffer, pos, bufferSize, event.socket);
+    pos = appendTraceField(buffer, pos, bufferSize, event.arg1);
+    pos = appendTraceField(buffer, pos, bufferSize, event.arg2);
+    // the last field's separator becomes the end of the line, unless the buffer was too small to hold any field.
+    if(pos == 0) {
+        buffer[0] = 0;
+        return 0;
+    }
+    buffer[pos - 1] = '\n';
+    buffer[pos] = 0;
+    return pos;
+}
+
+void WebTraceBuffer::dump(Print& out) const {
+    char line[64];
+    WebTraceEvent event;
+    for(uint32_t seq = getOldestSequence(); seq < recorded; seq++) {
+        if(!getEvent(seq, event)) continue;
+        auto len = formatEvent(event, line, sizeof line);
+        out.write((const uint8_t*)line, len);
+    }
+}
+
+#ifdef WS_TRACE_ENABLED
+
+WebTraceBuffer tcremote::webTraceBuffer;
+
+static void handleTraceDump(WebServerResponse& response) {
+    response.startHeader();
+    response.contentInfoChunked(WebServerResponse::PLAIN_TEXT);
+    // the dump is bounded by what was recorded when it started, as serving it records more events.
+    uint32_t last = webTraceBuffer.getRecordedCount();
+    char line[64];
+    WebTraceEvent event;
+    for(uint32_t seq = webTraceBuffer.getOldestSequence(); seq < last; seq++) {
+        // events overwritten while an earlier line was being sent are skipped.
+        if(!webTraceBuffer.getEvent(seq, event)) continue;
+        auto len = WebTraceBuffer::formatEvent(event, line, sizeof line);
+        if(!response.send(line, len)) break;
+    }
+}
+
+void tcremote::registerTraceEndpoint(TcMenuLightweightWebServer& webServer, const char* url) {
+    webServer.onUrlGet(url, handleTraceDump);
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+ * This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+ */
+
+/**
+ * @file TcWebTrace.h
+ *
+ * Compile time trace points for the web server and network drivers. Instead of formatting a log line, each trace
+ * point records a small binary event, the event id, the socket, two integer arguments and a microsecond timestamp,
+ * into a fixed ring buffer in RAM, so it costs a few stores and can be left on in production. The most recent events
+ * can be written out as text to any Print, such as Serial, or served over HTTP by registering the trace endpoint.
+ *
+ * Tracing is turned on by defining WS_TRACE_ENABLED for the whole build, otherwise every traceWeb call compiles to
+ * nothing and no buffer is allocated. Trace points must only be hit from task manager context, in the same way as the
+ * rest of the driver API, the buffer is not safe to record into from interrupts.
+ */
+
+#ifndef TCMENU_TCWEBTRACE_H
+#define TCMENU_TCWEBTRACE_H
+
+#include <Arduino.h>
+
+// The number of events held in the trace ring buffer, each event takes 16 bytes. Must be a power of two.
+#ifndef WS_TRACE_BUFFER_SIZE
+#define WS_TRACE_BUFFER_SIZE 64
+#endif
+
+namespace tcremote {
+
+    class TcMenuLightweightWebServer;
+
+    /**
+     * The events that can be recorded, the meaning of the two arguments is given for each one.
+     */
+    enum WebTraceEventId : uint8_t {
+        /** request line read, arg1 is the method, arg2 is the length of the path */
+        TRACE_REQUEST_LINE = 1,
+        /** a header was read, arg1 is the header type, arg2 is the length of the value */
+        TRACE_HEADER_READ,
+        /** reading the request failed, arg1 is the protocol error flag, arg2 is the connected flag */
+        TRACE_READ_ERROR,
+        /** a response was started, arg1 is the status code */
+        TRACE_RESPONSE_START,
+        /** a header was written, arg1 is the header type, arg2 is the length of the header line */
+        TRACE_HEADER_WRITE,
+        /** a response was completed, arg1 is the response mode */
+        TRACE_RESPONSE_END,
+        /** a websocket frame was flushed, arg1 is the payload length */
+        TRACE_WS_FLUSH,
+        /** data was queued with the network stack, arg1 is the amount queued, arg2 is what is left to queue */
+        TRACE_RAW_WRITE,
+        /** the network stack's send queue was full, arg1 is the space available */
+        TRACE_RAW_WRITE_FULL,
+        /** a connection was closed, arg1 is the response mode */
+        TRACE_CONNECTION_CLOSE
+    };
+
+    /**
+     * A single recorded event, kept to 16 bytes so that the buffer stays small.
+     */
+    struct WebTraceEvent {
+        uint32_t micros;
+        int32_t arg1;
+        int32_t arg2;
+        int16_t socket;
+        uint8_t eventId;
+        uint8_t reserved;
+    };
+
+    /**
+     * @return the name of a trace event for printing, or "?" for an unknown event.
+     */
+    const char* traceEventName(uint8_t eventId);
+
+    /**
+     * A fixed size ring buffer of trace events, once full the oldest events are overwritten. Recording is kept inline
+     * so that a trace point is only a handful of instructions.
+     */
+    class WebTraceBuffer {
+    private:
+        WebTraceEvent events[WS_TRACE_BUFFER_SIZE];
+        uint32_t recorded = 0;
+    public:
+        void record(uint8_t eventId, int socket, int32_t arg1, int32_t arg2) {
+            auto& ev = events[recorded & (WS_TRACE_BUFFER_SIZE - 1)];
+            ev.micros = micros();
+            ev.arg1 = arg1;
+            ev.arg2 = arg2;
+            ev.socket = (int16_t)socket;
+            ev.eventId = eventId;
+            recorded++;
+        }
+
+        /** @return the total number of events ever recorded, including those that have been overwritten. */
+        uint32_t getRecordedCount() const { return recorded; }
+
+        /** @return the sequence number of the oldest event still held in the buffer. */
+        uint32_t getOldestSequence() const { return recorded > WS_TRACE_BUFFER_SIZE ? recorded - WS_TRACE_BUFFER_SIZE : 0; }
+
+        /**
+         * Copies out an event by its sequence number, the first event recorded being zero.
+         * @param sequence the sequence number of the event
+         * @param event the event to copy into
+         * @return true if the event is still held, false if it has been overwritten or not yet recorded.
+         */
+        bool getEvent(uint32_t sequence, WebTraceEvent& event) const;
+
+        /**
+         * Formats an event as a single line of text, "micros event socket arg1 arg2" followed by a newline.
+         * @return the length of the line, zero when the buffer is too small to hold any of the fields
+         */
+        static size_t formatEvent(const WebTraceEvent& event, char* buffer, size_t bufferSize);
+
+        /**
+         * Writes every event held in the buffer to the print, oldest first, one line per event.
+         */
+        void dump(Print& out) const;
+
+        /** clears down the buffer */
+        void clear() { recorded = 0; }
+    };
+
+#ifdef WS_TRACE_ENABLED
+    /** the trace buffer that all trace points record into */
+    extern WebTraceBuffer webTraceBuffer;
+
+    /**
+     * Registers a handler on the web server that returns the trace buffer as plain text, oldest event first.
+     * @param webServer the web server to add the handler to
+     * @param url the URL of the trace dump
+     */
+    void registerTraceEndpoint(TcMenuLightweightWebServer& webServer, const char* url = "/trace");
+#endif
+}
+
+#ifdef WS_TRACE_ENABLED
+#define traceWeb(eventId, socket, arg1, arg2) tcremote::webTraceBuffer.record(eventId, socket, arg1, arg2)
+#else
+#define traceWeb(eventId, socket, arg1, arg2) ((void)0)
+#endif
+
+#endif //TCMENU_TCWEBTRACE_H
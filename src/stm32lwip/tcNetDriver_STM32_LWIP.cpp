@@ -17,9 +17,31 @@
 #include "IoLogging.h"
 #include <SCCircularBuffer.h>
 #include "TcMenuNetLwIP.h"
+#include <remote/TcWebTrace.h>
 
 #define MAX_TCP_ACCEPTS 2
+
+// The number of client sockets, if you use the web server this should be more than the number of web server responses
+// so that the web server can apply admission control, IE send a 503 or evict idle connections when overloaded.
+#ifndef MAX_TCP_CLIENTS
 #define MAX_TCP_CLIENTS 3
+#endif
+
+// The number of accepted connections that can wait for a free client socket, and how long they can wait for one.
+// Connections that overflow the queue, or wait too long, are closed.
+#ifndef MAX_TCP_ACCEPT_BACKLOG
+#define MAX_TCP_ACCEPT_BACKLOG 5
+#endif
+#ifndef MAX_TCP_ACCEPT_WAIT_MILLIS
+#define MAX_TCP_ACCEPT_WAIT_MILLIS 1000
+#endif
+// Constant and flash data is sent without copying, lwip then holds a reference pbuf that points at it until the data
+// has been acknowledged. This is how many such writes each client can have waiting for acknowledgement, it bounds how
+// much of lwip's MEMP_NUM_PBUF pool one client can take, further writes wait for acknowledgements to free some up.
+#ifndef MAX_NO_COPY_IN_FLIGHT
+#define MAX_NO_COPY_IN_FLIGHT 8
+#endif
+
 // The write buffer is to prevent small packets with only a few bytes from being written.
 #define WRITE_BUFFER_SIZE 128
 
@@ -33,6 +55,7 @@ namespace tcremote {
     err_t tcpDataWasReceived(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
     void tcpErrorCallback(void *arg, err_t err);
     err_t tcpDataSentCallback(void *arg, struct tcp_pcb *tpcb, u16_t len);
+    void tcpClientFreed();
 
     const uint8_t* myMacAddress;
 
@@ -45,39 +68,63 @@ namespace tcremote {
         uint16_t timeOutMillis;
         uint16_t lastWriteTick;
         uint8_t clientNumber;
+        bool writeReserved;
+        bool peerClosed;
+        uint32_t bytesQueued;
+        uint32_t bytesAcked;
+        uint32_t noCopyEnds[MAX_NO_COPY_IN_FLIGHT];
+        uint8_t noCopyFirst;
+        uint8_t noCopyCount;
+        SocketReadyCallback readyCallback;
+        void* readyCallbackData;
     public:
-        StmTcpClient() : clientStruct{}, writeBuffer{}, writeBufferPos(0), readBuffer(READ_BUFFER_SIZE), timeOutMillis(1000), lastWriteTick(0) {}
-
-        void initialise(tcp_pcb* pcb, unsigned int sockNo);
-        SocketErrCode flush();
-        SocketErrCode doRawTcpWrite(const uint8_t* buffer, size_t len, bool constMem);
+        StmTcpClient() : clientStruct{}, writeBuffer{}, writeBufferPos(0), readBuffer(READ_BUFFER_SIZE), timeOutMillis(1000),
+                         lastWriteTick(0), clientNumber(0), writeReserved(false), peerClosed(false), bytesQueued(0), bytesAcked(0),
+                         noCopyEnds{}, noCopyFirst(0), noCopyCount(0), readyCallback(nullptr),
+                         readyCallbackData(nullptr) {}
+
+        void initialise(tcp_pcb* pcb, unsigned int sockNo, SocketReadyCallback onReady, void* onReadyData);
+        void notifyReady() { if(readyCallback) readyCallback(clientNumber, readyCallbackData); }
+        SocketErrCode flush(bool pushNow = true);
+        SocketErrCode doRawTcpWrite(const uint8_t* buffer, size_t len, bool constMem, bool pushNow = true);
         void tick();
         void close();
         int read(uint8_t * buffer, size_t bufferSize);
         void setWriteTimeout(uint16_t timeout) { timeOutMillis =  timeout; }
         SocketErrCode pushToBuffer(uint8_t data);
+        uint8_t* reserve(size_t minimumLen, size_t* actualLen);
+        SocketErrCode commit(size_t len);
+        void dataSent(u16_t len);
         err_t dataRx(tcp_pcb* pcb, pbuf* p, err_t err);
 
         bool isInUse() const { return clientStruct.pcb != nullptr; }
+        bool isUsing(const tcp_pcb* pcb) const { return pcb != nullptr && clientStruct.pcb == pcb; }
 
         socket_t getClientNo() const { return clientNumber; }
 
-        bool readAvailable() const {
-            return clientStruct.data.available > 0;
+        bool readAvailable() {
+            // received data goes straight into the read buffer, the count in the client struct is never updated. Once
+            // the peer has closed, the failed read that tells the caller is always available.
+            return readBuffer.available() || peerClosed;
         }
 
         bool writeAvailable() {
-            return true;
+            // same test as doRawTcpWrite uses, so a write of up to MAX_SEND_PER_PACKET will not need to wait.
+            return clientStruct.pcb != nullptr && tcp_sndbuf(clientStruct.pcb) > MAX_SEND_PER_PACKET;
         }
     };
 
-    SocketErrCode StmTcpClient::flush() {
+    SocketErrCode StmTcpClient::flush(bool pushNow) {
         if ((clientStruct.state != TCP_ACCEPTED) && (clientStruct.state != TCP_CONNECTED)) {
             return SOCK_ERR_FAILED;
         }
 
-        if(writeBufferPos == 0) return SOCK_ERR_OK; // nothing to do
-        auto err = doRawTcpWrite(writeBuffer, writeBufferPos, false);
+        if(writeBufferPos == 0) {
+            // nothing buffered, but there may be data queued with lwip from an earlier write that was not pushed.
+            if(pushNow && clientStruct.pcb && ERR_OK != tcp_output(clientStruct.pcb)) return SOCK_ERR_FAILED;
+            return SOCK_ERR_OK;
+        }
+        auto err = doRawTcpWrite(writeBuffer, writeBufferPos, false, pushNow);
         writeBufferPos = 0;
 
         return err;
@@ -86,11 +133,14 @@ namespace tcremote {
     void StmTcpClient::tick() {
         if(clientStruct.pcb != nullptr && lastWriteTick > 0) {
             --lastWriteTick;
-            if(lastWriteTick == 0 && writeBufferPos > 0) flush();
+            // the timed flush must not move the buffer underneath space that is reserved but not yet committed.
+            if(lastWriteTick == 0 && writeBufferPos > 0 && !writeReserved) flush();
         }
     }
 
     void StmTcpClient::close() {
+        // space reserved for a write that will now never be committed must not hold back the timed flush.
+        writeReserved = false;
         if(clientStruct.pcb) {
             if(writeBufferPos != 0) {
                 serlogF2(SER_WARNING, "Close with buffer full", clientNumber);
@@ -98,10 +148,13 @@ namespace tcremote {
             tcp_connection_close(clientStruct.pcb, &clientStruct);
             // clear the read buffer out.
             while(readBuffer.available()) readBuffer.get();
+            readyCallback = nullptr;
+            // a connection may be waiting for this client.
+            tcpClientFreed();
         }
     }
 
-    SocketErrCode StmTcpClient::doRawTcpWrite(const uint8_t *buffer, size_t len, bool constMem) {
+    SocketErrCode StmTcpClient::doRawTcpWrite(const uint8_t *buffer, size_t len, bool constMem, bool pushNow) {
         size_t left = len;
         uint32_t then = millis();
         size_t posn = 0;
@@ -111,32 +164,53 @@ namespace tcremote {
             auto rawSendSize = uint16_t(tcp_sndbuf(clientStruct.pcb));
             size_t maxSendSize = min(uint16_t(MAX_SEND_PER_PACKET), rawSendSize);
 
-            if(rawSendSize > MAX_SEND_PER_PACKET) {
-                size_t thisTime = left > maxSendSize ? maxSendSize : left;
+            // constant data is referenced rather than copied, but only while there is a free slot to track it in.
+            bool noCopySlotFree = !constMem || noCopyCount < MAX_NO_COPY_IN_FLIGHT;
+            err_t err = ERR_MEM;
+            size_t thisTime = left > maxSendSize ? maxSendSize : left;
+            if(rawSendSize > MAX_SEND_PER_PACKET && noCopySlotFree) {
                 unsigned int flags = TCP_WRITE_FLAG_MORE;
-                if(constMem) flags |= TCP_WRITE_FLAG_COPY;
-                auto err = tcp_write(clientStruct.pcb, &buffer[posn], thisTime,  flags);
-                if (err != ERR_OK) {
+                // memory that is not constant must be copied, as it may be reused before lwip has finished with it,
+                // this is especially important now that writes may be queued with lwip until the next flush.
+                if(!constMem) flags |= TCP_WRITE_FLAG_COPY;
+                err = tcp_write(clientStruct.pcb, &buffer[posn], thisTime,  flags);
+                if (err != ERR_OK && err != ERR_MEM) {
                     serlogF4(NET_LOGGING_CHANNEL, "Socket write error, len", clientNumber, err, thisTime);
                     return SOCK_ERR_FAILED;
-                } else {
-#ifdef LOGGING_IO_OP_DEBUG
-                    serlogF4(NET_LOGGING_CHANNEL, "Written this time, left ", clientNumber, thisTime, left);
-#endif
+                }
+            }
+
+            if(err == ERR_OK) {
+                traceWeb(TRACE_RAW_WRITE, clientNumber, thisTime, left);
+                bytesQueued += thisTime;
+                if(constMem) {
+                    // the reference is released once everything up to the end of this write has been acknowledged.
+                    noCopyEnds[(noCopyFirst + noCopyCount) % MAX_NO_COPY_IN_FLIGHT] = bytesQueued;
+                    noCopyCount++;
                 }
 
                 left -= thisTime;
                 posn += thisTime;
 
+                // keep queueing while lwip has room, so a large file goes out as fast as the acknowledgements come
+                // back, rather than one packet per wait.
+                if(left > 0 && tcp_sndbuf(clientStruct.pcb) > MAX_SEND_PER_PACKET) continue;
+
+                // when not pushing now, the data stays queued in lwip so that several small writes, such as many
+                // pipelined responses, are coalesced into full segments on the next flush.
+                if(!pushNow && left == 0) break;
                 if (ERR_OK != tcp_output(clientStruct.pcb)) {
                     return SOCK_ERR_FAILED;
                 }
+                if(left == 0) break;
                 // give other tasks chance to run
                 taskManager.yieldForMicros(millisToMicros(20));
 
             } else {
-                // if we are getting ahead of ourselves by too far, or we've run out of space we back off
-                serlogF3(NET_LOGGING_CHANNEL, "Socket write queue full ", clientNumber, maxSendSize);
+                // if we are getting ahead of ourselves by too far, or we've run out of space, pbufs or no copy slots,
+                // we back off, making sure anything already queued is actually being sent.
+                tcp_output(clientStruct.pcb);
+                traceWeb(TRACE_RAW_WRITE_FULL, clientNumber, maxSendSize, 0);
                 // give other tasks chance to run
                 taskManager.yieldForMicros(millisToMicros(100));
 
@@ -151,6 +225,8 @@ namespace tcremote {
     }
 
     int StmTcpClient::read(uint8_t *buffer, size_t bufferSize) {
+        // as with a socket, the peer closing is reported as an error once everything it sent has been read.
+        if(peerClosed && !readBuffer.available()) return -1;
         size_t pos = 0;
         while(readBuffer.available() && pos < bufferSize) {
             buffer[pos] = readBuffer.get();
@@ -162,7 +238,8 @@ namespace tcremote {
 
     SocketErrCode StmTcpClient::pushToBuffer(uint8_t data) {
         if(writeBufferPos >= WRITE_BUFFER_SIZE) {
-            auto ret = flush();
+            // the buffer is full, hand it to lwip but don't push it yet, it will go with the next flush.
+            auto ret = flush(false);
             if(ret != SOCK_ERR_OK) {
                 close();
                 return ret;
@@ -174,12 +251,40 @@ namespace tcremote {
         return SOCK_ERR_OK;
     }
 
+    void StmTcpClient::dataSent(u16_t len) {
+        bytesAcked += len;
+        while(noCopyCount > 0 && int32_t(bytesAcked - noCopyEnds[noCopyFirst]) >= 0) {
+            noCopyFirst = (noCopyFirst + 1) % MAX_NO_COPY_IN_FLIGHT;
+            noCopyCount--;
+        }
+    }
+
+    uint8_t* StmTcpClient::reserve(size_t minimumLen, size_t* actualLen) {
+        if(minimumLen > WRITE_BUFFER_SIZE) return nullptr;
+        // as with pushToBuffer, when there is not enough room the buffer goes to lwip but is not pushed yet.
+        if(size_t(WRITE_BUFFER_SIZE - writeBufferPos) < minimumLen && flush(false) != SOCK_ERR_OK) return nullptr;
+        *actualLen = WRITE_BUFFER_SIZE - writeBufferPos;
+        writeReserved = true;
+        return &writeBuffer[writeBufferPos];
+    }
+
+    SocketErrCode StmTcpClient::commit(size_t len) {
+        writeReserved = false;
+        if(len > size_t(WRITE_BUFFER_SIZE - writeBufferPos)) return SOCK_ERR_FAILED;
+        writeBufferPos += len;
+        if(lastWriteTick == 0) lastWriteTick = 3;
+        return SOCK_ERR_OK;
+    }
+
     err_t StmTcpClient::dataRx(tcp_pcb *pcb, pbuf *p, err_t err) {
         err_t ret_err;
 
-        /* if we receive an empty tcp frame from server => close connection */
+        /* an empty tcp frame means the peer has closed its end */
         if (p == nullptr) {
-            /* probably a closed socket here, we ignore, the higher level protocols will time this out */
+            // reads fail once the data already received has been read, the server then closes its end straight away
+            // rather than leaving the connection until its deadline expires.
+            peerClosed = true;
+            notifyReady();
             ret_err = ERR_OK;
         } else if (err != ERR_OK) {
             /* free received pbuf*/
@@ -200,6 +305,7 @@ namespace tcremote {
                 buff = buff->next;
             }
             pbuf_free(p);
+            notifyReady();
             ret_err = ERR_OK;
         } else {
             /* data received when connection already closed */
@@ -213,14 +319,20 @@ namespace tcremote {
         return ret_err;
     }
 
-    void StmTcpClient::initialise(tcp_pcb *pcb, unsigned int sockNo) {
+    void StmTcpClient::initialise(tcp_pcb *pcb, unsigned int sockNo, SocketReadyCallback onReady, void* onReadyData) {
         clientStruct.pcb = pcb;
         clientStruct.state = TCP_ACCEPTED;
         clientStruct.data.p = nullptr;
         clientStruct.data.available = 0;
         writeBufferPos = 0;
+        writeReserved = false;
+        peerClosed = false;
+        bytesQueued = bytesAcked = 0;
+        noCopyFirst = noCopyCount = 0;
         lastWriteTick = 0;
         clientNumber = sockNo;
+        readyCallback = onReady;
+        readyCallbackData = onReadyData;
         serlogF2(NET_LOGGING_CHANNEL, "Client accept to ", sockNo);
         tcp_arg(pcb, this);
         tcp_recv(pcb, tcpDataWasReceived);
@@ -242,6 +354,12 @@ namespace tcremote {
     }
 
     err_t tcpDataSentCallback(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+        // there is now more room to write, anything waiting to send can continue.
+        auto* client = reinterpret_cast<StmTcpClient*>(arg);
+        if(client) {
+            client->dataSent(len);
+            client->notifyReady();
+        }
         return ERR_OK;
     }
 
@@ -249,23 +367,38 @@ namespace tcremote {
 
     class StmTcpServer : public BaseEvent {
     private:
+        struct WaitingClient {
+            tcp_pcb* pcb;
+            unsigned long acceptedAt;
+        };
         uint16_t portNum;
         tcp_struct tcpServer;
         void* userData;
         ServerAcceptedCallback theCallback;
-        tccollection::GenericCircularBuffer<tcp_pcb*> newClientQueue;
+        SocketReadyCallback readyCallback;
+        WaitingClient newClientQueue[MAX_TCP_ACCEPT_BACKLOG];
+        // clients set up within lwip's accept callback, that are yet to be given to the server from exec.
+        tcp_pcb* handOverPending[MAX_TCP_CLIENTS];
+        uint8_t queueFirst;
+        uint8_t queueCount;
     public:
-        StmTcpServer() : portNum(0), tcpServer{}, userData(nullptr), theCallback(nullptr), newClientQueue(5) {
+        StmTcpServer() : portNum(0), tcpServer{}, userData(nullptr), theCallback(nullptr), readyCallback(nullptr),
+                         newClientQueue{}, handOverPending{}, queueFirst(0), queueCount(0) {
         }
 
         uint16_t getPortNum() const { return portNum; }
 
-        bool initialise(uint16_t port, ServerAcceptedCallback cb, void *theData);
+        bool initialise(uint16_t port, ServerAcceptedCallback cb, void *theData, SocketReadyCallback onReady);
         void onNewClient(tcp_pcb* clientPcb);
+        void onClientFreed() { if(queueCount > 0) markTriggeredAndNotify(); }
 
         void exec() override;
 
         uint32_t timeOfNextCheck() override;
+    private:
+        void rejectClient(tcp_pcb* clientPcb);
+        void acceptClient(tcp_pcb* clientPcb, socket_t client);
+        void handOverClient(socket_t client);
     };
 
     err_t tcpConnectionEstablished(void *arg, struct tcp_pcb *newpcb, err_t err) {
@@ -279,7 +412,7 @@ namespace tcremote {
         }
     }
 
-    bool StmTcpServer::initialise(uint16_t port, ServerAcceptedCallback cb, void *theData) {
+    bool StmTcpServer::initialise(uint16_t port, ServerAcceptedCallback cb, void *theData, SocketReadyCallback onReady) {
         taskManager.registerEvent(this);
 
         tcpServer.pcb = tcp_new();
@@ -294,6 +427,7 @@ namespace tcremote {
 
         tcpServer.pcb = tcp_listen(tcpServer.pcb);
         theCallback = cb;
+        readyCallback = onReady;
         userData = theData;
         tcp_accept(tcpServer.pcb, tcpConnectionEstablished);
         portNum = port;
@@ -309,35 +443,93 @@ namespace tcremote {
 
     void StmTcpServer::onNewClient(tcp_pcb* clientPcb) {
         tcp_setprio(clientPcb, TCP_PRIO_MIN);
-        newClientQueue.put(clientPcb);
+        // when nothing is queued ahead of it and a client is free, it is set up straight away so that no data is
+        // lost, but the server is only told from exec, as it may write to or close the connection, which must not
+        // happen while lwip is still within its accept callback.
+        int client = nextFreeClient();
+        if(queueCount == 0 && client != TC_BAD_SOCKET_ID) {
+            tcpClients[client].initialise(clientPcb, client, readyCallback, userData);
+            handOverPending[client] = clientPcb;
+            markTriggeredAndNotify();
+            return;
+        }
+        if(queueCount >= MAX_TCP_ACCEPT_BACKLOG) {
+            serlogF2(NET_LOGGING_CHANNEL, "Accept backlog full on ", portNum);
+            rejectClient(clientPcb);
+            return;
+        }
+        auto& waiting = newClientQueue[(queueFirst + queueCount) % MAX_TCP_ACCEPT_BACKLOG];
+        waiting.pcb = clientPcb;
+        waiting.acceptedAt = millis();
+        queueCount++;
         markTriggeredAndNotify();
     }
 
+    void StmTcpServer::acceptClient(tcp_pcb* clientPcb, socket_t client) {
+        tcpClients[client].initialise(clientPcb, client, readyCallback, userData);
+        handOverClient(client);
+    }
+
+    void StmTcpServer::handOverClient(socket_t client) {
+        theCallback(client, userData);
+        // data may have arrived before the server knew about the client, let it know the data is there.
+        if(tcpClients[client].readAvailable()) tcpClients[client].notifyReady();
+    }
+
+    void StmTcpServer::rejectClient(tcp_pcb* clientPcb) {
+        // the protocol is not known at this level, so we just close, and abort if even that is not possible.
+        tcp_arg(clientPcb, nullptr);
+        if(tcp_close(clientPcb) != ERR_OK) tcp_abort(clientPcb);
+    }
+
     void StmTcpServer::exec() {
-        while(newClientQueue.available()) {
+        for(int i = 0; i < MAX_TCP_CLIENTS; i++) {
+            auto pcb = handOverPending[i];
+            handOverPending[i] = nullptr;
+            // the client may have closed since, and its slot even been given to another connection.
+            if(tcpClients[i].isUsing(pcb)) handOverClient(i);
+        }
+
+        while(queueCount > 0) {
+            auto& waiting = newClientQueue[queueFirst];
             int client = nextFreeClient();
-            if(client == TC_BAD_SOCKET_ID) {
+            if(client != TC_BAD_SOCKET_ID) {
+                // we have a client and an available handler, set up the client now.
+                acceptClient(waiting.pcb, client);
+            } else if((millis() - waiting.acceptedAt) > MAX_TCP_ACCEPT_WAIT_MILLIS) {
+                serlogF2(NET_LOGGING_CHANNEL, "Accept wait exceeded on ", portNum);
+                rejectClient(waiting.pcb);
+            } else {
                 // we can't accept at the moment so exit the exec method, we'll try again next call.
                 serlogF2(NET_LOGGING_CHANNEL, "Accepted client waiting on ", portNum);
                 return;
             }
-
-            // we have a client and an available handler, set up the client now.
-            auto pcb = (tcp_pcb*)newClientQueue.get();
-            tcpClients[client].initialise(pcb, client);
-            theCallback(client, userData);
+            queueFirst = (queueFirst + 1) % MAX_TCP_ACCEPT_BACKLOG;
+            queueCount--;
         }
     }
 
     uint32_t StmTcpServer::timeOfNextCheck() {
-        if(newClientQueue.available() && nextFreeClient() != TC_BAD_SOCKET_ID) {
+        // we are notified when a client is freed, so the only thing to check is when the oldest waiting connection
+        // will have waited too long, there is no need to poll when nothing is waiting.
+        if(queueCount == 0) return millisToMicros(MAX_TCP_ACCEPT_WAIT_MILLIS);
+
+        unsigned long waited = millis() - newClientQueue[queueFirst].acceptedAt;
+        if(waited > MAX_TCP_ACCEPT_WAIT_MILLIS) {
             markTriggeredAndNotify();
+            return millisToMicros(MAX_TCP_ACCEPT_WAIT_MILLIS);
         }
-        return millisToMicros(250);
+        return millisToMicros((MAX_TCP_ACCEPT_WAIT_MILLIS - waited) + 1);
     }
 
     StmTcpServer tcpSlots[MAX_TCP_ACCEPTS];
 
+    void tcpClientFreed() {
+        for(auto& slot : tcpSlots) {
+            slot.onClientFreed();
+        }
+    }
+
     SocketErrCode startNetLayerDhcp() {
         return SOCK_ERR_UNSUPPORTED;
     }
@@ -380,10 +572,10 @@ namespace tcremote {
         return !(!stm32_eth_is_init()) && stm32_eth_link_up() != 0;
     }
 
-    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void* callbackData) {
+    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void* callbackData, SocketReadyCallback onSocketReady) {
         for(int i=0; i<MAX_TCP_ACCEPTS; i++) {
             if(tcpSlots[i].getPortNum() == 0) {
-                tcpSlots[i].initialise(port, onServerAccepted, callbackData);
+                tcpSlots[i].initialise(port, onServerAccepted, callbackData, onSocketReady);
                 return SOCK_ERR_OK;
             }
         }
@@ -409,14 +601,16 @@ namespace tcremote {
 
     SocketErrCode rawWriteData(socket_t socketNum, const void* data, size_t dataLen, MemoryLocationType locationType, int timeoutMillis) {
         if(socketNum < 0 || socketNum >= MAX_TCP_CLIENTS || !tcpClients[socketNum].isInUse()) return SOCK_ERR_FAILED;
-        if(locationType == IN_PROGRAM_MEM) return SOCK_ERR_NO_PROGMEM_SUPPORT;
+        // both paths end up in the same write loop, so the timeout must be set before either, or a large write would
+        // wait for whatever timeout the previous small write left behind.
+        tcpClients[socketNum].setWriteTimeout(timeoutMillis);
         if(dataLen > 100) {
-            // this is a large data set, flush what we've got and send in one go
-            if(tcpClients[socketNum].flush() != SOCK_ERR_OK) return SOCK_ERR_FAILED;
-            return tcpClients[socketNum].doRawTcpWrite((uint8_t*)data, dataLen, locationType == CONSTANT_NO_COPY);
+            // this is a large data set, queue what we've got without pushing it, and send in one go. Flash is mapped
+            // into the address space on STM32, so program memory is sent by reference just like constant data.
+            if(tcpClients[socketNum].flush(false) != SOCK_ERR_OK) return SOCK_ERR_FAILED;
+            return tcpClients[socketNum].doRawTcpWrite((uint8_t*)data, dataLen, locationType != RAM_NEEDS_COPY);
         }
         else {
-            tcpClients[socketNum].setWriteTimeout(timeoutMillis);
             for (size_t i = 0; i < dataLen; i++) {
                 auto ret = tcpClients[socketNum].pushToBuffer(((uint8_t *) data)[i]);
                 if (ret != SOCK_ERR_OK) return ret;
@@ -425,6 +619,16 @@ namespace tcremote {
         return SOCK_ERR_OK;
     }
 
+    uint8_t* rawWriteReserve(socket_t socketNum, size_t minimumLen, size_t* actualLen) {
+        if(socketNum < 0 || socketNum >= MAX_TCP_CLIENTS || !tcpClients[socketNum].isInUse()) return nullptr;
+        return tcpClients[socketNum].reserve(minimumLen, actualLen);
+    }
+
+    SocketErrCode rawWriteCommit(socket_t socketNum, size_t len) {
+        if(socketNum < 0 || socketNum >= MAX_TCP_CLIENTS || !tcpClients[socketNum].isInUse()) return SOCK_ERR_FAILED;
+        return tcpClients[socketNum].commit(len);
+    }
+
     SocketErrCode rawFlushAll(socket_t socketNum) {
         if(socketNum < 0 || socketNum >= MAX_TCP_CLIENTS || !tcpClients[socketNum].isInUse()) return SOCK_ERR_FAILED;
         return tcpClients[socketNum].flush();
@@ -0,0 +1,243 @@
+// Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+// This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+
+/**
+ * End to end benchmarks that drive realistic traffic through the whole web server stack, from the server accepting the
+ * connection, through the response and transport, down to the unit test driver. Each benchmark reports requests per
+ * second, nanoseconds per request, driver calls per request, and the framing overhead, which is the number of bytes
+ * written to the driver for every hundred bytes of content. The bytes written are also split into those the driver had
+ * to copy from a buffer in the stack, and those the stack built in place in the driver's own buffer. Copies made inside
+ * the stack itself are not counted. The driver is set to discard what it is sent, so the figures only cover the server.
+ *
+ * The benchmarks are a separate host target from the unit tests, as they take much longer to run. They share the unit
+ * test driver from remoteTests, see benchmarkDriver.cpp.
+ */
+
+#include <AUnit.h>
+#include <remote/BaseRemoteComponents.h>
+#include <SimpleCollections.h>
+#include "remote/TcMenuWebServer.h"
+#include "SimpleTestFixtures.h"
+#include "../remoteTests/UnitTestDriver.h"
+
+using namespace aunit;
+using namespace tcremote;
+
+// The number of times each benchmark scenario is repeated, increase it for more stable figures on a host.
+#ifndef WS_BENCHMARK_ITERATIONS
+#define WS_BENCHMARK_ITERATIONS 500
+#endif
+
+// the requests a browser makes to load a page, the last one asks to close the connection.
+const char BENCH_REQ_INDEX[] = "GET /index.html HTTP/1.1\r\n"
+                               "Host: 192.168.0.20\r\n"
+                               "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                               "Accept-Encoding: gzip, deflate\r\n"
+                               "Accept-Language: en-GB,en;q=0.9\r\n"
+                               "Connection: keep-alive\r\n\r\n";
+const char BENCH_REQ_CSS[] = "GET /style.css HTTP/1.1\r\n"
+                             "Host: 192.168.0.20\r\n"
+                             "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                             "Accept: text/css,*/*;q=0.1\r\n"
+                             "Referer: http://192.168.0.20/index.html\r\n"
+                             "Accept-Encoding: gzip, deflate\r\n"
+                             "Connection: keep-alive\r\n\r\n";
+const char BENCH_REQ_JS[] = "GET /app.js HTTP/1.1\r\n"
+                            "Host: 192.168.0.20\r\n"
+                            "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                            "Accept: */*\r\n"
+                            "Referer: http://192.168.0.20/index.html\r\n"
+                            "Accept-Encoding: gzip, deflate\r\n"
+                            "Connection: keep-alive\r\n\r\n";
+const char BENCH_REQ_FAVICON[] = "GET /favicon.ico HTTP/1.1\r\n"
+                                 "Host: 192.168.0.20\r\n"
+                                 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                                 "Accept: image/avif,image/webp,image/*,*/*;q=0.8\r\n"
+                                 "Referer: http://192.168.0.20/index.html\r\n"
+                                 "Connection: close\r\n\r\n";
+
+const char BENCH_REQ_UPGRADE[] = "GET /ws HTTP/1.1\r\n"
+                                 "Host: 192.168.0.20\r\n"
+                                 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 Chrome/120.0\r\n"
+                                 "Upgrade: websocket\r\n"
+                                 "Connection: Upgrade\r\n"
+                                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                 "Origin: http://192.168.0.20\r\n"
+                                 "Sec-WebSocket-Version: 13\r\n\r\n";
+
+const char* const benchPageRequests[] = { BENCH_REQ_INDEX, BENCH_REQ_CSS, BENCH_REQ_JS, BENCH_REQ_FAVICON };
+const int benchPageRequestCount = sizeof(benchPageRequests) / sizeof(benchPageRequests[0]);
+
+char benchIndexHtml[1024];
+char benchStyleCss[600];
+char benchAppJs[1536];
+uint32_t benchPayloadBytes = 0;
+
+void fillBenchContent(char* content, size_t size, const char* pattern) {
+    size_t patternLen = strlen(pattern);
+    for(size_t i = 0; i < size; i++) content[i] = pattern[i % patternLen];
+}
+
+void sendBenchContent(WebServerResponse& response, WebServerResponse::WSRContentType type, const char* content, size_t size) {
+    response.startHeader();
+    response.contentInfo(type, size);
+    response.send(content, size);
+    benchPayloadBytes += size;
+}
+
+void registerBenchPages(TcMenuLightweightWebServer& webServer) {
+    fillBenchContent(benchIndexHtml, sizeof benchIndexHtml, "<div class=\"item\"><span>Volume</span><b>22dB</b></div>\n");
+    fillBenchContent(benchStyleCss, sizeof benchStyleCss, ".item { margin: 2px; padding: 4px; color: #333; }\n");
+    fillBenchContent(benchAppJs, sizeof benchAppJs, "function update(id, val) { document.getElementById(id).innerText = val; }\n");
+
+    webServer.onUrlGet("/index.html", [](WebServerResponse& response) {
+        sendBenchContent(response, WebServerResponse::HTML_TEXT, benchIndexHtml, sizeof benchIndexHtml);
+    });
+    webServer.onUrlGet("/style.css", [](WebServerResponse& response) {
+        sendBenchContent(response, WebServerResponse::TEXT_CSS, benchStyleCss, sizeof benchStyleCss);
+    });
+    webServer.onUrlGet("/app.js", [](WebServerResponse& response) {
+        sendBenchContent(response, WebServerResponse::JAVASCRIPT, benchAppJs, sizeof benchAppJs);
+    });
+}
+
+void reportBenchmark(const char* name, uint32_t requests, unsigned long elapsedMicros, uint32_t payloadBytes) {
+    if(elapsedMicros == 0) elapsedMicros = 1;
+    serdebugF2("Benchmark ", name);
+    serdebugF3("  requests, micros: ", requests, elapsedMicros);
+    serdebugF3("  requests/sec, ns/request: ", (uint32_t)((requests * 1000000ULL) / elapsedMicros),
+               (uint32_t)((elapsedMicros * 1000ULL) / requests));
+    serdebugF3("  driver calls/request, bytes read/request: ", driverStats.totalCalls() / requests, driverStats.bytesRead / requests);
+    serdebugF3("  driver bytes written, framing overhead per 100 content bytes: ", driverStats.bytesWritten,
+               payloadBytes ? (uint32_t)((driverStats.bytesWritten * 100ULL) / payloadBytes) : 0);
+    serdebugF3("  bytes copied by driver, built in place: ", driverStats.bytesWritten - driverStats.bytesCommitted,
+               driverStats.bytesCommitted);
+    serdebugF3("  reads, writes: ", driverStats.readCalls, driverStats.writeCalls);
+    serdebugF3("  flushes, available checks: ", driverStats.flushCalls, driverStats.availableCalls);
+}
+
+bool serveBenchPageLoad(TcMenuLightweightWebServer& webServer) {
+    simulateAccept();
+    for(int i = 0; i < benchPageRequestCount; i++) {
+        driverSocket.simulateIncomingRaw(benchPageRequests[i]);
+        webServer.exec();
+    }
+    // the favicon is not found, and the browser asked for the connection to be closed after it.
+    return driverSocket.didClose() && webServer.getWebResponse(0)->getMode() == WebServerResponse::NOT_IN_USE;
+}
+
+test(testBenchmarkBrowserPageLoad) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    registerBenchPages(webServer);
+    startNetLayerDhcp();
+    webServer.exec();
+    assertTrue(webServer.isInitialised());
+
+    driverSocket.setDiscardWrites(true);
+    resetDriverStats();
+    benchPayloadBytes = 0;
+
+    // a single page load first, to check every request is served before anything is measured.
+    assertTrue(serveBenchPageLoad(webServer));
+    assertEqual((uint32_t)(sizeof benchIndexHtml + sizeof benchStyleCss + sizeof benchAppJs), benchPayloadBytes);
+    uint32_t bytesPerLoad = driverStats.bytesWritten;
+
+    resetDriverStats();
+    benchPayloadBytes = 0;
+    unsigned long start = micros();
+    for(int i = 0; i < WS_BENCHMARK_ITERATIONS; i++) {
+        driverSocket.reset(false);
+        if(!serveBenchPageLoad(webServer)) break;
+    }
+    unsigned long elapsed = micros() - start;
+    driverSocket.setDiscardWrites(false);
+
+    assertEqual(bytesPerLoad * WS_BENCHMARK_ITERATIONS, driverStats.bytesWritten);
+    reportBenchmark("browser page load", WS_BENCHMARK_ITERATIONS * benchPageRequestCount, elapsed, benchPayloadBytes);
+}
+
+test(testBenchmarkWebSocketUpgrade) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+
+    driverSocket.setDiscardWrites(true);
+    resetDriverStats();
+    unsigned long start = micros();
+    int upgraded = 0;
+    for(int i = 0; i < WS_BENCHMARK_ITERATIONS; i++) {
+        driverSocket.reset(false);
+        simulateAccept();
+        driverSocket.simulateIncomingRaw(BENCH_REQ_UPGRADE);
+        webServer.exec();
+        auto response = webServer.getWebResponse(0);
+        if(response->getMode() == WebServerResponse::WEBSOCKET_BUSY) upgraded++;
+        // the websocket handler would close the connection when the client goes away.
+        response->closeConnection();
+    }
+    unsigned long elapsed = micros() - start;
+    driverSocket.setDiscardWrites(false);
+
+    assertEqual(WS_BENCHMARK_ITERATIONS, upgraded);
+    reportBenchmark("websocket upgrade", WS_BENCHMARK_ITERATIONS, elapsed, 0);
+}
+
+test(testBenchmarkTagValueMessageStream) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(BENCH_REQ_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == WebServerResponse::WEBSOCKET_BUSY);
+    auto transport = response->getTransport();
+
+    // each exchange is a change from the client that is read in full, and a change sent back as the remote would.
+    driverSocket.setDiscardWrites(true);
+    resetDriverStats();
+    const char incoming[] = "ID=1|VC=22|";
+    const char outgoing[] = "ID=1|IC=0|VC=22|";
+    uint32_t bytesReceived = 0;
+    unsigned long start = micros();
+    for(int i = 0; i < WS_BENCHMARK_ITERATIONS; i++) {
+        driverSocket.simulateIncomingMsg(MSG_HEARTBEAT, incoming, true);
+        // as with the remote connector, read available is polled until the frame header and the message are read.
+        bool endOfMsg = false;
+        int polls = 0;
+        while(!endOfMsg && polls++ < 100) {
+            while(!endOfMsg && transport->readAvailable()) {
+                bytesReceived++;
+                endOfMsg = transport->readByte() == 0x02;
+            }
+        }
+        transport->startMsg(MSG_HEARTBEAT);
+        transport->writeStr(outgoing);
+        transport->endMsg();
+    }
+    unsigned long elapsed = micros() - start;
+    driverSocket.setDiscardWrites(false);
+
+    // the start, protocol and type bytes, the fields, and the end of message byte.
+    assertEqual((uint32_t)((strlen(incoming) + 5) * WS_BENCHMARK_ITERATIONS), bytesReceived);
+    reportBenchmark("tag value message stream", WS_BENCHMARK_ITERATIONS * 2, elapsed, WS_BENCHMARK_ITERATIONS * strlen(outgoing));
+
+    response->closeConnection();
+}
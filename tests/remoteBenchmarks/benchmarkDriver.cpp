@@ -0,0 +1,5 @@
+// Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+// This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+
+// The benchmarks run on the same unit test driver as the remote tests, it is built into this target from there.
+#include "../remoteTests/unitTestDriver.cpp"
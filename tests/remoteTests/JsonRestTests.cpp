@@ -0,0 +1,479 @@
+// Copyright (c) 2018 https://www.thecoderscorner.com (Dave Cherry).
+// This product is licensed under an Apache license, see the LICENSE file in the top-level directory.
+
+#include <AUnit.h>
+#include <tcMenu.h>
+#include <SimpleCollections.h>
+#include <limits.h>
+#include "remote/TcMenuWebServer.h"
+#include "remote/TcWebJson.h"
+#include "remote/TcMenuRestApi.h"
+#include "UnitTestDriver.h"
+
+using namespace aunit;
+using namespace tcremote;
+
+test(testJsonStreamWriter) {
+    uint8_t buffer[128];
+    JsonStreamWriter writer(buffer, sizeof buffer);
+    writer.startObject();
+    writer.field("id", 12L);
+    writer.field("name", "Say \"hi\"\n");
+    writer.key("items");
+    writer.startArray();
+    writer.numberValue(-1);
+    writer.boolValue(true);
+    writer.startObject();
+    writer.endObject();
+    writer.nullValue();
+    writer.endArray();
+    writer.boolField("ro", false);
+    writer.endObject();
+    assertTrue(writer.flush());
+
+    buffer[writer.getBufferedLength()] = 0;
+    assertEqual("{\"id\":12,\"name\":\"Say \\\"hi\\\"\\n\",\"items\":[-1,true,{},null],\"ro\":false}", (const char*)buffer);
+
+    // without a response to send to, overflowing the buffer is a failure.
+    uint8_t small[8];
+    JsonStreamWriter smallWriter(small, sizeof small);
+    smallWriter.field("tooLong", "for the buffer");
+    assertFalse(smallWriter.flush());
+    assertTrue(smallWriter.hasFailed());
+}
+
+test(testJsonPullParser) {
+    char sz[16];
+    JsonPullParser parser(" {\"value\": -12.5e1, \"name\" : \"A\\\"b\\u0041\", \"list\":[true, false, null], \"sub\":{\"x\":1}}");
+    assertEqual(JSON_OBJECT_START, parser.next(sz, sizeof sz));
+    assertEqual(JSON_KEY, parser.next(sz, sizeof sz));
+    assertEqual("value", sz);
+    assertEqual(JSON_NUMBER, parser.next(sz, sizeof sz));
+    assertEqual("-12.5e1", sz);
+    assertEqual(JSON_KEY, parser.next(sz, sizeof sz));
+    assertEqual("name", sz);
+    assertEqual(JSON_STRING, parser.next(sz, sizeof sz));
+    assertEqual("A\"bA", sz);
+    assertEqual(JSON_KEY, parser.next(sz, sizeof sz));
+    assertEqual(JSON_ARRAY_START, parser.next(sz, sizeof sz));
+    assertEqual(JSON_TRUE, parser.next(sz, sizeof sz));
+    assertEqual(JSON_FALSE, parser.next(sz, sizeof sz));
+    assertEqual(JSON_NULL, parser.next(sz, sizeof sz));
+    assertEqual(JSON_ARRAY_END, parser.next(sz, sizeof sz));
+    assertEqual(JSON_KEY, parser.next(sz, sizeof sz));
+    assertEqual("sub", sz);
+    assertTrue(parser.skipValue(sz, sizeof sz));
+    assertEqual(JSON_OBJECT_END, parser.next(sz, sizeof sz));
+    assertEqual(JSON_END, parser.next(sz, sizeof sz));
+
+    // long strings are truncated to the buffer, and bad literals are errors.
+    JsonPullParser truncating("\"abcdefghijklmnopqrstuvwxyz\" nul");
+    assertEqual(JSON_STRING, truncating.next(sz, sizeof sz));
+    assertEqual("abcdefghijklmno", sz);
+    assertEqual(JSON_ERROR, truncating.next(sz, sizeof sz));
+}
+
+const char HTTP_REQ_REST_MISSING[]= "GET /api/item/9999 HTTP/1.1\r\n"
+                                    "Host: server.example.com\r\n\r\n";
+
+const char HTTP_REQ_REST_BAD_ID[]= "POST /api/item/abc HTTP/1.1\r\n"
+                                   "Host: server.example.com\r\n"
+                                   "Content-Length: 11\r\n\r\n"
+                                   "{\"value\":1}";
+
+const char EXPECTED_REST_NOT_FOUND[] = "HTTP/1.1 404 Not found\r\n"
+                                       "Server: tccWS\r\n"
+                                       "Content-Type: text/plain\r\n"
+                                       "Content-Length: 0\r\n\r\n";
+
+test(testRestApiUnknownItems) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    registerMenuRestApi(webServer);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_REST_MISSING);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_REST_NOT_FOUND));
+    assertFalse(driverSocket.didClose());
+
+    // the body of the request is discarded, so the connection stays usable
+    driverSocket.simulateIncomingRaw(HTTP_REQ_REST_BAD_ID);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_REST_NOT_FOUND));
+    assertFalse(driverSocket.didClose());
+}
+
+/**
+ * Reads the response written to the unit test driver and joins the chunks of its body together.
+ * @param body where to put the body, it is always terminated
+ * @param size the size of the body buffer
+ * @return true if the response was a 200 with a correctly chunked body.
+ */
+bool readChunkedResponseBody(char* body, size_t size) {
+    char sz[1024];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof(sz) - 1);
+    sz[len] = 0;
+    body[0] = 0;
+    if(strncmp(sz, "HTTP/1.1 200 OK\r\n", 17) != 0 || strstr(sz, "Transfer-Encoding: chunked\r\n") == nullptr) return false;
+    const char* pos = strstr(sz, "\r\n\r\n");
+    if(pos == nullptr) return false;
+    pos += 4;
+    size_t bodyLen = 0;
+    while(true) {
+        char* end;
+        long chunkLen = strtol(pos, &end, 16);
+        if(end == pos || strncmp(end, "\r\n", 2) != 0) return false;
+        pos = end + 2;
+        if(chunkLen == 0) return strcmp(pos, "\r\n") == 0;
+        if(bodyLen + chunkLen >= size || strlen(pos) < size_t(chunkLen + 2)) return false;
+        memcpy(&body[bodyLen], pos, chunkLen);
+        bodyLen += chunkLen;
+        body[bodyLen] = 0;
+        pos += chunkLen;
+        if(strncmp(pos, "\r\n", 2) != 0) return false;
+        pos += 2;
+    }
+}
+
+test(testJsonWriterBuildsInChunk) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    // the JSON is built straight into the chunk being gathered, mixed with other sends, it must come out in order.
+    webServer.onUrlGet("/list.json", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfoChunked(tcremote::WebServerResponse::JSON_TEXT);
+        response.send("{\"list\":", 8);
+        JsonStreamWriter writer(response);
+        writer.startArray();
+        for(int i = 0; i < 60; i++) writer.numberValue(i);
+        writer.endArray();
+        writer.flush();
+        response.send("}", 1);
+        response.end();
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw("GET /list.json HTTP/1.1\r\n\r\n");
+    webServer.exec();
+
+    char expected[300];
+    strcpy(expected, "{\"list\":[");
+    for(int i = 0; i < 60; i++) {
+        if(i) strcat(expected, ",");
+        ltoa(i, &expected[strlen(expected)], 10);
+    }
+    strcat(expected, "]}");
+    char body[300];
+    assertTrue(readChunkedResponseBody(body, sizeof body));
+    assertEqual(expected, (const char*)body);
+}
+
+WebBufferPool* jsonTestPool = nullptr;
+bool jsonWriterFailed = false;
+
+test(testJsonWriterFailsWithoutBuffer) {
+    taskManager.reset();
+    resetUnitLayer();
+    WebBufferPool pool(2, 125);
+    jsonTestPool = &pool;
+    jsonWriterFailed = false;
+    TcMenuLightweightWebServer webServer(80, 1, false, &pool);
+    webServer.init();
+
+    // every buffer is taken before the JSON starts, so the writer cannot get one to build it in.
+    webServer.onUrlGet("/list.json", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfoChunked(tcremote::WebServerResponse::JSON_TEXT);
+        auto held = jsonTestPool->lease();
+        JsonStreamWriter writer(response);
+        writer.startArray();
+        for(int i = 0; i < 60; i++) writer.numberValue(i);
+        writer.endArray();
+        jsonWriterFailed = !writer.flush() && writer.hasFailed();
+        if(held) jsonTestPool->release(held);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw("GET /list.json HTTP/1.1\r\n\r\n");
+    webServer.exec();
+
+    // the response fails and its connection is closed, rather than the JSON going out a character at a time.
+    assertTrue(jsonWriterFailed);
+    assertTrue(driverSocket.didClose());
+    assertTrue(webServer.getWebResponse(0)->getMode() == WebServerResponse::NOT_IN_USE);
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    char sz[512];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof(sz) - 1);
+    sz[len] = 0;
+    assertTrue(strstr(sz, "Transfer-Encoding: chunked\r\n") != nullptr);
+    assertTrue(strchr(sz, '[') == nullptr);
+}
+
+test(testRestApiReadsMenu) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    registerMenuRestApi(webServer);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // the whole tree, with the items of a submenu nested inside it.
+    char body[600];
+    simulateAccept();
+    driverSocket.simulateIncomingRaw("GET /api/menu HTTP/1.1\r\n\r\n");
+    webServer.exec();
+    assertTrue(readChunkedResponseBody(body, sizeof body));
+    assertEqual(0, strncmp(body, "{\"items\":[{\"id\":1,\"name\":\"Volume\",\"type\":\"analog\",\"readOnly\":false,\"visible\":true,\"value\":", 86));
+    assertTrue(strstr(body, "{\"id\":2,\"name\":\"Channel\",\"type\":\"enum\"") != nullptr);
+    assertTrue(strstr(body, "{\"id\":3,\"name\":\"Settings\",\"type\":\"sub\",\"readOnly\":false,\"visible\":true,"
+                            "\"items\":[{\"id\":4,\"name\":\"12V Standby\",\"type\":\"boolean\"") != nullptr);
+    assertEqual(0, strcmp(&body[strlen(body) - 5], "}]}]}"));
+    assertFalse(driverSocket.didClose());
+
+    // and then a single item on the same connection.
+    driverSocket.simulateIncomingRaw("GET /api/item/4 HTTP/1.1\r\n\r\n");
+    webServer.getWebResponse(0)->exec();
+    assertTrue(readChunkedResponseBody(body, sizeof body));
+    assertEqual(0, strncmp(body, "{\"id\":4,\"name\":\"12V Standby\",\"type\":\"boolean\",\"readOnly\":false,\"visible\":true,\"value\":", 85));
+    assertTrue(strstr(body, ",\"current\":") != nullptr);
+    assertFalse(driverSocket.didClose());
+}
+
+const char HTTP_REQ_REST_LONG_ID[]= "GET /api/item/12345678901234567890 HTTP/1.1\r\n"
+                                    "Host: server.example.com\r\n\r\n";
+
+const char EXPECTED_REST_BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\n"
+                                         "Server: tccWS\r\n"
+                                         "Content-Type: text/plain\r\n"
+                                         "Content-Length: 0\r\n\r\n";
+
+test(testRestApiChangesValue) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    registerMenuRestApi(webServer);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+
+    auto volume = reinterpret_cast<ValueMenuItem*>(getMenuItemById(1));
+    assertTrue(volume != nullptr);
+    auto oldVolume = volume->getCurrentValue();
+
+    char body[300];
+    simulateAccept();
+    driverSocket.simulateIncomingRaw("POST /api/item/1 HTTP/1.1\r\n"
+                                     "Content-Type: application/json\r\n"
+                                     "Content-Length: 26\r\n\r\n"
+                                     "{\"other\":[1,2],\"value\":42}");
+    webServer.exec();
+    assertEqual(42, (int)volume->getCurrentValue());
+    assertTrue(readChunkedResponseBody(body, sizeof body));
+    assertEqual(0, strncmp(body, "{\"id\":1,\"name\":\"Volume\"", 23));
+    assertEqual(0, strcmp(&body[strlen(body) - 14], ",\"current\":42}"));
+    assertFalse(driverSocket.didClose());
+
+    // a value out of range is rejected and the item left alone.
+    driverSocket.simulateIncomingRaw("POST /api/item/1 HTTP/1.1\r\n"
+                                     "Content-Length: 13\r\n\r\n"
+                                     "{\"value\":999}");
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_REST_BAD_REQUEST));
+    assertEqual(42, (int)volume->getCurrentValue());
+
+    // an id too long to hold is a bad request, rather than being cut short to another item's id.
+    driverSocket.simulateIncomingRaw(HTTP_REQ_REST_LONG_ID);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_REST_BAD_REQUEST));
+
+    volume->setCurrentValue(oldVolume, true);
+}
+
+test(testJsonWritesLongNumbers) {
+    uint8_t buffer[64];
+    JsonStreamWriter writer(buffer, sizeof buffer);
+    writer.startArray();
+    writer.numberValue(LONG_MIN);
+    writer.numberValue(LONG_MAX);
+    writer.endArray();
+    assertTrue(writer.flush());
+
+    char expected[64];
+    snprintf(expected, sizeof expected, "[%ld,%ld]", LONG_MIN, LONG_MAX);
+    buffer[writer.getBufferedLength()] = 0;
+    assertEqual(expected, (const char*)buffer);
+}
+
+/**
+ * Reads the next event from an event stream, checking that it is framed as an item event.
+ * @param pos the position in the stream, moved past the event
+ * @param id set to the id of the event
+ * @param data where to copy the data of the event
+ * @param size the size of data
+ * @return true if a correctly framed item event was read
+ */
+bool readItemEvent(const char*& pos, uint32_t& id, char* data, size_t size) {
+    if(strncmp(pos, "id: ", 4) != 0) return false;
+    char* end;
+    id = strtoul(pos + 4, &end, 10);
+    if(strncmp(end, "\nevent: item\ndata: ", 19) != 0) return false;
+    pos = end + 19;
+    const char* dataEnd = strstr(pos, "\n\n");
+    if(dataEnd == nullptr || size_t(dataEnd - pos) >= size || memchr(pos, '\n', dataEnd - pos) != nullptr) return false;
+    memcpy(data, pos, dataEnd - pos);
+    data[dataEnd - pos] = 0;
+    pos = dataEnd + 2;
+    return true;
+}
+
+/**
+ * Reads an event stream from the unit test driver, skipping the headers of the response if there are any.
+ */
+const char* readEventStream(char* sz, size_t size) {
+    int len = driverSocket.getClientTxBytesRaw(sz, size - 1);
+    sz[len] = 0;
+    const char* body = strstr(sz, "\r\n\r\n");
+    return body ? body + 4 : sz;
+}
+
+void connectEventStream(TcMenuLightweightWebServer& webServer, const char* lastEventId) {
+    char request[100];
+    strcpy(request, "GET /api/events HTTP/1.1\r\n");
+    if(lastEventId) {
+        strcat(request, "Last-Event-ID: ");
+        strcat(request, lastEventId);
+        strcat(request, "\r\n");
+    }
+    strcat(request, "\r\n");
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(request);
+    webServer.exec();
+}
+
+test(testMenuEventStream) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    registerMenuRestApi(webServer);
+    registerMenuEventStream(webServer, 2);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+    for(menuid_t itemId = 1; itemId <= 4; itemId++) getMenuItemById(itemId)->setSendRemoteNeeded(2, false);
+
+    // a new client is sent every item that is not a submenu, all with the id of the latest event.
+    char sz[1024];
+    char data[200];
+    uint32_t id;
+    connectEventStream(webServer, nullptr);
+    assertTrue(webServer.getWebResponse(0)->getMode() == WebServerResponse::EVENT_STREAM_BUSY);
+    const char* pos = readEventStream(sz, sizeof sz);
+    assertEqual(0, strncmp(pos, "retry: 3000\n\n", 13));
+    pos += 13;
+    assertTrue(readItemEvent(pos, id, data, sizeof data));
+    uint32_t latestId = id;
+    assertEqual(0, strncmp(data, "{\"id\":1,\"name\":\"Volume\"", 23));
+    assertTrue(readItemEvent(pos, id, data, sizeof data));
+    assertEqual(latestId, id);
+    assertEqual(0, strncmp(data, "{\"id\":2,", 8));
+    assertTrue(readItemEvent(pos, id, data, sizeof data));
+    assertEqual(latestId, id);
+    assertEqual(0, strncmp(data, "{\"id\":4,", 8));
+    assertEqual("", pos);
+
+    // a change that is notified is published on the next pass of task manager, as one event with the next id.
+    auto volume = reinterpret_cast<ValueMenuItem*>(getMenuItemById(1));
+    auto oldVolume = volume->getCurrentValue();
+    volume->setCurrentValue(7);
+    volume->setSendRemoteNeeded(2, true);
+    notifyMenuEventStream();
+    taskManager.runLoop();
+    pos = readEventStream(sz, sizeof sz);
+    assertTrue(readItemEvent(pos, id, data, sizeof data));
+    assertEqual(latestId + 1, id);
+    latestId = id;
+    assertEqual(0, strncmp(data, "{\"id\":1,", 8));
+    assertEqual(0, strcmp(&data[strlen(data) - 13], ",\"current\":7}"));
+    assertEqual("", pos);
+    assertFalse(volume->isSendRemoteNeeded(2));
+    webServer.getWebResponse(0)->closeConnection();
+
+    // a client that saw the latest event resumes without anything being sent again.
+    char lastId[12];
+    ltoa((long)latestId, lastId, 10);
+    connectEventStream(webServer, lastId);
+    assertEqual("retry: 3000\n\n", readEventStream(sz, sizeof sz));
+    webServer.getWebResponse(0)->closeConnection();
+
+    // but one that is ahead, as it would be after the device restarted, is sent every item again.
+    ltoa((long)(latestId + 100), lastId, 10);
+    connectEventStream(webServer, lastId);
+    pos = readEventStream(sz, sizeof sz) + 13;
+    for(int i = 0; i < 3; i++) {
+        assertTrue(readItemEvent(pos, id, data, sizeof data));
+        assertEqual(latestId, id);
+    }
+    assertEqual("", pos);
+    webServer.getWebResponse(0)->closeConnection();
+
+    volume->setCurrentValue(oldVolume, true);
+    volume->setSendRemoteNeeded(2, false);
+}
+
+test(testEventStreamsDoNotHoldPoolBuffers) {
+    taskManager.reset();
+    resetUnitLayer();
+    // more streams than buffers, each one only holds a buffer while an event is being written.
+    WebBufferPool pool(1, 125);
+    TcMenuLightweightWebServer webServer(80, 3, true, &pool);
+    registerMenuEventStream(webServer, 2);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+    for(menuid_t itemId = 1; itemId <= 4; itemId++) getMenuItemById(itemId)->setSendRemoteNeeded(2, false);
+
+    char sz[1024];
+    for(int i = 0; i < 3; i++) {
+        connectEventStream(webServer, nullptr);
+        assertTrue(webServer.getWebResponse(i)->getMode() == WebServerResponse::EVENT_STREAM_BUSY);
+        assertEqual(0, strncmp(readEventStream(sz, sizeof sz), "retry: 3000\n\n", 13));
+        assertEqual((uint8_t)0, pool.getLeasedCount());
+    }
+
+    // every stream is sent the change, each taking the one buffer in turn.
+    auto volume = reinterpret_cast<ValueMenuItem*>(getMenuItemById(1));
+    auto oldVolume = volume->getCurrentValue();
+    volume->setCurrentValue(7);
+    volume->setSendRemoteNeeded(2, true);
+    notifyMenuEventStream();
+    taskManager.runLoop();
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof(sz) - 1);
+    sz[len] = 0;
+    int events = 0;
+    for(const char* pos = sz; (pos = strstr(pos, "event: item\ndata: {\"id\":1,")) != nullptr; pos++) events++;
+    assertEqual(3, events);
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    for(int i = 0; i < 3; i++) {
+        assertTrue(webServer.getWebResponse(i)->getMode() == WebServerResponse::EVENT_STREAM_BUSY);
+        webServer.getWebResponse(i)->closeConnection();
+    }
+
+    volume->setCurrentValue(oldVolume, true);
+    volume->setSendRemoteNeeded(2, false);
+}
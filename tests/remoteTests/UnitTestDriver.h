@@ -138,27 +138,55 @@ namespace tcremote {
         }
     };
 
+    /**
+     * Counts the calls made into the unit test driver and the bytes that pass through it, the benchmarks use these to
+     * report how much driver work each request costs.
+     */
+    struct UnitDriverStats {
+        uint32_t readCalls;
+        uint32_t writeCalls;
+        uint32_t flushCalls;
+        uint32_t availableCalls;
+        uint32_t bytesRead;
+        uint32_t bytesWritten;
+        uint32_t bytesCommitted; // the part of bytesWritten that was built in place using reserve and commit
+        int lastWriteTimeout;
+
+        uint32_t totalCalls() const { return readCalls + writeCalls + flushCalls + availableCalls; }
+    };
+
     bool checkForMessageOfType(BtreeList<uint16_t, ReceivedMessage> &msgs, uint16_t msgType, const char *expected);
 
     class UnitDriverSocket {
     private:
         bool shouldBeInWebSocketMode = false;
+        bool writeAvailable = true;
+        bool discardWrites = false;
+        bool reserveSupported = true;
+        bool peerClosed = false;
+        bool writeReserved = false;
+        bool writeStalled = false;
+        int writeTimeout = 1000;
+        uint32_t lastWriteWaitMillis = 0;
+        int closeCount = 0;
         bool isConnected;
         bool hasClosed;
         SCCircularBuffer readScBuffer;
         SCCircularBuffer writeScBuffer;
         BtreeList<uint16_t, ReceivedMessage> receivedMessages;
+        uint8_t txStaging[128];
     public:
         explicit UnitDriverSocket(bsize_t sz = 125) : isConnected(false), hasClosed(false), readScBuffer(512),
-                                                      writeScBuffer(512) {}
+                                                      writeScBuffer(4096) {}
 
         bool isIdle() const { return !isConnected; }
 
         bool readAvailable() {
-            return readScBuffer.available();
+            return readScBuffer.available() || peerClosed;
         }
 
         int performRawRead(uint8_t *buffer, size_t bufferSize) {
+            if(peerClosed && !readScBuffer.available()) return -1;
             int pos = 0;
             while (readScBuffer.available() && pos < bufferSize) {
                 buffer[pos] = readScBuffer.get();
@@ -175,6 +203,14 @@ namespace tcremote {
         }
 
         int performRawWrite(const uint8_t *data, size_t dataSize) {
+            if(writeStalled) {
+                // like a real driver whose peer has stopped acknowledging, keep retrying until the timeout passes.
+                auto then = millis();
+                while((millis() - then) <= (unsigned long)writeTimeout) delay(1);
+                lastWriteWaitMillis = millis() - then;
+                return 0;
+            }
+            if(discardWrites) return (int) dataSize;
             size_t pos = 0;
             while (pos < dataSize) {
                 writeScBuffer.put(data[pos]);
@@ -185,8 +221,18 @@ namespace tcremote {
 
         void markAsClosed() {
             hasClosed = true;
+            closeCount++;
         }
 
+        /**
+         * Once what has already been received is read, reads fail as they do on a real driver after the client
+         * closes its end. It is cleared by reset.
+         */
+        void simulatePeerClosed() { peerClosed = true; }
+
+        /** @return the number of times the socket was closed through the driver since the last reset */
+        int getCloseCount() const { return closeCount; }
+
         void reset(bool connectionState = false) {
             // clear all received messages
             receivedMessages.clear();
@@ -198,11 +244,61 @@ namespace tcremote {
             // reset state
             isConnected = connectionState;
             shouldBeInWebSocketMode = false;
+            writeAvailable = true;
+            reserveSupported = true;
+            peerClosed = false;
+            writeReserved = false;
+            writeStalled = false;
+            writeTimeout = 1000;
+            lastWriteWaitMillis = 0;
             hasClosed = false;
+            closeCount = 0;
         }
 
+        void setWriteAvailable(bool avail) { writeAvailable = avail; }
+        bool isWriteAvailable() const { return writeAvailable; }
+
+        /**
+         * When set, writes are accepted by rawWriteAvailable but never complete, each one waits in the write loop
+         * until the timeout it was given has passed and then fails. It is cleared by reset.
+         */
+        void setWriteStalled(bool stalled) { writeStalled = stalled; }
+
+        /** the write loop timeout, as on a real driver it is kept with the socket and set on each rawWriteData */
+        void setWriteTimeout(int timeoutMillis) { writeTimeout = timeoutMillis; }
+
+        /** @return how long the last stalled write waited in the write loop before giving up */
+        uint32_t getLastWriteWaitMillis() const { return lastWriteWaitMillis; }
+
         void setShouldBeInWebSocketMode(bool b) { shouldBeInWebSocketMode = b; }
 
+        /**
+         * When set, data written to the socket is counted but not kept, so that benchmarks can send far more than
+         * the write buffer would hold. It is not cleared by reset.
+         */
+        void setDiscardWrites(bool discard) { discardWrites = discard; }
+
+        /**
+         * When cleared, rawWriteReserve returns nullptr as it does on drivers without a write buffer, so that the
+         * copying fallback can be tested. It is set again by reset.
+         */
+        void setReserveSupported(bool supported) { reserveSupported = supported; }
+
+        uint8_t* reserve(size_t minimumLen, size_t* actualLen) {
+            if(!reserveSupported || minimumLen > sizeof txStaging) return nullptr;
+            *actualLen = sizeof txStaging;
+            writeReserved = true;
+            return txStaging;
+        }
+
+        /** @return true when space has been reserved and not yet committed */
+        bool isWriteReserved() const { return writeReserved; }
+
+        int commit(size_t len) {
+            writeReserved = false;
+            return performRawWrite(txStaging, len > sizeof txStaging ? sizeof txStaging : len);
+        }
+
         void close() {
             hasClosed = true;
         }
@@ -233,8 +329,19 @@ namespace tcremote {
 
     void resetUnitLayer();
     void simulateAccept();
+    void simulateSocketReady();
+    void resetDriverStats();
+
+    /**
+     * The unit test driver replaces the global operator new so that it can count every allocation, tests take this
+     * count before and after running a path to check that it does not touch the heap once warmed up. Memory taken
+     * with malloc directly is not counted.
+     * @return the number of allocations made through operator new so far
+     */
+    uint32_t heapAllocationCount();
 
     extern UnitDriverSocket driverSocket;
+    extern UnitDriverStats driverStats;
 }
 
 #endif // UNITTEST_TRANSPORT_H
@@ -3,8 +3,13 @@
 #include <remote/BaseRemoteComponents.h>
 #include <SimpleCollections.h>
 #include "remote/TcMenuWebServer.h"
+#include "remote/TcWebTrace.h"
+#include "remote/TcWebMetrics.h"
 #include "SimpleTestFixtures.h"
 #include "UnitTestDriver.h"
+#if defined(EPOXY_DUINO)
+#include <unistd.h>
+#endif
 
 using namespace aunit;
 using namespace tcremote;
@@ -65,10 +70,9 @@ const char EXPECTED_RESP4[] = "HTTP/1.1 500 Internal error\r\n"
                               "Content-Length: 0\r\n"
                               "\r\n";
 
-// for the first version we'll not support more than one request on a connection.
-/*const char EXPECTED_RESP5[] = "HTTP/1.1 200 OK\r\n"
+// two pipelined requests on a keep alive connection, both responses are written back to back.
+const char EXPECTED_RESP5[] = "HTTP/1.1 200 OK\r\n"
                               "Server: tccWS\r\n"
-                              "Connection: close\r\n"
                               "Content-Type: text/plain\r\n"
                               "Content-Length: 11\r\n"
                               "\r\n"
@@ -77,7 +81,7 @@ const char EXPECTED_RESP4[] = "HTTP/1.1 500 Internal error\r\n"
                               "Content-Type: text/plain\r\n"
                               "Content-Length: 5\r\n"
                               "\r\n"
-                              "Aloha";*/
+                              "Aloha";
 
 void copyHtmlWithTitleAndText(const char* title, const char* heading, char* buffer) {
     strcpy(buffer, "<html><head><title>");
@@ -90,7 +94,7 @@ void copyHtmlWithTitleAndText(const char* title, const char* heading, char* buff
 test(testAbstractTcMenuWebServer) {
     taskManager.reset();
     resetUnitLayer();
-    TcMenuLightweightWebServer webServer(80, 1);
+    TcMenuLightweightWebServer webServer(80, 1, false);
     webServer.init();
 
     webServer.onUrlGet("/index.html", [](tcremote::WebServerResponse& response) {
@@ -187,3 +191,1808 @@ test(testAbstractTcMenuWebServer) {
     assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP4));
     assertTrue(driverSocket.didClose());
 }
+
+const char HTTP_REQ_RANGE_SINGLE[]= "GET /ranged.txt HTTP/1.1\r\n"
+                                    "Host: server.example.com\r\n"
+                                    "Range: bytes=8-12\r\n"
+                                    "Connection: close\r\n\r\n";
+const char HTTP_REQ_RANGE_OPEN[]= "GET /ranged.txt HTTP/1.1\r\n"
+                                  "Host: server.example.com\r\n"
+                                  "Range: bytes=15-\r\n"
+                                  "Connection: close\r\n\r\n";
+const char HTTP_REQ_RANGE_BAD[]= "GET /ranged.txt HTTP/1.1\r\n"
+                                 "Host: server.example.com\r\n"
+                                 "Range: bytes=25-30\r\n"
+                                 "Connection: close\r\n\r\n";
+
+const char HTTP_REQ_RANGE_HUGE[]= "GET /ranged.txt HTTP/1.1\r\n"
+                                  "Host: server.example.com\r\n"
+                                  "Range: bytes=4294967298-4294967300\r\n"
+                                  "Connection: close\r\n\r\n";
+
+const char EXPECTED_RANGE_SINGLE[] = "HTTP/1.1 206 Partial Content\r\n"
+                                     "Server: tccWS\r\n"
+                                     "Connection: close\r\n"
+                                     "Accept-Ranges: bytes\r\n"
+                                     "Content-Type: text/plain\r\n"
+                                     "Content-Range: bytes 8-12/20\r\n"
+                                     "Content-Length: 5\r\n"
+                                     "\r\n"
+                                     "89abc";
+const char EXPECTED_RANGE_OPEN[] = "HTTP/1.1 206 Partial Content\r\n"
+                                   "Server: tccWS\r\n"
+                                   "Connection: close\r\n"
+                                   "Accept-Ranges: bytes\r\n"
+                                   "Content-Type: text/plain\r\n"
+                                   "Content-Range: bytes 15-19/20\r\n"
+                                   "Content-Length: 5\r\n"
+                                   "\r\n"
+                                   "fghij";
+const char EXPECTED_RANGE_BAD[] = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Range: bytes */20\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "\r\n";
+
+test(testRangeRequests) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+
+    webServer.onUrlGet("/ranged.txt", [](tcremote::WebServerResponse& response) {
+        if(!response.startRangedHeader(20)) return;
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 20);
+        // send in two blocks to ensure the window is taken across both
+        response.send("0123456789", 10);
+        response.send("abcdefghij", 10);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+    assertTrue(webServer.isInitialised());
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_RANGE_SINGLE);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RANGE_SINGLE));
+    assertTrue(driverSocket.didClose());
+
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_RANGE_OPEN);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RANGE_OPEN));
+    assertTrue(driverSocket.didClose());
+
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_RANGE_BAD);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RANGE_BAD));
+    assertTrue(driverSocket.didClose());
+
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_RANGE_HUGE);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RANGE_BAD));
+    assertTrue(driverSocket.didClose());
+}
+
+test(testRangeHeaderParsing) {
+    int32_t first, last;
+    assertTrue(HttpProcessor::parseRange("bytes=0-499", first, last));
+    assertEqual((int32_t)0, first);
+    assertEqual((int32_t)499, last);
+
+    assertTrue(HttpProcessor::parseRange("bytes=500-", first, last));
+    assertEqual((int32_t)500, first);
+    assertEqual((int32_t)-1, last);
+
+    assertTrue(HttpProcessor::parseRange("bytes=-200", first, last));
+    assertEqual((int32_t)-1, first);
+    assertEqual((int32_t)200, last);
+
+    assertFalse(HttpProcessor::parseRange("bytes=0-10,20-30", first, last));
+    assertFalse(HttpProcessor::parseRange("bytes=10-5", first, last));
+    assertFalse(HttpProcessor::parseRange("items=0-5", first, last));
+    assertFalse(HttpProcessor::parseRange("bytes=-", first, last));
+
+    // positions too large to hold must not wrap around into a range that looks satisfiable.
+    assertTrue(HttpProcessor::parseRange("bytes=99999999999-", first, last));
+    assertEqual((int32_t)INT32_MAX, first);
+    assertTrue(HttpProcessor::parseRange("bytes=0-4294967296", first, last));
+    assertEqual((int32_t)INT32_MAX, first);
+    assertTrue(HttpProcessor::parseRange("bytes=2147483647-", first, last));
+    assertEqual((int32_t)INT32_MAX, first);
+    assertEqual((int32_t)-1, last);
+}
+
+const char HTTP_REQ_CHUNKED[]= "GET /chunked.json HTTP/1.1\r\n"
+                               "Host: server.example.com\r\n"
+                               "Connection: close\r\n\r\n";
+
+const char EXPECTED_CHUNKED[] = "HTTP/1.1 200 OK\r\n"
+                                "Server: tccWS\r\n"
+                                "Connection: close\r\n"
+                                "Content-Type: application/json\r\n"
+                                "Transfer-Encoding: chunked\r\n"
+                                "\r\n"
+                                "18\r\n{\"a\":1,\"b\":\"0123456789\"}\r\n"
+                                "0\r\n\r\n";
+
+test(testChunkedResponse) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+
+    webServer.onUrlGet("/chunked.json", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfoChunked(tcremote::WebServerResponse::JSON_TEXT);
+        response.send("{\"a\":1", 6);
+        response.send("", 0); // an empty send must not terminate the stream
+        response.send(",\"b\":\"0123456789\"", 17);
+        response.send("}", 1);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CHUNKED);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_CHUNKED));
+    assertTrue(driverSocket.didClose());
+}
+
+test(testChunkedSendsAreGathered) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+
+    webServer.onUrlGet("/chunked.json", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfoChunked(tcremote::WebServerResponse::PLAIN_TEXT);
+        for(int i = 0; i < 150; i++) {
+            char ch = char('a' + (i % 26));
+            response.send(&ch, 1);
+        }
+        char large[120];
+        memset(large, 'Z', sizeof large);
+        response.send(large, sizeof large);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CHUNKED);
+    resetDriverStats();
+    webServer.exec();
+
+    // with a 125 byte write buffer, 119 bytes fit in each gathered chunk, the large send is a chunk of its own.
+    char expected[400] = "77\r\n";
+    size_t pos = strlen(expected);
+    for(int i = 0; i < 150; i++) {
+        if(i == 119) {
+            strcpy(&expected[pos], "\r\n1f\r\n");
+            pos += 6;
+        }
+        expected[pos++] = char('a' + (i % 26));
+    }
+    strcpy(&expected[pos], "\r\n78\r\n");
+    pos += 6;
+    memset(&expected[pos], 'Z', 120);
+    pos += 120;
+    strcpy(&expected[pos], "\r\n0\r\n\r\n");
+    pos += 7;
+
+    char sz[500];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof sz);
+    auto body = strstr(sz, "\r\n\r\n");
+    assertTrue(body != nullptr);
+    body += 4;
+    assertEqual(pos, size_t(&sz[len] - body));
+    assertEqual(0, memcmp(expected, body, pos));
+    // the 150 small sends cost two writes, rather than three each.
+    assertLess(driverStats.writeCalls, (uint32_t)20);
+}
+
+test(testPipelinedKeepAliveRequests) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 5);
+        response.startData();
+        response.send("Aloha", 5);
+        response.end();
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // both requests arrive together, they should both be served in one go and the connection left open.
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertFalse(driverSocket.didClose());
+    assertTrue(webServer.getWebResponse(0)->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+
+    // with nothing waiting the next tick should neither block nor close the connection
+    webServer.getWebResponse(0)->exec();
+    assertFalse(driverSocket.didClose());
+
+    // and a later request on the same connection is also served
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertFalse(driverSocket.didClose());
+}
+
+test(testStaticWebServerSlotsInOneBlock) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuStaticWebServer<2, 100> webServer(80, true);
+    webServer.init();
+    assertEqual(2, webServer.getResponseCount());
+
+    // every response, transport and buffer is within the server object itself.
+    auto serverStart = (uint8_t*)&webServer;
+    auto serverEnd = serverStart + sizeof(webServer);
+    for(int i = 0; i < webServer.getResponseCount(); i++) {
+        auto response = webServer.getWebResponse(i);
+        auto transport = response->getTransport();
+        assertTrue((uint8_t*)response >= serverStart && (uint8_t*)response < serverEnd);
+        assertTrue((uint8_t*)transport >= serverStart && (uint8_t*)transport < serverEnd);
+        assertTrue(transport->getReadBuffer() >= serverStart && transport->getReadBuffer() + 100 <= serverEnd);
+        assertTrue(transport->getWriteBuffer() >= serverStart && transport->getWriteBuffer() + 100 <= serverEnd);
+        assertEqual((size_t)100, transport->getReadBufferSize());
+    }
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 5);
+        response.send("Aloha", 5);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertFalse(driverSocket.didClose());
+    webServer.getWebResponse(0)->closeConnection();
+}
+
+test(testRequestArenaAllocation) {
+    WebRequestArena arena;
+    auto text = arena.copyString("hello");
+    assertEqual("hello", text);
+    auto words = arena.allocateArray<uint32_t>(4);
+    assertTrue(words != nullptr);
+    assertEqual((size_t)0, ((uintptr_t)words) % alignof(uint32_t));
+    assertEqual((size_t)(8 + 16), arena.getUsed());
+
+    // when full, allocation fails rather than going to the heap, until the arena is reset.
+    assertTrue(arena.allocate(WS_REQUEST_ARENA_SIZE) == nullptr);
+    assertEqual((uint16_t)1, arena.getFailedCount());
+    arena.reset();
+    assertEqual((size_t)0, arena.getUsed());
+    assertTrue(arena.allocate(WS_REQUEST_ARENA_SIZE) != nullptr);
+    assertEqual((size_t)WS_REQUEST_ARENA_SIZE, arena.getPeakUsed());
+    assertTrue(arena.allocateString(0) == nullptr);
+}
+
+int arenaFailures = 0;
+
+void sendFromArena(tcremote::WebServerResponse& response, const char* text) {
+    // each request takes most of the arena, so this only works if it is reset after every request.
+    auto copy = response.getArena().copyString(text);
+    auto scratch = response.getArena().allocateArray<uint32_t>((WS_REQUEST_ARENA_SIZE / 4) - 8);
+    if(!copy || !scratch) {
+        arenaFailures++;
+        return;
+    }
+    response.startHeader();
+    response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, strlen(copy));
+    response.send(copy, strlen(copy));
+}
+
+test(testSteadyStateRequestsDoNotAllocate) {
+    taskManager.reset();
+    resetUnitLayer();
+    arenaFailures = 0;
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        sendFromArena(response, "Hello World");
+    });
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        sendFromArena(response, "Aloha");
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+
+    // once warmed up, serving requests on the connection must not touch the heap.
+    auto allocationsBefore = heapAllocationCount();
+    assertNotEqual((uint32_t)0, allocationsBefore); // the responses were allocated, so counting is working
+    for(int i = 0; i < 10; i++) {
+        driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+        webServer.exec();
+        assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    }
+    assertEqual(allocationsBefore, heapAllocationCount());
+    assertEqual(0, arenaFailures);
+    assertEqual((size_t)0, webServer.getWebResponse(0)->getArena().getUsed());
+    webServer.getWebResponse(0)->closeConnection();
+}
+
+const char HTTP_REQ_FLASH[] = "GET /flash.txt HTTP/1.1\r\n"
+                             "Host: server.example.com\r\n\r\n";
+
+char flashContent[300];
+
+bool flashBodyWasSent() {
+    char sz[500];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof sz);
+    sz[len] = 0;
+    auto body = strstr(sz, "\r\n\r\n");
+    return body && (&sz[len] - (body + 4)) == sizeof flashContent && memcmp(body + 4, flashContent, sizeof flashContent) == 0;
+}
+
+/**
+ * Reads a chunked response from the unit driver into body, checking that every chunk but the last is fullChunk long.
+ * @return the number of chunks, or -1 if the response is not chunked as expected
+ */
+int readFullChunks(char* body, size_t size, long fullChunk) {
+    char raw[3000];
+    int len = driverSocket.getClientTxBytesRaw(raw, sizeof(raw) - 1);
+    raw[len] = 0;
+    const char* pos = strstr(raw, "\r\n\r\n");
+    if(pos == nullptr) return -1;
+    pos += 4;
+    size_t bodyLen = 0;
+    int chunks = 0;
+    long lastLen = 0;
+    while(true) {
+        char* end;
+        long chunkLen = strtol(pos, &end, 16);
+        if(end == pos || strncmp(end, "\r\n", 2) != 0) return -1;
+        pos = end + 2;
+        if(chunkLen == 0) break;
+        if((chunks++ != 0 && lastLen != fullChunk) || bodyLen + chunkLen >= size) return -1;
+        lastLen = chunkLen;
+        memcpy(&body[bodyLen], pos, chunkLen);
+        bodyLen += chunkLen;
+        pos += chunkLen + 2;
+    }
+    body[bodyLen] = 0;
+    return chunks;
+}
+
+test(testSendFromProgramMemoryInChunks) {
+    taskManager.reset();
+    resetUnitLayer();
+    for(size_t i = 0; i < sizeof flashContent; i++) flashContent[i] = char('a' + (i % 26));
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    webServer.onUrlGet("/flash.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, sizeof flashContent);
+        response.send_P(flashContent, sizeof flashContent);
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+
+    // the unit driver cannot send program memory, so the content is sent as the socket drains after the handler
+    // returns, none of the pieces must go past the end of the content.
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+
+    // without reserve it goes through the read buffer, a second request on the same connection is sent the same way.
+    driverSocket.setReserveSupported(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+
+    // a socket that cannot take any more does not hold up the server, the rest goes once it drains.
+    driverSocket.setWriteAvailable(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::STREAMING_CONTENT);
+    driverSocket.setWriteAvailable(true);
+    simulateSocketReady();
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+    assertTrue(response->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+
+    // anything the handler sends afterwards waits for the content from program memory to go first.
+    webServer.onUrlGet("/flashThenRam.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, sizeof flashContent + 3);
+        response.send_P(flashContent, sizeof flashContent);
+        response.send((const uint8_t*)"end", 3, true);
+    });
+    driverSocket.simulateIncomingRaw("GET /flashThenRam.txt HTTP/1.1\r\n\r\n");
+    webServer.exec();
+    char sz[500];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof sz);
+    auto body = strstr(sz, "\r\n\r\n");
+    assertTrue(body != nullptr);
+    assertEqual((int)(sizeof flashContent + 3), (int)(&sz[len] - (body + 4)));
+    assertEqual(0, memcmp(body + 4, flashContent, sizeof flashContent));
+    assertEqual(0, memcmp(body + 4 + sizeof flashContent, "end", 3));
+    response->closeConnection();
+}
+
+class TrackedContentSource : public MemoryContentSource {
+public:
+    int finishedCount = 0;
+    bool completed = false;
+    TrackedContentSource(const uint8_t* data, size_t len) : MemoryContentSource(data, len) {}
+    void finished(bool wasCompleted) override {
+        finishedCount++;
+        completed = wasCompleted;
+    }
+};
+
+WebContentSource* sourceToStream = nullptr;
+
+const char HTTP_REQ_STREAMED_RANGE[] = "GET /flash.txt HTTP/1.1\r\n"
+                                       "Host: server.example.com\r\n"
+                                       "Range: bytes=26-30\r\n\r\n";
+
+const char EXPECTED_STREAMED_RANGE[] = "HTTP/1.1 206 Partial Content\r\n"
+                                       "Server: tccWS\r\n"
+                                       "Accept-Ranges: bytes\r\n"
+                                       "Content-Type: text/plain\r\n"
+                                       "Content-Range: bytes 26-30/300\r\n"
+                                       "Content-Length: 5\r\n"
+                                       "\r\n"
+                                       "abcde";
+
+test(testStreamContentFromSources) {
+    taskManager.reset();
+    resetUnitLayer();
+    for(size_t i = 0; i < sizeof flashContent; i++) flashContent[i] = char('a' + (i % 26));
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    webServer.onUrlGet("/flash.txt", [](tcremote::WebServerResponse& response) {
+        if(!response.startRangedHeader(sourceToStream->getLength())) return;
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, sourceToStream->getLength());
+        response.streamContent(*sourceToStream);
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+
+    // while the socket cannot be written the handler has already returned, and the body follows once it can.
+    TrackedContentSource memorySource((const uint8_t*)flashContent, sizeof flashContent);
+    sourceToStream = &memorySource;
+    driverSocket.setWriteAvailable(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::STREAMING_CONTENT);
+    assertEqual(0, memorySource.finishedCount);
+    driverSocket.setWriteAvailable(true);
+    simulateSocketReady();
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+    assertTrue(response->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+    assertEqual(1, memorySource.finishedCount);
+    assertTrue(memorySource.completed);
+
+    // only the requested window of the source is read for a range.
+    driverSocket.simulateIncomingRaw(HTTP_REQ_STREAMED_RANGE);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_STREAMED_RANGE));
+
+    // program memory without reserve goes through the read buffer
+    ProgramMemoryContentSource flashSource((const uint8_t*)flashContent, sizeof flashContent);
+    sourceToStream = &flashSource;
+    driverSocket.setReserveSupported(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+
+    // a file is read as the socket drains, and closed once it has all been sent.
+    FILE* fp = tmpfile();
+    assertTrue(fp != nullptr);
+    fwrite(flashContent, 1, sizeof flashContent, fp);
+    FileContentSource<StdioFile> fileSource{StdioFile(fp)};
+    sourceToStream = &fileSource;
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    assertTrue(flashBodyWasSent());
+    assertFalse(fileSource.getFile().isOpen());
+
+    // a connection that closes part way through tells the source it did not complete.
+    memorySource.finishedCount = 0;
+    sourceToStream = &memorySource;
+    driverSocket.setWriteAvailable(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    response->closeConnection();
+    assertEqual(1, memorySource.finishedCount);
+    assertFalse(memorySource.completed);
+}
+
+class FailingContentSource : public MemoryContentSource {
+public:
+    size_t failAt;
+    FailingContentSource(const uint8_t* data, size_t len, size_t failAt) : MemoryContentSource(data, len), failAt(failAt) {}
+    int readAt(size_t offset, uint8_t* buffer, size_t len) override {
+        if(offset >= failAt) return -1;
+        return MemoryContentSource::readAt(offset, buffer, min(len, failAt - offset));
+    }
+};
+
+test(testStreamContentChunkedAndFailing) {
+    taskManager.reset();
+    resetUnitLayer();
+    for(size_t i = 0; i < sizeof flashContent; i++) flashContent[i] = char('a' + (i % 26));
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.enableMetrics();
+    webServer.init();
+    webServer.onUrlGet("/flash.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfoChunked(tcremote::WebServerResponse::PLAIN_TEXT);
+        response.streamContent(*sourceToStream);
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+
+    // a chunked body is read straight into the chunk being gathered, so each chunk is a full write buffer.
+    MemoryContentSource memorySource((const uint8_t*)flashContent, sizeof flashContent);
+    sourceToStream = &memorySource;
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    long capacity = (long)(webServer.getWebResponse(0)->getTransport()->getWriteBufferSize() - WS_CHUNK_FRAMING);
+    char body[sizeof flashContent + 1];
+    assertEqual(3, readFullChunks(body, sizeof body, capacity));
+    assertTrue(memcmp(body, flashContent, sizeof flashContent) == 0);
+
+    // a source that fails part way through closes the connection, and is counted.
+    FailingContentSource failingSource((const uint8_t*)flashContent, sizeof flashContent, 200);
+    sourceToStream = &failingSource;
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FLASH);
+    webServer.exec();
+    assertTrue(driverSocket.didClose());
+    assertEqual((uint32_t)1, webServer.getMetrics()->getContentSourceFailures());
+
+    // a stdio file that cannot be measured is given as empty.
+#if defined(EPOXY_DUINO)
+    int fds[2];
+    assertEqual(0, pipe(fds));
+    StdioFile pipeFile(fdopen(fds[0], "r"));
+    assertEqual((size_t)0, pipeFile.size());
+    pipeFile.close();
+    ::close(fds[1]);
+#endif
+}
+
+test(testWebBufferPoolLeaseAndRelease) {
+    WebBufferPool pool(3, 50);
+    assertEqual((uint8_t)50, pool.getBufferSize());
+    assertEqual((uint8_t)3, pool.getBufferCount());
+
+    uint8_t* buffers[3];
+    for(auto& b : buffers) {
+        b = pool.lease();
+        assertTrue(b != nullptr);
+    }
+    assertTrue(buffers[0] != buffers[1] && buffers[1] != buffers[2]);
+    assertFalse(pool.hasFree());
+
+    // an empty pool is not an error, it is counted so the pool can be sized.
+    assertTrue(pool.lease() == nullptr);
+    assertEqual((uint32_t)1, pool.getExhaustedCount());
+
+    pool.release(buffers[1]);
+    pool.release(buffers[1]);
+    assertEqual((uint8_t)2, pool.getLeasedCount());
+    assertTrue(pool.lease() == buffers[1]);
+    pool.release(buffers[0]);
+    pool.release(buffers[1]);
+    pool.release(buffers[2]);
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    assertEqual((uint8_t)3, pool.getPeakLeased());
+    assertEqual((uint32_t)4, pool.getLeaseCount());
+}
+
+test(testPooledServerLeasesOnlyWhileBusy) {
+    taskManager.reset();
+    resetUnitLayer();
+    WebBufferPool pool(1, 125);
+    TcMenuLightweightWebServer webServer(80, 2, true, &pool);
+    webServer.init();
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 5);
+        response.send("Aloha", 5);
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // an idle connection holds no buffers, and the buffer goes back once the requests have been served.
+    simulateAccept();
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    assertEqual((uint8_t)1, pool.getPeakLeased());
+
+    // with the pool empty the request waits in the socket, it is served as soon as a buffer is free.
+    auto taken = pool.lease();
+    auto response = webServer.getWebResponse(0);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    response->exec();
+    char sz[10];
+    assertEqual(0, driverSocket.getClientTxBytesRaw(sz, sizeof sz));
+    assertTrue(response->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+    assertFalse(driverSocket.didClose());
+    pool.release(taken);
+    response->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    response->closeConnection();
+}
+
+const char HTTP_REQ_FORM_POST[]= "POST /form.do HTTP/1.1\r\n"
+                                 "Host: server.example.com\r\n"
+                                 "Content-Type: application/x-www-form-urlencoded\r\n"
+                                 "Content-Length: 32\r\n\r\n"
+                                 "name=Dave+C&value=10%25&flag&x=1"
+                                 "GET /data1.txt HTTP/1.1\r\n"
+                                 "Host: server.example.com\r\n\r\n";
+const char HTTP_REQ_LARGE_POST[]= "POST /form.do HTTP/1.1\r\n"
+                                  "Host: server.example.com\r\n"
+                                  "Content-Length: 100000\r\n\r\n"
+                                  "abcdef";
+
+const char EXPECTED_FORM_POST[] = "HTTP/1.1 200 OK\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Content-Length: 28\r\n"
+                                  "\r\n"
+                                  "name=Dave C,value=10%,flag=,"
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Content-Length: 11\r\n"
+                                  "\r\n"
+                                  "Hello World";
+const char EXPECTED_LARGE_POST[] = "HTTP/1.1 413 Payload Too Large\r\n"
+                                   "Server: tccWS\r\n"
+                                   "Connection: close\r\n"
+                                   "Content-Type: text/plain\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "\r\n";
+
+test(testPostBodyFormFields) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    webServer.onUrlPost("/form.do", [](tcremote::WebServerResponse& response) {
+        char sz[40] = {0};
+        char name[10];
+        char value[10];
+        // read three fields, leaving the last one unread, it must be discarded before the next request.
+        for(int i=0; i<3 && response.nextFormField(name, sizeof name, value, sizeof value); i++) {
+            strcat(sz, name);
+            strcat(sz, "=");
+            strcat(sz, value);
+            strcat(sz, ",");
+        }
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, strlen(sz));
+        response.send(sz, strlen(sz));
+    });
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_FORM_POST);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_FORM_POST));
+    assertFalse(driverSocket.didClose());
+
+    driverSocket.reset(false);
+    webServer.getWebResponse(0)->closeConnection();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_LARGE_POST);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_LARGE_POST));
+    assertTrue(driverSocket.didClose());
+}
+
+const char HTTP_REQ_BAD_FORM_POST[]= "POST /form.do HTTP/1.1\r\n"
+                                     "Host: server.example.com\r\n"
+                                     "Content-Type: application/x-www-form-urlencoded\r\n"
+                                     "Content-Length: 37\r\n\r\n"
+                                     "a=5%&b=%zq&nul=%00&good=A%42+c&end=%4";
+const char HTTP_REQ_NEGATIVE_LENGTH[]= "POST /form.do HTTP/1.1\r\n"
+                                       "Host: server.example.com\r\n"
+                                       "Content-Length: -5\r\n\r\n";
+const char HTTP_REQ_TEXT_LENGTH[]= "POST /form.do HTTP/1.1\r\n"
+                                   "Host: server.example.com\r\n"
+                                   "Content-Length: 12abc\r\n\r\n";
+const char EXPECTED_BAD_LENGTH[] = "HTTP/1.1 400 Bad Request\r\n"
+                                   "Server: tccWS\r\n"
+                                   "Connection: close\r\n"
+                                   "Content-Type: text/plain\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "\r\n";
+
+int formFieldsRead = 0;
+
+test(testBadFormBodiesAreRejected) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    // fields that are not correctly encoded are skipped, rather than decoding to a NUL.
+    webServer.onUrlPost("/form.do", [](tcremote::WebServerResponse& response) {
+        char sz[40] = {0};
+        char name[10];
+        char value[10];
+        while(response.nextFormField(name, sizeof name, value, sizeof value)) {
+            strcat(sz, name);
+            strcat(sz, "=");
+            strcat(sz, value);
+            strcat(sz, ",");
+        }
+        if(response.nextFormField(name, 0, value, sizeof value)) strcat(sz, "zero size read");
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, strlen(sz));
+        response.send(sz, strlen(sz));
+    });
+    webServer.onUrlPost("/cut.do", [](tcremote::WebServerResponse& response) {
+        char name[10];
+        char value[10];
+        formFieldsRead = 0;
+        while(response.nextFormField(name, sizeof name, value, sizeof value) && formFieldsRead < 100) {
+            // the client goes away part way through the body, the loop must still end.
+            if(++formFieldsRead == 1) response.getTransport()->close();
+        }
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_BAD_FORM_POST);
+    webServer.exec();
+    char sz[200];
+    int len = driverSocket.getClientTxBytesRaw(sz, sizeof(sz) - 1);
+    sz[len] = 0;
+    assertTrue(strstr(sz, "\r\n\r\ngood=AB c,") != nullptr);
+    assertEqual(0, strcmp(strstr(sz, "\r\n\r\n"), "\r\n\r\ngood=AB c,"));
+
+    driverSocket.simulateIncomingRaw("POST /cut.do HTTP/1.1\r\n"
+                                     "Content-Type: application/x-www-form-urlencoded\r\n"
+                                     "Content-Length: 40\r\n\r\n"
+                                     "a=1&b=2&");
+    webServer.exec();
+    assertEqual(1, formFieldsRead);
+    assertEqual((uint32_t)0, webServer.getWebResponse(0)->getBodyRemaining());
+    assertTrue(webServer.getWebResponse(0)->getMode() == tcremote::WebServerResponse::NOT_IN_USE);
+
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_NEGATIVE_LENGTH);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_BAD_LENGTH));
+    assertTrue(driverSocket.didClose());
+
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_TEXT_LENGTH);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_BAD_LENGTH));
+    assertTrue(driverSocket.didClose());
+
+    uint32_t length;
+    assertTrue(HttpProcessor::parseContentLength("4096", length));
+    assertEqual((uint32_t)4096, length);
+    assertTrue(HttpProcessor::parseContentLength("99999999999", length));
+    assertEqual((uint32_t)UINT32_MAX, length);
+    assertFalse(HttpProcessor::parseContentLength("", length));
+    assertFalse(HttpProcessor::parseContentLength("+5", length));
+}
+
+const char EXPECTED_SERVICE_UNAVAILABLE[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                           "Server: tccWS\r\n"
+                                           "Retry-After: 2\r\n"
+                                           "Connection: close\r\n"
+                                           "Content-Length: 0\r\n\r\n";
+
+test(testAdmissionControlEvictsAndRejects) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // serve one request on a keep alive connection, it is then idle
+    simulateAccept();
+    driverSocket.simulateIncomingRaw("GET /data1.txt HTTP/1.1\r\n\r\n");
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(webServer.getWebResponse(0)->isIdleKeepAlive());
+    assertFalse(driverSocket.didClose());
+
+    // a new connection arrives with no free slot, the idle keep alive connection should be evicted for it.
+    webServer.pushClientSocket(1);
+    webServer.exec();
+    assertTrue(driverSocket.didClose());
+    assertEqual(1, webServer.getWebResponse(0)->getTransport()->getClientFd());
+    assertFalse(webServer.getWebResponse(0)->isIdleKeepAlive());
+
+    // the slot is now busy with a connection that has not yet made a request, so new connections queue up.
+    driverSocket.reset(true);
+    for(int i=2; i < (2 + WS_CONNECTION_BACKLOG); i++) {
+        webServer.pushClientSocket(i);
+    }
+    webServer.exec();
+    assertFalse(driverSocket.didClose());
+
+    // and once the backlog is full, the next one gets an immediate 503.
+    resetDriverStats();
+    webServer.pushClientSocket(99);
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_SERVICE_UNAVAILABLE));
+    assertTrue(driverSocket.didClose());
+    assertEqual(WS_REJECT_WRITE_MILLIS, driverStats.lastWriteTimeout);
+
+    // when the socket takes the 503 but never drains, the write loop gives up after the short timeout.
+    driverSocket.reset(true);
+    driverSocket.setWriteStalled(true);
+    webServer.pushClientSocket(98);
+    assertTrue(driverSocket.didClose());
+    assertMore(driverSocket.getLastWriteWaitMillis(), (uint32_t)(WS_REJECT_WRITE_MILLIS - 1));
+    assertLess(driverSocket.getLastWriteWaitMillis(), (uint32_t)500);
+
+    // when the socket cannot take the 503 straight away, it is dropped rather than waited on.
+    driverSocket.reset(true);
+    driverSocket.setWriteAvailable(false);
+    resetDriverStats();
+    webServer.pushClientSocket(100);
+    assertEqual((uint32_t)0, driverStats.writeCalls);
+    assertTrue(driverSocket.didClose());
+    driverSocket.setWriteAvailable(true);
+}
+
+int wheelExpiryCount = 0;
+TimerWheelEntry* lastExpiredEntry = nullptr;
+
+test(testTimerWheelDeadlines) {
+    wheelExpiryCount = 0;
+    TimerWheel wheel([](TimerWheelEntry& entry) {
+        wheelExpiryCount++;
+        lastExpiredEntry = &entry;
+    });
+    TimerWheelEntry shortEntry, longEntry, cancelledEntry;
+
+    unsigned long now = millis();
+    wheel.schedule(shortEntry, 1, 250);
+    wheel.schedule(longEntry, 2, 5000); // more than one revolution of the wheel
+    wheel.schedule(cancelledEntry, 3, 250);
+    wheel.cancel(cancelledEntry);
+    assertTrue(wheel.hasEntries());
+    assertFalse(cancelledEntry.isScheduled());
+
+    wheel.advance(now + 150);
+    assertEqual(0, wheelExpiryCount);
+
+    wheel.advance(now + 350);
+    assertEqual(1, wheelExpiryCount);
+    assertTrue(lastExpiredEntry == &shortEntry);
+    assertFalse(shortEntry.isScheduled());
+
+    // once around the wheel is not enough for the long entry
+    wheel.advance(now + 4000);
+    assertEqual(1, wheelExpiryCount);
+
+    wheel.advance(now + 5200);
+    assertEqual(2, wheelExpiryCount);
+    assertTrue(lastExpiredEntry == &longEntry);
+    assertEqual(2, (int)longEntry.getDeadlineType());
+    assertFalse(wheel.hasEntries());
+}
+
+test(testKeepAliveDeadlineClosesIdleConnection) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 5);
+        response.send("Aloha", 5);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertTrue(webServer.getWebResponse(0)->getDeadline().isScheduled());
+
+    // the keep alive deadline has not yet passed, so the connection stays open
+    unsigned long now = millis();
+    webServer.getTimerWheel().advance(now + (WS_KEEP_ALIVE_IDLE_MILLIS / 2));
+    assertFalse(driverSocket.didClose());
+
+    webServer.getTimerWheel().advance(now + WS_KEEP_ALIVE_IDLE_MILLIS + (WS_TIMER_WHEEL_TICK_MILLIS * 2));
+    assertTrue(driverSocket.didClose());
+    assertTrue(webServer.getWebResponse(0)->getMode() == tcremote::WebServerResponse::NOT_IN_USE);
+    assertFalse(webServer.getTimerWheel().hasEntries());
+}
+
+test(testReactorServicesReadyConnections) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 2, true);
+    webServer.init();
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    webServer.onUrlGet("/data2.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 5);
+        response.send("Aloha", 5);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // the request is served by the reactor in the same pass that admits the connection
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertFalse(webServer.getWebResponse(0)->takeReady());
+    assertTrue(webServer.getWebResponse(1)->getMode() == tcremote::WebServerResponse::NOT_IN_USE);
+
+    // a later request on the keep alive connection puts the response on the ready list through the driver
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    assertTrue(webServer.getWebResponse(0)->takeReady());
+    assertFalse(webServer.getWebResponse(1)->takeReady());
+    webServer.getWebResponse(0)->markReady();
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_RESP5));
+    assertFalse(driverSocket.didClose());
+}
+
+test(testRequestHeadParsedAsItArrives) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+
+    // each part ends within a word, the reactor returns straight away and carries on when the next part arrives.
+    const char* parts[] = { "GE", "T /data", "1.txt HTTP/1.1\r\nHo", "st: server.exa", "mple.com\r\n", "\r" };
+    for(auto part : parts) {
+        driverSocket.simulateIncomingRaw(part);
+        webServer.exec();
+        assertTrue(response->getMode() == tcremote::WebServerResponse::READING_HEADERS);
+        char sz[2];
+        assertEqual(0, driverSocket.getClientTxBytesRaw(sz, sizeof sz));
+    }
+    driverSocket.simulateIncomingRaw("\n");
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst("HTTP/1.1 200 OK\r\nServer: tccWS\r\nContent-Type: text/plain\r\n"
+                                                 "Content-Length: 11\r\n\r\nHello World"));
+    assertTrue(response->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+
+    // a request that stops part way through is closed by its deadline, as nothing is waiting on it.
+    driverSocket.simulateIncomingRaw("GET /data1.txt HTTP/1.1\r\nHost: ser");
+    webServer.exec();
+    assertTrue(response->getMode() == tcremote::WebServerResponse::READING_HEADERS);
+    webServer.getTimerWheel().advance(millis() + WS_REQUEST_TIMEOUT_MILLIS + (WS_TIMER_WHEEL_TICK_MILLIS * 2));
+    assertTrue(driverSocket.didClose());
+    assertTrue(response->getMode() == tcremote::WebServerResponse::NOT_IN_USE);
+}
+
+test(testResponseStopAndInit) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // stopping a response closes its connection and it is not given another until init is called.
+    simulateAccept();
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::TRANSPORT_ASSIGNED);
+    response->stop();
+    assertTrue(driverSocket.didClose());
+    assertTrue(response->getMode() == tcremote::WebServerResponse::NOT_IN_USE);
+    assertTrue(webServer.nextAvailableResponse() == nullptr);
+
+    response->init();
+    assertTrue(webServer.nextAvailableResponse() == response);
+}
+
+const char HTTP_REQ_EVENT_STREAM[]= "GET /events HTTP/1.1\r\n"
+                                    "Host: server.example.com\r\n"
+                                    "Last-Event-ID: 42\r\n\r\n";
+
+const char EXPECTED_EVENT_STREAM[] = "HTTP/1.1 200 OK\r\n"
+                                     "Server: tccWS\r\n"
+                                     "Content-Type: text/event-stream\r\n"
+                                     "Cache-Control: no-cache\r\n"
+                                     "\r\n"
+                                     "retry: 3000\n\n"
+                                     "id: 43\nevent: item\ndata: line1\ndata: line2\n\n";
+
+uint32_t eventStreamLastId = 0;
+
+test(testEventStreamHeldOpen) {
+    taskManager.reset();
+    resetUnitLayer();
+    // even in single shot mode the event stream holds the connection open
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+
+    webServer.onUrlGet("/events", [](tcremote::WebServerResponse& response) {
+        eventStreamLastId = response.hasLastEventId() ? response.getLastEventId() : 0;
+        response.turnRequestIntoEventStream();
+        response.sendEvent(eventStreamLastId + 1, "item", "line1\nline2");
+    });
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_EVENT_STREAM);
+    webServer.exec();
+    assertEqual((uint32_t)42, eventStreamLastId);
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_EVENT_STREAM));
+    assertFalse(driverSocket.didClose());
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::EVENT_STREAM_BUSY);
+
+    // a quiet stream is sent a comment to keep it alive, and stays open
+    webServer.getTimerWheel().advance(millis() + WS_EVENT_STREAM_PING_MILLIS + (WS_TIMER_WHEEL_TICK_MILLIS * 2));
+    assertTrue(driverSocket.checkResponseAgainst(":\n\n"));
+    assertTrue(response->getMode() == tcremote::WebServerResponse::EVENT_STREAM_BUSY);
+    assertTrue(response->getDeadline().isScheduled());
+
+    // events can also be streamed using send, then the stream is closed by the server.
+    assertTrue(response->startEvent(44, nullptr));
+    response->send("{}", 2);
+    assertTrue(response->endEvent());
+    response->flushEvents();
+    assertTrue(driverSocket.checkResponseAgainst("id: 44\ndata: {}\n\n"));
+    response->closeConnection();
+    assertTrue(driverSocket.didClose());
+    assertFalse(response->sendEvent(45, nullptr, "gone"));
+}
+
+const char HTTP_REQ_CACHED[]= "GET /dash.json HTTP/1.1\r\n"
+                             "Host: server.example.com\r\n\r\n";
+
+const char HTTP_REQ_CACHED_IF_NONE_MATCH[]= "GET /dash.json HTTP/1.1\r\n"
+                                            "If-None-Match: \"00000001\"\r\n\r\n";
+
+const char EXPECTED_CACHED_V1[] = "HTTP/1.1 200 OK\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Content-Type: application/json\r\n"
+                                  "ETag: \"00000001\"\r\n"
+                                  "Content-Length: 7\r\n"
+                                  "\r\n"
+                                  "{\"v\":1}";
+
+const char EXPECTED_NOT_MODIFIED[] = "HTTP/1.1 304 Not Modified\r\n"
+                                     "Server: tccWS\r\n"
+                                     "ETag: \"00000001\"\r\n"
+                                     "\r\n";
+
+const char EXPECTED_CACHED_V2[] = "HTTP/1.1 200 OK\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Content-Type: application/json\r\n"
+                                  "ETag: \"00000002\"\r\n"
+                                  "Content-Length: 7\r\n"
+                                  "\r\n"
+                                  "{\"v\":2}";
+
+uint32_t cachedContentVersion = 1;
+int cachedRenderCount = 0;
+
+test(testResponseCacheAndConditionalGet) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, true);
+    webServer.init();
+    cachedContentVersion = 1;
+    cachedRenderCount = 0;
+
+    // with no ttl the version is checked on every request, and the cache is used while it is unchanged.
+    webServer.onUrlGetCached("/dash.json", [](tcremote::WebServerResponse& response) {
+        char sz[10];
+        strcpy(sz, "{\"v\":0}");
+        sz[5] = (char)('0' + cachedContentVersion);
+        cachedRenderCount++;
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::JSON_TEXT, 7);
+        response.send(sz, 7);
+    }, [](tcremote::WebServerResponse&) { return cachedContentVersion; }, 0);
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CACHED);
+    webServer.exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_CACHED_V1));
+    assertEqual(1, cachedRenderCount);
+
+    // the same content again comes from the cache without rendering
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CACHED);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_CACHED_V1));
+    assertEqual(1, cachedRenderCount);
+
+    // a client with the current version gets a 304
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CACHED_IF_NONE_MATCH);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_NOT_MODIFIED));
+    assertEqual(1, cachedRenderCount);
+
+    // once the version changes, the content is rendered again, and the old version is no longer a match
+    cachedContentVersion = 2;
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CACHED_IF_NONE_MATCH);
+    webServer.getWebResponse(0)->exec();
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_CACHED_V2));
+    assertEqual(2, cachedRenderCount);
+    assertFalse(driverSocket.didClose());
+
+    uint32_t version;
+    assertTrue(HttpProcessor::parseEntityTag("W/\"0000abCD\"", version));
+    assertEqual((uint32_t)0xabcd, version);
+    assertFalse(HttpProcessor::parseEntityTag("\"abcd\"", version));
+    assertFalse(HttpProcessor::parseEntityTag("*", version));
+}
+
+test(testCacheEntryFreedAfterLastReader) {
+    WebCacheEntry entry;
+    assertEqual((int)WebCacheEntry::ENTRY_FREE, (int)entry.getState());
+
+    // an entry being sent is only retired, and freed when the last reader has finished with it.
+    entry.pin();
+    entry.pin();
+    entry.retire();
+    assertEqual((int)WebCacheEntry::ENTRY_RETIRED, (int)entry.getState());
+    entry.captureData((const uint8_t*)"abc", 3, RAM_NEEDS_COPY);
+    assertEqual((int)WebCacheEntry::ENTRY_RETIRED, (int)entry.getState());
+    assertEqual(0, (int)entry.getLength());
+    entry.unpin();
+    assertEqual((int)WebCacheEntry::ENTRY_RETIRED, (int)entry.getState());
+    entry.unpin();
+    assertEqual((int)WebCacheEntry::ENTRY_FREE, (int)entry.getState());
+
+    // without any readers, it is freed straight away.
+    entry.retire();
+    assertEqual((int)WebCacheEntry::ENTRY_FREE, (int)entry.getState());
+}
+
+test(testWebDateFormatting) {
+    char sz[WS_WEB_DATE_SIZE];
+    formatWebDate(sz, 2009, 7, 22, 19, 15, 56);
+    assertEqual("Wed, 22 Jul 2009 19:15:56 GMT", sz);
+    formatWebDate(sz, 2024, 2, 29, 0, 5, 9);
+    assertEqual("Thu, 29 Feb 2024 00:05:09 GMT", sz);
+    formatWebDate(sz, 2000, 1, 1, 23, 59, 59);
+    assertEqual("Sat, 01 Jan 2000 23:59:59 GMT", sz);
+
+    // the build date is in the same form, and formatted only once
+    const char* built = buildDateInWebForm();
+    assertEqual((size_t)(WS_WEB_DATE_SIZE - 1), strlen(built));
+    assertEqual(" GMT", &built[25]);
+    assertTrue(built == buildDateInWebForm());
+}
+
+int webDateReads = 0;
+
+test(testWebDateCacheRefresh) {
+    webDateReads = 0;
+    WebDateCache cache;
+    auto source = [](char* buffer, size_t bufferLen) {
+        webDateReads++;
+        if(bufferLen >= WS_WEB_DATE_SIZE) formatWebDate(buffer, 2009, 7, 22, 19, 15, webDateReads);
+    };
+
+    // the first call reads the source, after that the cached date is used until it is too old.
+    assertEqual("Wed, 22 Jul 2009 19:15:01 GMT", cache.get(source, 50));
+    assertEqual("Wed, 22 Jul 2009 19:15:01 GMT", cache.get(source, 50));
+    assertEqual(1, webDateReads);
+
+    delay(60);
+    assertEqual("Wed, 22 Jul 2009 19:15:02 GMT", cache.get(source, 50));
+    assertEqual(2, webDateReads);
+}
+
+class TraceCapture : public Print {
+public:
+    char text[WS_TRACE_BUFFER_SIZE * 64];
+    size_t pos = 0;
+    size_t write(uint8_t ch) override {
+        if(pos >= sizeof(text) - 1) return 0;
+        text[pos++] = (char)ch;
+        text[pos] = 0;
+        return 1;
+    }
+};
+
+test(testTraceBufferRecordsAndDumps) {
+    WebTraceBuffer trace;
+    WebTraceEvent event;
+    assertEqual((uint32_t)0, trace.getRecordedCount());
+    assertFalse(trace.getEvent(0, event));
+
+    trace.record(TRACE_RESPONSE_START, 3, 200, 0);
+    assertTrue(trace.getEvent(0, event));
+    assertEqual((int)TRACE_RESPONSE_START, (int)event.eventId);
+    assertEqual((int16_t)3, event.socket);
+    assertEqual((int32_t)200, event.arg1);
+
+    char line[64];
+    event.micros = 1234;
+    event.arg2 = -5;
+    auto len = WebTraceBuffer::formatEvent(event, line, sizeof line);
+    assertEqual("1234 respStart 3 200 -5\n", line);
+    assertEqual(strlen(line), len);
+
+    // timestamps past 2^31 microseconds stay positive, and the full signed range of the arguments prints.
+    event.micros = 3000000000UL;
+    event.arg1 = INT32_MIN;
+    WebTraceBuffer::formatEvent(event, line, sizeof line);
+    assertEqual("3000000000 respStart 3 -2147483648 -5\n", line);
+    event.micros = 1234;
+
+    // a buffer too small for any of the fields gives an empty line.
+    line[0] = 'x';
+    assertEqual((size_t)0, WebTraceBuffer::formatEvent(event, line, 2));
+    assertEqual("", line);
+
+    // once full the oldest events are overwritten, and only the ones still held are dumped.
+    for(int i = 1; i <= WS_TRACE_BUFFER_SIZE + 10; i++) {
+        trace.record(TRACE_HEADER_READ, 4, i, 0);
+    }
+    assertEqual((uint32_t)(WS_TRACE_BUFFER_SIZE + 11), trace.getRecordedCount());
+    assertEqual((uint32_t)11, trace.getOldestSequence());
+    assertFalse(trace.getEvent(10, event));
+    assertTrue(trace.getEvent(11, event));
+    assertEqual((int32_t)11, event.arg1);
+
+    TraceCapture capture;
+    trace.dump(capture);
+    int lines = 0;
+    for(size_t i = 0; i < capture.pos; i++) {
+        if(capture.text[i] == '\n') lines++;
+    }
+    assertEqual(WS_TRACE_BUFFER_SIZE, lines);
+    assertTrue(strstr(capture.text, " hdrRead 4 11 0\n") != nullptr);
+    assertTrue(strstr(capture.text, " hdrRead 4 10 0\n") == nullptr);
+
+    trace.clear();
+    assertEqual((uint32_t)0, trace.getRecordedCount());
+}
+
+test(testLatencyHistogramBuckets) {
+    assertEqual(0, WebLatencyHistogram::bucketFor(0));
+    assertEqual(0, WebLatencyHistogram::bucketFor(64));
+    assertEqual(1, WebLatencyHistogram::bucketFor(65));
+    assertEqual(1, WebLatencyHistogram::bucketFor(128));
+    assertEqual(2, WebLatencyHistogram::bucketFor(129));
+    assertEqual((uint32_t)256, WebLatencyHistogram::bucketLimit(2));
+    assertEqual(32 - WS_METRICS_FIRST_BUCKET_SHIFT, WebLatencyHistogram::bucketFor(0xffffffffUL));
+
+    WebLatencyHistogram histogram;
+    histogram.record(10);
+    histogram.record(100);
+    histogram.record(120);
+    // too large for any bucket, it is only in the count and sum.
+    histogram.record(0xffffffffUL);
+    assertEqual((uint32_t)1, histogram.getBucketCount(0));
+    assertEqual((uint32_t)2, histogram.getBucketCount(1));
+    assertEqual((uint32_t)4, histogram.getCount());
+    assertTrue(histogram.getSum() == 230ULL + 0xffffffffULL);
+}
+
+test(testMetricsRoutesOverflowToOther) {
+    WebServerMetrics metrics;
+    char routeNames[WS_METRICS_MAX_ROUTES + 2][4];
+    for(int i = 0; i < WS_METRICS_MAX_ROUTES + 2; i++) {
+        itoa(i, routeNames[i], 10);
+        metrics.recordRequest(routeNames[i], 10, 10, 1);
+    }
+    metrics.recordRequest(routeNames[0], 10, 10, 1);
+
+    // every entry but the last has a route of its own, the last holds the three routes that did not fit.
+    assertEqual(routeNames[0], metrics.getRoute(0).route);
+    assertEqual((uint32_t)2, metrics.getRoute(0).bytesSent);
+    assertEqual(routeNames[WS_METRICS_MAX_ROUTES - 2], metrics.getRoute(WS_METRICS_MAX_ROUTES - 2).route);
+    assertEqual((uint32_t)1, metrics.getRoute(WS_METRICS_MAX_ROUTES - 2).bytesSent);
+    assertEqual("other", metrics.getRoute(WS_METRICS_MAX_ROUTES - 1).route);
+    assertEqual((uint32_t)3, metrics.getRoute(WS_METRICS_MAX_ROUTES - 1).bytesSent);
+    assertEqual((uint32_t)3, metrics.getRoute(WS_METRICS_MAX_ROUTES - 1).handlerTime.getCount());
+}
+
+const char HTTP_REQ_METRICS[] = "GET /metrics HTTP/1.1\r\n"
+                                "Host: server.example.com\r\n"
+                                "Connection: close\r\n\r\n";
+
+test(testMetricsBuiltInTheChunk) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.enableMetrics();
+    webServer.init();
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS);
+    webServer.exec();
+    assertTrue(driverSocket.didClose());
+
+    // the lines are built in the write buffer, so every chunk but the last is a full buffer of them.
+    long capacity = (long)(webServer.getWebResponse(0)->getTransport()->getWriteBufferSize() - WS_CHUNK_FRAMING);
+    char body[3000];
+    assertMore(readFullChunks(body, sizeof body, capacity), 10);
+    size_t bodyLen = strlen(body);
+    assertTrue(strncmp(body, "# TYPE tcweb_time_to_first_byte_microseconds histogram\n", 55) == 0);
+    assertTrue(strstr(body, "\ntcweb_ws_reply_microseconds_bucket{le=\"64\"} 0\n") != nullptr);
+    assertTrue(strstr(body, "\ntcweb_ws_sent_bytes_total 0\n") == &body[bodyLen - 29]);
+}
+
+const char HTTP_REQ_METRICS_UPGRADE[] = "GET /ws HTTP/1.1\r\n"
+                                        "Host: server.example.com\r\n"
+                                        "Upgrade: websocket\r\n"
+                                        "Connection: Upgrade\r\n"
+                                        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                        "Sec-WebSocket-Version: 13\r\n\r\n";
+
+test(testWebServerMetricsPerRoute) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    assertTrue(webServer.getMetrics() == nullptr);
+    webServer.enableMetrics();
+    webServer.init();
+    webServer.onUrlGet("/data1.txt", [](tcremote::WebServerResponse& response) {
+        response.startHeader();
+        response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, 11);
+        response.send("Hello World", 11);
+    });
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_GET2);
+    webServer.exec();
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_404);
+    webServer.exec();
+
+    // routes are claimed in the order they are first requested, requests with no handler go to unmatched.
+    auto metrics = webServer.getMetrics();
+    assertEqual("/data1.txt", metrics->getRoute(0).route);
+    assertEqual((uint32_t)1, metrics->getRoute(0).timeToFirstByte.getCount());
+    assertEqual((uint32_t)1, metrics->getRoute(0).handlerTime.getCount());
+    assertEqual((uint32_t)11, metrics->getRoute(0).bytesSent);
+    assertEqual("unmatched", metrics->getRoute(1).route);
+    assertEqual((uint32_t)1, metrics->getRoute(1).timeToFirstByte.getCount());
+    assertEqual((uint32_t)0, metrics->getRoute(1).bytesSent);
+
+    // a websocket frame in and a reply out
+    driverSocket.reset(false);
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+    assertEqual("/ws", metrics->getRoute(2).route);
+
+    auto transport = response->getTransport();
+    driverSocket.simulateIncomingMsg(MSG_HEARTBEAT, "HI=1|", true);
+    bool endOfMsg = false;
+    int polls = 0;
+    while(!endOfMsg && polls++ < 100) {
+        while(!endOfMsg && transport->readAvailable()) endOfMsg = transport->readByte() == 0x02;
+    }
+    assertTrue(endOfMsg);
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    transport->endMsg();
+
+    assertEqual((uint32_t)1, metrics->getWebSocketFramesReceived());
+    assertEqual((uint32_t)1, metrics->getWebSocketFramesSent());
+    assertEqual((uint32_t)1, metrics->getWebSocketReplyTime().getCount());
+    assertEqual((uint32_t)1, metrics->getWebSocketWriteTime().getCount());
+    response->closeConnection();
+}
+
+test(testPooledWebSocketLeasesPerFrame) {
+    taskManager.reset();
+    resetUnitLayer();
+    WebBufferPool pool(2, 125);
+    TcMenuLightweightWebServer webServer(80, 1, false, &pool);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+
+    // a buffer is leased to read the frame and goes back once it has been read, the reply is built in the driver.
+    auto transport = response->getTransport();
+    driverSocket.simulateIncomingMsg(MSG_HEARTBEAT, "HI=1|", true);
+    bool endOfMsg = false;
+    int polls = 0;
+    while(!endOfMsg && polls++ < 100) {
+        while(!endOfMsg && transport->readAvailable()) endOfMsg = transport->readByte() == 0x02;
+    }
+    assertTrue(endOfMsg);
+    assertFalse(transport->readAvailable());
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+    transport->endMsg();
+    assertEqual((uint8_t)1, pool.getPeakLeased());
+
+    // when the driver cannot reserve space, the reply is built in a leased buffer instead.
+    driverSocket.setReserveSupported(false);
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    assertEqual((uint8_t)1, pool.getLeasedCount());
+    transport->endMsg();
+    assertEqual((uint8_t)0, pool.getLeasedCount());
+
+    // without a free buffer the transport holds back its updates.
+    auto first = pool.lease();
+    auto second = pool.lease();
+    assertFalse(transport->available());
+    pool.release(first);
+    assertTrue(transport->available());
+
+    // unless the driver reserves space for its frames, then the pool is not needed.
+    driverSocket.setReserveSupported(true);
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    transport->endMsg();
+    first = pool.lease();
+    assertTrue(transport->available());
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    transport->endMsg();
+    assertEqual((uint8_t)2, pool.getLeasedCount());
+    pool.release(first);
+    pool.release(second);
+    response->closeConnection();
+}
+
+test(testWebSocketFramesBuiltInDriverBuffer) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuStaticWebServer<1, 200> webServer(80, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+    char frames[200];
+    while(driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+
+    char payload[151];
+    memset(payload, 'a', 150);
+    payload[150] = 0;
+
+    // built in the driver, frames are kept short enough for the two byte header.
+    auto transport = response->getTransport();
+    resetDriverStats();
+    transport->writeStr(payload);
+    transport->flush();
+    assertEqual((uint32_t)2, driverStats.writeCalls);
+    assertEqual(154, driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+    assertEqual(0x81, (uint8_t)frames[0]);
+    assertEqual(125, (int)frames[1]);
+    assertEqual(0x81, (uint8_t)frames[127]);
+    assertEqual(25, (int)frames[128]);
+    response->closeConnection();
+}
+
+test(testLongFramesGetExtendedLength) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuStaticWebServer<1, 200> webServer(80, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+    char frames[200];
+    while(driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+
+    char payload[151];
+    memset(payload, 'a', 150);
+    payload[150] = 0;
+
+    // built in the transport's own buffer, which is larger than a short frame, the frame needs the extended length.
+    auto transport = response->getTransport();
+    driverSocket.setReserveSupported(false);
+    transport->writeStr(payload);
+    transport->flush();
+    assertEqual(154, driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+    assertEqual(0x81, (uint8_t)frames[0]);
+    assertEqual(WS_EXTENDED_PAYLOAD, (int)(uint8_t)frames[1]);
+    assertEqual(0, (int)frames[2]);
+    assertEqual(150, (int)(uint8_t)frames[3]);
+    assertEqual('a', frames[4]);
+    assertEqual('a', frames[153]);
+    response->closeConnection();
+}
+
+test(testCloseReleasesReservedFrame) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+    char frames[200];
+    while(driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+
+    // closing part way through building a frame gives the reserved space back, and only the close frame is sent.
+    auto transport = response->getTransport();
+    transport->startMsg(MSG_HEARTBEAT);
+    transport->writeStr("HI=1|");
+    assertTrue(driverSocket.isWriteReserved());
+    transport->close();
+    assertFalse(driverSocket.isWriteReserved());
+    assertTrue(driverSocket.didClose());
+    assertEqual(2, driverSocket.getClientTxBytesRaw(frames, sizeof frames));
+    assertEqual(0x88, (uint8_t)frames[0]);
+    assertEqual(0, (int)frames[1]);
+    response->closeConnection();
+}
+
+test(testWebSocketClosesWhenClientGoes) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+    webServer.onUrlGet("/ws", [](tcremote::WebServerResponse& response) {
+        response.turnRequestIntoWebSocket();
+    });
+    startNetLayerDhcp();
+    webServer.exec();
+    simulateAccept();
+    driverSocket.simulateIncomingRaw(HTTP_REQ_METRICS_UPGRADE);
+    webServer.exec();
+    auto response = webServer.getWebResponse(0);
+    assertTrue(response->getMode() == tcremote::WebServerResponse::WEBSOCKET_BUSY);
+
+    // a failed read means the client has gone, so the socket is closed straight away.
+    auto transport = response->getTransport();
+    driverSocket.simulatePeerClosed();
+    assertFalse(transport->readAvailable());
+    assertTrue(driverSocket.didClose());
+    assertEqual(1, driverSocket.getCloseCount());
+    assertFalse(transport->connected());
+
+    // closing again must leave the socket alone, as the driver may have given its number to another client.
+    transport->close();
+    response->closeConnection();
+    assertEqual(1, driverSocket.getCloseCount());
+}
+
+#if defined(WS_COROUTINE_HANDLERS)
+
+const char HTTP_REQ_CO_POST[]= "POST /echo.do HTTP/1.1\r\n"
+                               "Host: server.example.com\r\n"
+                               "Connection: close\r\n"
+                               "Content-Length: 5\r\n\r\n"
+                               "12345";
+
+const char EXPECTED_CO_HEADER[] = "HTTP/1.1 200 OK\r\n"
+                                  "Server: tccWS\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "Content-Length: 10\r\n"
+                                  "\r\n";
+
+WebCoroutine echoCoroutineHandler(tcremote::WebServerResponse& response) {
+    uint8_t body[10];
+    int len = co_await response.asyncReadBody(body, sizeof body);
+    response.startHeader();
+    response.contentInfo(tcremote::WebServerResponse::PLAIN_TEXT, len * 2);
+    co_await response.asyncSend(body, len);
+    co_await response.asyncSend(body, len);
+}
+
+test(testCoroutineHandlerSuspendsOnBackpressure) {
+    taskManager.reset();
+    resetUnitLayer();
+    TcMenuLightweightWebServer webServer(80, 1, false);
+    webServer.init();
+    webServer.onUrlPostAsync("/echo.do", echoCoroutineHandler);
+
+    startNetLayerDhcp();
+    webServer.exec();
+
+    // the socket cannot be written, so the handler should suspend after the header has been written.
+    simulateAccept();
+    driverSocket.setWriteAvailable(false);
+    driverSocket.simulateIncomingRaw(HTTP_REQ_CO_POST);
+    webServer.exec();
+    webServer.getWebResponse(0)->exec();
+    assertTrue(webServer.getWebResponse(0)->isCoroutineActive());
+    assertTrue(driverSocket.checkResponseAgainst(EXPECTED_CO_HEADER));
+    assertFalse(driverSocket.didClose());
+
+    // still not writable, nothing should happen
+    webServer.getWebResponse(0)->exec();
+    assertTrue(webServer.getWebResponse(0)->isCoroutineActive());
+
+    // now it is writable, the handler should resume and complete, closing the connection.
+    driverSocket.setWriteAvailable(true);
+    webServer.getWebResponse(0)->exec();
+    assertFalse(webServer.getWebResponse(0)->isCoroutineActive());
+    assertTrue(driverSocket.checkResponseAgainst("1234512345"));
+    assertTrue(driverSocket.didClose());
+}
+
+int coroutineFramesFreed = 0;
+
+// counts when the copy held in a coroutine frame is destroyed, which only happens when the frame is freed.
+struct CoroutineFrameWatch {
+    bool owned = true;
+    CoroutineFrameWatch() = default;
+    CoroutineFrameWatch(CoroutineFrameWatch&& other) noexcept { other.owned = false; }
+    ~CoroutineFrameWatch() { if(owned) coroutineFramesFreed++; }
+};
+
+WebCoroutine watchedCoroutine(CoroutineFrameWatch) {
+    co_return;
+}
+
+test(testCoroutineNotStartedIsFreed) {
+    coroutineFramesFreed = 0;
+    {
+        WebCoroutine first = watchedCoroutine(CoroutineFrameWatch());
+        WebCoroutine second(std::move(first));
+        assertTrue(first.release() == nullptr);
+        assertEqual(0, coroutineFramesFreed);
+
+        WebCoroutine third = watchedCoroutine(CoroutineFrameWatch());
+        third = std::move(second);
+        assertEqual(1, coroutineFramesFreed);
+    }
+    assertEqual(2, coroutineFramesFreed);
+}
+
+#endif
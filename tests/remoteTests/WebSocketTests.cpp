@@ -34,7 +34,7 @@ TcMenuWebSocketConnectionHandler connectionHandler;
 
 test(testPromoteWebSocket) {
     taskManager.reset();
-    TcMenuLightweightWebServer webServer(80, 1);
+    TcMenuLightweightWebServer webServer(80, 1, false);
 
     webServer.onUrlGet("/chat", [](tcremote::WebServerResponse& response) {
         if(connectionHandler.hasFreeConnection()) {
@@ -7,14 +7,12 @@
 #include <remote/BaseRemoteComponents.h>
 #include <SimpleCollections.h>
 #include "remote/TcMenuWebServer.h"
+#include "remote/TcWebSha1.h"
+#include "remote/TcWebBase64.h"
 
 using namespace aunit;
 using namespace tcremote;
 
-namespace tc_b64 {
-    int base64(const uint8_t *data, int dataSize, uint8_t *buffer, int bufferSize);
-}
-
 extern "C" {
 int sha1digest(uint8_t *hexDigest, const uint8_t *data, size_t databytes);
 }
@@ -39,6 +37,92 @@ test(testThatBase64WorksProperly) {
     assertEqual("Ug==", szBase64);
 }
 
+bool base64Matches(const char* input, const char* expected) {
+    char encoded[32];
+    int len = tc_b64::base64((const uint8_t*)input, (int)strlen(input), (uint8_t*)encoded, sizeof encoded);
+    if(len != (int)strlen(expected) || strcmp(encoded, expected) != 0) {
+        serdebugF3("Base64 encode mismatch ", expected, encoded);
+        return false;
+    }
+    uint8_t decoded[32];
+    len = tc_b64::base64Decode(expected, strlen(expected), decoded, sizeof decoded);
+    if(len != (int)strlen(input) || memcmp(decoded, input, len) != 0) {
+        serdebugF2("Base64 decode mismatch ", expected);
+        return false;
+    }
+    return true;
+}
+
+test(testBase64EncodeDecodeVectors) {
+    // the test vectors from RFC 4648
+    assertTrue(base64Matches("", ""));
+    assertTrue(base64Matches("f", "Zg=="));
+    assertTrue(base64Matches("fo", "Zm8="));
+    assertTrue(base64Matches("foo", "Zm9v"));
+    assertTrue(base64Matches("foob", "Zm9vYg=="));
+    assertTrue(base64Matches("fooba", "Zm9vYmE="));
+    assertTrue(base64Matches("foobar", "Zm9vYmFy"));
+
+    // every byte value and every length of tail must survive a round trip, decoding in place
+    uint8_t data[100];
+    for(size_t i = 0; i < sizeof data; i++) data[i] = (uint8_t)(i * 73 + 11);
+    for(int len = 0; len <= (int)sizeof data; len++) {
+        uint8_t encoded[BASE64_ENCODED_SIZE(sizeof data) + 1];
+        int encodedLen = tc_b64::base64(data, len, encoded, sizeof encoded);
+        assertEqual(BASE64_ENCODED_SIZE(len), encodedLen);
+        assertEqual((int)strlen((char*)encoded), encodedLen);
+        assertEqual(len, tc_b64::base64Decode((const char*)encoded, encodedLen, encoded, sizeof encoded));
+        assertEqual(0, memcmp(data, encoded, len));
+    }
+}
+
+test(testBase64RejectsInvalidInput) {
+    uint8_t decoded[16];
+    assertEqual(-1, tc_b64::base64Decode("Zm9", 3, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Zm9vY", 5, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Zm9*", 4, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Zm9v\xc3\xa9mF", 8, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Zg==Zm9v", 8, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Z===", 4, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("====", 4, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Z=g=", 4, decoded, sizeof decoded));
+    // non zero bits after the end of the data are not canonical
+    assertEqual(-1, tc_b64::base64Decode("Zh==", 4, decoded, sizeof decoded));
+    assertEqual(-1, tc_b64::base64Decode("Zm9=", 4, decoded, sizeof decoded));
+
+    // the output buffer must be large enough for the decoded data, and the encoded data with its terminator
+    assertEqual(-1, tc_b64::base64Decode("Zm9vYmFy", 8, decoded, 5));
+    assertEqual(6, tc_b64::base64Decode("Zm9vYmFy", 8, decoded, 6));
+    char encoded[9];
+    assertEqual(-1, tc_b64::base64((const uint8_t*)"foobar", 6, (uint8_t*)encoded, 8));
+    assertEqual(8, tc_b64::base64((const uint8_t*)"foobar", 6, (uint8_t*)encoded, 9));
+}
+
+test(testBase64ThroughputBenchmark) {
+    uint8_t data[1024];
+    for(size_t i = 0; i < sizeof data; i++) data[i] = (uint8_t)(i * 31 + 7);
+    uint8_t encoded[BASE64_ENCODED_SIZE(sizeof data) + 1];
+    uint8_t decoded[sizeof data];
+
+    const int iterations = 200;
+    unsigned long start = micros();
+    for(int i = 0; i < iterations; i++) {
+        tc_b64::base64(data, sizeof data, encoded, sizeof encoded);
+    }
+    unsigned long encodeMicros = micros() - start;
+
+    start = micros();
+    int decodedLen = 0;
+    for(int i = 0; i < iterations; i++) {
+        decodedLen = tc_b64::base64Decode((const char*)encoded, BASE64_ENCODED_SIZE(sizeof data), decoded, sizeof decoded);
+    }
+    unsigned long decodeMicros = micros() - start;
+
+    serdebugF3("Base64 micros per 200KB, encode vs decode: ", encodeMicros, decodeMicros);
+    assertEqual((int)sizeof data, decodedLen);
+    assertEqual(0, memcmp(data, decoded, sizeof data));
+}
+
 const uint8_t expectedSha1[] = { 0x7C, 0x74, 0xC4, 0xB5, 0xBE, 0x9E, 0x30, 0x57, 0xA9,
                                  0xDE, 0xD5, 0x94, 0xD7, 0x59,0x99, 0x21, 0x6B,
                                  0xC3, 0x53, 0x39};
@@ -52,3 +136,84 @@ test(testThatSha1WorksProperly) {
         assertEqual(expectedSha1[i], sha1Output[i]);
     }
 }
+
+bool sha1Matches(const char* input, size_t len, const char* expectedHex) {
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    tc_sha1::sha1((const uint8_t*)input, len, digest);
+    char hex[SHA1_DIGEST_SIZE * 2 + 1];
+    for(int i = 0; i < SHA1_DIGEST_SIZE; i++) {
+        hex[i * 2] = "0123456789abcdef"[digest[i] >> 4];
+        hex[(i * 2) + 1] = "0123456789abcdef"[digest[i] & 0x0f];
+    }
+    hex[SHA1_DIGEST_SIZE * 2] = 0;
+    if(strcmp(hex, expectedHex) != 0) {
+        serdebugF3("SHA1 mismatch ", expectedHex, hex);
+        return false;
+    }
+    return true;
+}
+
+test(testWordOrientedSha1Vectors) {
+    // the FIPS 180 test vectors, along with lengths either side of the padding boundary
+    assertTrue(sha1Matches("", 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709"));
+    assertTrue(sha1Matches("abc", 3, "a9993e364706816aba3e25717850c26c9cd0d89d"));
+    const char* twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    assertTrue(sha1Matches(twoBlocks, strlen(twoBlocks), "84983e441c3bd26ebaae4aa1f95129e5e54670f1"));
+    assertTrue(sha1Matches("This is a test SHA1 string", 26, "7c74c4b5be9e3057a9ded594d75999216bc35339"));
+
+    // every length up to a few blocks must agree with the original byte oriented implementation
+    uint8_t data[150];
+    for(size_t i = 0; i < sizeof data; i++) data[i] = (uint8_t)(i * 7 + 3);
+    for(size_t len = 0; len <= sizeof data; len++) {
+        uint8_t expected[SHA1_DIGEST_SIZE];
+        uint8_t actual[SHA1_DIGEST_SIZE];
+        sha1digest(expected, data, len);
+        tc_sha1::sha1(data, len, actual);
+        assertEqual(0, memcmp(expected, actual, SHA1_DIGEST_SIZE));
+    }
+
+    // a million a's, added in uneven pieces to exercise the partial block handling
+    tc_sha1::Sha1 hash;
+    uint8_t block[97];
+    memset(block, 'a', sizeof block);
+    size_t remaining = 1000000;
+    while(remaining) {
+        size_t len = min(remaining, sizeof block);
+        hash.update(block, len);
+        remaining -= len;
+    }
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    hash.finish(digest);
+    const uint8_t millionA[] = { 0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e, 0xeb, 0x2b, 0xdb, 0xad,
+                                 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f };
+    assertEqual(0, memcmp(millionA, digest, SHA1_DIGEST_SIZE));
+}
+
+const char wsHandshakeKey[] = "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+test(testWebSocketHandshakeBenchmark) {
+    // the example from RFC 6455, the key and GUID hashed and then base64 encoded
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    char accept[32];
+    tc_sha1::sha1((const uint8_t*)wsHandshakeKey, strlen(wsHandshakeKey), digest);
+    tc_b64::base64(digest, sizeof digest, (uint8_t*)accept, sizeof accept);
+    assertEqual("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept);
+
+    const int iterations = 1000;
+    unsigned long start = micros();
+    for(int i = 0; i < iterations; i++) {
+        sha1digest(digest, (const uint8_t*)wsHandshakeKey, strlen(wsHandshakeKey));
+        tc_b64::base64(digest, sizeof digest, (uint8_t*)accept, sizeof accept);
+    }
+    unsigned long byteOriented = micros() - start;
+
+    start = micros();
+    for(int i = 0; i < iterations; i++) {
+        tc_sha1::sha1((const uint8_t*)wsHandshakeKey, strlen(wsHandshakeKey), digest);
+        tc_b64::base64(digest, sizeof digest, (uint8_t*)accept, sizeof accept);
+    }
+    unsigned long wordOriented = micros() - start;
+
+    serdebugF3("Handshake micros per 1000, byte vs word SHA1: ", byteOriented, wordOriented);
+    assertEqual("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept);
+}
@@ -4,6 +4,24 @@
 #include "remote/TcMenuWebServer.h"
 #include "UnitTestDriver.h"
 
+// every allocation through new is counted, so that tests can check that the request path does not use the heap.
+static uint32_t unitHeapAllocations = 0;
+
+void* operator new(size_t size) {
+    unitHeapAllocations++;
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size) {
+    unitHeapAllocations++;
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
 namespace tcremote {
     const uint8_t serverMask[] = {0xaa, 0xee, 0xdd, 0xa0};
 
@@ -11,15 +29,26 @@ namespace tcremote {
     int acceptorSocket = TC_BAD_SOCKET_ID;
     int acceptPortChosen = 0;
     ServerAcceptedCallback serverAcceptCallback = nullptr;
+    SocketReadyCallback socketReadyCallback = nullptr;
     void *serverCallbackData = nullptr;
 
     UnitDriverSocket driverSocket;
+    UnitDriverStats driverStats;
+
+    uint32_t heapAllocationCount() {
+        return unitHeapAllocations;
+    }
+
+    void resetDriverStats() {
+        memset(&driverStats, 0, sizeof driverStats);
+    }
 
     void resetUnitLayer() {
         unitLayerStarted = false;
         acceptorSocket = TC_BAD_SOCKET_ID;
         acceptPortChosen = 0;
         serverAcceptCallback = nullptr;
+        socketReadyCallback = nullptr;
         serverCallbackData = nullptr;
         driverSocket.reset();
     }
@@ -45,15 +74,17 @@ namespace tcremote {
         return unitLayerStarted;
     }
 
-    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void *callbackData) {
+    SocketErrCode initialiseAccept(int port, ServerAcceptedCallback onServerAccepted, void *callbackData, SocketReadyCallback onSocketReady) {
         acceptorSocket = 99;
         acceptPortChosen = port;
         serverAcceptCallback = onServerAccepted;
+        socketReadyCallback = onSocketReady;
         serverCallbackData = callbackData;
         return SOCK_ERR_OK;
     }
 
     bool rawReadAvailable(socket_t socketNum) {
+        driverStats.availableCalls++;
         if (socketNum < 0) return -1;
         if (driverSocket.isIdle()) return false;
         return driverSocket.readAvailable();
@@ -62,24 +93,47 @@ namespace tcremote {
     int rawReadData(socket_t socketNum, void *data, size_t dataLen) {
         if (socketNum < 0) return -1;
         if (driverSocket.isIdle()) return false;
-        return driverSocket.performRawRead((uint8_t *) data, dataLen);
+        driverStats.readCalls++;
+        auto actual = driverSocket.performRawRead((uint8_t *) data, dataLen);
+        driverStats.bytesRead += actual;
+        return actual;
     }
 
     bool rawWriteAvailable(socket_t socketNum) {
-        return true;
+        driverStats.availableCalls++;
+        return driverSocket.isWriteAvailable();
     }
 
     SocketErrCode rawWriteData(socket_t socketNum, const void *data, size_t dataLen, MemoryLocationType memType, int timeoutMillis) {
         if(memType == IN_PROGRAM_MEM) return SOCK_ERR_NO_PROGMEM_SUPPORT;
         if (socketNum < 0) return SOCK_ERR_FAILED;
         if (driverSocket.isIdle()) return SOCK_ERR_FAILED;
+        driverStats.writeCalls++;
+        driverStats.bytesWritten += dataLen;
+        driverStats.lastWriteTimeout = timeoutMillis;
+        driverSocket.setWriteTimeout(timeoutMillis);
         if (driverSocket.performRawWrite((uint8_t *) data, dataLen) == dataLen) return SOCK_ERR_OK;
         return SOCK_ERR_FAILED;
     }
 
+    uint8_t* rawWriteReserve(socket_t socketNum, size_t minimumLen, size_t* actualLen) {
+        if (socketNum < 0 || driverSocket.isIdle()) return nullptr;
+        return driverSocket.reserve(minimumLen, actualLen);
+    }
+
+    SocketErrCode rawWriteCommit(socket_t socketNum, size_t len) {
+        if (socketNum < 0 || driverSocket.isIdle()) return SOCK_ERR_FAILED;
+        driverStats.writeCalls++;
+        driverStats.bytesWritten += len;
+        driverStats.bytesCommitted += len;
+        if (driverSocket.commit(len) == (int)len) return SOCK_ERR_OK;
+        return SOCK_ERR_FAILED;
+    }
+
     SocketErrCode rawFlushAll(socket_t socketNum) {
         if (socketNum < 0) return SOCK_ERR_FAILED;
         if (driverSocket.isIdle()) return SOCK_ERR_FAILED;
+        driverStats.flushCalls++;
         driverSocket.flush();
         return SOCK_ERR_OK;
     }
@@ -95,6 +149,10 @@ namespace tcremote {
         else return TC_BAD_SOCKET_ID;
     }
 
+    void simulateSocketReady() {
+        if (socketReadyCallback && !driverSocket.isIdle()) socketReadyCallback(0, serverCallbackData);
+    }
+
     void simulateAccept() {
         if (serverAcceptCallback) {
             auto sock = nextDriverSocket();
@@ -106,7 +164,7 @@ namespace tcremote {
 
 
     void UnitDriverSocket::flush() {
-        if(!shouldBeInWebSocketMode) return;
+        if(!shouldBeInWebSocketMode || discardWrites) return;
         int fl = writeScBuffer.get();
         if (fl != 0x81) return; // Final message, text
         int len = writeScBuffer.get();
@@ -158,6 +216,7 @@ namespace tcremote {
             data++;
         }
         readScBuffer.put(0x02 ^ serverMask[maskPosition % 4]); // end
+        simulateSocketReady();
     }
 
     void UnitDriverSocket::simulateIncomingRaw(const char *rawData) {
@@ -165,6 +224,7 @@ namespace tcremote {
             readScBuffer.put(*rawData);
             rawData++;
         }
+        simulateSocketReady();
     }
 
     bool UnitDriverSocket::checkResponseAgainst(const char *expected) {